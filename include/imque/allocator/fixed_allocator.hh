@@ -2,46 +2,113 @@
 #define IMQUE_ALLOCATOR_FIXED_ALLOCATOR_HH
 
 #include "../atomic/atomic.hh"
+#include "../ipc/process.hh"
+#include "../stats.hh"
 #include "variable_allocator.hh"
 #include <cassert>
+#include <vector>
+#include <sched.h>
 
 namespace imque {
   namespace allocator {
     namespace FixedAllocatorAux {
+      template<typename MD>
       struct Block {
-        uint32_t next; // index of next Block
+        MD next; // index of next Block
 
-        static const uint32_t END = 0xFFFFFFFF;
+        static const MD END = static_cast<MD>(-1);
       };
       
+      // 各サイズクラスのフリーリストの先頭(head)は、カウンタ類や他のサイズクラスとは別のキャッシュラインに配置する
+      template<typename MD>
       struct SuperBlock {
         uint32_t block_size;
         uint32_t used_count;
         uint32_t free_count;
-        Block head;
+        Block<MD> head IMQUE_CACHE_ALIGNED;
+      };
+
+      static const uint32_t SUPER_BLOCK_COUNT = 7;
+      static const uint32_t MAGAZINE_SIZE = 8;
+
+      // プロセス毎のブロックのキャッシュ(マガジン)。
+      // 共有メモリ上に置き、所有プロセスが SIGKILL された場合でも、他のプロセスがキャッシュ中のブロックを回収できるようにする。
+      // 保持するブロックは参照カウントが 0 の状態のもの(SuperBlock のフリーリストと同様)で、SuperBlock の used_count に含まれる。
+      template<typename MD>
+      struct Magazine {
+        volatile uint64_t owner IMQUE_CACHE_ALIGNED; // 所有プロセスの識別子 (ipc::process::identity。未使用なら 0)
+        volatile uint64_t busy;                        // マガジンの内容を操作中のプロセスの識別子 (ipc::process::identity。操作中でなければ 0)
+        uint32_t counts[SUPER_BLOCK_COUNT];
+        MD blocks[SUPER_BLOCK_COUNT][MAGAZINE_SIZE];
       };
     }
     
     // ロックフリーな固定長ブロックアロケータ。
     // VariableAllocatorの上に構築されており BLOCK_SIZE_START から BLOCK_SIZE_LAST までの二の階乗サイズのブロックを扱うことが可能。
     // BLOCK_SIZE_LAST を越えるサイズのメモリ割当要求に対しては VariableAllocator に直接処理を委譲する。
-    class FixedAllocator {
-      typedef FixedAllocatorAux::Block Block;
-      typedef FixedAllocatorAux::SuperBlock SuperBlock;
+    //
+    // region が十分に大きい場合は、プロセス毎のキャッシュ(マガジン)を使用する。
+    // 割当/解放は、まず自プロセスのマガジンに対して行い、マガジンが空(満杯)の場合にのみ、
+    // 複数のブロックをまとめて SuperBlock のフリーリストから取得(へ返却)するので、共有のフリーリストや各種カウンタへのアクセスが減る。
+    // SIGKILL されたプロセスのマガジン中のブロックは、その後に他のプロセスがマガジンを確保する際(もしくは reclaimDeadMagazines() 呼び出し時)に回収される。
+    // また、VariableAllocator からの割当に失敗した場合は、キャッシュ中のブロックを掻き集めてから再試行する。(drainCaches 参照)
+    // 他のプロセスのマガジンは、そのキャッシュで要求を満たし得る場合にのみ掻き集めるので、
+    // 生存中だが割当/解放を行っていないプロセスのマガジンや、他のサイズクラスにキャッシュされたブロックのために、空きがあるのに割当に失敗することはない。
+    // (割当の失敗時には、プロセスの生存確認のようなシステムコールは行わない)
+    //
+    // SuperBlock のフリーリストの ABA 問題は、メモリ記述子のバージョンで防ぐ。
+    // フリーリストから取り出したブロックは、割当(dupNew)もしくはマガジンへの移動(renew)の際に必ずバージョンが進むので、
+    // 同じブロックがフリーリストに戻されても、取り出し前に読み込んだ先頭の記述子とは一致しない。
+    template<class Layout>
+    class BasicFixedAllocator {
+    public:
+      typedef typename Layout::MD MD; // memory descriptor
+
+    private:
+      typedef FixedAllocatorAux::Block<MD> Block;
+      typedef FixedAllocatorAux::SuperBlock<MD> SuperBlock;
+      typedef FixedAllocatorAux::Magazine<MD> Magazine;
       
-      static const uint32_t SUPER_BLOCK_COUNT = 7;
+      static const uint32_t SUPER_BLOCK_COUNT = FixedAllocatorAux::SUPER_BLOCK_COUNT;
       static const uint32_t BLOCK_SIZE_START = 64;
       static const uint32_t BLOCK_SIZE_LAST  = BLOCK_SIZE_START << (SUPER_BLOCK_COUNT-1);
       static const uint32_t SUPER_BLOCKS_SIZE = sizeof(SuperBlock)*SUPER_BLOCK_COUNT;
+
+      static const uint32_t MAGAZINE_SIZE = FixedAllocatorAux::MAGAZINE_SIZE;
+      static const uint32_t MAGAZINE_BATCH_SIZE = MAGAZINE_SIZE / 2; // フリーリストとの間で、一度に移動するブロック数
+      static const uint32_t MAGAZINE_COUNT = 32;                     // マガジンを使用可能なプロセスの最大数
+      static const uint32_t MAGAZINES_SIZE = sizeof(Magazine)*MAGAZINE_COUNT;
+      static const uint32_t MAGAZINE_MIN_REGION_SIZE = MAGAZINES_SIZE*64; // これ未満のサイズの region ではマガジンを使用しない
       
     public:
       // region: 割当に使用するメモリ領域。
       // size: regionのサイズ
-      FixedAllocator(void* region, uint32_t size) 
+      BasicFixedAllocator(void* region, size_t size) 
         : super_blocks_(reinterpret_cast<SuperBlock*>(region)),
-          base_alc_(super_blocks_+SUPER_BLOCK_COUNT, 
-                    size > SUPER_BLOCKS_SIZE ? size - SUPER_BLOCKS_SIZE : 0),
-          region_size_(size) {
+          magazines_(reinterpret_cast<Magazine*>(super_blocks_+SUPER_BLOCK_COUNT)),
+          magazine_count_(size >= MAGAZINE_MIN_REGION_SIZE ? MAGAZINE_COUNT : 0),
+          base_alc_(magazines_+magazine_count_, 
+                    size > metaSize() ? size - metaSize() : 0),
+          region_size_(size),
+          my_magazine_(NULL),
+          my_magazine_pid_(0),
+          stats_(NULL) {
+      }
+
+      // 統計情報の記録先を設定する (IMQUE_STATS 定義時のみ有効)
+      void setStats(stats::Stats* stats) {
+        stats_ = stats;
+        base_alc_.setStats(stats);
+      }
+
+      // 自プロセスが確保しているマガジン内のブロックを、共有のフリーリストに返却する
+      ~BasicFixedAllocator() {
+        Magazine* mag = my_magazine_;
+        if(mag && my_magazine_pid_ == ipc::process::self() && tryLock(*mag)) {
+          flushAll(*mag);
+          unlockMagazine(mag);
+          atomic::store(&mag->owner, static_cast<uint64_t>(0));
+        }
       }
 
       operator bool() const { return super_blocks_ != NULL && base_alc_; }
@@ -62,41 +129,86 @@ namespace imque {
             
             block_size *= 2;
           }
+
+          for(uint32_t i=0; i < magazine_count_; i++) {
+            Magazine& mag = magazines_[i];
+            mag.owner = 0;
+            mag.busy = 0;
+            for(uint32_t j=0; j < SUPER_BLOCK_COUNT; j++) {
+              mag.counts[j] = 0;
+            }
+          }
+          my_magazine_ = NULL;
+          my_magazine_pid_ = 0;
         }
       }
 
       // メモリ割当を行う。
       // 要求したサイズの割当に失敗した場合は 0 を、それ以外はメモリ領域参照用の識別子(記述子)を返す。
       // (識別子を ptrメソッド に渡すことで、実際のメモリ領域を参照可能)
-      uint32_t allocate(uint32_t size) {
+      MD allocate(size_t size) {
         if(size == 0) {
           return 0;
         }
         
         if(size > BLOCK_SIZE_LAST) {
-          return base_alc_.allocate(size);
+          stats::add(stats_, stats::FIXED_LARGE);
+          MD md = base_alc_.allocate(size);
+          if(md == 0 && drainCaches(SUPER_BLOCK_COUNT, size)) {
+            md = base_alc_.allocate(size);
+          }
+          return md;
+        }
+
+        const uint32_t sb_id = getSuperBlockId(size);
+        MD md = allocateBlock(sb_id);
+        if(md == 0 && drainCaches(sb_id-1, super_blocks_[sb_id-1].block_size)) {
+          md = allocateBlock(sb_id);
         }
+        return md;
+      }
 
-        uint32_t sb_id = getSuperBlockId(size);
+    private:
+      // sb_id 番目の SuperBlock のサイズのブロックを、マガジン、SuperBlock のフリーリスト、VariableAllocator の順に割り当てる
+      MD allocateBlock(uint32_t sb_id) {
         SuperBlock& sb = super_blocks_[sb_id-1];
+
+        // まず自プロセスのマガジンからのブロック取得を試みる
+        if(Magazine* mag = lockMagazine()) {
+          uint32_t& count = mag->counts[sb_id-1];
+          if(count == 0) {
+            refill(*mag, sb_id-1);
+          }
+          if(count != 0) {
+            // 先にカウントを減らしておく (ここで SIGKILL された場合はブロックがリークするが、二重に使用されることはない)
+            MD md = mag->blocks[sb_id-1][count-1];
+            count--;
+            unlockMagazine(mag);
+            stats::add(stats_, stats::FIXED_MAGAZINE_HIT, sb_id-1, 1);
+            return base_alc_.dupNew(md);
+          }
+          unlockMagazine(mag);
+        }
       
-        // まずキャッシュからのブロック取得を試みる
+        // 次にキャッシュからのブロック取得を試みる
         for(Block head = atomic::fetch(&sb.head);
             head.next != Block::END;
             head = atomic::fetch(&sb.head)) {
-          Block block = *base_alc_.ptr<Block>(head.next);
+          Block block = *base_alc_.template ptr<Block>(head.next);
           Block new_head = {block.next};
         
           if(atomic::compare_and_swap(&sb.head, head, new_head)) {
             atomic::add(&sb.used_count, 1);
             atomic::sub(&sb.free_count, 1);
 
+            stats::add(stats_, stats::FIXED_FREELIST_HIT, sb_id-1, 1);
             return base_alc_.dupNew(head.next); // キャッシュから再利用
           }
         }
 
         // キャッシュには利用可能なブロックがないので、可変長ブロックアロケータに割当を依頼する
-        uint32_t md = base_alc_.allocate(sb.block_size); // memory descriptor
+        stats::add(stats_, stats::FIXED_MISS, sb_id-1, 1);
+        MD md = base_alc_.allocate(sb.block_size); // memory descriptor
         if(md == 0) {
           return 0;
         }
@@ -105,16 +217,28 @@ namespace imque {
         return md;
       }
 
+    public:
       // allocateメソッドで割り当てたメモリ領域を解放する。(解放に成功した場合は trueを、失敗した場合は false を返す)
       // md(メモリ記述子)が 0 の場合は何も行わない。
-      bool release(uint32_t md) {
+      bool release(MD md) {
         if(md == 0) {
           return true;
         }
         if(! base_alc_.undup(md)) {
           return true; // まだ誰かが参照中
         }
+        return reclaim(md);
+      }
+
+      // 参照カウントを一つ減らす。カウントが 0 になった(= 解放可能になった)場合は true を返す。
+      // true の場合、呼び出し元は(必要なら領域の内容を参照した後で) reclaim() を呼び出して、領域を解放する必要がある。
+      // (解放直前の領域の内容を参照する必要がある場合に、release の代わりに使用する)
+      bool undup(MD md) {
+        return md != 0 && base_alc_.undup(md);
+      }
 
+      // undup が true を返した(参照カウントが 0 の)領域を解放する
+      bool reclaim(MD md) {
         uint32_t sb_id = getSuperBlockId(base_alc_.getSize(md));
         if(sb_id == 0) {
           return base_alc_.release(md);
@@ -123,6 +247,18 @@ namespace imque {
 
         SuperBlock& sb = super_blocks_[sb_id-1];
 
+        // 自プロセスのマガジンに空きがあれば、そこに追加する
+        if(Magazine* mag = lockMagazine()) {
+          uint32_t& count = mag->counts[sb_id-1];
+          if(count == MAGAZINE_SIZE) {
+            flush(*mag, sb_id-1, MAGAZINE_BATCH_SIZE);
+          }
+          mag->blocks[sb_id-1][count] = md;
+          count++;
+          unlockMagazine(mag);
+          return true;
+        }
+
         // キャッシュに溜めておく必要がないなら、ブロックを解放する
         if(sb.used_count < sb.free_count &&
            base_alc_.lightRelease(md)) {
@@ -134,7 +270,7 @@ namespace imque {
         for(;;) {
           Block head = atomic::fetch(&sb.head);
           Block new_head = {md};
-          base_alc_.ptr<Block>(new_head.next)->next = head.next;
+          base_alc_.template ptr<Block>(new_head.next)->next = head.next;
           
           if(atomic::compare_and_swap(&sb.head, head, new_head)) {
             break;
@@ -146,19 +282,371 @@ namespace imque {
         return true;
       }
 
-      bool dup(uint32_t md, uint32_t delta=1) {
+      bool dup(MD md, uint32_t delta=1) {
         return base_alc_.dup(md, delta);
       }
 
       // allocateメソッドが返したメモリ記述子から、対応する実際にメモリ領域を取得する
       template<typename T>
-      T* ptr(uint32_t md) const { return base_alc_.ptr<T>(md); }
+      T* ptr(MD md) const { return base_alc_.template ptr<T>(md); }
+
+      // 一回の割当で確保可能な最大のサイズ (これを越えるサイズの割当は必ず失敗する)
+      // BLOCK_SIZE_LAST 以下の割当はブロックサイズに切り上げられるので、VariableAllocator の上限に収まる最大のブロックサイズまでとなる。
+      size_t maxAllocationSize() const {
+        const size_t base_max = base_alc_.maxAllocationSize();
+        if(base_max > BLOCK_SIZE_LAST) {
+          return base_max;
+        }
+
+        size_t block_size = BLOCK_SIZE_LAST;
+        for(; block_size >= BLOCK_SIZE_START && block_size > base_max; block_size /= 2);
+        return block_size >= BLOCK_SIZE_START ? block_size : 0;
+      }
       
       template<typename T>
-      T* ptr(uint32_t md, uint32_t offset) const { return base_alc_.ptr<T>(md, offset); }
+      T* ptr(MD md, size_t offset) const { return base_alc_.template ptr<T>(md, offset); }
+
+      // size バイトの割当で実際に使用される領域のサイズ (BLOCK_SIZE_LAST 以下の割当はブロックサイズに切り上げられる)
+      static size_t blockSizeOf(size_t size) {
+        const uint32_t sb_id = getSuperBlockId(size);
+        return sb_id == 0 ? size : BLOCK_SIZE_START << (sb_id-1);
+      }
+
+      // VariableAllocator のフリーリストの状態を返す (SuperBlock やマガジンにキャッシュ中のブロックは空き領域に含まない)
+      typename BasicVariableAllocator<Layout>::FreeListInfo freeListInfo() { return base_alc_.freeListInfo(); }
+
+      // 以下は、SIGKILL されたプロセスがリークさせた領域の回収用のメソッド。
+      // 他のプロセスがアロケータを操作していない(静止した)状態でのみ使用可能。
+
+      // 割当済みの全領域(キャッシュ中のブロックを含む)のメモリ記述子を mds に追加する
+      void collectAllocated(std::vector<MD>& mds) const { base_alc_.collectAllocated(mds); }
+
+      // 割当済み領域の不正なチャンク数を修正する (VariableAllocator::repairAllocatedCounts を参照)
+      size_t repairAllocatedCounts() { return base_alc_.repairAllocatedCounts(); }
+
+      // SuperBlock のフリーリスト、およびマガジンにキャッシュされている(参照カウントが 0 の)ブロックのメモリ記述子を mds に追加する
+      void collectCached(std::vector<MD>& mds) const {
+        for(uint32_t i=0; i < SUPER_BLOCK_COUNT; i++) {
+          for(MD md = super_blocks_[i].head.next; md != Block::END; md = base_alc_.template ptr<Block>(md)->next) {
+            mds.push_back(md);
+          }
+        }
+        for(uint32_t i=0; i < magazine_count_; i++) {
+          const Magazine& mag = magazines_[i];
+          for(uint32_t j=0; j < SUPER_BLOCK_COUNT; j++) {
+            for(uint32_t k=0; k < mag.counts[j] && k < MAGAZINE_SIZE; k++) {
+              mds.push_back(mag.blocks[j][k]);
+            }
+          }
+        }
+      }
+
+      // SuperBlock のフリーリスト、およびマガジンにキャッシュされている全てのブロックを VariableAllocator に返却する。
+      // (キャッシュ中のブロックは、他のサイズの割当には使用できないので、断片化の解消に使用する)
+      void trimCaches() {
+        for(uint32_t i=0; i < magazine_count_; i++) {
+          Magazine& mag = magazines_[i];
+          for(uint32_t j=0; j < SUPER_BLOCK_COUNT; j++) {
+            for(uint32_t k=0; k < mag.counts[j] && k < MAGAZINE_SIZE; k++) {
+              base_alc_.release(mag.blocks[j][k]);
+              atomic::sub(&super_blocks_[j].used_count, 1);
+            }
+            mag.counts[j] = 0;
+          }
+        }
+
+        for(uint32_t i=0; i < SUPER_BLOCK_COUNT; i++) {
+          SuperBlock& sb = super_blocks_[i];
+          MD md = sb.head.next;
+          sb.head.next = Block::END;
+          while(md != Block::END) {
+            MD next = base_alc_.template ptr<Block>(md)->next;
+            base_alc_.release(md);
+            md = next;
+          }
+          sb.free_count = 0;
+        }
+      }
+
+      uint32_t refCount(MD md) const { return base_alc_.refCount(md); }
+      void setRefCount(MD md, uint32_t ref_count) { base_alc_.setRefCount(md, ref_count); }
+
+      // SIGKILL されたプロセスが確保していたマガジンを解放し、その中のブロックを共有のフリーリストに返却する。
+      // 回収したマガジンの数を返す。
+      // また、マガジンの操作中に SIGKILL されたプロセスが busy を獲得したままの場合は、それを解除する。
+      // (他のプロセスがマガジンを確保する際にも呼ばれるので、通常はクライアントコードで明示的に呼び出す必要はない)
+      // 各マガジンの所有者の生存確認にシステムコールを使用するので、割当の度に呼び出すようなことはしないこと。
+      uint32_t reclaimDeadMagazines() {
+        const uint64_t self = ipc::process::selfIdentity();
+        uint32_t reclaimed = 0;
+        for(uint32_t i=0; i < magazine_count_; i++) {
+          Magazine& mag = magazines_[i];
+          clearDeadLock(mag);
+
+          uint64_t owner = atomic::fetch(&mag.owner);
+          if(owner == 0 || owner == self || ipc::process::isAliveIdentity(owner)) {
+            continue;
+          }
+
+          // 回収中は自プロセスを所有者にしておく (回収中に SIGKILL された場合は、別のプロセスが改めて回収する)
+          // drainCaches でマガジンを操作中のプロセスがいる場合は、その完了を待ってから回収する
+          if(atomic::compare_and_swap(&mag.owner, owner, self)) {
+            while(tryLock(mag) == false) {
+              clearDeadLock(mag);
+              sched_yield();
+            }
+            flushAll(mag);
+            unlockMagazine(&mag);
+            atomic::store(&mag.owner, static_cast<uint64_t>(0));
+            reclaimed++;
+          }
+        }
+        return reclaimed;
+      }
 
     private:
-      static uint32_t getSuperBlockId(uint32_t size) {
+      // VariableAllocator からの割当に失敗した場合に、キャッシュ中のブロックを割当に使用できるようにする。移動したブロックがある場合は true を返す。
+      //  - 自プロセスのマガジン内のブロックを、SuperBlock のフリーリストに返却する
+      //  - 他のプロセスのマガジンにキャッシュされたブロックの合計サイズが size 以上なら、それらも同様に返却する (他のプロセスが操作中のマガジンは対象外)
+      //  - keep_index 番目以外の SuperBlock のフリーリスト内のブロックを、VariableAllocator に返却する
+      // keep_index 番目のサイズクラスのブロックは、VariableAllocator には返却せずにフリーリストからの再利用に回す。
+      // (VariableAllocator の空き領域は最低一チャンクを残すので、割当済みの領域に挟まれた単独のブロックを返却しても、同じサイズの割当には使用できない)
+      //
+      // 他のプロセスのマガジンのキャッシュでも足りない場合(本当に容量が不足している場合)は、それらのマガジンには触れない。
+      // (キューが満杯の間、enq を繰り返すプロセスが、他のプロセスのキャッシュを空にし続けることがないようにするため)
+      // SIGKILL されたプロセスのマガジンも同様に扱い、所有者や busy を獲得中のプロセスの生存確認(と所有権の回収)は、マガジンの確保時(reclaimDeadMagazines)にのみ行う。
+      bool drainCaches(uint32_t keep_index, size_t size) {
+        bool drained = false;
+        if(Magazine* mag = lockMagazine()) {
+          drained = flushAll(*mag);
+          unlockMagazine(mag);
+        }
+
+        if(othersCachedSize() >= size) {
+          const Magazine* own = my_magazine_pid_ == ipc::process::self() ? my_magazine_ : NULL;
+          for(uint32_t i=0; i < magazine_count_; i++) {
+            Magazine& mag = magazines_[i];
+            if(&mag == own || atomic::fetch(&mag.owner) == 0 || tryLock(mag) == false) {
+              continue;
+            }
+            drained = flushAll(mag) || drained;
+            unlockMagazine(&mag);
+          }
+        }
+
+        for(uint32_t i=0; i < SUPER_BLOCK_COUNT; i++) {
+          if(i == keep_index) {
+            continue;
+          }
+          SuperBlock& sb = super_blocks_[i];
+          for(Block head = atomic::fetch(&sb.head);
+              head.next != Block::END;
+              head = atomic::fetch(&sb.head)) {
+            Block block = *base_alc_.template ptr<Block>(head.next);
+            Block new_head = {block.next};
+            if(atomic::compare_and_swap(&sb.head, head, new_head) == false) {
+              continue;
+            }
+
+            atomic::sub(&sb.free_count, 1);
+            if(base_alc_.release(head.next) == false) {
+              // 高競合下で解放に失敗した場合は、(バージョンを進めてから)フリーリストに戻して次のサイズクラスに移る
+              atomic::add(&sb.used_count, 1);
+              reclaim(base_alc_.renew(head.next));
+              break;
+            }
+            drained = true;
+          }
+        }
+        return drained;
+      }
+
+      // 自プロセス以外のマガジンにキャッシュされているブロックの合計サイズ (ロックせずに読むので概算値)
+      size_t othersCachedSize() {
+        const Magazine* own = my_magazine_pid_ == ipc::process::self() ? my_magazine_ : NULL;
+        size_t total = 0;
+        for(uint32_t i=0; i < magazine_count_; i++) {
+          Magazine& mag = magazines_[i];
+          if(&mag == own || atomic::fetch(&mag.owner) == 0) {
+            continue;
+          }
+          for(uint32_t j=0; j < SUPER_BLOCK_COUNT; j++) {
+            total += static_cast<size_t>(mag.counts[j]) * super_blocks_[j].block_size;
+          }
+        }
+        return total;
+      }
+
+      static size_t metaSize(uint32_t magazine_count) {
+        return SUPER_BLOCKS_SIZE + sizeof(Magazine)*magazine_count;
+      }
+      size_t metaSize() const { return metaSize(magazine_count_); }
+
+      // 自プロセス用のマガジンを返す。(マガジンを使用しない、もしくは確保できなかった場合は NULL を返す)
+      // 初回(およびfork後の初回)の呼び出し時に、未使用のマガジンを確保する。
+      //
+      // 同一プロセス内の複数のスレッドが同時に初回の呼び出しを行った場合に、それぞれがマガジンを確保(リーク)しないように、
+      // my_magazine_pid_ を CAS で -self (確保中) に変更できたスレッドのみが確保を行う。
+      // 確保中に呼び出した他のスレッドには NULL を返す。(その場合はマガジンを使わずに処理が行われる)
+      Magazine* ownMagazine() {
+        const pid_t self = ipc::process::self();
+        const uint64_t self_identity = ipc::process::selfIdentity();
+        const pid_t owner = atomic::fetch(&my_magazine_pid_);
+        if(owner == self) {
+          return my_magazine_; // my_magazine_ は my_magazine_pid_ の(releaseストアでの)更新前に設定済み
+        }
+        if(owner == -self || atomic::compare_and_swap(&my_magazine_pid_, owner, -self) == false) {
+          return NULL;
+        }
+
+        Magazine* found = NULL;
+        if(magazine_count_ != 0) {
+          reclaimDeadMagazines();
+          for(uint32_t i=0; i < magazine_count_; i++) {
+            Magazine& mag = magazines_[i];
+            if(atomic::compare_and_swap(&mag.owner, static_cast<uint64_t>(0), self_identity)) {
+              found = &mag;
+              break;
+            }
+          }
+        }
+        my_magazine_ = found;
+        atomic::store(&my_magazine_pid_, self);
+        return found;
+      }
+
+      // 自プロセスのマガジンを、同一プロセス内の他のスレッドや drainCaches 中の他のプロセスと排他的に使用するためにロックする。
+      // (ロックできなかった場合は NULL を返す。その場合はマガジンを使わずに処理を行う)
+      Magazine* lockMagazine() {
+        Magazine* mag = ownMagazine();
+        if(mag && tryLock(*mag)) {
+          return mag;
+        }
+        return NULL;
+      }
+
+      // マガジンの busy を自プロセスの識別子に変更する。(owner と同じく ipc::process::identity を使用する)
+      // 他のプロセスが busy を獲得している場合は、その生存確認は行わずに false を返す。
+      // (割当/解放や drainCaches の度にシステムコールを発行しないため。SIGKILL されたプロセスの busy は reclaimDeadMagazines で解除する)
+      bool tryLock(Magazine& mag) {
+        return atomic::compare_and_swap(&mag.busy, static_cast<uint64_t>(0), ipc::process::selfIdentity());
+      }
+
+      // 操作中に SIGKILL されたプロセスが busy を獲得したままの場合は、それを解除する。
+      // (生存確認にシステムコールを使用するので、reclaimDeadMagazines からのみ呼び出す)
+      void clearDeadLock(Magazine& mag) {
+        const uint64_t holder = atomic::fetch(&mag.busy);
+        if(holder != 0 && holder != ipc::process::selfIdentity() && ipc::process::isAliveIdentity(holder) == false) {
+          atomic::compare_and_swap(&mag.busy, holder, static_cast<uint64_t>(0));
+        }
+      }
+
+      void unlockMagazine(Magazine* mag) {
+        atomic::store(&mag->busy, static_cast<uint64_t>(0));
+      }
+
+      // SuperBlock のフリーリストから、最大 MAGAZINE_BATCH_SIZE 個のブロックを一回の CAS でまとめて取り出し、マガジンに追加する
+      void refill(Magazine& mag, uint32_t sb_index) {
+        SuperBlock& sb = super_blocks_[sb_index];
+        MD mds[MAGAZINE_BATCH_SIZE];
+        for(;;) {
+          Block head = atomic::fetch(&sb.head);
+          if(head.next == Block::END) {
+            return;
+          }
+
+          // フリーリストの先頭が変わっていない限り、辿ったブロックはフリーリスト内にあるので、読み込んだ next は正しい。
+          // (取り出されたブロックは、戻される前にバージョンが進むので、先頭の記述子が同じなら、その間に取り出されてはいない)
+          uint32_t n = 0;
+          MD next = head.next;
+          bool modified = false;
+          while(next != Block::END && n < MAGAZINE_BATCH_SIZE) {
+            mds[n++] = next;
+            next = base_alc_.template ptr<Block>(next)->next;
+            if(atomic::fetch(&sb.head).next != head.next) {
+              modified = true;
+              break;
+            }
+          }
+          if(modified) {
+            continue;
+          }
+
+          Block new_head = {next};
+          if(atomic::compare_and_swap(&sb.head, head, new_head)) {
+            // ここで SIGKILL された場合はブロックがリークするが、二重に使用されることはない
+            // マガジンには、バージョンを進めた記述子を置く (後で flush で戻した際に、取り出し前の記述子と区別できるようにする)
+            for(uint32_t i=0; i < n; i++) {
+              mag.blocks[sb_index][mag.counts[sb_index]++] = base_alc_.renew(mds[i]);
+            }
+            atomic::add(&sb.used_count, n);
+            atomic::sub(&sb.free_count, n);
+            return;
+          }
+        }
+      }
+
+      // マガジンの末尾の count 個のブロックを、SuperBlock のフリーリストに返却する。
+      // 返却するブロック群は予め連結しておき、一回の CAS でフリーリストに追加する。
+      // (キャッシュに溜めておく必要がないブロックは、VariableAllocator に解放する)
+      void flush(Magazine& mag, uint32_t sb_index, uint32_t count) {
+        SuperBlock& sb = super_blocks_[sb_index];
+        MD mds[MAGAZINE_SIZE];
+
+        // 先にカウントを減らしておく (ここで SIGKILL された場合はブロックがリークするが、二重に使用されることはない)
+        mag.counts[sb_index] -= count;
+        for(uint32_t i=0; i < count; i++) {
+          mds[i] = mag.blocks[sb_index][mag.counts[sb_index]+i];
+        }
+
+        uint32_t n = 0;
+        for(uint32_t i=0; i < count; i++) {
+          if(sb.used_count < sb.free_count && base_alc_.lightRelease(mds[i])) {
+            atomic::sub(&sb.used_count, 1);
+            continue;
+          }
+          if(n != 0) {
+            base_alc_.template ptr<Block>(mds[n-1])->next = mds[i];
+          }
+          mds[n++] = mds[i];
+        }
+        if(n == 0) {
+          return;
+        }
+
+        Block* last = base_alc_.template ptr<Block>(mds[n-1]);
+        for(;;) {
+          Block head = atomic::fetch(&sb.head);
+          Block new_head = {mds[0]};
+          last->next = head.next;
+          
+          if(atomic::compare_and_swap(&sb.head, head, new_head)) {
+            break;
+          }
+        }
+
+        atomic::sub(&sb.used_count, n);
+        atomic::add(&sb.free_count, n);
+      }
+
+      // マガジン内の全てのブロックを返却する。返却したブロックがある場合は true を返す
+      bool flushAll(Magazine& mag) {
+        bool flushed = false;
+        for(uint32_t i=0; i < SUPER_BLOCK_COUNT; i++) {
+          if(mag.counts[i] != 0) {
+            flushed = true;
+            flush(mag, i, mag.counts[i]);
+          }
+        }
+        return flushed;
+      }
+
+      // size バイトのブロックを扱う SuperBlock の番号(1 始まり)を返す。
+      // BLOCK_SIZE_LAST を越える場合は 0 を返す。(VariableAllocator に直接割り当てた領域)
+      static uint32_t getSuperBlockId(size_t size) {
+        if(size > BLOCK_SIZE_LAST) {
+          return 0;
+        }
         uint32_t block_size = BLOCK_SIZE_START;
         uint32_t id=1;
         for(; block_size < size; id++) {
@@ -168,11 +656,28 @@ namespace imque {
         return id;
       }
       
+    private:
+      BasicFixedAllocator(const BasicFixedAllocator&);
+      BasicFixedAllocator& operator=(const BasicFixedAllocator&);
+
     private:
       SuperBlock* super_blocks_;
-      VariableAllocator base_alc_;
-      const uint32_t region_size_;
+      Magazine* magazines_;
+      const uint32_t magazine_count_;
+      BasicVariableAllocator<Layout> base_alc_;
+      const size_t region_size_;
+
+      // 自プロセス用のマガジン (プロセスローカル)
+      Magazine* my_magazine_;
+      volatile pid_t my_magazine_pid_; // my_magazine_ を確保したプロセスのID (確保中は符号を反転した値)。fork後の子プロセスでは自身のIDと一致しなくなる
+
+      stats::Stats* stats_; // 統計情報の記録先 (プロセスローカル。記録しない場合は NULL)
     };
+
+    typedef BasicFixedAllocator<NarrowLayout> FixedAllocator;
+#ifdef IMQUE_HAS_ATOMIC_16
+    typedef BasicFixedAllocator<WideLayout> WideFixedAllocator;
+#endif
   }
 }
 
@@ -2,48 +2,89 @@
 #define IMQUE_ALLOCATOR_VARIABLE_ALLOCATOR_HH
 
 #include "../atomic/atomic.hh"
+#include "../stats.hh"
 #include <cassert>
 #include <inttypes.h>
+#include <vector>
 
 namespace imque {
   namespace allocator {
     namespace VariableAllocatorAux {
-      struct Node {
-        uint32_t version:10; // tag for ABA problem
-        uint32_t next:22;    // index of next Node
-        uint32_t count:24;   // avaiable Chunk count
-        uint32_t status:8;
-        
+      // ノードの状態の共通部分
+      template<class Self>
+      struct NodeOps {
         // nextフィールドは参照カウント用にも使用される
-        uint32_t refCount() const { return next; }
-        void setRefCount(uint32_t ref_count) { next = ref_count; }
+        uint32_t refCount() const { return self().next; }
+        void setRefCount(uint32_t ref_count) { self().next = ref_count; }
 
         enum STATUS {
           AVAILABLE = 0,
           JOIN_HEAD = 1, 
-          JOIN_TAIL = 2
+          JOIN_TAIL = 2,
+          IN_LIST   = 4  // フリーリストに連結済みであることが保証されたノード (索引からの参照の検証に使用する)
         };
         
-        bool isAvaiable() const { return status == AVAILABLE; }
-        bool isJoinHead() const { return status & JOIN_HEAD; }
-        bool isJoinTail() const { return status & JOIN_TAIL; }
+        bool isAvaiable() const { return (self().status & ~IN_LIST) == AVAILABLE; }
+        bool isIndexable() const { return (self().status & (IN_LIST|JOIN_TAIL)) == IN_LIST; }
+        bool isJoinHead() const { return self().status & JOIN_HEAD; }
+        bool isJoinTail() const { return self().status & JOIN_TAIL; }
+
+        Self join(const Self& tail_node) const {
+          return Self::make(tail_node.version+1,
+                            tail_node.next,
+                            self().count + tail_node.count,
+                            (self().status & ~JOIN_HEAD) | (tail_node.status & ~JOIN_TAIL));
+        }
 
-        Node join(const Node& tail_node) const {
-          return (Node){tail_node.version+1,
-                        tail_node.next,
-                        count + tail_node.count,
-                        (status & ~Node::JOIN_HEAD) | (tail_node.status & ~Node::JOIN_TAIL)};
+        Self changeNext(uint32_t new_next) const { return Self::make(self().version+1, new_next, self().count, self().status); }
+        Self changeCount(uint32_t new_count) const { return Self::make(self().version+1, self().next, new_count, self().status); }
+        Self changeStatus(uint32_t new_status) const { return Self::make(self().version+1, self().next, self().count, new_status); }
+
+        // ビットフィールドへの代入時の切り詰めは意図したもの (versionは循環する)
+        static Self make(uint32_t version, uint32_t next, uint32_t count, uint32_t status) {
+          Self node;
+          node.version = version;
+          node.next = next;
+          node.count = count;
+          node.status = status;
+          return node;
         }
 
-        Node changeNext(uint32_t new_next) const { return (Node){version+1, new_next, count, status}; }
-        Node changeCount(uint32_t new_count) const { return (Node){version+1, next, new_count, status}; }
-        Node changeStatus(uint32_t new_status) const { return (Node){version+1, next, count, new_status}; }
+      private:
+        const Self& self() const { return static_cast<const Self&>(*this); }
+        Self& self() { return static_cast<Self&>(*this); }
       };
 
+      struct Node : NodeOps<Node> {
+        uint32_t version:10; // tag for ABA problem
+        uint32_t next:22;    // index of next Node
+        uint32_t count:24;   // avaiable Chunk count
+        uint32_t status:8;
+      };
+
+      // WideLayout 用のノード (16byte)
+      struct WideNode : NodeOps<WideNode> {
+        uint32_t version;    // tag for ABA problem
+        uint32_t next;       // index of next Node
+        uint32_t count;      // avaiable Chunk count
+        uint32_t status;
+      } __attribute__((aligned(16)));
+
       struct Chunk {
         char padding[64];
       };
 
+      static const uint32_t SIZE_CLASS_COUNT = 32; // ノードのチャンク数の log2 毎の分類
+      static const uint32_t SEGMENT_COUNT = 64;    // ノード配列を(アドレス順に)等分した区間の数
+
+      // フリーリストの索引。
+      // 各要素はフリーリスト内のノードの位置 (0 なら該当なし) を保持するが、あくまでもヒントであり、
+      // 参照先のノードがまだフリーリスト内にあるかどうかは、使用時にノードの IN_LIST フラグで検証する。
+      struct FreeIndex {
+        volatile uint32_t size_classes[SIZE_CLASS_COUNT]; // チャンク数が [2^i, 2^(i+1)) のノード
+        volatile uint32_t segments[SEGMENT_COUNT];        // i 番目の区間内のノード
+      } IMQUE_CACHE_ALIGNED;
+
       struct Descriptor {
         uint32_t version:10; // tag for ABA problem
         uint32_t index:22;   // allocated node index
@@ -51,29 +92,94 @@ namespace imque {
         uint32_t encode() const { return atomic::cast<Descriptor, uint32_t>(*this); }
         static Descriptor decode(uint32_t v) { return atomic::cast<uint32_t, Descriptor>(v); }
       };
+
+      // WideLayout 用のメモリ記述子 (64bit)
+      struct WideDescriptor {
+        uint32_t version;    // tag for ABA problem
+        uint32_t index;      // allocated node index
+
+        uint64_t encode() const { return atomic::cast<WideDescriptor, uint64_t>(*this); }
+        static WideDescriptor decode(uint64_t v) { return atomic::cast<uint64_t, WideDescriptor>(v); }
+      };
     }
-    
+
+    // 32bitのメモリ記述子と8byteのノードを用いるレイアウト。
+    // 割当可能なメモリ領域の最大長は sizeof(Chunk)*NODE_COUNT_LIMIT = 256MB
+    struct NarrowLayout {
+      typedef uint32_t MD; // memory descriptor
+      typedef VariableAllocatorAux::Node NODE;
+      typedef VariableAllocatorAux::Descriptor DESCRIPTOR;
+      typedef uint32_t SIZE; // 割当領域に格納するデータのサイズの型 (割当可能な最大長 256MB を表せれば十分)
+      static const uint32_t NODE_COUNT_LIMIT = 0x400000; // 22bit
+    };
+
+#ifdef IMQUE_HAS_ATOMIC_16
+    // 64bitのメモリ記述子と16byteのノードを用いるレイアウト。(ノードの更新には16byteのCASを使用する)
+    // 割当可能なメモリ領域の最大長は sizeof(Chunk)*NODE_COUNT_LIMIT = 約256GB。
+    // また ABA 対策用のバージョンタグが32bitになるので、NarrowLayout よりもABA問題が起こる可能性が大幅に低い。
+    struct WideLayout {
+      typedef uint64_t MD; // memory descriptor
+      typedef VariableAllocatorAux::WideNode NODE;
+      typedef VariableAllocatorAux::WideDescriptor DESCRIPTOR;
+      typedef uint64_t SIZE; // 割当領域に格納するデータのサイズの型 (4GB 以上のデータも扱う)
+      static const uint32_t NODE_COUNT_LIMIT = 0xFFFFFFFF;
+    };
+#endif
     
     // ロックフリーな可変長ブロックアロケータ。
-    // 一つのインスタンスで(実際に)割当可能なメモリ領域の最大長は sizeof(Chunk)*NODE_COUNT_LIMIT = 256MB
-    class VariableAllocator {
-      typedef VariableAllocatorAux::Node Node;
+    // 一つのインスタンスで(実際に)割当可能なメモリ領域の最大長は sizeof(Chunk)*NODE_COUNT_LIMIT
+    // (NarrowLayout の場合は 256MB、WideLayout の場合は約256GB)
+    //
+    // 空き領域はアドレス順に連結されたフリーリストで管理し、その上にサイズ別/区間別の索引(FreeIndex)を持つ。
+    // 割当時はサイズ別の索引から十分な大きさのノードを直接探し、解放時は区間別の索引から直前のノードの近くを探し始めるので、
+    // 断片化によってフリーリストが長くなっても、通常はリストを先頭から辿る必要はない。
+    // 割当時に索引から見つからなかった場合は、要求と同じサイズクラスの索引のノード(無ければリストの先頭)から辿るが、
+    // 辿るノードの数は SEARCH_STEP_LIMIT 個までに制限する。(辿る途中で見つけたノードは索引に登録される)
+    // そのため、索引に登録されていない遠くのノードにしか収まらない割当は、空きがあっても失敗することがある。
+    // 解放時は直前のノードを必ず見つける必要があるので、辿るノードの数は制限しない。
+    //
+    // 索引の正しさは以下の不変条件で保証する:
+    //  - IN_LIST が立っていて JOIN_TAIL が立っていないノードは、フリーリスト内にある。
+    //    (フリーリストからノードが外れるのは結合時のみで、その前に必ず JOIN_TAIL が CAS で設定される)
+    //  - 割当時にはノードの status を初期化し、IN_LIST を落とす。
+    //  - IN_LIST は、フリーリスト内にあることが確認済みのノードに対する CAS でのみ設定する。
+    template<class Layout>
+    class BasicVariableAllocator {
+      typedef typename Layout::NODE Node;
       typedef atomic::Snapshot<Node> NodeSnapshot;
       typedef VariableAllocatorAux::Chunk Chunk;
-      typedef VariableAllocatorAux::Descriptor Descriptor;
+      typedef VariableAllocatorAux::FreeIndex FreeIndex;
+      typedef typename Layout::DESCRIPTOR Descriptor;
+
+      static const uint32_t SIZE_CLASS_COUNT = VariableAllocatorAux::SIZE_CLASS_COUNT;
+      static const uint32_t SEGMENT_COUNT = VariableAllocatorAux::SEGMENT_COUNT;
       
       static const int RETRY_LIMIT = 32;
       static const int LIGHT_RETRY_LIMIT = 1;
-      static const uint32_t NODE_COUNT_LIMIT = 0x400000; // 22bit
+      static const uint32_t NODE_COUNT_LIMIT = Layout::NODE_COUNT_LIMIT;
 
     public:
+      typedef typename Layout::MD MD; // memory descriptor
+
+      static const int SEARCH_STEP_LIMIT = 256; // 割当時に索引から見つからなかった場合に、フリーリストを辿るノード数の上限
+
       // region: 割当に使用するメモリ領域。
-      // size: regionのサイズ。メモリ領域の内の sizeof(Node)/sizeof(Chunk) は管理用に利用される。
-      VariableAllocator(void* region, uint32_t size)
-        : node_count_(size/(sizeof(Node)+sizeof(Chunk))),
-          nodes_(reinterpret_cast<Node*>(region)),
-          chunks_(reinterpret_cast<Chunk*>(nodes_+node_count_)) {
+      // size: regionのサイズ。メモリ領域の内の sizeof(FreeIndex) と sizeof(Node)/sizeof(Chunk) は管理用に利用される。
+      //
+      // region の先頭には索引(FreeIndex)を置く。
+      // 全ての割当/解放処理が参照するフリーリストの先頭ノード(nodes_[0])は、偽共有を避けるために単独でキャッシュラインを占有する。
+      // (nodes_[0] は索引の次のキャッシュラインの末尾に置かれ、nodes_[1] 以降はその次のキャッシュラインから始まる)
+      // チャンク群の開始位置もキャッシュライン境界に揃える。
+      BasicVariableAllocator(void* region, size_t size)
+        : node_count_(calcNodeCount(size)),
+          index_(reinterpret_cast<FreeIndex*>(region)),
+          nodes_(region ? reinterpret_cast<Node*>(reinterpret_cast<char*>(index_+1) + atomic::CACHE_LINE_SIZE - sizeof(Node)) : NULL),
+          chunks_(reinterpret_cast<Chunk*>(alignToCacheLine(reinterpret_cast<char*>(nodes_+node_count_)))),
+          stats_(NULL) {
       }
+
+      // 統計情報の記録先を設定する (IMQUE_STATS 定義時のみ有効)
+      void setStats(stats::Stats* stats) { stats_ = stats; }
       
       operator bool() const { return nodes_ != NULL && node_count_ > 2 && node_count_ < NODE_COUNT_LIMIT; }
 
@@ -81,8 +187,8 @@ namespace imque {
       // コンストラクタに渡した region につき一回呼び出す必要がある。
       void init() {
         if(*this) {
-          assert(sizeof(Descriptor) == 4);
-          assert(sizeof(Node) == 8);
+          assert(sizeof(Descriptor) == sizeof(MD));
+          assert(sizeof(Node) == sizeof(MD)*2);
 
           nodes_[0].next   = 1;
           nodes_[0].count  = 0;
@@ -90,7 +196,15 @@ namespace imque {
           
           nodes_[1].next   = node_count_;
           nodes_[1].count  = node_count_-1;
-          nodes_[1].status = Node::AVAILABLE;
+          nodes_[1].status = Node::AVAILABLE | Node::IN_LIST;
+
+          for(uint32_t i=0; i < SIZE_CLASS_COUNT; i++) {
+            index_->size_classes[i] = 0;
+          }
+          for(uint32_t i=0; i < SEGMENT_COUNT; i++) {
+            index_->segments[i] = 0;
+          }
+          addToIndex(NodeSnapshot(&nodes_[1]));
         }
       }
       
@@ -98,26 +212,40 @@ namespace imque {
       // 要求したサイズの割当に失敗した場合は 0 を、それ以外はメモリ領域参照用の識別子(記述子)を返す。
       // (識別子を ptrメソッド に渡すことで、実際のメモリ領域を参照可能)
       //
-      // メモリ割当は、領域不足以外に、極めて高い競合下で楽観的ロックの試行回数(RETRY_LIMIT)を越えた場合にも失敗する。
-      uint32_t allocate(uint32_t size) {
+      // メモリ割当は、領域不足以外に、極めて高い競合下で楽観的ロックの試行回数(RETRY_LIMIT)を越えた場合や、
+      // 索引から見つからずにフリーリストを SEARCH_STEP_LIMIT 個辿っても見つからなかった場合にも失敗する。
+      MD allocate(size_t size) {
         if(size == 0) {
           return 0; // invalid argument
         }
+        if((size+sizeof(Chunk)-1) / sizeof(Chunk) >= node_count_) {
+          stats::add(stats_, stats::VAR_OUT_OF_MEMORY);
+          return 0; // out of memory
+        }
 
         uint32_t need_chunk_count = (size+sizeof(Chunk)-1) / sizeof(Chunk);
       
         NodeSnapshot cand;
-        if(findCandidate(IsEnoughChunk(need_chunk_count), cand) == false) {
-          return 0; // out of memory (or exceeded retry limit)
+        uint32_t walk_start = 0;
+        int retry = RETRY_LIMIT;
+        int steps = SEARCH_STEP_LIMIT;
+        if(findIndexedCandidate(need_chunk_count, cand, walk_start)) {
+          stats::add(stats_, stats::VAR_INDEX_HIT);
+        } else if(findBoundedCandidate(need_chunk_count, walk_start, cand, retry, steps) == false) {
+          // 試行回数や探索長の上限を使い切った場合は、空きが不足しているとは限らない
+          stats::add(stats_, (retry < 0 || steps < 0) ? stats::VAR_RETRY_EXHAUSTED : stats::VAR_OUT_OF_MEMORY);
+          return 0; // out of memory (or exceeded retry/search limit)
         }
 
         uint32_t new_count = cand.node().count - need_chunk_count;
-        if(cand.compare_and_swap(cand.node().changeCount(new_count)) == false) {
+        if(cand.compare_and_swap(markInList(cand.node().changeCount(new_count))) == false) {
           return allocate(size);
         }
+        addToIndex(cand);
       
         uint32_t allocated_node_index = index(cand) + new_count; 
         Node& node = nodes_[allocated_node_index];
+        node.status = Node::AVAILABLE; // IN_LIST を落とす (割当済みのノードは索引の検証で弾かれるようにする)
         node.version++;
         node.count = need_chunk_count;
         node.setRefCount(1);
@@ -131,7 +259,7 @@ namespace imque {
       //
       // メモリ解放は、極めて高い競合下で楽観的ロックの試行回数(RETRY_LIMIT)を越えた場合に失敗することがある。
       // ※ ベンチマーク的なプログラムを除き、通常の使用途ではまず失敗しないはず
-      bool release(uint32_t md) {
+      bool release(MD md) {
         if(! undup(md)) {
           return true; // まだ誰かが参照中の場合は解放しない場合は
         }
@@ -139,7 +267,7 @@ namespace imque {
       }
       
       // 楽観的ロック失敗時の試行回数が少ない以外は releaseメソッド と同様。
-      bool lightRelease(uint32_t md) {
+      bool lightRelease(MD md) {
         if(! undup(md)) {
           return true; // まだ誰かが参照中の場合は解放しない場合は
         }
@@ -147,12 +275,12 @@ namespace imque {
       }
 
       // 割当領域のサイズ(バイト数)を返す
-      uint32_t getSize(uint32_t md) {
-        return nodes_[Descriptor::decode(md).index].count * sizeof(Chunk);
+      size_t getSize(MD md) {
+        return static_cast<size_t>(nodes_[Descriptor::decode(md).index].count) * sizeof(Chunk);
       }
       
       // 割当領域の参照カウントを増やす
-      bool dup(uint32_t md, uint32_t delta=1) {
+      bool dup(MD md, uint32_t delta=1) {
         Descriptor desc = Descriptor::decode(md);
 
         for(;;) {
@@ -172,7 +300,7 @@ namespace imque {
 
       // 解放可能(参照カウントが0)の割当領域を再利用する。
       // 返り値は、新しいメモリ記述子。
-      uint32_t dupNew(uint32_t md) {
+      MD dupNew(MD md) {
         Descriptor desc = Descriptor::decode(md);
 
         NodeSnapshot snap(nodes_ + desc.index);
@@ -188,10 +316,29 @@ namespace imque {
         desc.version++;
         return desc.encode();
       }
+
+      // 解放可能(参照カウントが0)の割当領域のバージョンを、参照カウントは 0 のままで進める。
+      // 返り値は、新しいメモリ記述子。
+      // (FixedAllocator が、割当を経ずにキャッシュ間でブロックを移動する際に、古い記述子との ABA 問題を防ぐために使用する)
+      MD renew(MD md) {
+        Descriptor desc = Descriptor::decode(md);
+
+        NodeSnapshot snap(nodes_ + desc.index);
+        Node node = snap.node();
+        assert(node.version == desc.version);
+        assert(node.refCount() == 0);
+
+        node.version++;
+        bool rlt = snap.compare_and_swap(node); // 他と競合するような使い方をしてはいけない
+        assert(rlt);
+
+        desc.version++;
+        return desc.encode();
+      }
       
       // 参照カウントを減らす。カウントが0(= 解放可能)なら true を返す。
       // release() メソッドの中で呼び出されるので、通常はクライアントコードで明示的に呼ばれることはない。
-      bool undup(uint32_t md) {
+      bool undup(MD md) {
         Descriptor desc = Descriptor::decode(md);
         
         for(;;) {
@@ -212,18 +359,132 @@ namespace imque {
 
       // allocateメソッドが返したメモリ記述子から、対応する実際にメモリ領域を取得する
       template<typename T>
-      T* ptr(uint32_t md) const { return reinterpret_cast<T*>(chunks_ + Descriptor::decode(md).index); }
+      T* ptr(MD md) const { return reinterpret_cast<T*>(chunks_ + Descriptor::decode(md).index); }
 
       template<typename T>
-      T* ptr(uint32_t md, uint32_t offset) const { return reinterpret_cast<T*>(ptr<char>(md)+offset); }
+      T* ptr(MD md, size_t offset) const { return reinterpret_cast<T*>(ptr<char>(md)+offset); }
+
+      // 一回の割当で確保可能な最大のサイズ (領域全体が空いている場合の上限。これを越えるサイズの割当は必ず失敗する)
+      // 割当は要求よりも多いチャンクを持つ空きノードからのみ行う(空きノードには最低一チャンクが残る)ので、領域全体のチャンク数よりも一つ少ない。
+      size_t maxAllocationSize() const { return static_cast<size_t>(node_count_-2) * sizeof(Chunk); }
+
+      // フリーリストの状態 (断片化の観測用)
+      struct FreeListInfo {
+        uint32_t node_count;  // フリーリスト内のノード(空き領域)の数
+        size_t free_bytes;    // 空き領域の合計バイト数
+        size_t largest_bytes; // 最大の空き領域のバイト数 (これを越えるサイズの割当は失敗する)
+      };
+
+      // フリーリストを先頭から辿って、その状態を返す。
+      // 他のプロセスの割当/解放と並行して呼び出すことも可能だが、その場合の値は概算となる。
+      FreeListInfo freeListInfo() {
+        FreeListInfo info = {0, 0, 0};
+        uint32_t pos = NodeSnapshot(&nodes_[0]).node().next;
+        while(pos > 0 && pos < node_count_) {
+          const Node node = NodeSnapshot(&nodes_[pos]).node();
+          const size_t bytes = static_cast<size_t>(node.count) * sizeof(Chunk);
+          info.node_count++;
+          info.free_bytes += bytes;
+          if(bytes > info.largest_bytes) {
+            info.largest_bytes = bytes;
+          }
+          if(node.next <= pos) {
+            break; // 並行する更新で、リストから外れたノードを辿った (リストはアドレス順なので、後ろに戻ることはない)
+          }
+          pos = node.next;
+        }
+        return info;
+      }
+
+      // 以下は、SIGKILL されたプロセスがリークさせた領域の回収用のメソッド。
+      // 他のプロセスがアロケータを操作していない(静止した)状態でのみ使用可能。
+
+      // 割当済み(フリーリスト外)の全領域のメモリ記述子を mds に追加する。
+      // 領域はアドレス順に、フリーリスト内のノードと割当済みのノードで隙間なく埋められているので、先頭から順に辿る。
+      // (割当処理の途中で SIGKILL されて、割当済みノードのチャンク数が不正な場合は、次の空きノードまでを一つの領域とみなす)
+      // 共有メモリ上の値は変更しない。(不正なチャンク数の修正は repairAllocatedCounts で行う)
+      void collectAllocated(std::vector<MD>& mds) const {
+        uint32_t next_free = nodes_[0].next;
+        uint32_t pos = 1;
+        while(pos < node_count_) {
+          for(; next_free < pos; next_free = nodes_[next_free].next);
+          if(pos == next_free) {
+            if(nodes_[pos].count == 0) {
+              break; // 壊れている
+            }
+            pos += nodes_[pos].count;
+            continue;
+          }
+
+          const Node& node = nodes_[pos];
+          Descriptor desc = {node.version, pos};
+          mds.push_back(desc.encode());
+          pos += allocatedCount(pos, next_free);
+        }
+      }
+
+      // 割当済みノードのうち、チャンク数が不正なもの(割当処理の途中で SIGKILL された場合)を、次の空きノードまでの長さに修正する。
+      // collectAllocated で収集した領域を解放する前に呼び出すこと。修正したノードの数を返す。
+      size_t repairAllocatedCounts() {
+        size_t repaired = 0;
+        uint32_t next_free = nodes_[0].next;
+        uint32_t pos = 1;
+        while(pos < node_count_) {
+          for(; next_free < pos; next_free = nodes_[next_free].next);
+          if(pos == next_free) {
+            if(nodes_[pos].count == 0) {
+              break; // 壊れている
+            }
+            pos += nodes_[pos].count;
+            continue;
+          }
+
+          const uint32_t count = allocatedCount(pos, next_free);
+          if(nodes_[pos].count != count) {
+            nodes_[pos].count = count;
+            repaired++;
+          }
+          pos += count;
+        }
+        return repaired;
+      }
+
+      uint32_t refCount(MD md) const {
+        return nodes_[Descriptor::decode(md).index].refCount();
+      }
+
+      void setRefCount(MD md, uint32_t ref_count) {
+        nodes_[Descriptor::decode(md).index].setRefCount(ref_count);
+      }
       
     private:
+      // 位置 pos の割当済みノードのチャンク数 (不正な場合は、次の空きノード next_free までの長さとみなす)
+      uint32_t allocatedCount(uint32_t pos, uint32_t next_free) const {
+        const uint32_t count = nodes_[pos].count;
+        return count == 0 || pos + count > next_free ? next_free - pos : count;
+      }
+
+      // 索引、ヘッダ用のキャッシュライン、ノード配列、キャッシュライン境界へのパディング、チャンク配列、が size に収まるノード数を返す
+      static uint32_t calcNodeCount(size_t size) {
+        const size_t reserved = sizeof(FreeIndex) + atomic::CACHE_LINE_SIZE*2;
+        const size_t count = size > reserved ? (size - reserved)/(sizeof(Node)+sizeof(Chunk)) : 0;
+        return count < NODE_COUNT_LIMIT ? count : NODE_COUNT_LIMIT; // 上限を越える場合は、無効なアロケータとなる
+      }
+
+      static char* alignToCacheLine(char* ptr) {
+        const uintptr_t mask = atomic::CACHE_LINE_SIZE - 1;
+        return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(ptr) + mask) & ~mask);
+      }
+
       struct IsEnoughChunk {
         IsEnoughChunk(uint32_t need_chunk_count) : count_(need_chunk_count) {}
         
         bool operator()(const NodeSnapshot& curr) const {
           return curr.node().isAvaiable() && curr.node().count > count_;
         }
+
+        // 探索を開始しても良いノードの位置の上限 (0 の場合は常に先頭から探索する)
+        uint32_t startLimit() const { return 0; }
         
         const uint32_t count_;
       };
@@ -235,17 +496,46 @@ namespace imque {
           return node_index_ < curr.node().next;
         }
 
+        uint32_t startLimit() const { return node_index_; }
+
+        const uint32_t node_index_;
+      };
+      
+      // 解放したノード(node_index)と、その後続のノードとの結合を試みた時点で探索を終える
+      struct IsPastReleased {
+        IsPastReleased(const Node* nodes, uint32_t node_index) : nodes_(nodes), node_index_(node_index) {}
+
+        bool operator()(const NodeSnapshot& curr) const {
+          return static_cast<uint32_t>(curr.place() - nodes_) > node_index_;
+        }
+
+        uint32_t startLimit() const { return node_index_; }
+
+        const Node* nodes_;
         const uint32_t node_index_;
       };
       
+      // 条件 fn を満たすノードを探す。
+      // 競合による探索のやり直し毎に retry を減らし、負になった場合は(条件を満たすノードの有無に関わらず) false を返す。
+      // steps が NULL でない場合は、辿ったノード毎に *steps を減らし、負になった場合も同様に false を返す。(やり直しを跨いで数える)
       template<class Callback>
-      bool findCandidate(const Callback& fn, NodeSnapshot& node, int retry=RETRY_LIMIT) {
-        NodeSnapshot head(&nodes_[0]);
-        return findCandidate(fn, head, node, retry);
+      bool findCandidate(const Callback& fn, NodeSnapshot& node, int& retry, int* steps=NULL) {
+        if(retry < 0) {
+          return false;
+        }
+        stats::add(stats_, stats::VAR_SEARCH);
+        NodeSnapshot start;
+        findStart(fn.startLimit(), start);
+        if(start.node().isJoinHead() == false && fn(start)) {
+          // 索引から取得した開始ノード自体が条件を満たす (先頭ノードが条件を満たすことはない)
+          node = start;
+          return true;
+        }
+        return findCandidate(fn, start, node, retry, steps);
       }
 
       template<class Callback>
-      bool findCandidate(const Callback& fn, NodeSnapshot& pred, NodeSnapshot& curr, int retry) {
+      bool findCandidate(const Callback& fn, NodeSnapshot& pred, NodeSnapshot& curr, int& retry, int* steps=NULL) {
         if(retry < 0) {
           return false;
         }
@@ -253,11 +543,20 @@ namespace imque {
         if(pred.node().next == node_count_) { // 終端ノードに達した
           return false;
         }
+        if(steps && --*steps < 0) { // 探索長の上限に達した
+          return false;
+        }
+        stats::add(stats_, stats::VAR_SEARCH_STEP);
         
         if(getNextSnapshot(pred, curr) == false ||  
            updateNodeStatus(pred, curr) == false ||
            joinNodesIfNeed(pred, curr) == false) { 
-          return findCandidate(fn, curr, retry-1);
+          retry--;
+          return findCandidate(fn, curr, retry, steps);
+        }
+
+        if(curr.node().isIndexable()) {
+          addToIndex(curr);
         }
 
         if(fn(curr)) {
@@ -265,7 +564,120 @@ namespace imque {
         }
 
         pred = curr;
-        return findCandidate(fn, pred, curr, retry);
+        return findCandidate(fn, pred, curr, retry, steps);
+      }
+
+      // 索引(サイズ別)から need_chunk_count より多くのチャンクを持つ空きノードを探す。
+      // 見つかったノードは(スナップショットの取得時点で)フリーリスト内にあることが保証される。
+      // 要求と同じサイズクラスの欄のノードが小さ過ぎた場合は、その位置を walk_start に設定する。(findBoundedCandidate の開始位置)
+      // それより上のサイズクラスの欄のノードは、必ず要求を満たす。
+      bool findIndexedCandidate(uint32_t need_chunk_count, NodeSnapshot& cand, uint32_t& walk_start) {
+        for(uint32_t i=sizeClassOf(need_chunk_count); i < SIZE_CLASS_COUNT; i++) {
+          volatile uint32_t* place = &index_->size_classes[i];
+          uint32_t node_index = atomic::fetch(place);
+          if(node_index == 0 || node_index >= node_count_) {
+            continue;
+          }
+
+          cand.update(&nodes_[node_index]);
+          if(cand.node().isIndexable() == false || sizeClassOf(cand.node().count) != i) {
+            // 既にフリーリストから外れているか、サイズが変わっている
+            atomic::compare_and_swap(place, node_index, 0u);
+            continue;
+          }
+          if(cand.node().isAvaiable() && cand.node().count > need_chunk_count) {
+            return true;
+          }
+          walk_start = node_index;
+        }
+        return false;
+      }
+
+      // 索引から見つからなかった場合に、walk_start のノード(0 ならリストの先頭)から、最大 steps 個のノードを辿って探す。
+      // (walk_start より前のノードは対象外。walk_start が既にフリーリストから外れていた場合や、競合でやり直す場合は先頭から辿る)
+      bool findBoundedCandidate(uint32_t need_chunk_count, uint32_t walk_start, NodeSnapshot& cand, int& retry, int& steps) {
+        const IsEnoughChunk fn(need_chunk_count);
+        if(walk_start != 0) {
+          NodeSnapshot start(&nodes_[walk_start]);
+          if(start.node().isIndexable()) {
+            stats::add(stats_, stats::VAR_SEARCH);
+            return findCandidate(fn, start, cand, retry, &steps);
+          }
+        }
+        return findCandidate(fn, cand, retry, &steps);
+      }
+
+      // 索引(区間別)から、位置が limit 未満の空きノードで、なるべく limit に近いものを探し、探索の開始位置とする。
+      // 見つからなかった場合はフリーリストの先頭から開始する。
+      void findStart(uint32_t limit, NodeSnapshot& start) {
+        if(limit != 0) {
+          for(uint32_t i=segmentOf(limit)+1; i > 0; i--) {
+            volatile uint32_t* place = &index_->segments[i-1];
+            uint32_t node_index = atomic::fetch(place);
+            if(node_index == 0 || node_index >= limit) {
+              continue;
+            }
+
+            start.update(&nodes_[node_index]);
+            if(start.node().isIndexable()) {
+              return;
+            }
+            atomic::compare_and_swap(place, node_index, 0u); // 既にフリーリストから外れている
+          }
+        }
+        start.update(&nodes_[0]);
+      }
+
+      // フリーリスト内にあることが確認済みのノードを索引に登録する。
+      // 索引への書き込みを減らすために、該当する欄が空いているか、欄のノードが既に無効(フリーリスト外か、サイズや区間が異なる)の場合にのみ登録する。
+      // (無効なノードを指したままの欄を上書きしないと、その欄の区間やサイズクラスのノードが、探索で辿られるまで索引から見つからなくなる)
+      void addToIndex(const NodeSnapshot& node) {
+        const uint32_t node_index = index(node);
+        if(node_index == 0 || node.node().count == 0) {
+          return;
+        }
+
+        const uint32_t size_class_id = sizeClassOf(node.node().count);
+        volatile uint32_t* size_class = &index_->size_classes[size_class_id];
+        const uint32_t size_class_curr = atomic::fetch(size_class);
+        if(size_class_curr != node_index && isStaleHint(size_class_curr, size_class_id, segmentOf(size_class_curr))) {
+          atomic::compare_and_swap(size_class, size_class_curr, node_index);
+        }
+
+        const uint32_t segment_id = segmentOf(node_index);
+        volatile uint32_t* segment = &index_->segments[segment_id];
+        const uint32_t segment_curr = atomic::fetch(segment);
+        if(segment_curr != node_index && isStaleHint(segment_curr, sizeClassOf(nodeAt(segment_curr).count), segment_id)) {
+          atomic::compare_and_swap(segment, segment_curr, node_index);
+        }
+      }
+
+      // 索引の欄の値 hint が、サイズクラス size_class_id・区間 segment_id のフリーリスト内のノードを指していないなら true を返す
+      bool isStaleHint(uint32_t hint, uint32_t size_class_id, uint32_t segment_id) const {
+        if(hint == 0 || hint >= node_count_) {
+          return true;
+        }
+        const Node node = nodeAt(hint);
+        return (node.isIndexable() == false ||
+                sizeClassOf(node.count) != size_class_id ||
+                segmentOf(hint) != segment_id);
+      }
+
+      Node nodeAt(uint32_t node_index) const {
+        return node_index < node_count_ ? atomic::fetch(&nodes_[node_index]) : Node();
+      }
+
+      static Node markInList(Node node) {
+        node.status |= Node::IN_LIST;
+        return node;
+      }
+
+      static uint32_t sizeClassOf(uint32_t chunk_count) {
+        return 31 - __builtin_clz(chunk_count | 1);
+      }
+
+      uint32_t segmentOf(uint32_t node_index) const {
+        return static_cast<uint64_t>(node_index) * SEGMENT_COUNT / node_count_;
       }
 
       bool getNextSnapshot(NodeSnapshot& pred, NodeSnapshot& curr) const {
@@ -318,7 +730,7 @@ namespace imque {
         return node.node().next == index(node) + node.node().count; 
       }
 
-      bool releaseImpl(uint32_t md, int retry_limit, bool fast) {
+      bool releaseImpl(MD md, int retry_limit, bool fast) {
         if(md == 0) {
           return true;
         }
@@ -327,11 +739,12 @@ namespace imque {
 
         uint32_t node_index = desc.index;
         NodeSnapshot pred;
-        if(findCandidate(IsPredecessor(node_index), pred, retry_limit) == false) {
+        int retry = retry_limit;
+        if(findCandidate(IsPredecessor(node_index), pred, retry) == false) {
           return false;
         }
         // 極めて高い競合下では、以下のassertionがfalseになる場合はある。
-        // 原因はおそらくABA問題で Node.version に割り当てるビット量を増やせば発生頻度は低下する。
+        // 原因はおそらくABA問題で Node.version に割り当てるビット量を増やせば発生頻度は低下する。(WideLayout では32bit)
         // ※ ただしFixedAllocatorと併用する場合は、ほぼ間違いなくといって良いほど、この問題は起こらないので、
         //    現状の割り当てビット数で問題ない。
         assert(node_index >= index(pred)+pred.node().count);
@@ -351,22 +764,56 @@ namespace imque {
           node->status = Node::AVAILABLE;
         }
         node->version++;
+        const Node linked_node = *node; // 連結時点でのノードの値
       
-        if(pred.compare_and_swap(new_pred_node) == false) {
+        if(pred.compare_and_swap(markInList(new_pred_node)) == false) {
           node->version--;
           node->setRefCount(0);
           
           return fast ? false : releaseImpl(md, retry_limit, fast);
         }
-      
+        addToIndex(pred);
+
+        if(! is_neighbor) {
+          // フリーリストに連結したノードに IN_LIST を設定する。
+          // 連結時点から変更されていなければ、まだフリーリスト内にある。
+          // (既に他のプロセスによって更新されていた場合は設定しない。その場合は、後で割当や解放の対象となった際に設定される)
+          if(atomic::compare_and_swap(node, linked_node, markInList(linked_node.changeStatus(linked_node.status)))) {
+            addToIndex(NodeSnapshot(node));
+          }
+        }
+
+        joinSuccessor(pred, node_index);
         return true;
       }
 
+      // 解放したノード(node_index。直前のノードに結合済みの場合もある)を、領域が隣接している後続の空きノードと結合する。
+      // 割当は索引から、解放は直前のノードの近くから探索を始めるので、リストを先頭から辿る際の結合処理だけに任せると、
+      // 隣接した空きノードが分割されたまま残り、大きな割当ができなくなっていく。
+      // 結合は辿る際と同じ手順で行い、競合した場合は(探索をやり直さずに)諦める。(後でリストを辿る際に結合される)
+      void joinSuccessor(const NodeSnapshot& linked_pred, uint32_t node_index) {
+        NodeSnapshot pred(const_cast<Node*>(linked_pred.place()));
+        if(index(pred) != 0 && pred.node().isIndexable() == false) {
+          return; // 既に他のノードに結合されたか、割当に使用された
+        }
+
+        NodeSnapshot curr;
+        int retry = 0; // 一度でも競合したら、findCandidate はやり直さずに false を返す
+        findCandidate(IsPastReleased(nodes_, node_index), pred, curr, retry);
+      }
+
     private:
       const uint32_t node_count_;
+      FreeIndex* index_;
       Node* nodes_;
       Chunk* chunks_;      
+      stats::Stats* stats_; // 統計情報の記録先 (プロセスローカル。記録しない場合は NULL)
     };
+
+    typedef BasicVariableAllocator<NarrowLayout> VariableAllocator;
+#ifdef IMQUE_HAS_ATOMIC_16
+    typedef BasicVariableAllocator<WideLayout> WideVariableAllocator;
+#endif
   }
 }
 
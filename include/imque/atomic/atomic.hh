@@ -4,8 +4,22 @@
 #include <string.h>
 #include <inttypes.h>
 
+// 共有メモリ上で頻繁に更新される値を、それぞれ別のキャッシュラインに配置するために使用する。
+// (共有メモリのレイアウトが変わるので、同じキューを使用する全てのプロセスで同じ値を指定する必要がある)
+#ifndef IMQUE_CACHE_LINE_SIZE
+#define IMQUE_CACHE_LINE_SIZE 64
+#endif
+#define IMQUE_CACHE_ALIGNED __attribute__((aligned(IMQUE_CACHE_LINE_SIZE)))
+
+// 16byteの値に対する fetch/compare_and_swap が使用可能かどうか (x86-64 では -mcx16 を指定してコンパイルする必要がある)
+#if defined(__ATOMIC_ACQUIRE) && defined(__SIZEOF_INT128__) && defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+#define IMQUE_HAS_ATOMIC_16 1
+#endif
+
 namespace imque {
   namespace atomic {
+    static const uint32_t CACHE_LINE_SIZE = IMQUE_CACHE_LINE_SIZE;
+
     namespace {
       // From から To へと型変換を行う
       template<typename From, typename To>
@@ -37,6 +51,42 @@ namespace imque {
       template<> struct SizeToType<2> { typedef uint16_t TYPE; };
       template<> struct SizeToType<4> { typedef uint32_t TYPE; };
       template<> struct SizeToType<8> { typedef uint64_t TYPE; };
+#ifdef IMQUE_HAS_ATOMIC_16
+      template<> struct SizeToType<16> { typedef unsigned __int128 TYPE; };
+#endif
+
+#ifdef __ATOMIC_ACQUIRE
+      // サイズ毎の CAS/ロード命令
+      template<int SIZE> struct Ops {
+        template<typename P, typename V>
+        static bool compare_and_swap(P place, V old_value, V new_value) {
+          return __atomic_compare_exchange_n(place, &old_value, new_value, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        }
+
+        template<typename V, typename P>
+        static V load(P place) {
+          return __atomic_load_n(place, __ATOMIC_ACQUIRE);
+        }
+      };
+
+#ifdef IMQUE_HAS_ATOMIC_16
+      // 16byteの場合は __atomic 系の組み込み関数だと libatomic の呼び出しになるので、cmpxchg16b を直接使用する。
+      // (ロードも CAS で代用するので、ロック付きの命令になる)
+      // ※ CAS は値が一致しなくても書き込みとして扱われるので、読み込み専用(PROT_READ)でマッピングした領域に対する
+      //    16byteの fetch は SIGSEGV になる。読み込み専用でマッピングする側(imque-stat など)では、8byte 以下の読み込みのみを行うこと。
+      template<> struct Ops<16> {
+        template<typename P, typename V>
+        static bool compare_and_swap(P place, V old_value, V new_value) {
+          return __sync_bool_compare_and_swap(place, old_value, new_value);
+        }
+
+        template<typename V, typename P>
+        static V load(P place) {
+          return __sync_val_compare_and_swap(place, V(), V());
+        }
+      };
+#endif
+#endif
     }
 
     // TODO: 場所移動
@@ -44,6 +94,79 @@ namespace imque {
     To cast(From v) { return union_conv<From,To>(v); }
     
     // 各種アトミック命令
+    //
+    // gcc4.7以降(および clang)では __atomic 系の組み込み関数を使用し、操作毎に必要最小限のメモリオーダーを指定する。
+    //  - fetch:                acquire ロード (ロック付きの RMW 命令は発行しない)
+    //  - compare_and_swap:     acq_rel (失敗時は acquire)
+    //  - fetch_and_add/clear/or/and:  acq_rel
+    //  - add/sub:              relaxed (統計用などのカウンタ向け。順序付けが必要な場合は fence と併用する)
+    //                          delta は place と同じ幅で加減算されるので、64bit のカウンタには size_t などをそのまま渡せる
+    // それ以前の gcc では、従来通り __sync 系の組み込み関数(全て full barrier)を使用する。
+#ifdef __ATOMIC_ACQUIRE
+    template<typename T, typename T2>
+    bool compare_and_swap(T* place, T2 old_value, T2 new_value) {
+      typedef typename SizeToType<sizeof(T)>::TYPE uint;
+      return Ops<sizeof(T)>::compare_and_swap(union_conv<T, uint>(place),
+                                              union_conv<T2, uint>(old_value),
+                                              union_conv<T2, uint>(new_value));
+    }
+    
+    template<typename T>
+    T fetch_and_add(T* place, int delta) {
+      typedef typename SizeToType<sizeof(T)>::TYPE uint;
+      return union_conv<uint, T>(__atomic_fetch_add(union_conv<T, uint>(place), delta, __ATOMIC_ACQ_REL));
+    }
+
+    template<typename T>
+    T fetch_and_clear(T* place) {
+      typedef typename SizeToType<sizeof(T)>::TYPE uint;
+      return union_conv<uint, T>(__atomic_fetch_and(union_conv<T, uint>(place), 0, __ATOMIC_ACQ_REL));
+    }
+
+    // ビット演算 (acq_rel)。操作前の値を返す
+    template<typename T, typename T2>
+    T fetch_and_or(T* place, T2 bits) {
+      typedef typename SizeToType<sizeof(T)>::TYPE uint;
+      return union_conv<uint, T>(__atomic_fetch_or(union_conv<T, uint>(place), bits, __ATOMIC_ACQ_REL));
+    }
+
+    template<typename T, typename T2>
+    T fetch_and_and(T* place, T2 bits) {
+      typedef typename SizeToType<sizeof(T)>::TYPE uint;
+      return union_conv<uint, T>(__atomic_fetch_and(union_conv<T, uint>(place), bits, __ATOMIC_ACQ_REL));
+    }
+
+    template<typename T, typename T2>
+    void add(T* place, T2 delta) {
+      typedef typename SizeToType<sizeof(T)>::TYPE uint;
+      __atomic_add_fetch(union_conv<T, uint>(place), delta, __ATOMIC_RELAXED);
+    }
+    
+    template<typename T, typename T2>
+    void sub(T* place, T2 delta) {
+      typedef typename SizeToType<sizeof(T)>::TYPE uint;
+      __atomic_sub_fetch(union_conv<T, uint>(place), delta, __ATOMIC_RELAXED);
+    }
+
+    // 8byteの構造体(VariableAllocatorAux::Node など)も、一回のロード命令で読み込まれる
+    template<typename T>
+    T fetch(T* place) {
+      typedef typename SizeToType<sizeof(T)>::TYPE uint;
+      return union_conv<uint, T>(Ops<sizeof(T)>::template load<uint>(union_conv<T, uint>(place)));
+    }
+
+    // release ストア (これ以前の書き込みが、fetch で値を読み込んだ側からも可視になる)
+    template<typename T, typename T2>
+    void store(T* place, T2 value) {
+      typedef typename SizeToType<sizeof(T)>::TYPE uint;
+      __atomic_store_n(union_conv<T, uint>(place), union_conv<T2, uint>(value), __ATOMIC_RELEASE);
+    }
+
+    // 前後のメモリ操作の順序を保証する (full barrier)
+    inline void fence() {
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+#else
     template<typename T, typename T2>
     bool compare_and_swap(T* place, T2 old_value, T2 new_value) {
       typedef typename SizeToType<sizeof(T)>::TYPE uint;
@@ -64,14 +187,26 @@ namespace imque {
       return union_conv<uint, T>(__sync_fetch_and_and(union_conv<T, uint>(place), 0));
     }
 
-    template<typename T>
-    void add(T* place, int delta) {
+    template<typename T, typename T2>
+    T fetch_and_or(T* place, T2 bits) {
+      typedef typename SizeToType<sizeof(T)>::TYPE uint;
+      return union_conv<uint, T>(__sync_fetch_and_or(union_conv<T, uint>(place), bits));
+    }
+
+    template<typename T, typename T2>
+    T fetch_and_and(T* place, T2 bits) {
+      typedef typename SizeToType<sizeof(T)>::TYPE uint;
+      return union_conv<uint, T>(__sync_fetch_and_and(union_conv<T, uint>(place), bits));
+    }
+
+    template<typename T, typename T2>
+    void add(T* place, T2 delta) {
       typedef typename SizeToType<sizeof(T)>::TYPE uint;
       __sync_add_and_fetch(union_conv<T, uint>(place), delta);
     }
     
-    template<typename T>
-    void sub(T* place, int delta) {
+    template<typename T, typename T2>
+    void sub(T* place, T2 delta) {
       typedef typename SizeToType<sizeof(T)>::TYPE uint;
       __sync_sub_and_fetch(union_conv<T, uint>(place), delta);
     }
@@ -81,6 +216,17 @@ namespace imque {
       return fetch_and_add(place, 0);
     }
 
+    template<typename T, typename T2>
+    void store(T* place, T2 value) {
+      __sync_synchronize();
+      *place = value;
+    }
+
+    inline void fence() {
+      __sync_synchronize();
+    }
+#endif
+
     // スナップショットクラス
     template<typename T>
     class Snapshot {
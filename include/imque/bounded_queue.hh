@@ -0,0 +1,70 @@
+#ifndef IMQUE_BOUNDED_QUEUE_HH
+#define IMQUE_BOUNDED_QUEUE_HH
+
+#include "ipc/shared_memory.hh"
+#include "queue/bounded_queue_impl.hh"
+#include <string>
+#include <sys/types.h>
+
+namespace imque {
+  // 固定長の要素用の、有界なロックフリーFIFOキュー
+  // マルチプロセス間で使用可能
+  // 要素はスロット配列に直接コピーされ、メモリアロケータを使用しないので、小さな要素を大量に扱う場合は Queue よりも高速。
+  class BoundedQueue {
+  public:
+    // 親子プロセス間で共有可能な無名キューを作成する
+    // slot_count はキューに格納可能な要素数 (二の階乗に切り上げられる)
+    // slot_data_size は要素の最大サイズ
+    BoundedQueue(uint32_t slot_count, uint32_t slot_data_size)
+      : shm_(queue::BoundedQueueImpl::calcShmSize(slot_count, slot_data_size)),
+        impl_(shm_, slot_count, slot_data_size) {
+      init();
+    }
+
+    // 複数プロセス間で共有可能な名前付きキューを作成する
+    // slot_count および slot_data_size は、キューを共有する全てのプロセスで同じ値を指定する必要がある
+    // filepath は共有メモリのマッピングに使用するファイルのパス
+    BoundedQueue(uint32_t slot_count, uint32_t slot_data_size, const std::string& filepath, mode_t mode=0660)
+      : shm_(filepath, queue::BoundedQueueImpl::calcShmSize(slot_count, slot_data_size), mode),
+        impl_(shm_, slot_count, slot_data_size) {
+      if(*this) {
+        impl_.init_once();
+      }
+    }
+
+    operator bool() const { return shm_ && impl_; }
+
+    // 初期化メソッド。
+    // キューを空に戻したい場合や、名前付きキュー用のファイルを使い回して明示的に初期化したい場合などに使用する。
+    void init() {
+      if(*this) {
+        impl_.init();
+      }
+    }
+
+    // キューに要素を追加する (キューに空きがない場合や、要素のサイズが slot_data_size を越える場合は false を返す)
+    // datav および sizev は count 分のサイズを持ち、それらを全て結合したデータがキューには追加される
+    bool enqv(const void** datav, size_t* sizev, size_t count) { return impl_.enqv(datav, sizev, count); }
+
+    // キューに要素を追加する (キューに空きがない場合や、要素のサイズが slot_data_size を越える場合は false を返す)
+    bool enq(const void* data, size_t size) { return impl_.enq(data, size); }
+
+    // キューから要素を取り出し buf に格納する (キューが空の場合は false を返す)
+    bool deq(std::string& data) { return impl_.deq(data); }
+
+    // キューが空なら true を返す
+    bool isEmpty() const { return impl_.isEmpty(); }
+
+    // キューへの要素追加に失敗した回数を返す
+    size_t overflowedCount() const { return impl_.overflowedCount(); }
+
+    // キューへの要素追加失敗回数の取得と、カウントの初期化をアトミックに行う。
+    size_t resetOverflowedCount() { return impl_.resetOverflowedCount(); }
+
+  private:
+    ipc::SharedMemory       shm_;
+    queue::BoundedQueueImpl impl_;
+  };
+}
+
+#endif
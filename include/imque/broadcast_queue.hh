@@ -0,0 +1,108 @@
+#ifndef IMQUE_BROADCAST_QUEUE_HH
+#define IMQUE_BROADCAST_QUEUE_HH
+
+#include "ipc/shared_memory.hh"
+#include "queue/broadcast_queue_impl.hh"
+#include <string>
+#include <sys/types.h>
+
+namespace imque {
+  // 全ての購読者が、全ての要素を受け取るキュー (ブロードキャスト/トピック)
+  // マルチプロセス間で使用可能
+  //
+  // 要素は一回だけ共有メモリ上に格納され、各購読者は独自のカーソルで要素を取り出す。
+  // (購読者毎に Queue を用意して、同じ要素を購読者数分追加する場合と比べて、割当とコピーが一回で済む)
+  // 要素は、全ての購読者が取り出した時点で解放される。
+  //
+  // 遅い購読者が要素を取り出さずにいると、それ以降の要素が解放されずにメモリが枯渇するので、
+  // cut_off_lag を指定した場合は、空きがなくなった時点で、未取得の要素数が cut_off_lag を越える購読者を切り離す。
+  // (cutOffSlowSubscribers で明示的に切り離すことも可能)
+  class BroadcastQueue {
+  public:
+    static const uint32_t MAX_SUBSCRIBER_COUNT = queue::BroadcastQueueImpl::MAX_SUBSCRIBER_COUNT;
+
+    // 親子プロセス間で共有可能な無名キューを作成する
+    // shm_size は共有メモリ領域のサイズ (最大約256MB)
+    // cut_off_lag は遅い購読者を自動的に切り離す際の閾値 (0 なら自動的には切り離さない)
+    // map_options は共有メモリ領域のマッピング方法 (MapOption の組み合わせ)
+    BroadcastQueue(size_t shm_size, uint64_t cut_off_lag=0, int map_options=ipc::MapOption::NONE)
+      : shm_(shm_size, map_options),
+        impl_(shm_),
+        cut_off_lag_(cut_off_lag) {
+      init();
+    }
+
+    // 複数プロセス間で共有可能な名前付きキューを作成する
+    // filepath は共有メモリのマッピングに使用するファイルのパス
+    BroadcastQueue(size_t shm_size, const std::string& filepath, mode_t mode=0660, uint64_t cut_off_lag=0, int map_options=ipc::MapOption::NONE)
+      : shm_(filepath, shm_size, mode, map_options),
+        impl_(shm_),
+        cut_off_lag_(cut_off_lag) {
+      if(*this) {
+        impl_.init_once();
+      }
+    }
+
+    operator bool() const { return shm_ && impl_; }
+
+    // 初期化メソッド。
+    // キューを空に戻したい場合や、名前付きキュー用のファイルを使い回して明示的に初期化したい場合などに使用する。
+    // (全ての購読者の登録も解除される)
+    void init() {
+      if(*this) {
+        impl_.init();
+      }
+    }
+
+    // 要素を追加する (キューに空きがない場合は false を返す)
+    // datav および sizev は count 分のサイズを持ち、それらを全て結合したデータがキューには追加される
+    bool enqv(const void** datav, size_t* sizev, size_t count) { return impl_.enqv(datav, sizev, count, cut_off_lag_); }
+
+    // 要素を追加する (キューに空きがない場合は false を返す)
+    bool enq(const void* data, size_t size) { return impl_.enqv(&data, &size, 1, cut_off_lag_); }
+
+    // 購読を開始し、購読者のIDを返す。(購読者数が MAX_SUBSCRIBER_COUNT に達している場合は -1 を返す)
+    // 購読開始以降に追加された要素が、deq で取り出し可能となる。
+    // SIGKILL されたプロセスの購読者IDは、他のプロセスの購読開始時に再利用される。
+    int subscribe() { return impl_.subscribe(); }
+
+    // 購読を終了する
+    void unsubscribe(int subscriber) { impl_.unsubscribe(subscriber); }
+
+    // 切り離された購読者が、改めて(その時点の末尾から)購読を開始する
+    void resubscribe(int subscriber) { impl_.resubscribe(subscriber); }
+
+    // 購読者 subscriber が未取得の要素を一つ取り出し buf に格納する
+    // (未取得の要素がない場合や、購読者が切り離されている場合は false を返す)
+    bool deq(int subscriber, std::string& buf) { return impl_.deq(subscriber, buf); }
+
+    // 購読者が切り離されているかどうか
+    bool isCutOff(int subscriber) const { return impl_.isCutOff(subscriber); }
+
+    // 購読者の未取得の要素数を返す
+    uint64_t lag(int subscriber) { return impl_.lag(subscriber); }
+
+    // 未取得の要素数が max_lag を越える購読者、および SIGKILL された購読者を切り離す。切り離した購読者の数を返す。
+    uint32_t cutOffSlowSubscribers(uint64_t max_lag) { return impl_.cutOffSlowSubscribers(max_lag); }
+
+    // キューへの要素追加に失敗した回数を返す
+    size_t overflowedCount() const { return impl_.overflowedCount(); }
+
+    // キューへの要素追加失敗回数の取得と、カウントの初期化をアトミックに行う。
+    size_t resetOverflowedCount() { return impl_.resetOverflowedCount(); }
+
+    // 購読者を切り離した回数を返す
+    size_t cutOffCount() const { return impl_.cutOffCount(); }
+
+    // 解放されていない要素(ノード)の数を返す。購読者がいない(全て取り出し済みの)場合は 1 となる。
+    // 他のプロセスがキューを操作していない状態でのみ使用可能。(解放漏れの検査用)
+    size_t nodeCount() { return impl_.nodeCount(); }
+
+  private:
+    ipc::SharedMemory          shm_;
+    queue::BroadcastQueueImpl  impl_;
+    const uint64_t             cut_off_lag_;
+  };
+}
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef IMQUE_IPC_FD_PASSING_HH
+#define IMQUE_IPC_FD_PASSING_HH
+
+#include <string>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+
+namespace imque {
+  namespace ipc {
+    // Unix domain socket 経由でのファイルディスクリプタの受け渡し (SCM_RIGHTS)
+    // memfd で作成した共有メモリ領域を、親子関係のないプロセス間で共有する場合などに使用する。
+    //
+    // 例:
+    //   [作成側]  imque::Queue que(shm_size, ipc::Memfd());
+    //            int sock = ipc::fd_passing::accept(listen_sock);
+    //            ipc::fd_passing::send(sock, que.fd());
+    //   [参照側]  int sock = ipc::fd_passing::connect("/tmp/imque.sock");
+    //            imque::Queue que(ipc::Fd(ipc::fd_passing::recv(sock)));
+    namespace fd_passing {
+      inline bool setSocketPath(sockaddr_un& addr, const std::string& path) {
+        if(path.size() >= sizeof(addr.sun_path)) {
+          return false;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.c_str(), path.size()+1);
+        return true;
+      }
+
+      // path に Unix domain socket を作成し、接続待ち状態にする。(失敗した場合は -1 を返す)
+      // path に既にファイルが存在する場合は削除してから作成する。
+      inline int listen(const std::string& path, int backlog=16) {
+        sockaddr_un addr;
+        if(setSocketPath(addr, path) == false) {
+          return -1;
+        }
+
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(sock == -1) {
+          return -1;
+        }
+
+        ::unlink(path.c_str());
+        if(bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+           ::listen(sock, backlog) != 0) {
+          close(sock);
+          return -1;
+        }
+        return sock;
+      }
+
+      // listen() で作成したソケットへの接続を受け付ける。(失敗した場合は -1 を返す)
+      inline int accept(int listen_sock) {
+        int sock;
+        do {
+          sock = ::accept(listen_sock, NULL, NULL);
+        } while(sock == -1 && errno == EINTR);
+        return sock;
+      }
+
+      // path の Unix domain socket に接続する。(失敗した場合は -1 を返す)
+      inline int connect(const std::string& path) {
+        sockaddr_un addr;
+        if(setSocketPath(addr, path) == false) {
+          return -1;
+        }
+
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(sock == -1) {
+          return -1;
+        }
+
+        if(::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+          close(sock);
+          return -1;
+        }
+        return sock;
+      }
+
+      // 接続済みのソケット sock を通して、ファイルディスクリプタ fd を送信する
+      // (送信後も、送信側の fd はそのまま有効)
+      inline bool send(int sock, int fd) {
+        char dummy = 0;
+        iovec iov;
+        iov.iov_base = &dummy;
+        iov.iov_len = 1;
+
+        char control[CMSG_SPACE(sizeof(int))];
+        memset(control, 0, sizeof(control));
+
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+        ssize_t rlt;
+        do {
+          rlt = sendmsg(sock, &msg, 0);
+        } while(rlt == -1 && errno == EINTR);
+        return rlt == 1;
+      }
+
+      // 接続済みのソケット sock を通して、ファイルディスクリプタを受信する。(失敗した場合は -1 を返す)
+      // 受信した fd の所有権は呼び出し元に移る。(不要になったら close するか、ipc::Fd として SharedMemory に渡す)
+      inline int recv(int sock) {
+        char dummy;
+        iovec iov;
+        iov.iov_base = &dummy;
+        iov.iov_len = 1;
+
+        char control[CMSG_SPACE(sizeof(int))];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t rlt;
+        do {
+          rlt = recvmsg(sock, &msg, 0);
+        } while(rlt == -1 && errno == EINTR);
+        if(rlt != 1) {
+          return -1;
+        }
+
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+           cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+          return -1;
+        }
+
+        int fd;
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        return fd;
+      }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef IMQUE_IPC_FUTEX_HH
+#define IMQUE_IPC_FUTEX_HH
+
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+namespace imque {
+  namespace ipc {
+    // 共有メモリ上の32bitワードを用いたプロセス間の待機/起床処理
+    // Linux では futex(2) を使用し、それ以外の環境では短いスリープを挟んだポーリングで代用する。
+    // ※ 共有メモリ(MAP_SHARED)上で使用するので、FUTEX_PRIVATE_FLAG は付けない
+    namespace futex {
+      // *place の値が expected と等しい間、最大 timeout_us マイクロ秒スリープする。
+      // タイムアウトした場合は false を、それ以外(起床/値の変更/シグナル割り込み)の場合は true を返す。
+      inline bool wait(volatile uint32_t* place, uint32_t expected, long timeout_us) {
+#ifdef __linux__
+        timespec ts;
+        ts.tv_sec  = timeout_us / 1000000;
+        ts.tv_nsec = (timeout_us % 1000000) * 1000;
+        if(syscall(SYS_futex, place, FUTEX_WAIT, expected, &ts, NULL, 0) == -1 && errno == ETIMEDOUT) {
+          return false;
+        }
+        return true;
+#else
+        if(*place != expected) {
+          return true;
+        }
+        usleep(timeout_us < 1000 ? timeout_us : 1000);
+        return *place != expected;
+#endif
+      }
+
+      // place で待機中のプロセスを最大 count 個起床する
+      inline void wake(volatile uint32_t* place, int count) {
+#ifdef __linux__
+        syscall(SYS_futex, place, FUTEX_WAKE, count, NULL, NULL, 0);
+#else
+        (void)place;
+        (void)count;
+#endif
+      }
+    }
+  }
+}
+
+#endif
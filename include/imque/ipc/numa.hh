@@ -0,0 +1,91 @@
+#ifndef IMQUE_IPC_NUMA_HH
+#define IMQUE_IPC_NUMA_HH
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+namespace imque {
+  namespace ipc {
+    // NUMAノードの情報取得と、メモリ領域の配置ポリシーの設定用の関数群
+    // libnuma には依存せず、システムコールを直接呼び出す。(Linux 以外の環境では、全て単一ノードとして振る舞う)
+    namespace numa {
+      static const int MAX_NODE_COUNT = 1024;
+
+      // mempolicy.h の値
+      static const int MPOL_PREFERRED_  = 1;
+      static const int MPOL_BIND_       = 2;
+      static const int MPOL_INTERLEAVE_ = 3;
+      static const unsigned MPOL_MF_MOVE_ = 1 << 1;
+
+      // システムのNUMAノード数を返す (取得できない場合は 1)
+      inline int nodeCount() {
+        int count = 1;
+        if(FILE* fp = fopen("/sys/devices/system/node/possible", "r")) {
+          // "0" や "0-3" などの形式
+          int first, last;
+          int n = fscanf(fp, "%d-%d", &first, &last);
+          if(n == 2 && last >= 0 && last < MAX_NODE_COUNT) {
+            count = last + 1;
+          }
+          fclose(fp);
+        }
+        return count;
+      }
+
+      // 呼び出し元のスレッドが現在実行されているCPUのNUMAノードを返す (取得できない場合は 0)
+      inline int currentNode() {
+#if defined(__linux__) && defined(SYS_getcpu)
+        unsigned cpu = 0;
+        unsigned node = 0;
+        if(syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+          return static_cast<int>(node);
+        }
+#endif
+        return 0;
+      }
+
+      inline bool setPolicy(void* addr, size_t len, int mode, const unsigned long* nodemask, unsigned long maxnode) {
+#if defined(__linux__) && defined(SYS_mbind)
+        return syscall(SYS_mbind, addr, len, mode, nodemask, maxnode, MPOL_MF_MOVE_) == 0;
+#else
+        (void)addr; (void)len; (void)mode; (void)nodemask; (void)maxnode;
+        return false;
+#endif
+      }
+
+      inline bool setPolicy(void* addr, size_t len, int mode, int node_first, int node_last) {
+        const int BITS = sizeof(unsigned long) * 8;
+        unsigned long nodemask[MAX_NODE_COUNT / BITS];
+        memset(nodemask, 0, sizeof(nodemask));
+        if(node_first < 0 || node_last >= MAX_NODE_COUNT) {
+          return false;
+        }
+        for(int node=node_first; node <= node_last; node++) {
+          nodemask[node / BITS] |= 1UL << (node % BITS);
+        }
+        return setPolicy(addr, len, mode, nodemask, MAX_NODE_COUNT + 1);
+      }
+
+      // [addr, addr+len) のページを node に配置する (addr はページ境界である必要がある)
+      // ポリシーは以後に割り当てられるページに適用される。(既に割り当て済みのページは、可能なら移動される)
+      // ※ 通常のファイルをマッピングした領域では効果がない (無名メモリ、shm_open、memfd の領域でのみ有効)
+      inline bool bind(void* addr, size_t len, int node) {
+        return setPolicy(addr, len, MPOL_BIND_, node, node);
+      }
+
+      // bind と同様だが、node のメモリが不足している場合は他のノードに配置される
+      inline bool prefer(void* addr, size_t len, int node) {
+        return setPolicy(addr, len, MPOL_PREFERRED_, node, node);
+      }
+
+      // [addr, addr+len) のページを全ノードにインターリーブして配置する
+      inline bool interleave(void* addr, size_t len) {
+        return setPolicy(addr, len, MPOL_INTERLEAVE_, 0, nodeCount()-1);
+      }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef IMQUE_IPC_PROCESS_HH
+#define IMQUE_IPC_PROCESS_HH
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace imque {
+  namespace ipc {
+    // 共有メモリ上のデータの所有者の識別、および所有者の生存確認用の関数群
+    namespace process {
+      inline volatile pid_t& cachedSelf() {
+        static volatile pid_t pid = 0;
+        return pid;
+      }
+
+      inline volatile uint64_t& cachedSelfIdentity() {
+        static volatile uint64_t identity = 0;
+        return identity;
+      }
+
+      inline void clearCachedSelf() {
+        cachedSelf() = 0;
+        cachedSelfIdentity() = 0;
+      }
+
+      // 自プロセスのIDを返す。
+      // getpid() の結果はキャッシュしておき、fork() 後の子プロセスでのみ再取得する。(pthread_atfork で検出する)
+      inline pid_t self() {
+        volatile pid_t& pid = cachedSelf();
+        if(pid == 0) {
+          static const bool registered = pthread_atfork(NULL, NULL, clearCachedSelf) == 0;
+          (void)registered;
+          pid = getpid();
+        }
+        return pid;
+      }
+
+      // プロセスが生存しているかどうか (権限不足で確認できない場合は、生存しているものとして扱う)
+      inline bool isAlive(pid_t pid) {
+        return kill(pid, 0) == 0 || errno != ESRCH;
+      }
+
+      // プロセスの起動時刻 (/proc/PID/stat の starttime。システム起動からのクロックティック数) を返す。(取得できない場合は 0 を返す)
+      inline uint64_t startTime(pid_t pid) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/stat", static_cast<int>(pid));
+        FILE* fp = fopen(path, "r");
+        if(fp == NULL) {
+          return 0;
+        }
+        char buf[1024];
+        size_t len = fread(buf, 1, sizeof(buf)-1, fp);
+        fclose(fp);
+        buf[len] = '\0';
+
+        // 二番目のフィールド(comm)は空白や括弧を含み得るので、最後の ')' 以降を解析する。starttime は22番目のフィールド
+        const char* p = strrchr(buf, ')');
+        unsigned long long start_time = 0;
+        if(p == NULL ||
+           sscanf(p+1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu", &start_time) != 1) {
+          return 0;
+        }
+        return start_time;
+      }
+
+      // PID と起動時刻(の下位32bit)を組み合わせた、プロセスの識別子を返す。
+      // PID が再利用された場合でも、以前のプロセスの識別子とは(起動時刻が異なるので)一致しない。
+      inline uint64_t identity(pid_t pid) {
+        return (startTime(pid) << 32) | static_cast<uint32_t>(pid);
+      }
+
+      // 自プロセスの識別子を返す (self と同様に、fork() 後の子プロセスでのみ再取得する)
+      inline uint64_t selfIdentity() {
+        volatile uint64_t& id = cachedSelfIdentity();
+        if(id == 0) {
+          id = identity(self());
+        }
+        return id;
+      }
+
+      inline pid_t pidOf(uint64_t identity) {
+        return static_cast<pid_t>(identity & 0xFFFFFFFF);
+      }
+
+      // 識別子が指すプロセスが生存しているかどうか。
+      // PID のプロセスが存在しても、起動時刻が異なる場合(PID が再利用された場合)は、死亡しているものとして扱う。
+      inline bool isAliveIdentity(uint64_t id) {
+        const pid_t pid = pidOf(id);
+        if(! isAlive(pid)) {
+          return false;
+        }
+        const uint64_t start_time = startTime(pid);
+        return start_time == 0 || (start_time & 0xFFFFFFFF) == (id >> 32); // 起動時刻が取得できない場合は、生存しているものとして扱う
+      }
+    }
+  }
+}
+
+#endif
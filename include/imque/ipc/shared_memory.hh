@@ -1,12 +1,18 @@
 #ifndef IMQUE_IPC_SHARED_MEMORY_HH
 #define IMQUE_IPC_SHARED_MEMORY_HH
 
+#include "../atomic/atomic.hh"
+#include "numa.hh"
 #include <string>
+#include <stdio.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h> 
 #include <fcntl.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
 
 #ifndef MAP_ANONYMOUS
 #define MAP_ANONYMOUS MAP_ANON
@@ -14,31 +20,183 @@
 
 namespace imque {
   namespace ipc {
+    // 共有メモリ領域のマッピング方法の指定 (ビットORで組み合わせて指定する)
+    // いずれも環境が対応していない場合や、権限/リソース不足で失敗した場合は無視される。(実際に適用されたものは SharedMemory::options() で取得可能)
+    struct MapOption {
+      enum FLAG {
+        NONE      = 0,
+        HUGE_TLB  = 1, // 無名メモリ領域を MAP_HUGETLB で確保する (予め /proc/sys/vm/nr_hugepages でヒュージページを確保しておく必要がある)
+                       // ※ 名前付きの場合は、hugetlbfs 上のパスを指定すれば、このオプションなしでもヒュージページが使用される
+        HUGE_PAGE = 2, // madvise(MADV_HUGEPAGE) で Transparent Huge Pages の使用を促す
+        POPULATE  = 4, // マッピング時に全ページを事前にフォールトさせる (MAP_POPULATE および各ページへの書き込みアクセス)
+        LOCK      = 8, // mlock で領域をメモリ上に固定する (RLIMIT_MEMLOCK の制限を受ける)
+
+        // NUMAノードへの配置 (通常のファイルを用いる名前付き領域では効果がない)
+        NUMA_INTERLEAVE = 16, // 全ノードにページをインターリーブして配置する
+        NUMA_BIND       = 32, // bindTo(node) で指定したノードにページを配置する
+
+        READ_ONLY = 64 // 読み込み専用でマッピングする (Fd で渡された、O_RDONLY で開いたファイルの参照用。POPULATE は無視される)
+      };
+
+      static const int NUMA_NODE_SHIFT = 16;
+
+      // 領域を node に配置するためのオプション値を返す (他のオプションとビットORで組み合わせ可能)
+      static int bindTo(int node) { return NUMA_BIND | (node << NUMA_NODE_SHIFT); }
+      static int nodeOf(int options) { return options >> NUMA_NODE_SHIFT; }
+    };
+
+    // shm_open で作成する名前付き共有メモリ領域の名前 (例: "/imque-sample")
+    // 通常のファイルと異なり、ディスクへの書き戻しは発生しない。(Linux では /dev/shm 以下に作成される)
+    struct ShmName {
+      explicit ShmName(const std::string& name) : name(name) {}
+      std::string name;
+    };
+
+    // memfd_create で作成する無名共有メモリ領域の指定 (name はデバッグ用の表示名)
+    // ファイルシステム上には何も作成されない。他のプロセスとは、ファイルディスクリプタを受け渡すことで共有する。(fd_passing.hh 参照)
+    struct Memfd {
+      explicit Memfd(const std::string& name="imque") : name(name) {}
+      std::string name;
+    };
+
+    // 既に作成済みの共有メモリ領域(memfd など)を参照するファイルディスクリプタ
+    // SharedMemory に渡した fd の所有権は SharedMemory に移り、破棄時に close される。
+    struct Fd {
+      explicit Fd(int fd) : fd(fd) {}
+      int fd;
+    };
+
     class SharedMemory {
     public:
       // 親子プロセス間で共有可能な無名メモリ領域を作成する
-      SharedMemory(size_t size) : ptr_(MAP_FAILED), size_(size) {
-	ptr_ = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+      // options は MapOption の組み合わせ
+      SharedMemory(size_t size, int options=MapOption::NONE) 
+	: ptr_(MAP_FAILED), size_(size), map_size_(size), options_(MapOption::NONE), fd_(-1) {
+#ifdef MAP_HUGETLB
+	if(options & MapOption::HUGE_TLB) {
+	  map_size_ = roundUp(size, hugePageSize());
+	  ptr_ = mmap(NULL, map_size_, protFlag(options), MAP_SHARED|MAP_ANONYMOUS|MAP_HUGETLB|populateFlag(options), -1, 0);
+	  if(ptr_ != MAP_FAILED) {
+	    options_ |= MapOption::HUGE_TLB;
+	  } else {
+	    map_size_ = size; // 通常のページで確保し直す
+	  }
+	}
+#endif
+	if(ptr_ == MAP_FAILED) {
+	  ptr_ = mmap(NULL, map_size_, protFlag(options), MAP_SHARED|MAP_ANONYMOUS|populateFlag(options), -1, 0);
+	}
+	applyOptions(options);
       }
 
       // 複数プロセス間で共有可能な名前つきメモリ領域を作成する
-      SharedMemory(const std::string& filepath, size_t size, mode_t mode=0660) 
-	: ptr_(MAP_FAILED), size_(size) {
+      // filepath が hugetlbfs 上のパスの場合は、ファイルサイズはヒュージページの倍数に切り上げられる
+      // options は MapOption の組み合わせ (HUGE_TLB は無視される)
+      SharedMemory(const std::string& filepath, size_t size, mode_t mode=0660, int options=MapOption::NONE) 
+	: ptr_(MAP_FAILED), size_(size), map_size_(size), options_(MapOption::NONE), fd_(-1) {
 	int fd = open(filepath.c_str(), O_CREAT|O_RDWR, mode);
 	if(fd == -1) {
 	  return;
 	}
 
-	if(ftruncate(fd, size) == 0) {
-	  ptr_ = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	const size_t huge_page_size = hugeTlbPageSize(fd);
+	if(huge_page_size != 0) {
+	  map_size_ = roundUp(size, huge_page_size);
+	  options_ |= MapOption::HUGE_TLB;
+	}
+
+	if(ftruncate(fd, map_size_) == 0) {
+	  ptr_ = mmap(NULL, map_size_, protFlag(options), MAP_SHARED|populateFlag(options), fd, 0);
+	}
+	close(fd);
+	applyOptions(options);
+      }
+
+      // shm_open で、複数プロセス間で共有可能な名前つきメモリ領域を作成する (既に存在する場合はそれを使用する)
+      // options は MapOption の組み合わせ (HUGE_TLB は無視される)
+      SharedMemory(const ShmName& shm_name, size_t size, mode_t mode=0660, int options=MapOption::NONE) 
+	: ptr_(MAP_FAILED), size_(size), map_size_(size), options_(MapOption::NONE), fd_(-1) {
+	int fd = shm_open(shm_name.name.c_str(), O_CREAT|O_RDWR, mode);
+	if(fd == -1) {
+	  return;
+	}
+
+	if(ftruncate(fd, map_size_) == 0) {
+	  ptr_ = mmap(NULL, map_size_, protFlag(options), MAP_SHARED|populateFlag(options), fd, 0);
 	}
 	close(fd);
+	applyOptions(options);
+      }
+
+      // memfd_create で、ファイルシステム上に名前を持たない共有メモリ領域を作成する
+      // 作成した領域のファイルディスクリプタは fd() で取得でき、他のプロセスに渡すことで共有可能。
+      // options は MapOption の組み合わせ (HUGE_TLB 指定時は MFD_HUGETLB を使用する)
+      SharedMemory(const Memfd& memfd, size_t size, int options=MapOption::NONE)
+	: ptr_(MAP_FAILED), size_(size), map_size_(size), options_(MapOption::NONE), fd_(-1) {
+#ifdef MFD_CLOEXEC
+#ifdef MFD_HUGETLB
+	if(options & MapOption::HUGE_TLB) {
+	  fd_ = memfd_create(memfd.name.c_str(), MFD_CLOEXEC|MFD_HUGETLB);
+	  if(fd_ != -1) {
+	    // Fd で参照する側は fstat でサイズを取得するので、size_ も切り上げたサイズに揃えておく
+	    size_ = map_size_ = roundUp(size, hugePageSize());
+	    options_ |= MapOption::HUGE_TLB;
+	  }
+	}
+#endif
+	if(fd_ == -1) {
+	  fd_ = memfd_create(memfd.name.c_str(), MFD_CLOEXEC);
+	}
+	if(fd_ == -1) {
+	  return;
+	}
+
+	if(ftruncate(fd_, map_size_) == 0) {
+	  ptr_ = mmap(NULL, map_size_, protFlag(options), MAP_SHARED|populateFlag(options), fd_, 0);
+	}
+	if(ptr_ == MAP_FAILED) {
+	  options_ = MapOption::NONE;
+	}
+	applyOptions(options);
+#else
+	(void)memfd;
+	(void)options;
+#endif
+      }
+
+      // ファイルディスクリプタが参照する、作成済みの共有メモリ領域をマッピングする。(サイズは fstat で取得する)
+      // 他のプロセスから受け取った memfd を使用する場合などに使う。
+      // options は MapOption の組み合わせ (HUGE_TLB は無視される)
+      SharedMemory(const Fd& fd, int options=MapOption::NONE)
+	: ptr_(MAP_FAILED), size_(fileSize(fd.fd)), map_size_(size_), options_(MapOption::NONE), fd_(fd.fd) {
+	if(fd_ == -1 || size_ == 0) {
+	  return;
+	}
+
+	const size_t huge_page_size = hugeTlbPageSize(fd_);
+	if(huge_page_size != 0) {
+	  options_ |= MapOption::HUGE_TLB;
+	}
+	ptr_ = mmap(NULL, map_size_, protFlag(options), MAP_SHARED|populateFlag(options), fd_, 0);
+	if(ptr_ == MAP_FAILED) {
+	  options_ = MapOption::NONE;
+	}
+	applyOptions(options);
       }
     
       ~SharedMemory() {
 	if(ptr_ != MAP_FAILED) {
-	  munmap(ptr_, size_);
+	  munmap(ptr_, map_size_);
 	}
+	if(fd_ != -1) {
+	  close(fd_);
+	}
+      }
+
+      // shm_open で作成した名前付きメモリ領域を削除する
+      // (既にマッピング済みのプロセスは、そのまま使用を続けられる)
+      static bool unlink(const ShmName& shm_name) {
+	return shm_unlink(shm_name.name.c_str()) == 0;
       }
 
       operator bool() const { return ptr_ != MAP_FAILED; }
@@ -50,10 +208,132 @@ namespace imque {
       T* ptr(size_t offset) const { return reinterpret_cast<T*>(ptr<char>()+offset); }
   
       size_t size() const { return size_; }
+
+      // 実際に適用されたマッピングオプションを返す
+      int options() const { return *this ? options_ : MapOption::NONE; }
+
+      // 全ページに書き込みアクセスを行い、ページフォールトを事前に発生させる。
+      // (MAP_POPULATE は読み込み用にしかページを割り当てない場合があるため)
+      // 既に他のプロセスが使用中の領域の場合もあるので、値は変更しない (0 のアトミックな加算)
+      // MapOption::POPULATE 指定時にはコンストラクタ内で呼ばれる。
+      // マッピング後に領域の一部に対してNUMAノードを指定した場合などは、その後で明示的に呼び出す。
+      // 呼び出し後は、options() が POPULATE を含むようになる。
+      // 読み込み専用でマッピングした領域では、書き込みアクセスが SIGSEGV になるので何もしない。
+      void populate() {
+	if(ptr_ == MAP_FAILED || (options_ & MapOption::READ_ONLY)) {
+	  return;
+	}
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	for(size_t offset=0; offset < map_size_; offset += page_size) {
+	  atomic::add(reinterpret_cast<char*>(ptr_) + offset, 0);
+	}
+	options_ |= MapOption::POPULATE;
+      }
+
+      // memfd(もしくは Fd で渡された)領域のファイルディスクリプタを返す。(それ以外の場合は -1)
+      // 返り値の所有権は SharedMemory が保持したままなので、close してはいけない。
+      int fd() const { return fd_; }
     
+    private:
+      static int protFlag(int options) {
+	return (options & MapOption::READ_ONLY) ? PROT_READ : PROT_READ|PROT_WRITE;
+      }
+
+      static int populateFlag(int options) {
+#ifdef MAP_POPULATE
+	// NUMAノードを指定する場合は、ポリシーの設定後にフォールトさせる必要があるので MAP_POPULATE は使わない
+	// 読み込み専用の場合も、POPULATE は無視するので使わない
+	if(options & (MapOption::NUMA_INTERLEAVE|MapOption::NUMA_BIND|MapOption::READ_ONLY)) {
+	  return 0;
+	}
+	return (options & MapOption::POPULATE) ? MAP_POPULATE : 0;
+#else
+	return 0;
+#endif
+      }
+
+      void applyOptions(int options) {
+	if(ptr_ == MAP_FAILED) {
+	  return;
+	}
+
+	// NUMAノードへの配置やヒュージページの指定は、事前フォールトよりも前に行う必要がある
+	if(options & MapOption::NUMA_INTERLEAVE) {
+	  if(numa::interleave(ptr_, map_size_)) {
+	    options_ |= MapOption::NUMA_INTERLEAVE;
+	  }
+	} else if(options & MapOption::NUMA_BIND) {
+	  if(numa::bind(ptr_, map_size_, MapOption::nodeOf(options))) {
+	    options_ |= MapOption::bindTo(MapOption::nodeOf(options));
+	  }
+	}
+
+#ifdef MADV_HUGEPAGE
+	if((options & MapOption::HUGE_PAGE) && !(options_ & MapOption::HUGE_TLB) &&
+	   madvise(ptr_, map_size_, MADV_HUGEPAGE) == 0) {
+	  options_ |= MapOption::HUGE_PAGE;
+	}
+#endif
+
+	if(options & MapOption::READ_ONLY) {
+	  options_ |= MapOption::READ_ONLY; // populate() は書き込みアクセスを伴うので、以降は何もしなくなる (POPULATE は無視される)
+	} else if(options & MapOption::POPULATE) {
+	  populate();
+	}
+
+	if((options & MapOption::LOCK) && mlock(ptr_, map_size_) == 0) {
+	  options_ |= MapOption::LOCK;
+	}
+      }
+
+      // fd が hugetlbfs 上のファイルなら、そのヒュージページのサイズを返す。それ以外は 0 を返す。
+      static size_t hugeTlbPageSize(int fd) {
+#ifdef __linux__
+	const long HUGETLBFS_MAGIC = 0x958458f6;
+	struct statfs st;
+	if(fstatfs(fd, &st) == 0 && static_cast<long>(st.f_type) == HUGETLBFS_MAGIC) {
+	  return st.f_bsize;
+	}
+#endif
+	return 0;
+      }
+
+      // デフォルトのヒュージページのサイズ (/proc/meminfo から取得できない場合は 2MB とする)
+      static size_t hugePageSize() {
+	size_t size_kb = 2048;
+	if(FILE* fp = fopen("/proc/meminfo", "r")) {
+	  char line[256];
+	  while(fgets(line, sizeof(line), fp)) {
+	    unsigned long kb;
+	    if(sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+	      size_kb = kb;
+	      break;
+	    }
+	  }
+	  fclose(fp);
+	}
+	return size_kb * 1024;
+      }
+
+      static size_t roundUp(size_t size, size_t unit) {
+	return (size + unit - 1) / unit * unit;
+      }
+
+      static size_t fileSize(int fd) {
+	struct stat st;
+	return fd != -1 && fstat(fd, &st) == 0 ? st.st_size : 0;
+      }
+
+    private:
+      SharedMemory(const SharedMemory&);
+      SharedMemory& operator=(const SharedMemory&);
+
     private:
       void* ptr_;
-      const size_t size_;
+      size_t size_;
+      size_t map_size_; // 実際にマッピングしたサイズ (ヒュージページ使用時は size_ を切り上げたもの)
+      int options_;
+      int fd_; // 共有用に保持しているファイルディスクリプタ (memfd/Fd の場合のみ。それ以外は -1)
     };
   }
 }
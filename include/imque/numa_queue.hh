@@ -0,0 +1,133 @@
+#ifndef IMQUE_NUMA_QUEUE_HH
+#define IMQUE_NUMA_QUEUE_HH
+
+#include "ipc/shared_memory.hh"
+#include "ipc/numa.hh"
+#include "queue/lane_queue_impl.hh"
+#include <string>
+#include <sys/types.h>
+
+namespace imque {
+  // NUMAノード毎のサブキューを持つFIFOキュー
+  // マルチプロセス間で使用可能
+  //
+  // 共有メモリ領域をNUMAノード数のレーンに分割し、各レーンのページをそれぞれのノードに配置する。
+  // 要素の追加は、呼び出し元が実行されているノードのレーンに対して行う。
+  // 取り出しは、まず自ノードのレーンから行い、それが空の場合にのみ他のノードのレーンから取り出す。
+  // そのため、通常は要素のコピーやノード操作がローカルメモリへのアクセスで済む。
+  //
+  // 要素の順序は、同じノード上で追加された要素間でのみ保証される。
+  // (プロセスが実行中に別のノードに移動した場合は、そのプロセスが追加した要素間の順序も保証されない)
+  class NumaQueue {
+  public:
+    // 親子プロセス間で共有可能な無名キューを作成する
+    // shm_size は共有メモリ領域全体のサイズ (各レーンの最大サイズは Queue と同様に約256MB)
+    // map_options は共有メモリ領域のマッピング方法 (MapOption の組み合わせ。NUMA関連の指定は無視される)
+    NumaQueue(size_t shm_size, int map_options=ipc::MapOption::NONE)
+      : shm_(shm_size, mapOptionsForLanes(map_options)),
+        impl_(shm_, ipc::numa::nodeCount()),
+        deq_start_(0) {
+      placeLanes(map_options);
+      init();
+    }
+      
+    // 複数プロセス間で共有可能な名前付きキューを作成する
+    // shm_size は共有メモリ領域全体のサイズ
+    // filepath は共有メモリのマッピングに使用するファイルのパス
+    // (各レーンのNUMAノードへの配置は、tmpfs(/dev/shm など)や hugetlbfs 上のパスの場合にのみ有効)
+    NumaQueue(size_t shm_size, const std::string& filepath, mode_t mode=0660, int map_options=ipc::MapOption::NONE)
+      : shm_(filepath, shm_size, mode, mapOptionsForLanes(map_options)),
+        impl_(shm_, ipc::numa::nodeCount()),
+        deq_start_(0) {
+      placeLanes(map_options);
+      if(*this) {
+        impl_.init_once();
+      }
+    }
+
+    operator bool() const { return shm_ && impl_; }
+
+    // 初期化メソッド。
+    // キューを空に戻したい場合や、名前付きキュー用のファイルを使い回して明示的に初期化したい場合などに使用する。
+    void init() {
+      if(*this) {
+        impl_.init();
+      }
+    }
+
+    // 自ノードのレーンに要素を追加する (レーンに空きがない場合は false を返す)
+    // datav および sizev は count 分のサイズを持ち、それらを全て結合したデータがキューには追加される
+    bool enqv(const void** datav, size_t* sizev, size_t count) { return localLane().enqv(datav, sizev, count); }
+    
+    // 自ノードのレーンに要素を追加する (レーンに空きがない場合は false を返す)
+    bool enq(const void* data, size_t size) { return localLane().enq(data, size); }
+
+    // 要素を取り出し buf に格納する (キューが空の場合は false を返す)
+    // 自ノードのレーンが空の場合は、他のノードのレーンから取り出す。
+    bool deq(std::string& buf) {
+      const uint32_t local = localLaneIndex();
+      if(impl_.lane(local).deq(buf)) {
+        return true;
+      }
+
+      // 他ノードのレーンは、偏りが出ないように呼び出し毎に一つずつずらした位置から試す
+      const uint32_t count = impl_.laneCount();
+      const uint32_t start = deq_start_++;
+      for(uint32_t i=0; i < count; i++) {
+        const uint32_t lane = (start + i) % count;
+        if(lane != local && impl_.lane(lane).deq(buf)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // キューが空なら true を返す
+    bool isEmpty() { return impl_.isEmpty(); }
+
+    // キューへの要素追加に失敗した回数を返す
+    size_t overflowedCount() const { return impl_.overflowedCount(); }
+
+    // キューへの要素追加失敗回数の取得と、カウントの初期化をアトミックに行う。
+    size_t resetOverflowedCount() { return impl_.resetOverflowedCount(); }
+
+    // レーン(NUMAノード)の数を返す
+    uint32_t laneCount() const { return impl_.laneCount(); }
+
+    // 共有メモリ領域に実際に適用されたマッピング方法 (MapOption の組み合わせ) を返す
+    // POPULATE は各レーンの配置後に適用するが、Queue と同様に結果に含まれる。(NUMA関連の指定はレーン毎に行うので含まれない)
+    int mapOptions() const { return shm_.options(); }
+
+  private:
+    // 各レーンのノード配置前にページが割り当てられないように、事前フォールトは配置後に行う (placeLanes を参照)
+    static int mapOptionsForLanes(int map_options) {
+      return map_options & ~(ipc::MapOption::POPULATE|ipc::MapOption::NUMA_INTERLEAVE|ipc::MapOption::NUMA_BIND|
+                             ~((1 << ipc::MapOption::NUMA_NODE_SHIFT)-1));
+    }
+
+    void placeLanes(int map_options) {
+      if(! *this) {
+        return;
+      }
+      for(uint32_t i=0; i < impl_.laneCount(); i++) {
+        ipc::numa::prefer(impl_.laneRegion(shm_, i), impl_.laneSize(), i);
+      }
+      if(map_options & ipc::MapOption::POPULATE) {
+        shm_.populate(); // shm_.options() にも POPULATE が反映される
+      }
+    }
+
+    uint32_t localLaneIndex() const {
+      return static_cast<uint32_t>(ipc::numa::currentNode()) % impl_.laneCount();
+    }
+
+    queue::QueueImpl& localLane() { return impl_.lane(localLaneIndex()); }
+
+  private:
+    ipc::SharedMemory     shm_;
+    queue::LaneQueueImpl  impl_;
+    uint32_t              deq_start_; // プロセスローカル
+  };
+}
+
+#endif
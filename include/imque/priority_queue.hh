@@ -0,0 +1,83 @@
+#ifndef IMQUE_PRIORITY_QUEUE_HH
+#define IMQUE_PRIORITY_QUEUE_HH
+
+#include "ipc/shared_memory.hh"
+#include "queue/priority_queue_impl.hh"
+#include <string>
+#include <sys/types.h>
+
+namespace imque {
+  // 優先度付きのロックフリーFIFOキュー
+  // マルチプロセス間で使用可能
+  //
+  // level_count 個の優先度(0 が最も高い)毎のキューが、一つの共有メモリ領域(アロケータ)を共有する。
+  // 複数の Queue を優先度順に調べる場合と異なり、deq は要素の存在するレベルのみを調べ、メモリも全レベルで融通しあえる。
+  // 要素の順序は、同じ優先度の要素間でのみ保証される。
+  class PriorityQueue {
+  public:
+    static const uint32_t MAX_LEVEL_COUNT = queue::PriorityQueueImpl::MAX_LEVEL_COUNT;
+
+    // 親子プロセス間で共有可能な無名キューを作成する
+    // shm_size は共有メモリ領域のサイズ (最大約256MB)
+    // level_count は優先度の数 (1 から MAX_LEVEL_COUNT まで)
+    // map_options は共有メモリ領域のマッピング方法 (MapOption の組み合わせ)
+    PriorityQueue(size_t shm_size, uint32_t level_count, int map_options=ipc::MapOption::NONE)
+      : shm_(shm_size, map_options),
+        impl_(shm_, level_count) {
+      init();
+    }
+
+    // 複数プロセス間で共有可能な名前付きキューを作成する
+    // level_count はキューを共有する全てのプロセスで同じ値を指定する必要がある
+    // filepath は共有メモリのマッピングに使用するファイルのパス
+    PriorityQueue(size_t shm_size, uint32_t level_count, const std::string& filepath, mode_t mode=0660, int map_options=ipc::MapOption::NONE)
+      : shm_(filepath, shm_size, mode, map_options),
+        impl_(shm_, level_count) {
+      if(*this) {
+        impl_.init_once();
+      }
+    }
+
+    operator bool() const { return shm_ && impl_; }
+
+    // 初期化メソッド。
+    // キューを空に戻したい場合や、名前付きキュー用のファイルを使い回して明示的に初期化したい場合などに使用する。
+    void init() {
+      if(*this) {
+        impl_.init();
+      }
+    }
+
+    // 優先度 priority の要素を追加する (キューに空きがない場合や、priority が levelCount() 以上の場合は false を返す)
+    // datav および sizev は count 分のサイズを持ち、それらを全て結合したデータがキューには追加される
+    bool enqv(uint32_t priority, const void** datav, size_t* sizev, size_t count) { return impl_.enqv(priority, datav, sizev, count); }
+
+    // 優先度 priority の要素を追加する (キューに空きがない場合や、priority が levelCount() 以上の場合は false を返す)
+    // priority が範囲外の場合は、overflowedCount には数えない
+    bool enq(uint32_t priority, const void* data, size_t size) { return impl_.enqv(priority, &data, &size, 1); }
+
+    // 最も優先度の高い要素を取り出し buf に格納する (キューが空の場合は false を返す)
+    bool deq(std::string& buf) { return impl_.deq(buf, NULL); }
+
+    // 最も優先度の高い要素を取り出し buf に、その優先度を priority に格納する (キューが空の場合は false を返す)
+    bool deq(std::string& buf, uint32_t& priority) { return impl_.deq(buf, &priority); }
+
+    // キューが空なら true を返す
+    bool isEmpty() { return impl_.isEmpty(); }
+
+    // キューへの要素追加に失敗した回数を返す
+    size_t overflowedCount() const { return impl_.overflowedCount(); }
+
+    // キューへの要素追加失敗回数の取得と、カウントの初期化をアトミックに行う。
+    size_t resetOverflowedCount() { return impl_.resetOverflowedCount(); }
+
+    // 優先度の数を返す
+    uint32_t levelCount() const { return impl_.levelCount(); }
+
+  private:
+    ipc::SharedMemory         shm_;
+    queue::PriorityQueueImpl  impl_;
+  };
+}
+
+#endif
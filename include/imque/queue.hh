@@ -4,26 +4,67 @@
 #include "ipc/shared_memory.hh"
 #include "queue/queue_impl.hh"
 #include <string>
+#include <vector>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 namespace imque {
+  // 共有メモリ領域のマッピング方法の指定 (ヒュージページの使用や、事前フォールト、mlock など)
+  typedef ipc::MapOption MapOption;
+
   // ロックフリーなFIFOキュー
   // マルチプロセス間で使用可能
-  class Queue {
+  // 実際には Queue (もしくは WideQueue) の typedef を通して使用する
+  template<class Layout>
+  class BasicQueue {
   public:
+    typedef typename queue::BasicQueueImpl<Layout>::MessageView MessageView;
+    typedef typename queue::BasicQueueImpl<Layout>::Reservation Reservation;
+
     // 親子プロセス間で共有可能な無名キューを作成する
-    // shm_size は共有メモリ領域のサイズ (最大約256MB)
-    Queue(size_t shm_size)
-      : shm_(shm_size),
+    // shm_size は共有メモリ領域のサイズ (Queue は最大約256MB)
+    // map_options は共有メモリ領域のマッピング方法 (MapOption の組み合わせ)
+    BasicQueue(size_t shm_size, int map_options=MapOption::NONE)
+      : shm_(shm_size, map_options),
         impl_(shm_) {
       init();
     }
       
     // 複数プロセス間で共有可能な名前付きキューを作成する
-    // shm_size は共有メモリ領域のサイズ (最大約256MB)
-    // filepath は共有メモリのマッピングに使用するファイルのパス
-    Queue(size_t shm_size, const std::string& filepath, mode_t mode=0660)
-      : shm_(filepath, shm_size, mode),
+    // shm_size は共有メモリ領域のサイズ (Queue は最大約256MB)
+    // filepath は共有メモリのマッピングに使用するファイルのパス (hugetlbfs 上のパスを指定した場合は、ヒュージページが使用される)
+    // map_options は共有メモリ領域のマッピング方法 (MapOption の組み合わせ)
+    BasicQueue(size_t shm_size, const std::string& filepath, mode_t mode=0660, int map_options=MapOption::NONE)
+      : shm_(filepath, shm_size, mode, map_options),
+        impl_(shm_) {
+      if(*this) {
+        impl_.init_once();
+      }
+    }
+
+    // shm_open で作成した共有メモリ領域を用いて、複数プロセス間で共有可能な名前付きキューを作成する
+    // (ファイルを用いる場合と異なり、ディスクへの書き戻しは発生しない)
+    // shm_name は共有メモリ領域の名前 (例: ipc::ShmName("/imque-sample"))。不要になったら ipc::SharedMemory::unlink で削除する。
+    BasicQueue(size_t shm_size, const ipc::ShmName& shm_name, mode_t mode=0660, int map_options=MapOption::NONE)
+      : shm_(shm_name, shm_size, mode, map_options),
+        impl_(shm_) {
+      if(*this) {
+        impl_.init_once();
+      }
+    }
+
+    // memfd_create で作成した(ファイルシステム上に名前を持たない)共有メモリ領域を用いてキューを作成する
+    // fd() で取得できるファイルディスクリプタを他のプロセスに渡すことで、キューを共有できる。(ipc/fd_passing.hh 参照)
+    BasicQueue(size_t shm_size, const ipc::Memfd& memfd, int map_options=MapOption::NONE)
+      : shm_(memfd, shm_size, map_options),
+        impl_(shm_) {
+      init();
+    }
+
+    // 他のプロセスから受け取ったファイルディスクリプタが参照する共有メモリ領域の、キューを使用する
+    // fd の所有権はキューに移る。
+    BasicQueue(const ipc::Fd& fd, int map_options=MapOption::NONE)
+      : shm_(fd, map_options),
         impl_(shm_) {
       if(*this) {
         impl_.init_once();
@@ -50,6 +91,48 @@ namespace imque {
     // キューから要素を取り出し buf に格納する (キューが空の場合は false を返す)
     bool deq(std::string& data) { return impl_.deq(data); }
 
+    // キューに要素を追加する。
+    // キューに空きがない場合、もしくは使用量が setWatermarks で設定した high を越える場合は、
+    // 他のプロセスの要素の取り出しによって十分な空きができるまで最大 timeout_ms ミリ秒待機する (timeout_ms が負の場合は無期限に待機する)。
+    // タイムアウトした場合は false を返す。
+    // キューが空でも収まらないサイズの要素は、待機せずに false を返す。(high を越えるサイズの要素は、キューが空になった時点で追加される)
+    bool enqWait(const void* data, size_t size, int timeout_ms=-1) { return impl_.enqWait(data, size, timeout_ms); }
+
+    // datav および sizev は count 分のサイズを持ち、それらを全て結合したデータがキューには追加される
+    bool enqvWait(const void** datav, size_t* sizev, size_t count, int timeout_ms=-1) { return impl_.enqvWait(datav, sizev, count, timeout_ms); }
+
+    // enqWait 用の水位(キュー内の要素の合計バイト数)を設定する。(キューを共有する全プロセスに反映される)
+    // 使用量が high を越えると enqWait は待機し、使用量が low 以下になるまで起床しない。(high が 0 なら空き不足の場合のみ待機する)
+    void setWatermarks(size_t high, size_t low=0) { impl_.setWatermarks(high, low); }
+
+    // キュー内(追加済みで未取得、予約中、もしくは deqView で参照中)の要素の合計バイト数を返す
+    size_t usedBytes() const { return impl_.usedBytes(); }
+
+    // records 内の count 個の要素を、まとめてキューに追加する。
+    // 追加された要素群は順番通りに、かつ(他の要素が間に入ることなく)一度に取り出し可能になる。
+    // 一つでも要素用の領域が確保できない場合は、何も追加せずに false を返す。
+    // (失敗時の overflowedCount は、要素の数に関わらず、一回の呼び出しにつき 1 増加する)
+    bool enqBatch(const iovec* records, size_t count) { return impl_.enqBatch(records, count); }
+
+    // size バイトの要素用の領域をキュー内に確保し、reservation から書き込み可能にする。(キューに空きがない場合は false を返す)
+    // reservation.data() に書き込んだ後で reservation.commit() を呼び出すと、要素がキューに追加される。
+    // reservation.abort() を呼び出すか、commit() せずに reservation を破棄した場合は、確保した領域は解放される。
+    bool reserve(size_t size, Reservation& reservation) { return impl_.reserve(size, reservation); }
+
+    // キューから最大 max_count 個の要素をまとめて取り出し bufs に格納する。取り出した要素の数を返す。
+    // (bufs のサイズは取り出した要素の数に変更される)
+    // 複数の要素を一回の head の更新で取り出すので、小さな要素を大量に扱う場合は deq を繰り返すよりも高速。
+    size_t deqBatch(std::vector<std::string>& bufs, size_t max_count) { return impl_.deqBatch(bufs, max_count); }
+
+    // キューから要素を取り出し、コピーせずに view から参照可能にする (キューが空の場合は false を返す)
+    // 要素の領域は view が破棄(もしくは reset)されるまで解放されず、それまでは usedBytes にも含まれる。
+    bool deqView(MessageView& view) { return impl_.deqView(view); }
+
+    // キューから要素を取り出し buf に格納する。
+    // キューが空の場合は、要素が追加されるまで最大 timeout_ms ミリ秒待機する (timeout_ms が負の場合は無期限に待機する)。
+    // タイムアウトした場合は false を返す。
+    bool deqWait(std::string& data, int timeout_ms=-1) { return impl_.deqWait(data, timeout_ms); }
+
     // キューが空なら true を返す
     bool isEmpty() { return impl_.isEmpty(); }
     
@@ -59,10 +142,42 @@ namespace imque {
     // キューへの要素追加失敗回数の取得と、カウントの初期化をアトミックに行う。
     size_t resetOverflowedCount() { return impl_.resetOverflowedCount(); }
 
+    // 統計情報を返す (IMQUE_STATS マクロを定義してビルドした場合のみ。それ以外は NULL を返す)
+    const stats::Stats* stats() const { return impl_.stats(); }
+
+    // SIGKILL されたプロセスがリークさせた領域を回収し、回収した領域の数を返す。
+    // ※ 他のプロセスがキューを使用していない(静止した)状態でのみ呼び出し可能。(詳細は queue::BasicQueueImpl::recover を参照)
+    size_t recover() { return impl_.recover(); }
+
+    // 共有メモリ領域に実際に適用されたマッピング方法 (MapOption の組み合わせ) を返す
+    int mapOptions() const { return shm_.options(); }
+
+    // memfd で作成した(もしくは ipc::Fd で渡された)キューの、共有メモリ領域のファイルディスクリプタを返す。(それ以外は -1)
+    // 返り値はキューが所有しているので、close してはいけない。
+    int fd() const { return shm_.fd(); }
+
   private:
-    ipc::SharedMemory shm_;
-    queue::QueueImpl  impl_;
+    ipc::SharedMemory              shm_;
+    queue::BasicQueueImpl<Layout>  impl_;
   };
+
+  // 32bitのメモリ記述子を使用するキュー (共有メモリ領域は最大約256MB)
+  typedef BasicQueue<allocator::NarrowLayout> Queue;
+
+  // deqView() で取り出した要素を参照するためのクラス
+  typedef queue::MessageView MessageView;
+
+  // reserve() で確保した要素の書き込み領域を扱うためのクラス
+  typedef queue::Reservation Reservation;
+
+#ifdef IMQUE_HAS_ATOMIC_16
+  // 64bitのメモリ記述子を使用するキュー (数十GB以上の共有メモリ領域を扱える)
+  // メモリ記述子の更新に16バイトのCASを使用するので、x86-64 の場合は -mcx16 を付けてコンパイルする必要がある。
+  // (16バイトのCASが利用できない環境では定義されない)
+  typedef BasicQueue<allocator::WideLayout> WideQueue;
+  typedef queue::WideMessageView WideMessageView;
+  typedef queue::WideReservation WideReservation;
+#endif
 }
 
 #endif
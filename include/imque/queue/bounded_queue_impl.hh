@@ -0,0 +1,321 @@
+#ifndef IMQUE_QUEUE_BOUNDED_QUEUE_IMPL_HH
+#define IMQUE_QUEUE_BOUNDED_QUEUE_IMPL_HH
+
+#include "../atomic/atomic.hh"
+#include "../ipc/shared_memory.hh"
+#include "../ipc/process.hh"
+#include <inttypes.h>
+#include <string.h>
+#include <string>
+
+namespace imque {
+  namespace queue {
+    static const char BOUNDED_MAGIC[] = "IMQUE-BOUNDED-0.3.2";
+
+    // 固定長(最大 slot_data_size バイト)の要素用の、有界なFIFOキュー。
+    // 要素数が二の階乗のスロット配列を共有メモリ上に確保し、各スロットに要素を直接コピーする。(アロケータは使用しない)
+    //
+    // 各スロットは、シーケンス番号による状態管理を行う (いわゆる sequence-per-slot 方式の有界MPMCキュー)。
+    //  - seq == pos:             位置 pos への書き込み待ち (空)
+    //  - seq == pos+1:           位置 pos の要素が読み込み可能
+    //  - seq == pos+slot_count:  読み込み済みで、次の周回の書き込み待ち
+    // シーケンス番号と同じ64bitワードに、スロットを使用中のプロセスのIDを格納し、一回のCASで確保を行う。
+    // 確保後には、PID と起動時刻を組み合わせた識別子(ipc::process::identity)を Slot::owner に記録する。
+    // 書き込み中(読み込み中)のプロセスが SIGKILL された場合は、そのスロットで待たされた他のプロセスが
+    // 所有プロセスの死亡を検出した時点でスロットを解放するので、キューが停止することはない。
+    // (その場合、書き込み(読み込み)中だった要素は失われる)
+    // 生存確認は識別子を用いて行うので、PID が再利用されていても死亡を検出できる。
+    // (確保の CAS から識別子の記録までの間に SIGKILL された場合のみ、PID による確認となる)
+    class BoundedQueueImpl {
+      struct Header {
+        char magic[sizeof(BOUNDED_MAGIC)];
+        uint64_t shm_size;
+        uint32_t cache_line_size;
+        uint32_t slot_count;
+        uint32_t slot_data_size;
+
+        uint32_t overflowed_count;
+
+        volatile uint32_t enq_pos IMQUE_CACHE_ALIGNED;
+        volatile uint32_t deq_pos IMQUE_CACHE_ALIGNED;
+      };
+      static const uint32_t HEADER_SIZE = sizeof(Header);
+
+      struct Slot {
+        volatile uint64_t state; // 上位32bit: 所有プロセスのID (未使用なら 0)、下位32bit: シーケンス番号
+        volatile uint64_t owner; // 所有プロセスの識別子 (ipc::process::identity。未使用、もしくは記録前なら 0)
+        uint32_t data_size;
+        char data[0];
+      };
+
+      static const int STALL_SPIN_LIMIT = 128; // 使用中のスロットを待つ回数。これを越えたら所有プロセスの生存を確認する
+
+    public:
+      // slot_count は二の階乗に切り上げられる
+      BoundedQueueImpl(ipc::SharedMemory& shm, uint32_t slot_count, uint32_t slot_data_size)
+        : shm_size_(shm.size()),
+          slot_count_(roundUpToPowerOfTwo(slot_count)),
+          slot_data_size_(slot_data_size),
+          slot_size_(calcSlotSize(slot_data_size)),
+          que_(shm_size_ >= calcShmSize(slot_count, slot_data_size) ? shm.ptr<Header>() : NULL),
+          slots_(shm.ptr<char>(HEADER_SIZE)) {
+      }
+
+      // slot_count 個の slot_data_size バイトの要素を格納するのに必要な共有メモリ領域のサイズを返す
+      static size_t calcShmSize(uint32_t slot_count, uint32_t slot_data_size) {
+        return HEADER_SIZE + static_cast<size_t>(roundUpToPowerOfTwo(slot_count)) * calcSlotSize(slot_data_size);
+      }
+
+      operator bool() const { return que_ != NULL && slot_count_ != 0; }
+
+      // 初期化メソッド。
+      // コンストラクタに渡した一つの shm につき、一回呼び出す必要がある。
+      void init() {
+        if(*this) {
+          memcpy(que_->magic, BOUNDED_MAGIC, sizeof(BOUNDED_MAGIC));
+          que_->shm_size = shm_size_;
+          que_->cache_line_size = atomic::CACHE_LINE_SIZE;
+          que_->slot_count = slot_count_;
+          que_->slot_data_size = slot_data_size_;
+          que_->overflowed_count = 0;
+          que_->enq_pos = 0;
+          que_->deq_pos = 0;
+
+          for(uint32_t i=0; i < slot_count_; i++) {
+            slotAt(i)->state = makeState(i, 0);
+            slotAt(i)->owner = 0;
+          }
+        }
+      }
+
+      // 重複初期化チェック(簡易)付きの初期化メソッド。
+      void init_once() {
+        if(*this && (memcmp(que_->magic, BOUNDED_MAGIC, sizeof(BOUNDED_MAGIC)) != 0 ||
+                     shm_size_ != que_->shm_size ||
+                     atomic::CACHE_LINE_SIZE != que_->cache_line_size ||
+                     slot_count_ != que_->slot_count ||
+                     slot_data_size_ != que_->slot_data_size)) {
+          init();
+        }
+      }
+
+      // キューに要素を追加する
+      // (キューに空きがない場合や、要素のサイズが slot_data_size を越える場合は false を返す)
+      bool enq(const void* data, size_t size) {
+        return enqv(&data, &size, 1);
+      }
+
+      // キューに要素を追加する
+      // (キューに空きがない場合や、要素のサイズが slot_data_size を越える場合は false を返す)
+      // datav および sizev は count 分のサイズを持ち、それらを全て結合したデータがキューには追加される
+      bool enqv(const void** datav, size_t* sizev, size_t count) {
+        size_t total_size = 0;
+        for(size_t i=0; i < count; i++) {
+          total_size += sizev[i];
+        }
+
+        uint32_t pos;
+        Slot* slot;
+        if(total_size > slot_data_size_ || claimForEnq(pos, slot) == false) {
+          atomic::add(&que_->overflowed_count, 1);
+          return false;
+        }
+
+        slot->data_size = total_size;
+        size_t offset = 0;
+        for(size_t i=0; i < count; i++) {
+          memcpy(slot->data + offset, datav[i], sizev[i]);
+          offset += sizev[i];
+        }
+
+        slot->owner = 0;
+        atomic::store(&slot->state, makeState(pos+1, 0));
+        return true;
+      }
+
+      // キューから要素を取り出し buf に格納する (キューが空の場合は false を返す)
+      bool deq(std::string& buf) {
+        uint32_t pos;
+        Slot* slot;
+        if(claimForDeq(pos, slot) == false) {
+          return false;
+        }
+
+        buf.assign(slot->data, slot->data_size);
+
+        slot->owner = 0;
+        atomic::store(&slot->state, makeState(pos+slot_count_, 0));
+        return true;
+      }
+
+      // キューが空かどうか
+      bool isEmpty() const {
+        return atomic::fetch(&que_->deq_pos) == atomic::fetch(&que_->enq_pos);
+      }
+
+      // キューへの要素追加に失敗した回数を返す
+      size_t overflowedCount() const { return que_->overflowed_count; }
+      size_t resetOverflowedCount() {
+        return atomic::fetch_and_clear(&que_->overflowed_count);
+      }
+
+    private:
+      // 書き込み用のスロットを確保する。(キューに空きがない場合は false を返す)
+      bool claimForEnq(uint32_t& pos, Slot*& slot) {
+        const uint32_t self = ipc::process::self();
+        StallDetector stall;
+        for(;;) {
+          pos = atomic::fetch(&que_->enq_pos);
+          slot = slotAt(pos);
+          uint64_t state = atomic::fetch(&slot->state);
+          uint32_t owner = ownerOf(state);
+          int32_t diff = static_cast<int32_t>(seqOf(state) - pos);
+
+          if(diff == 0) {
+            if(owner == 0) {
+              if(atomic::compare_and_swap(&slot->state, state, makeState(pos, self))) {
+                atomic::store(&slot->owner, ipc::process::selfIdentity());
+                atomic::compare_and_swap(&que_->enq_pos, pos, pos+1);
+                return true;
+              }
+            } else {
+              // 他のプロセスが確保済み。enq_pos の更新前に SIGKILL された場合に備えて、代わりに進めておく
+              atomic::compare_and_swap(&que_->enq_pos, pos, pos+1);
+            }
+          } else if(diff < 0) {
+            // 前の周回の要素が残っている
+            if(owner == 0 || diff < -static_cast<int32_t>(slot_count_)) {
+              return false; // queue is full
+            }
+
+            // 前の周回の要素を書き込み中、もしくは読み込み中のプロセスを待つ
+            if(stall.isStalled(state) == false) {
+              continue;
+            }
+            if(isOwnerAlive(slot, owner)) {
+              return false;
+            }
+
+            // 使用中のプロセスが死亡しているので、スロットを解放する (前の周回の要素は失われる)
+            uint32_t prev_pos = pos - slot_count_;
+            atomic::compare_and_swap(&que_->deq_pos, prev_pos, prev_pos+1);
+            atomic::compare_and_swap(&slot->state, state, makeState(pos, 0));
+          } else {
+            // enq_pos の読み込み後に、他のプロセスが位置 pos に要素を追加している
+            atomic::compare_and_swap(&que_->enq_pos, pos, pos+1);
+          }
+        }
+      }
+
+      // 読み込み用のスロットを確保する。(キューが空の場合は false を返す)
+      bool claimForDeq(uint32_t& pos, Slot*& slot) {
+        const uint32_t self = ipc::process::self();
+        StallDetector stall;
+        for(;;) {
+          pos = atomic::fetch(&que_->deq_pos);
+          slot = slotAt(pos);
+          uint64_t state = atomic::fetch(&slot->state);
+          uint32_t owner = ownerOf(state);
+          int32_t diff = static_cast<int32_t>(seqOf(state) - (pos+1));
+
+          if(diff == 0) {
+            if(owner == 0) {
+              if(atomic::compare_and_swap(&slot->state, state, makeState(pos+1, self))) {
+                atomic::store(&slot->owner, ipc::process::selfIdentity());
+                atomic::compare_and_swap(&que_->deq_pos, pos, pos+1);
+                return true;
+              }
+            } else {
+              // 他のプロセスが読み込み中。
+              // (読み込み中のプロセスが死亡している場合は、次の周回で書き込みを行うプロセスが解放する)
+              atomic::compare_and_swap(&que_->deq_pos, pos, pos+1);
+            }
+          } else if(diff == -1 && owner != 0) {
+            // 書き込み中のプロセスを待つ
+            if(stall.isStalled(state) == false) {
+              continue;
+            }
+            if(isOwnerAlive(slot, owner)) {
+              return false;
+            }
+
+            // 書き込み中のプロセスが死亡しているので、要素を破棄して、次の周回用にスロットを解放する
+            atomic::compare_and_swap(&que_->enq_pos, pos, pos+1);
+            atomic::compare_and_swap(&slot->state, state, makeState(pos+slot_count_, 0));
+            atomic::compare_and_swap(&que_->deq_pos, pos, pos+1);
+          } else if(diff < 0) {
+            return false; // queue is empty
+          } else {
+            // deq_pos の読み込み後に、他のプロセスが位置 pos の要素を取り出している (もしくは破棄されている)
+            atomic::compare_and_swap(&que_->deq_pos, pos, pos+1);
+          }
+        }
+      }
+
+      // スロットを使用中のプロセス(state に格納された PID が owner)が生存しているかどうか。
+      // 死亡している場合は、記録されている識別子を消去しておく。(PID が再利用された場合に、次の確保者の識別子と混同しないように)
+      bool isOwnerAlive(Slot* slot, uint32_t owner) {
+        const uint64_t id = atomic::fetch(&slot->owner);
+        if(ipc::process::pidOf(id) != static_cast<pid_t>(owner)) {
+          // 確保直後で、識別子がまだ記録されていない (もしくは state の読み込み後に、他のプロセスが確保し直した)
+          return ipc::process::isAlive(owner);
+        }
+        if(ipc::process::isAliveIdentity(id)) {
+          return true;
+        }
+        atomic::compare_and_swap(&slot->owner, id, static_cast<uint64_t>(0));
+        return false;
+      }
+
+      // 同じスロットの状態を STALL_SPIN_LIMIT 回続けて観測したかどうかを判定する
+      class StallDetector {
+      public:
+        StallDetector() : state_(0), count_(0) {}
+
+        bool isStalled(uint64_t state) {
+          if(state != state_) {
+            state_ = state;
+            count_ = 0;
+          }
+          return ++count_ > STALL_SPIN_LIMIT;
+        }
+
+      private:
+        uint64_t state_;
+        int count_;
+      };
+
+      static uint64_t makeState(uint32_t seq, uint32_t owner) { return (static_cast<uint64_t>(owner) << 32) | seq; }
+      static uint32_t seqOf(uint64_t state) { return static_cast<uint32_t>(state); }
+      static uint32_t ownerOf(uint64_t state) { return static_cast<uint32_t>(state >> 32); }
+
+      Slot* slotAt(uint32_t pos) const {
+        return reinterpret_cast<Slot*>(slots_ + (pos & (slot_count_-1)) * slot_size_);
+      }
+
+      static uint64_t calcSlotSize(uint32_t slot_data_size) {
+        const uint64_t mask = atomic::CACHE_LINE_SIZE - 1;
+        return (sizeof(Slot) + static_cast<uint64_t>(slot_data_size) + mask) & ~mask;
+      }
+
+      static uint32_t roundUpToPowerOfTwo(uint32_t n) {
+        uint32_t v = 1;
+        while(v < n && v != 0x80000000) {
+          v *= 2;
+        }
+        return v;
+      }
+
+    private:
+      const uint64_t shm_size_;
+      const uint32_t slot_count_;
+      const uint32_t slot_data_size_;
+      const uint64_t slot_size_;
+
+      Header* que_;
+      char* slots_;
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,372 @@
+#ifndef IMQUE_QUEUE_BROADCAST_QUEUE_IMPL_HH
+#define IMQUE_QUEUE_BROADCAST_QUEUE_IMPL_HH
+
+#include "../atomic/atomic.hh"
+#include "../ipc/shared_memory.hh"
+#include "../ipc/process.hh"
+#include "../allocator/fixed_allocator.hh"
+#include <inttypes.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace imque {
+  namespace queue {
+    static const char BROADCAST_MAGIC[] = "IMQUE-BROADCAST-0.3.2";
+
+    // 全ての購読者(subscriber)が、全ての要素を受け取るキュー。
+    // 要素は一回だけ共有メモリ上に格納され、購読者はそれぞれ独自のカーソルで連結リストを辿る。
+    //
+    // 参照カウント:
+    //  - 各ノードは、次のノードへのリンク(next)の分の参照を保持する
+    //  - tail および各購読者のカーソルは、指しているノードの分の参照を保持する
+    // 最後のカーソル(もしくは tail)がノードを通過すると、参照カウントが 0 になってノードは解放され、
+    // 同時にそのノードが保持していた次のノードへの参照も解放される。(releaseNode 参照)
+    // そのため、購読者がいない場合は、要素は追加されると(tail が通過した時点で)直ちに解放される。
+    //
+    // 遅い購読者は、そのカーソル以降の全ノードを解放できなくしてしまうので、
+    // 末尾との差(lag)が一定値を越えた購読者は、cutOffSlowSubscribers で切り離すことができる。
+    // 切り離された購読者のカーソルは無効になり、以降の deq は失敗する。(isCutOff で検出して、購読し直す)
+    // SIGKILL された購読者のカーソルも、同様に切り離される。
+    // (購読者は PID と起動時刻を組み合わせた識別子(ipc::process::identity)で記録するので、PID が再利用されても生存中とはみなさない)
+    class BroadcastQueueImpl {
+      typedef allocator::FixedAllocator::MD MD; // memory descriptor
+      typedef allocator::FixedAllocator Allocator;
+
+    public:
+      static const uint32_t MAX_SUBSCRIBER_COUNT = 64;
+
+    private:
+      struct Node {
+        MD next;
+        uint32_t data_size;
+        uint64_t seq; // 追加順の通し番号 (末尾との差の計算用)
+        char data[0];
+
+        static const MD END = 0;
+      };
+
+      // 購読者毎のスロット
+      struct Subscriber {
+        volatile uint64_t owner IMQUE_CACHE_ALIGNED; // 購読者のプロセスの識別子 (ipc::process::identity。未使用なら 0)
+        volatile MD cursor;                          // 最後に取り出したノード (切り離された場合は 0)
+      };
+
+      struct Header {
+        char magic[sizeof(BROADCAST_MAGIC)];
+        uint64_t shm_size;
+        uint32_t cache_line_size;
+
+        uint32_t overflowed_count;
+        uint32_t cut_off_count;
+
+        volatile MD tail IMQUE_CACHE_ALIGNED;
+        Subscriber subscribers[MAX_SUBSCRIBER_COUNT];
+      };
+      static const uint32_t HEADER_SIZE = sizeof(Header);
+
+    public:
+      BroadcastQueueImpl(ipc::SharedMemory& shm)
+        : shm_size_(shm.size()),
+          que_(shm.ptr<Header>()),
+          alc_(shm.ptr<void>(HEADER_SIZE), shm.size() > HEADER_SIZE ? shm.size() - HEADER_SIZE : 0) {
+      }
+
+      operator bool() const { return alc_ && que_; }
+
+      // 初期化メソッド。
+      // コンストラクタに渡した一つの shm につき、一回呼び出す必要がある。
+      void init() {
+        if(*this) {
+          alc_.init();
+
+          MD sentinel = alc_.allocate(sizeof(Node));
+          if(sentinel == 0) {
+            que_ = NULL;
+            return;
+          }
+          Node* node = alc_.ptr<Node>(sentinel);
+          node->next = Node::END;
+          node->data_size = 0;
+          node->seq = 0;
+
+          memcpy(que_->magic, BROADCAST_MAGIC, sizeof(BROADCAST_MAGIC));
+          que_->shm_size = shm_size_;
+          que_->cache_line_size = atomic::CACHE_LINE_SIZE;
+          que_->overflowed_count = 0;
+          que_->cut_off_count = 0;
+          que_->tail = sentinel; // 割当時の参照カウントは tail からの参照分
+          for(uint32_t i=0; i < MAX_SUBSCRIBER_COUNT; i++) {
+            que_->subscribers[i].owner = 0;
+            que_->subscribers[i].cursor = 0;
+          }
+        }
+      }
+
+      // 重複初期化チェック(簡易)付きの初期化メソッド。
+      void init_once() {
+        if(*this && (memcmp(que_->magic, BROADCAST_MAGIC, sizeof(BROADCAST_MAGIC)) != 0 ||
+                     shm_size_ != que_->shm_size ||
+                     atomic::CACHE_LINE_SIZE != que_->cache_line_size)) {
+          init();
+        }
+      }
+
+      // 要素を追加する (キューに空きがない場合は false を返す)
+      // cut_off_lag が 0 以外の場合は、空きがなければ末尾との差が cut_off_lag を越える購読者を切り離した後で、再度追加を試みる。
+      // datav および sizev は count 分のサイズを持ち、それらを全て結合したデータがキューには追加される
+      bool enqv(const void** datav, size_t* sizev, size_t count, uint64_t cut_off_lag) {
+        size_t total_size = 0;
+        for(size_t i=0; i < count; i++) {
+          total_size += sizev[i];
+        }
+
+        MD md = alc_.allocate(sizeof(Node) + total_size);
+        if(md == 0 && cut_off_lag != 0 && cutOffSlowSubscribers(cut_off_lag) != 0) {
+          md = alc_.allocate(sizeof(Node) + total_size);
+        }
+        if(md == 0) {
+          atomic::add(&que_->overflowed_count, 1);
+          return false;
+        }
+
+        Node* node = alc_.ptr<Node>(md);
+        node->next = Node::END;
+        node->data_size = total_size;
+        size_t offset = 0;
+        for(size_t i=0; i < count; i++) {
+          memcpy(node->data + offset, datav[i], sizev[i]);
+          offset += sizev[i];
+        }
+
+        enqImpl(md);
+        return true;
+      }
+
+      // 購読を開始する。以降に追加された要素が deq で取り出し可能になる。
+      // 購読者のID(0 以上)を返す。購読者数が上限に達している場合は -1 を返す。
+      int subscribe() {
+        const uint64_t self = ipc::process::selfIdentity();
+        for(uint32_t i=0; i < MAX_SUBSCRIBER_COUNT; i++) {
+          Subscriber& sub = que_->subscribers[i];
+          uint64_t owner = atomic::fetch(&sub.owner);
+          if(owner != 0 && ipc::process::isAliveIdentity(owner)) {
+            continue;
+          }
+
+          // 未使用、もしくは SIGKILL された購読者のスロットを再利用する
+          if(atomic::compare_and_swap(&sub.owner, owner, self)) {
+            detach(sub);
+            atomic::store(&sub.cursor, pinTail());
+            return i;
+          }
+        }
+        return -1;
+      }
+
+      // 購読を終了する。カーソルが保持していたノードは、他に参照がなければ解放される。
+      void unsubscribe(int id) {
+        Subscriber& sub = que_->subscribers[id];
+        detach(sub);
+        atomic::store(&sub.owner, static_cast<uint64_t>(0));
+      }
+
+      // 購読を終了した後で、改めて末尾から購読を開始する (切り離された購読者の復帰用)
+      void resubscribe(int id) {
+        Subscriber& sub = que_->subscribers[id];
+        detach(sub);
+        atomic::store(&sub.cursor, pinTail());
+      }
+
+      // 購読者 id のカーソルを一つ進め、その要素を buf に格納する
+      // (未取得の要素がない場合や、購読者が切り離されている場合は false を返す)
+      bool deq(int id, std::string& buf) {
+        Subscriber& sub = que_->subscribers[id];
+        for(;;) {
+          MD curr = atomic::fetch(&sub.cursor);
+          if(curr == 0) {
+            return false; // cut off
+          }
+          if(alc_.dup(curr) == false) {
+            continue; // 切り離しと競合し、既に解放済み
+          }
+
+          MD next = atomic::fetch(&alc_.ptr<Node>(curr)->next);
+          if(next == Node::END) {
+            releaseNode(curr);
+            return false; // no new element
+          }
+          bool rlt = alc_.dup(next); // curr からのリンク分の参照があるので、解放済みであることはない
+          assert(rlt);
+
+          if(atomic::compare_and_swap(&sub.cursor, curr, next)) {
+            Node* node = alc_.ptr<Node>(next);
+            buf.assign(node->data, node->data_size);
+            releaseNode(curr); // dup した分
+            releaseNode(curr); // カーソルからの参照分
+            return true;
+          }
+
+          // 切り離された
+          releaseNode(next);
+          releaseNode(curr);
+        }
+      }
+
+      // 購読者 id が切り離されているかどうか
+      bool isCutOff(int id) const {
+        return atomic::fetch(&que_->subscribers[id].cursor) == 0;
+      }
+
+      // 購読者 id の未取得の要素数 (末尾との差) を返す (切り離されている場合は 0)
+      uint64_t lag(int id) {
+        MD curr = atomic::fetch(&que_->subscribers[id].cursor);
+        if(curr == 0 || alc_.dup(curr) == false) {
+          return 0;
+        }
+        uint64_t seq = alc_.ptr<Node>(curr)->seq;
+        releaseNode(curr);
+        return tailSeq() - seq;
+      }
+
+      // 末尾との差が max_lag を越える購読者、および SIGKILL された購読者を切り離す。切り離した購読者の数を返す。
+      uint32_t cutOffSlowSubscribers(uint64_t max_lag) {
+        const uint64_t tail_seq = tailSeq();
+        uint32_t cut_count = 0;
+        for(uint32_t i=0; i < MAX_SUBSCRIBER_COUNT; i++) {
+          Subscriber& sub = que_->subscribers[i];
+          uint64_t owner = atomic::fetch(&sub.owner);
+          MD curr = atomic::fetch(&sub.cursor);
+          if(owner == 0 || curr == 0) {
+            continue;
+          }
+
+          if(ipc::process::isAliveIdentity(owner)) {
+            if(alc_.dup(curr) == false) {
+              continue; // カーソルが進んだ
+            }
+            uint64_t seq = alc_.ptr<Node>(curr)->seq;
+            releaseNode(curr);
+            if(tail_seq - seq <= max_lag) {
+              continue;
+            }
+          }
+
+          if(atomic::compare_and_swap(&sub.cursor, curr, static_cast<MD>(0))) {
+            releaseNode(curr);
+            atomic::add(&que_->cut_off_count, 1);
+            cut_count++;
+          }
+        }
+        return cut_count;
+      }
+
+      // キューへの要素追加に失敗した回数を返す
+      size_t overflowedCount() const { return que_->overflowed_count; }
+      size_t resetOverflowedCount() {
+        return atomic::fetch_and_clear(&que_->overflowed_count);
+      }
+
+      // 購読者を切り離した回数を返す
+      size_t cutOffCount() const { return que_->cut_off_count; }
+
+      // 解放されていないノードの数を返す (アロケータにキャッシュ中のブロックは含まない)
+      // tail が指すノードと、いずれかの購読者のカーソル以降にある(未取得の要素を持つ)ノードの数になる。
+      // 他のプロセスがキューを操作していない(静止した)状態でのみ使用可能。(ノードの解放漏れの検査用)
+      size_t nodeCount() const {
+        std::vector<MD> allocated;
+        std::vector<MD> cached;
+        alc_.collectAllocated(allocated);
+        alc_.collectCached(cached);
+        return allocated.size() - cached.size();
+      }
+
+    private:
+      void enqImpl(MD new_tail) {
+        bool rlt = alc_.dup(new_tail); // 前のノードからのリンク分と、tail からの参照分
+        assert(rlt);
+
+        for(;;) {
+          MD tail = atomic::fetch(&que_->tail);
+          if(alc_.dup(tail) == false) {
+            continue;
+          }
+
+          Node* tail_node = alc_.ptr<Node>(tail);
+          MD next = atomic::fetch(&tail_node->next);
+          if(next != Node::END) {
+            // tail が末尾を指していないので、一つ前に進める
+            tryMoveTail(tail, next);
+            releaseNode(tail);
+            continue;
+          }
+
+          alc_.ptr<Node>(new_tail)->seq = tail_node->seq + 1;
+          if(atomic::compare_and_swap(&tail_node->next, next, new_tail)) {
+            tryMoveTail(tail, new_tail);
+            releaseNode(tail);
+            return;
+          }
+          releaseNode(tail);
+        }
+      }
+
+      void tryMoveTail(MD curr, MD next) {
+        if(atomic::compare_and_swap(&que_->tail, curr, next)) {
+          releaseNode(curr);
+        }
+      }
+
+      // tail が指すノードの参照カウントを一つ増やして返す
+      MD pinTail() {
+        for(;;) {
+          MD tail = atomic::fetch(&que_->tail);
+          if(alc_.dup(tail)) {
+            return tail;
+          }
+        }
+      }
+
+      uint64_t tailSeq() {
+        MD tail = pinTail();
+        uint64_t seq = alc_.ptr<Node>(tail)->seq;
+        releaseNode(tail);
+        return seq;
+      }
+
+      // 購読者のカーソルを無効にし、その参照を解放する
+      void detach(Subscriber& sub) {
+        for(;;) {
+          MD curr = atomic::fetch(&sub.cursor);
+          if(curr == 0) {
+            return;
+          }
+          if(atomic::compare_and_swap(&sub.cursor, curr, static_cast<MD>(0))) {
+            releaseNode(curr);
+            return;
+          }
+        }
+      }
+
+      // ノードの参照を解放する。
+      // 参照カウントが 0 になった場合は、そのノードが保持していた次のノードへの参照も(連鎖的に)解放する。
+      // (参照カウントが 0 のノードは tail から通過済みなので、next はもう変更されない)
+      void releaseNode(MD md) {
+        while(md != Node::END && alc_.undup(md)) {
+          MD next = alc_.ptr<Node>(md)->next;
+          bool rlt = alc_.reclaim(md);
+          assert(rlt);
+          md = next;
+        }
+      }
+
+    private:
+      const size_t shm_size_;
+
+      Header* que_;
+      Allocator alc_;
+    };
+  }
+}
+
+#endif
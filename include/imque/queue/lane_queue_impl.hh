@@ -0,0 +1,150 @@
+#ifndef IMQUE_QUEUE_LANE_QUEUE_IMPL_HH
+#define IMQUE_QUEUE_LANE_QUEUE_IMPL_HH
+
+#include "../ipc/shared_memory.hh"
+#include "queue_impl.hh"
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+namespace imque {
+  namespace queue {
+    static const char LANE_MAGIC[] = "IMQUE-LANES-0.3.1";
+
+    // 一つの共有メモリ領域を lane_count 個の独立したキュー(レーン)に分割したもの。
+    // 各レーンは QueueImpl で、それぞれが独自の head/tail とアロケータを持つので、レーン間での競合はない。
+    // 各レーンはページ境界から始まるので、レーン毎に異なるNUMAノードに配置することも可能。(laneRegion 参照)
+    //
+    // どのレーンに追加し、どのレーンから取り出すかは、上位のクラス(NumaQueue など)が決める。
+    // 要素の順序はレーン内でのみ保証される。
+    class LaneQueueImpl {
+      struct Header {
+        char magic[sizeof(LANE_MAGIC)];
+        uint32_t lane_count;
+        uint64_t lane_size;
+      };
+
+    public:
+      LaneQueueImpl(ipc::SharedMemory& shm, uint32_t lane_count)
+        : que_(shm.ptr<Header>()),
+          lanes_offset_(roundUpToPage(sizeof(Header))),
+          lane_size_(calcLaneSize(shm.size(), lane_count)),
+          lanes_(lane_count) {
+        for(uint32_t i=0; i < lane_count; i++) {
+          lanes_[i] = new QueueImpl(que_ && lane_size_ ? shm.ptr<char>(lanes_offset_ + lane_size_*i) : NULL, lane_size_);
+        }
+      }
+
+      ~LaneQueueImpl() {
+        for(size_t i=0; i < lanes_.size(); i++) {
+          delete lanes_[i];
+        }
+      }
+
+      operator bool() const {
+        if(que_ == NULL || lanes_.empty()) {
+          return false;
+        }
+        for(size_t i=0; i < lanes_.size(); i++) {
+          if(! *lanes_[i]) {
+            return false;
+          }
+        }
+        return true;
+      }
+
+      // 初期化メソッド。
+      // コンストラクタに渡した一つの shm につき、一回呼び出す必要がある。
+      void init() {
+        if(*this) {
+          for(size_t i=0; i < lanes_.size(); i++) {
+            lanes_[i]->init();
+          }
+          que_->lane_count = lanes_.size();
+          que_->lane_size = lane_size_;
+          memcpy(que_->magic, LANE_MAGIC, sizeof(LANE_MAGIC));
+        }
+      }
+
+      // 重複初期化チェック(簡易)付きの初期化メソッド。
+      void init_once() {
+        if(*this == false) {
+          return;
+        }
+        if(memcmp(que_->magic, LANE_MAGIC, sizeof(LANE_MAGIC)) != 0 ||
+           que_->lane_count != lanes_.size() ||
+           que_->lane_size != lane_size_) {
+          init();
+        } else {
+          for(size_t i=0; i < lanes_.size(); i++) {
+            lanes_[i]->init_once();
+          }
+        }
+      }
+
+      uint32_t laneCount() const { return lanes_.size(); }
+      QueueImpl& lane(uint32_t i) { return *lanes_[i]; }
+
+      // i 番目のレーンが使用する共有メモリ領域 (ページ境界から始まる)
+      void* laneRegion(ipc::SharedMemory& shm, uint32_t i) const { return shm.ptr<char>(lanes_offset_ + lane_size_*i); }
+      size_t laneSize() const { return lane_size_; }
+
+      bool isEmpty() {
+        for(size_t i=0; i < lanes_.size(); i++) {
+          if(lanes_[i]->isEmpty() == false) {
+            return false;
+          }
+        }
+        return true;
+      }
+
+      size_t overflowedCount() const {
+        size_t count = 0;
+        for(size_t i=0; i < lanes_.size(); i++) {
+          count += lanes_[i]->overflowedCount();
+        }
+        return count;
+      }
+
+      size_t resetOverflowedCount() {
+        size_t count = 0;
+        for(size_t i=0; i < lanes_.size(); i++) {
+          count += lanes_[i]->resetOverflowedCount();
+        }
+        return count;
+      }
+
+    private:
+      static size_t pageSize() {
+        return sysconf(_SC_PAGESIZE);
+      }
+
+      static size_t roundUpToPage(size_t size) {
+        return (size + pageSize() - 1) / pageSize() * pageSize();
+      }
+
+      // 各レーンのサイズ (ページ単位に切り捨て)
+      static size_t calcLaneSize(size_t shm_size, uint32_t lane_count) {
+        const size_t offset = roundUpToPage(sizeof(Header));
+        if(lane_count == 0 || shm_size <= offset) {
+          return 0;
+        }
+        return (shm_size - offset) / lane_count / pageSize() * pageSize();
+      }
+
+    private:
+      LaneQueueImpl(const LaneQueueImpl&);
+      LaneQueueImpl& operator=(const LaneQueueImpl&);
+
+    private:
+      Header* que_;
+      const size_t lanes_offset_;
+      const size_t lane_size_;
+      std::vector<QueueImpl*> lanes_;
+    };
+  }
+}
+
+#endif
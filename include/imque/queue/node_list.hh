@@ -0,0 +1,251 @@
+#ifndef IMQUE_QUEUE_NODE_LIST_HH
+#define IMQUE_QUEUE_NODE_LIST_HH
+
+#include "../atomic/atomic.hh"
+#include "../allocator/fixed_allocator.hh"
+#include "../stats.hh"
+#include <inttypes.h>
+#include <cassert>
+
+namespace imque {
+  namespace queue {
+    // 共有メモリ上の head/tail (Ends) と、アロケータから割り当てたノードからなる、ロックフリーな連結リスト(FIFO)の操作。
+    // QueueImpl と PriorityQueueImpl (の各レベル) で共有する。
+    // このクラス自体はプロセスローカルで、アロケータと統計情報の記録先への参照のみを保持する。
+    //
+    // head は取り出し済みの(番兵)ノードを、tail は末尾(もしくはその少し手前)のノードを指す。
+    // ノードの参照カウントは、head と tail のそれぞれから参照されている分と、割当時の分(取り出した側が解放する)からなる。
+    template<class Layout>
+    class BasicNodeList {
+    public:
+      typedef typename Layout::MD MD; // memory descriptor
+      typedef allocator::BasicFixedAllocator<Layout> Allocator;
+
+      struct Node {
+        MD next;
+        typename Layout::SIZE data_size; // WideLayout では 4GB 以上の要素を扱えるように 64bit
+        char data[0];
+
+        static const MD END = 0;
+      };
+
+      // 偽共有を避けるために head と tail は別のキャッシュラインに配置する
+      struct Ends {
+        volatile MD head IMQUE_CACHE_ALIGNED;  // NOTE: mdを保持。md自体がABA対策がなされているので、ここではそれ用のフィールドは不要。
+        volatile MD tail IMQUE_CACHE_ALIGNED;
+      };
+
+    private:
+      // 参照カウント周りの処理隠蔽用のクラス
+      class NodeRef {
+      public:
+        NodeRef(MD md, Allocator& alc, stats::Stats* stats)
+          : alc_(alc), md_(0) {
+          if(alc.dup(md)) { // 既に解放されている可能性もあるのでチェックする
+            md_ = md;
+          } else {
+            stats::add(stats, stats::NODE_REF_RETRY);
+          }
+        }
+
+        ~NodeRef() {
+          if(md_) {
+            bool rlt = alc_.release(md_);
+            assert(rlt);
+          }
+        }
+
+        operator bool() const { return md_ != 0; }
+
+        MD next() const { return atomic::fetch(&alc_.template ptr<Node>(md_)->next); }
+        MD& node_next() { return alc_.template ptr<Node>(md_)->next; }
+        MD md() const { return md_; }
+
+      private:
+        Allocator& alc_;
+        MD md_;
+      };
+
+    public:
+      // stats: 統計情報の記録先 (記録しない場合は NULL)
+      BasicNodeList(Allocator& alc, stats::Stats* stats)
+        : alc_(alc), stats_(stats) {
+      }
+
+      // 番兵ノードを割り当てて、ends を空のリストとして初期化する。(割当に失敗した場合は false を返す)
+      bool init(Ends& ends) {
+        MD sentinel = alc_.allocate(sizeof(Node));
+        if(sentinel == 0) {
+          return false;
+        }
+        alc_.template ptr<Node>(sentinel)->next = Node::END;
+
+        ends.head = sentinel;
+        ends.tail = sentinel;
+        bool rlt = alc_.dup(sentinel); // head と tail の二箇所から参照されているので、参照カウントを一つ増やしておく
+        assert(rlt);
+        return true;
+      }
+
+      void enq(Ends& ends, MD new_tail) {
+        enq(ends, &new_tail, 1);
+      }
+
+      // mds 内の count 個のノード(next フィールドで連結済み)を、まとめてリストの末尾に追加する
+      void enq(Ends& ends, const MD* mds, size_t count) {
+        for(size_t i=0; i < count; i++) {
+          bool rlt = alc_.dup(mds[i], 2); // head と tail からの参照分を始めにカウントしておく
+          assert(rlt);
+        }
+
+        for(;;) {
+          NodeRef tail_ref(ends.tail, alc_, stats_);
+          if(! tail_ref) {
+            continue;
+          }
+
+          MD next = tail_ref.next();
+          if(next != Node::END) {
+            // tail が末尾を指していないので、一つ前に進める
+            stats::add(stats_, stats::TAIL_LAG);
+            tryMoveNext(&ends.tail, tail_ref.md(), next);
+            continue;
+          }
+
+          if(atomic::compare_and_swap(&tail_ref.node_next(), next, mds[0])) {
+            tryMoveTail(ends, tail_ref.md(), mds, count);
+            break;
+          }
+          stats::add(stats_, stats::ENQ_CAS_RETRY);
+        }
+      }
+
+      // 先頭の要素のノードを取り出す。(リストが空の場合は 0 を返す)
+      // 取り出したノードの(割当時の)参照カウントの解放は呼び出し元の責務。
+      MD deq(Ends& ends) {
+        for(;;) {
+          NodeRef head_ref(ends.head, alc_, stats_);
+          if(! head_ref) {
+            continue;
+          }
+
+          MD next = head_ref.next();
+          if(next == Node::END) {
+            return 0; // list is empty
+          }
+
+          if(tryMoveNext(&ends.head, head_ref.md(), next)) {
+            return next;
+          }
+          stats::add(stats_, stats::DEQ_CAS_RETRY);
+        }
+      }
+
+      // head から最大 max_count 個の要素を辿り、一回の CAS で head をまとめて進める。
+      // 取り出した要素のメモリ記述子を mds に格納し、その数を返す。
+      // (deq と同様に、各要素の(割当時の)参照カウントの解放は呼び出し元の責務)
+      size_t deqBatch(Ends& ends, MD* mds, size_t max_count) {
+        for(;;) {
+          NodeRef head_ref(ends.head, alc_, stats_);
+          if(! head_ref) {
+            continue;
+          }
+
+          // head が指すノード以降は、head が動いていない限り解放されないので、
+          // ノード読み込み後に head が変わっていないことを確認することで、読み込んだ値の正当性を保証する
+          size_t n = 0;
+          bool modified = false;
+          for(MD next = head_ref.next();
+              next != Node::END && n < max_count;
+              n++) {
+            mds[n] = next;
+            next = atomic::fetch(&alc_.template ptr<Node>(next)->next);
+            if(ends.head != head_ref.md()) {
+              modified = true;
+              break;
+            }
+          }
+          if(modified) {
+            stats::add(stats_, stats::DEQ_CAS_RETRY);
+            continue;
+          }
+
+          if(n == 0) {
+            return 0; // list is empty
+          }
+
+          if(tryMoveNext(&ends.head, head_ref.md(), mds[n-1])) {
+            // 末尾以外の要素は head から参照されることがなくなったので、その分の参照カウントを減らしておく
+            for(size_t i=0; i < n-1; i++) {
+              bool rlt = alc_.release(mds[i]);
+              assert(rlt);
+            }
+            return n;
+          }
+          stats::add(stats_, stats::DEQ_CAS_RETRY);
+        }
+      }
+
+      // リストが空かどうか
+      bool isEmpty(Ends& ends) {
+        for(;;) {
+          NodeRef head_ref(ends.head, alc_, stats_);
+          if(! head_ref) {
+            continue;
+          }
+
+          return head_ref.next() == Node::END;
+        }
+      }
+
+    private:
+      // prev_tail の後ろに連結した mds の末尾まで、一回の CAS で tail を進める。
+      // 他のプロセスが(tryMoveNextで)既に tail を連結したノード群の途中まで進めている場合は、そこから末尾まで進める。
+      // tail が一度も指すことのなかったノードは、tail からの参照分の参照カウントを減らしておく。
+      void tryMoveTail(Ends& ends, MD prev_tail, const MD* mds, size_t count) {
+        const MD last = mds[count-1];
+        for(;;) {
+          MD curr = ends.tail;
+
+          size_t pos = 0; // curr の次のノードの mds 内での位置
+          if(curr != prev_tail) {
+            for(; pos < count-1 && mds[pos] != curr; pos++);
+            if(pos == count-1) {
+              return; // 既に他のプロセスが末尾(もしくはそれ以降)まで tail を進めている
+            }
+            pos++;
+          }
+
+          if(tryMoveNext(&ends.tail, curr, last)) {
+            for(; pos < count-1; pos++) {
+              bool rlt = alc_.release(mds[pos]);
+              assert(rlt);
+            }
+            return;
+          }
+        }
+      }
+
+      bool tryMoveNext(volatile MD* place, MD curr, MD next) {
+        if(atomic::compare_and_swap(place, curr, next)) {
+          bool rlt = alc_.release(curr);
+          assert(rlt);
+          return true;
+        }
+        return false;
+      }
+
+    private:
+      BasicNodeList(const BasicNodeList&);
+      BasicNodeList& operator=(const BasicNodeList&);
+
+    private:
+      Allocator& alc_;
+      stats::Stats* stats_;
+    };
+
+    typedef BasicNodeList<allocator::NarrowLayout> NodeList;
+  }
+}
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef IMQUE_QUEUE_PRIORITY_QUEUE_IMPL_HH
+#define IMQUE_QUEUE_PRIORITY_QUEUE_IMPL_HH
+
+#include "../atomic/atomic.hh"
+#include "../ipc/shared_memory.hh"
+#include "../allocator/fixed_allocator.hh"
+#include "node_list.hh"
+#include <inttypes.h>
+#include <string.h>
+#include <string>
+
+namespace imque {
+  namespace queue {
+    static const char PRIORITY_MAGIC[] = "IMQUE-PRIORITY-0.3.1";
+
+    // 優先度(レベル)毎のFIFOキューを、一つの共有メモリ領域(アロケータ)上にまとめたもの。
+    // 各レベルは QueueImpl と同じ連結リスト(NodeList)で、ノードは全レベルで共有する一つの FixedAllocator から割り当てる。
+    // そのため、どのレベルの要素であっても、共有メモリ領域全体を使用可能。
+    //
+    // 要素が存在する(可能性のある)レベルは、共有の nonempty_mask で管理する。
+    // deq はマスク中の最も優先度の高い(番号の小さい)レベルから取り出すので、空のレベルを順に調べることはない。
+    //  - enq: レベルへの要素の追加後に、そのレベルのビットを立てる (既に立っている場合は、アトミックな書き込みは行わない)
+    //  - deq: ビットの立っているレベルが空だった場合は、ビットを落とした後で、再度そのレベルが空かどうかを確認する
+    //         (空でなかった場合はビットを立て直すので、要素が追加されたレベルのビットが落ちたままになることはない)
+    class PriorityQueueImpl {
+      typedef allocator::FixedAllocator::MD MD; // memory descriptor
+      typedef allocator::FixedAllocator Allocator;
+
+    public:
+      static const uint32_t MAX_LEVEL_COUNT = 32; // nonempty_mask のビット数
+
+    private:
+      typedef NodeList::Node Node;
+      typedef NodeList::Ends Level;
+
+      struct Header {
+        char magic[sizeof(PRIORITY_MAGIC)];
+        uint64_t shm_size;
+        uint32_t cache_line_size;
+        uint32_t level_count;
+
+        uint32_t overflowed_count;
+
+        volatile uint32_t nonempty_mask IMQUE_CACHE_ALIGNED; // i 番目のビットが立っていれば、レベル i に要素が存在する可能性がある
+        Level levels[MAX_LEVEL_COUNT];
+      };
+      static const uint32_t HEADER_SIZE = sizeof(Header);
+
+    public:
+      // level_count は 1 から MAX_LEVEL_COUNT の間
+      PriorityQueueImpl(ipc::SharedMemory& shm, uint32_t level_count)
+        : shm_size_(shm.size()),
+          level_count_(level_count),
+          que_(level_count >= 1 && level_count <= MAX_LEVEL_COUNT ? shm.ptr<Header>() : NULL),
+          alc_(shm.ptr<void>(HEADER_SIZE), shm.size() > HEADER_SIZE ? shm.size() - HEADER_SIZE : 0),
+          list_(alc_, NULL) {
+      }
+
+      operator bool() const { return alc_ && que_; }
+
+      // 初期化メソッド。
+      // コンストラクタに渡した一つの shm につき、一回呼び出す必要がある。
+      void init() {
+        if(*this) {
+          alc_.init();
+
+          for(uint32_t i=0; i < level_count_; i++) {
+            if(list_.init(que_->levels[i]) == false) {
+              que_ = NULL;
+              return;
+            }
+          }
+
+          memcpy(que_->magic, PRIORITY_MAGIC, sizeof(PRIORITY_MAGIC));
+          que_->shm_size = shm_size_;
+          que_->cache_line_size = atomic::CACHE_LINE_SIZE;
+          que_->level_count = level_count_;
+          que_->overflowed_count = 0;
+          que_->nonempty_mask = 0;
+        }
+      }
+
+      // 重複初期化チェック(簡易)付きの初期化メソッド。
+      void init_once() {
+        if(*this && (memcmp(que_->magic, PRIORITY_MAGIC, sizeof(PRIORITY_MAGIC)) != 0 ||
+                     shm_size_ != que_->shm_size ||
+                     atomic::CACHE_LINE_SIZE != que_->cache_line_size ||
+                     level_count_ != que_->level_count)) {
+          init();
+        }
+      }
+
+      uint32_t levelCount() const { return level_count_; }
+
+      // レベル priority に要素を追加する (キューに空きがない場合や、priority が範囲外の場合は false を返す)
+      // datav および sizev は count 分のサイズを持ち、それらを全て結合したデータがキューには追加される
+      // (priority が範囲外の場合は呼び出し側の誤りなので、overflowedCount には数えない)
+      bool enqv(uint32_t priority, const void** datav, size_t* sizev, size_t count) {
+        if(priority >= level_count_) {
+          return false;
+        }
+
+        size_t total_size = 0;
+        for(size_t i=0; i < count; i++) {
+          total_size += sizev[i];
+        }
+
+        MD md = alc_.allocate(sizeof(Node) + total_size);
+        if(md == 0) {
+          atomic::add(&que_->overflowed_count, 1);
+          return false;
+        }
+
+        Node* node = alc_.ptr<Node>(md);
+        node->next = Node::END;
+        node->data_size = total_size;
+        size_t offset = 0;
+        for(size_t i=0; i < count; i++) {
+          memcpy(node->data + offset, datav[i], sizev[i]);
+          offset += sizev[i];
+        }
+
+        list_.enq(que_->levels[priority], md);
+        markNonEmpty(priority);
+        return true;
+      }
+
+      // 最も優先度の高い(番号の小さい)レベルから要素を取り出し buf に格納する (キューが空の場合は false を返す)
+      // priority が NULL 以外の場合は、取り出した要素のレベルを格納する
+      bool deq(std::string& buf, uint32_t* priority) {
+        for(;;) {
+          uint32_t mask = atomic::fetch(&que_->nonempty_mask);
+          if(mask == 0) {
+            return false; // queue is empty
+          }
+
+          const uint32_t level = __builtin_ctz(mask);
+          MD md = list_.deq(que_->levels[level]);
+          if(md != 0) {
+            if(priority) {
+              *priority = level;
+            }
+            return takeData(md, buf);
+          }
+
+          // レベルが空なのでビットを落とす。
+          // その間に要素が追加されていた場合に、ビットが落ちたままにならないよう、落とした後で再確認する。
+          atomic::fetch_and_and(&que_->nonempty_mask, ~(1U << level));
+          atomic::fence();
+          if(list_.isEmpty(que_->levels[level]) == false) {
+            atomic::fetch_and_or(&que_->nonempty_mask, 1U << level);
+          }
+        }
+      }
+
+      // キューが空かどうか
+      bool isEmpty() {
+        for(uint32_t i=0; i < level_count_; i++) {
+          if(list_.isEmpty(que_->levels[i]) == false) {
+            return false;
+          }
+        }
+        return true;
+      }
+
+      // キューへの要素追加に失敗した回数を返す
+      size_t overflowedCount() const { return que_->overflowed_count; }
+      size_t resetOverflowedCount() {
+        return atomic::fetch_and_clear(&que_->overflowed_count);
+      }
+
+    private:
+      // enq 側の通常パスでは、マスクの読み込みのみを行う (既にビットが立っていれば書き込まない)
+      void markNonEmpty(uint32_t level) {
+        atomic::fence(); // 要素の追加(tail側のCAS)よりも前にマスクを読み込まないようにする (deq 側のビットの落としと対になる)
+        if((atomic::fetch(&que_->nonempty_mask) & (1U << level)) == 0) {
+          atomic::fetch_and_or(&que_->nonempty_mask, 1U << level);
+        }
+      }
+
+      bool takeData(MD md, std::string& buf) {
+        Node* node = alc_.ptr<Node>(md);
+        buf.assign(node->data, node->data_size);
+
+        bool rlt = alc_.release(md);
+        assert(rlt);
+        return true;
+      }
+
+    private:
+      const size_t shm_size_;
+      const uint32_t level_count_;
+
+      Header* que_;
+      Allocator alc_;
+      NodeList list_;
+    };
+  }
+}
+
+#endif
@@ -3,69 +3,232 @@
 
 #include "../atomic/atomic.hh"
 #include "../ipc/shared_memory.hh"
+#include "../ipc/futex.hh"
 #include "../allocator/fixed_allocator.hh"
+#include "../stats.hh"
+#include "node_list.hh"
 #include <inttypes.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <algorithm>
+#include <string>
+#include <vector>
 
 namespace imque {
   namespace queue {
-    static const char MAGIC[] = "IMQUE-0.1.2";
+    static const char MAGIC[] = "IMQUE-0.3.1";
+
+    template<class Layout> class BasicQueueImpl;
+
+    // キューから取り出した要素を、コピーせずに共有メモリ上で直接参照するためのクラス。
+    // 参照中は要素の領域が解放されないように参照カウントを保持し、デストラクタ(もしくは reset()) で解放する。
+    // 要素の領域はキューの使用量(usedBytes)に含まれたままで、解放時に減算される。(enqWait で待機中のプロセスの起床も解放時に行う)
+    // コピーは不可 (C++11以降ではムーブが可能。それ以前は swap() で所有権を移す)。
+    template<class Layout>
+    class BasicMessageView {
+      typedef BasicQueueImpl<Layout> Queue;
+      typedef typename Layout::MD MD;
+
+    public:
+      BasicMessageView() : que_(NULL), md_(0), data_(NULL), size_(0) {}
+      ~BasicMessageView() { reset(); }
+
+#if __cplusplus >= 201103L
+      BasicMessageView(BasicMessageView&& src) : que_(NULL), md_(0), data_(NULL), size_(0) { swap(src); }
+      BasicMessageView& operator=(BasicMessageView&& src) {
+        reset();
+        swap(src);
+        return *this;
+      }
+#endif
+
+      operator bool() const { return md_ != 0; }
+
+      const char* data() const { return data_; }
+      size_t size() const { return size_; }
+
+      // 参照中の要素を解放する
+      inline void reset();
+
+      void swap(BasicMessageView& other) {
+        std::swap(que_, other.que_);
+        std::swap(md_, other.md_);
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+      }
+
+    private:
+      BasicMessageView(const BasicMessageView&);
+      BasicMessageView& operator=(const BasicMessageView&);
+
+      friend class BasicQueueImpl<Layout>;
+      void assign(Queue* que, MD md, const char* data, size_t size) {
+        reset();
+        que_ = que;
+        md_ = md;
+        data_ = data;
+        size_ = size;
+      }
+
+      void clear() {
+        que_ = NULL;
+        md_ = 0;
+        data_ = NULL;
+        size_ = 0;
+      }
+
+    private:
+      Queue* que_;
+      MD md_;
+      const char* data_;
+      size_t size_;
+    };
+
+    // キューに追加する要素の領域を事前に確保し、共有メモリ上に直接データを書き込むためのクラス。
+    // commit() でキューに追加され、abort() (もしくは commit() せずに破棄) で確保した領域は解放される。
+    // コピーは不可 (C++11以降ではムーブが可能。それ以前は swap() で所有権を移す)。
+    template<class Layout>
+    class BasicReservation {
+      typedef BasicQueueImpl<Layout> Queue;
+      typedef typename Layout::MD MD;
+
+    public:
+      BasicReservation() : que_(NULL), md_(0), data_(NULL), size_(0) {}
+      ~BasicReservation() { abort(); }
+
+#if __cplusplus >= 201103L
+      BasicReservation(BasicReservation&& src) : que_(NULL), md_(0), data_(NULL), size_(0) { swap(src); }
+      BasicReservation& operator=(BasicReservation&& src) {
+        abort();
+        swap(src);
+        return *this;
+      }
+#endif
+
+      operator bool() const { return md_ != 0; }
+
+      char* data() const { return data_; }
+      size_t size() const { return size_; }
+
+      // 書き込んだ要素をキューに追加する
+      inline void commit();
+
+      // 確保した領域を解放する (キューには何も追加されない)
+      inline void abort();
+
+      void swap(BasicReservation& other) {
+        std::swap(que_, other.que_);
+        std::swap(md_, other.md_);
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+      }
+
+    private:
+      BasicReservation(const BasicReservation&);
+      BasicReservation& operator=(const BasicReservation&);
+
+      friend class BasicQueueImpl<Layout>;
+      void assign(Queue* que, MD md, char* data, size_t size) {
+        abort();
+        que_ = que;
+        md_ = md;
+        data_ = data;
+        size_ = size;
+      }
+
+      void clear() {
+        que_ = NULL;
+        md_ = 0;
+        data_ = NULL;
+        size_ = 0;
+      }
+
+    private:
+      Queue* que_;
+      MD md_;
+      char* data_;
+      size_t size_;
+    };
 
     // FIFOキュー
-    class QueueImpl {
-      struct Node {
-        uint32_t next;
-        uint32_t data_size;
-        char data[0];
-        
-        static const uint32_t END = 0;
-      };
+    //
+    // Layout が allocator::NarrowLayout の場合は 32bit、allocator::WideLayout の場合は 64bit のメモリ記述子を使用する。
+    template<class Layout>
+    class BasicQueueImpl {
+      friend class BasicReservation<Layout>;
+      friend class BasicMessageView<Layout>;
+
+      typedef typename Layout::MD MD; // memory descriptor
+      typedef allocator::BasicFixedAllocator<Layout> Allocator;
+      typedef BasicNodeList<Layout> NodeList;
+      typedef typename NodeList::Node Node;
 
+    public:
+      typedef BasicMessageView<Layout> MessageView;
+      typedef BasicReservation<Layout> Reservation;
+
+    private:
+
+      // 頻繁に更新される値(head, tail, 待機/起床用のワード)は、偽共有を避けるために、それぞれ別のキャッシュラインに配置する
       struct Header {
         char magic[sizeof(MAGIC)];
-        uint32_t shm_size;
+        uint64_t shm_size;
+        uint32_t cache_line_size; // レイアウトの作成時の IMQUE_CACHE_LINE_SIZE
+        uint32_t md_size;         // メモリ記述子のサイズ (NarrowLayout なら 4、WideLayout なら 8)
 
-        volatile uint32_t head;  // NOTE: mdを保持。md自体がABA対策がなされているので、ここではそれ用のフィールドは不要。
-        volatile uint32_t tail;
-        
         uint32_t overflowed_count;
-      };
-      static const uint32_t HEADER_SIZE = sizeof(Header);
+        uint32_t stats_size;      // 統計領域のサイズ (IMQUE_STATS 未定義時は 0)
 
-      // 参照カウント周りの処理隠蔽用のクラス
-      class NodeRef {
-      public:
-        NodeRef(uint32_t md, allocator::FixedAllocator& alc) 
-          : alc_(alc), md_(0) {
-          if(alc.dup(md)) { // 既に解放されている可能性もあるのでチェックする
-            md_ = md;
-          }
-        }
-        
-        ~NodeRef() {
-          if(md_) {
-            bool rlt = alc_.release(md_);
-            assert(rlt);
-          }
-        }
+        typename NodeList::Ends list;  // 要素のリストの head と tail
 
-        operator bool() const { return md_ != 0; }
+        volatile uint32_t deq_waiting IMQUE_CACHE_ALIGNED; // deqWait で待機中(もしくは待機に入ろうとしている)のプロセス数
+        volatile uint32_t enq_signal IMQUE_CACHE_ALIGNED;  // 待機中のプロセスの起床に使用する futex ワード
 
-        Node node_copy() const { return atomic::fetch(alc_.ptr<Node>(md_)); }
-        uint32_t& node_next() { return alc_.ptr<Node>(md_)->next; }
-        uint32_t md() const { return md_; }
-        
-      private:
-        allocator::FixedAllocator& alc_;
-        uint32_t md_;
+        // enqWait 用 (待機中のプロデューサの管理と、水位の設定値)
+        volatile uint32_t enq_waiting IMQUE_CACHE_ALIGNED; // enqWait で待機中(もしくは待機に入ろうとしている)のプロセス数
+        volatile uint32_t deq_signal;      // 待機中のプロデューサの起床に使用する futex ワード
+        volatile uint64_t enq_wake_below;  // used_bytes がこの値を下回ったら、待機中のプロデューサを起床する (0 なら起床対象なし)
+        uint64_t high_watermark;           // used_bytes がこの値を越える場合は enqWait は待機する (0 なら無制限)
+        uint64_t low_watermark;            // high_watermark による待機の解除は used_bytes がこの値以下になるまで待つ
+
+        volatile uint64_t used_bytes IMQUE_CACHE_ALIGNED;  // キュー内(追加済みで未取得、予約中、もしくは deqView で参照中)の要素の合計バイト数
+
+#ifdef IMQUE_STATS
+        stats::Stats stats;
+#endif
       };
+      static const uint32_t HEADER_SIZE = sizeof(Header);
+#ifdef IMQUE_STATS
+      static const uint32_t STATS_SIZE = sizeof(stats::Stats);
+#else
+      static const uint32_t STATS_SIZE = 0;
+#endif
+
+      static const int DEQ_WAIT_SPIN_LIMIT = 128;    // futexで待機に入る前に、要素の取り出しを試みる回数
+      static const long DEQ_WAIT_SLICE_US = 100*1000; // 一回の futex 待機の最大時間
+      static const long ENQ_WAIT_SLICE_US = 100*1000; // enqWait の一回の futex 待機の最大時間
+      static const size_t DEQ_BATCH_LIMIT = 64;        // deqBatch で一回の head 更新で取り出す要素の最大数
+      static const size_t ENQ_BATCH_STACK_LIMIT = 64;  // enqBatch でメモリ記述子をスタック上に保持する要素の最大数
 
     public:
-      QueueImpl(ipc::SharedMemory& shm)
+      BasicQueueImpl(ipc::SharedMemory& shm)
         : shm_size_(shm.size()),
           que_(shm.ptr<Header>()),
-          alc_(shm.ptr<void>(HEADER_SIZE), std::max(0, static_cast<int32_t>(shm.size() - HEADER_SIZE))) {
+          alc_(shm.ptr<void>(HEADER_SIZE), shm.size() > HEADER_SIZE ? shm.size() - HEADER_SIZE : 0),
+          list_(alc_, statsRegion()) {
+        alc_.setStats(statsRegion());
+      }
+
+      // 共有メモリ領域の一部(region から size バイト)をキューとして使用する
+      // (一つの共有メモリ領域に、複数のキューを配置する場合に使用する)
+      BasicQueueImpl(void* region, size_t size)
+        : shm_size_(size),
+          que_(reinterpret_cast<Header*>(region)),
+          alc_(region ? reinterpret_cast<char*>(region) + HEADER_SIZE : NULL, size > HEADER_SIZE ? size - HEADER_SIZE : 0),
+          list_(alc_, statsRegion()) {
+        alc_.setStats(statsRegion());
       }
 
       operator bool() const { return alc_ && que_; }
@@ -76,23 +239,31 @@ namespace imque {
         if(*this) {
           alc_.init();
       
-          uint32_t sentinel = alc_.allocate(sizeof(Node));
-          if(sentinel == 0) {
+          if(list_.init(que_->list) == false) {
             que_ = NULL;
             return;
           }
 
           memcpy(que_->magic, MAGIC, sizeof(MAGIC));
           que_->shm_size = shm_size_;
-          
-          alc_.ptr<Node>(sentinel)->next = Node::END;
-          
-          que_->head = sentinel;
-          que_->tail = sentinel;
-          bool rlt = alc_.dup(sentinel); // head と tail の二箇所から参照されているので、参照カウントを一つ増やしておく
-          assert(rlt);
+          que_->cache_line_size = atomic::CACHE_LINE_SIZE;
+          que_->md_size = sizeof(MD);
 
           que_->overflowed_count = 0;
+          que_->deq_waiting = 0;
+          que_->enq_signal = 0;
+
+          que_->enq_waiting = 0;
+          que_->deq_signal = 0;
+          que_->enq_wake_below = 0;
+          que_->high_watermark = 0;
+          que_->low_watermark = 0;
+          que_->used_bytes = 0;
+
+          que_->stats_size = STATS_SIZE;
+#ifdef IMQUE_STATS
+          que_->stats.clear();
+#endif
         }
       }
 
@@ -100,7 +271,10 @@ namespace imque {
       // 共有メモリ用のファイルを使い回している場合は、二回目以降は明示的なinit()呼び出しを行った方が安全。
       void init_once() {
         if(*this && (memcmp(que_->magic, MAGIC, sizeof(MAGIC)) != 0 || 
-                     shm_size_ != que_->shm_size)) {
+                     shm_size_ != que_->shm_size ||
+                     atomic::CACHE_LINE_SIZE != que_->cache_line_size ||
+                     sizeof(MD) != que_->md_size ||
+                     STATS_SIZE != que_->stats_size)) {
           init();
         }
       }
@@ -118,117 +292,548 @@ namespace imque {
           total_size += sizev[i];
         }
         
-        uint32_t md = alc_.allocate(sizeof(Node) + total_size); // md = memory descriptor
+        MD md = allocateNode(total_size);
         if(md == 0) {
           atomic::add(&que_->overflowed_count, 1);
+          stats::add(statsRegion(), stats::ENQ_OVERFLOW);
           return false;
         }
 
-        Node* node = alc_.ptr<Node>(md);
-        node->next = Node::END;
-        node->data_size = total_size;
+        enqData(md, datav, sizev, count, total_size);
+        return true;
+      }
+
+      // キューに要素を追加する。
+      // キューに空きがない場合、もしくは使用量が high_watermark を越える場合は、
+      // 要素の取り出しによって十分な空きができるまで最大 timeout_ms ミリ秒待機する (timeout_ms が負の場合は無期限に待機する)。
+      // タイムアウトした場合は false を返す。
+      // キューが空でも割当できないサイズの要素は、待機せずに false を返す。
+      // (high_watermark を越えるサイズの要素は、キューが空になった時点で追加される)
+      bool enqWait(const void* data, size_t size, int timeout_ms) {
+        return enqvWait(&data, &size, 1, timeout_ms);
+      }
 
-        size_t offset = sizeof(Node);
+      // datav および sizev は count 分のサイズを持ち、それらを全て結合したデータがキューには追加される
+      bool enqvWait(const void** datav, size_t* sizev, size_t count, int timeout_ms) {
+        size_t total_size = 0;
         for(size_t i=0; i < count; i++) {
-          memcpy(alc_.ptr<void>(md, offset), datav[i], sizev[i]);
-          offset += sizev[i];
+          total_size += sizev[i];
+        }
+
+        MD md = 0;
+        if(total_size <= maxDataSize()) { // 越える場合は、待機しても割当できることはない
+          md = allocateBelowWatermark(total_size);
+          if(md == 0) {
+            md = enqWaitImpl(total_size, timeout_ms);
+          }
+        }
+        if(md == 0) {
+          atomic::add(&que_->overflowed_count, 1);
+          stats::add(statsRegion(), stats::ENQ_OVERFLOW);
+          return false;
         }
 
-        enqImpl(md);
+        enqData(md, datav, sizev, count, total_size);
         return true;
       }
 
-      // キューから要素を取り出し buf に格納する (キューが空の場合は false を返す)
-      bool deq(std::string& buf) {
-        uint32_t md = deqImpl();
+      // enqWait 用の水位(キュー内の要素の合計バイト数)を設定する。設定はキューを共有する全プロセスに反映される。
+      //  - high: 使用量がこれを越える場合、enqWait は(割当可能であっても)待機する。0 なら空き不足の場合のみ待機する。(キューが空の場合は待機しない)
+      //  - low:  high による待機中のプロデューサは、使用量が low 以下になるまで起床されない。(0 もしくは high 以上なら high と同じ)
+      // enq/enqv などの待機しない追加処理は、水位の影響を受けない。
+      void setWatermarks(size_t high, size_t low) {
+        que_->high_watermark = high;
+        que_->low_watermark = (low == 0 || low > high) ? high : low;
+      }
+
+      // 空のキューに追加可能な要素の最大サイズ。
+      // 空のキューでも番兵ノードが(要素を持たない最小のノード分の)領域を使用しているので、アロケータの上限からその分を引く。
+      size_t maxDataSize() const {
+        const size_t max = alc_.maxAllocationSize();
+        const size_t reserved = Allocator::blockSizeOf(sizeof(Node)) + sizeof(Node);
+        return max > reserved ? max - reserved : 0;
+      }
+
+      // キュー内(追加済みで未取得、予約中、もしくは deqView で参照中)の要素の合計バイト数を返す
+      size_t usedBytes() const { return atomic::fetch(&que_->used_bytes); }
+
+      // records 内の count 個の要素を、まとめてキューに追加する。
+      // 全要素分のノードを割り当てて連結した後で、一回の CAS でキューの末尾に繋げるので、
+      // 追加された要素群は順番通りに、かつ(他の要素が間に入ることなく)一度に取り出し可能になる。
+      // 一つでもノードの割り当てに失敗した場合は、何も追加せずに false を返す。(この場合 overflowedCount は、他の追加処理と同様に 1 増加する)
+      bool enqBatch(const iovec* records, size_t count) {
+        if(count == 0) {
+          return true;
+        }
+
+        MD stack_mds[ENQ_BATCH_STACK_LIMIT];
+        std::vector<MD> heap_mds;
+        MD* mds = stack_mds;
+        if(count > ENQ_BATCH_STACK_LIMIT) {
+          heap_mds.resize(count);
+          mds = &heap_mds[0];
+        }
+
+        for(size_t i=0; i < count; i++) {
+          mds[i] = allocateNode(records[i].iov_len);
+          if(mds[i] == 0) {
+            for(size_t j=0; j < i; j++) {
+              releaseNode(mds[j]); // 解放した分の空きを待っている enqWait のプロセスがいれば起床する
+            }
+            atomic::add(&que_->overflowed_count, 1);
+            stats::add(statsRegion(), stats::ENQ_OVERFLOW);
+            return false;
+          }
+
+          Node* node = alc_.template ptr<Node>(mds[i]);
+          memcpy(node->data, records[i].iov_base, records[i].iov_len);
+          if(i > 0) {
+            alc_.template ptr<Node>(mds[i-1])->next = mds[i];
+          }
+        }
+
+        list_.enq(que_->list, mds, count);
+        if(stats::Stats* st = statsRegion()) {
+          size_t total_size = 0;
+          for(size_t i=0; i < count; i++) {
+            total_size += records[i].iov_len;
+          }
+          stats::add(st, stats::ENQ_COUNT, count);
+          stats::add(st, stats::ENQ_BYTES, total_size);
+        }
+        wakeDeqWaiter(count);
+        return true;
+      }
+
+      // size バイトの要素用の領域をキュー内に確保し、reservation から書き込み可能にする。
+      // (キューに空きがない場合は false を返す)
+      // 書き込み後に reservation.commit() を呼び出すことで、要素がキューに追加される。
+      bool reserve(size_t size, Reservation& reservation) {
+        MD md = allocateNode(size);
         if(md == 0) {
+          atomic::add(&que_->overflowed_count, 1);
+          stats::add(statsRegion(), stats::ENQ_OVERFLOW);
           return false;
         }
 
-        Node* node = alc_.ptr<Node>(md);
-        buf.assign(node->data, node->data_size);
-      
-        bool rlt = alc_.release(md);
-        assert(rlt);
+        reservation.assign(this, md, alc_.template ptr<Node>(md)->data, size);
         return true;
       }
-      
-      // キューが空かどうか
-      bool isEmpty() {
-        for(;;) {
-          NodeRef head_ref(que_->head, alc_);
-          if(! head_ref) {
-            continue; 
+
+      // キューから要素を取り出し buf に格納する (キューが空の場合は false を返す)
+      bool deq(std::string& buf) {
+        return takeData(deqImpl(), buf);
+      }
+
+      // キューから最大 max_count 個の要素をまとめて取り出し bufs に格納する。取り出した要素の数を返す。
+      // (bufs のサイズは取り出した要素の数に変更される)
+      // DEQ_BATCH_LIMIT 個の要素毎に、一回の head の更新でまとめて取り出すので deq を繰り返すよりも競合が少ない。
+      // bufs は取り出した要素の分だけ伸ばす。(既存の要素の文字列は、格納先として再利用する)
+      size_t deqBatch(std::vector<std::string>& bufs, size_t max_count) {
+        MD mds[DEQ_BATCH_LIMIT];
+        size_t total = 0;
+
+        while(total < max_count) {
+          size_t want = std::min(max_count - total, DEQ_BATCH_LIMIT);
+          size_t n = list_.deqBatch(que_->list, mds, want);
+          if(bufs.size() < total + n) {
+            bufs.resize(total + n);
+          }
+          for(size_t i=0; i < n; i++) {
+            takeData(mds[i], bufs[total+i]);
           }
+          total += n;
 
-          return head_ref.node_copy().next == Node::END;
+          if(n < want) {
+            break;
+          }
         }
+
+        bufs.resize(total);
+        return total;
       }
 
+      // キューから要素を取り出し、コピーせずに view から参照可能にする (キューが空の場合は false を返す)
+      // 要素の領域は view が破棄(もしくは reset)されるまで解放されず、それまでは使用量にも含まれる。
+      bool deqView(MessageView& view) {
+        MD md = deqImpl();
+        if(md == 0) {
+          return false;
+        }
+
+        Node* node = alc_.template ptr<Node>(md);
+        view.assign(this, md, node->data, node->data_size);
+        stats::add(statsRegion(), stats::DEQ_COUNT);
+        stats::add(statsRegion(), stats::DEQ_BYTES, node->data_size);
+        return true;
+      }
+
+      // キューから要素を取り出し buf に格納する。
+      // キューが空の場合は、要素が追加されるまで最大 timeout_ms ミリ秒待機する (timeout_ms が負の場合は無期限に待機する)。
+      // タイムアウトした場合は false を返す。
+      bool deqWait(std::string& buf, int timeout_ms) {
+        return takeData(deqWaitImpl(timeout_ms), buf);
+      }
+      
+      // キューが空かどうか
+      bool isEmpty() { return list_.isEmpty(que_->list); }
+
       // キューへの要素追加に失敗した回数を返す
       size_t overflowedCount() const { return que_->overflowed_count; }
       size_t resetOverflowedCount() { 
         return atomic::fetch_and_clear(&que_->overflowed_count);
       }
 
+      // 統計情報を返す (IMQUE_STATS 未定義時は NULL)
+      const stats::Stats* stats() const { return que_ ? statsRegion() : NULL; }
+
+      // shm が、このキューと同じレイアウト(メモリ記述子のサイズ、キャッシュラインサイズ、統計の有無)で初期化済みの、
+      // shm 全体を使用するキューの領域なら true を返す。(読み込み専用でマッピングした領域に対しても使用可能)
+      // init_once() と異なり、一致しない場合でも領域は変更しないので、既存のキューを開く前の確認に使用する。
+      static bool isCompatible(const ipc::SharedMemory& shm) {
+        const Header* header = shm.ptr<const Header>();
+        return header != NULL && shm.size() >= HEADER_SIZE &&
+               memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0 &&
+               header->shm_size == shm.size() &&
+               header->cache_line_size == atomic::CACHE_LINE_SIZE &&
+               header->md_size == sizeof(MD) &&
+               header->stats_size == STATS_SIZE;
+      }
+
+      // 読み込み専用でマッピングした(他のプロセスが使用中の)キューの領域から、統計情報を取得する。
+      // キューの領域でない場合や、キューが統計を記録していない場合は NULL を返す。
+      // (isCompatible と同様に、ヘッダと統計領域の 8byte 以下の値しか読まないので、WideQueue の領域にも使用可能。
+      //  16byte の atomic::fetch は書き込みを伴うので、読み込み専用の領域に対しては head/tail などを参照しないこと)
+      static const stats::Stats* statsOf(const ipc::SharedMemory& shm) {
+#ifdef IMQUE_STATS
+        if(isCompatible(shm) == false) {
+          return NULL;
+        }
+        return &shm.ptr<const Header>()->stats;
+#else
+        (void)shm;
+        return NULL;
+#endif
+      }
+
+      // SIGKILL されたプロセスがリークさせた領域を回収し、回収した領域の数を返す。
+      //  - head から到達可能なノード、およびアロケータにキャッシュされているブロック以外の割当済み領域を解放する
+      //    (enq の途中や、deq した要素のコピー中に SIGKILL された場合の領域)
+      //  - 到達可能なノードの参照カウントを本来の値に戻す (NodeRef を保持したまま SIGKILL された場合の過剰な参照)
+      //  - tail を末尾のノードに合わせ、deqWait/enqWait の待機プロセス数を 0 に戻し、使用量を数え直す
+      //  - アロケータのキャッシュ中のブロックを全て返却し、断片化を解消する
+      //  - head から辿れるノードが一つもない(head が壊れている)場合は、取り出せる要素も残っていないので、キューを初期化し直す
+      // ※ 他のプロセスがキューを使用していない(静止した)状態でのみ呼び出し可能。
+      //    (MessageView や Reservation で参照中の領域も、到達不能とみなして解放される)
+      size_t recover() {
+        alc_.reclaimDeadMagazines();
+        alc_.repairAllocatedCounts();
+
+        std::vector<MD> allocated;
+        std::vector<MD> live;
+        alc_.collectAllocated(allocated);
+        alc_.collectCached(live);
+
+        // head から辿れるノード (壊れたリンクで循環しないように、割当済み領域の数で打ち切る)
+        std::vector<MD> reachable;
+        for(MD md = que_->list.head; md != Node::END && reachable.size() <= allocated.size(); md = alc_.template ptr<Node>(md)->next) {
+          reachable.push_back(md);
+        }
+        live.insert(live.end(), reachable.begin(), reachable.end());
+        std::sort(live.begin(), live.end());
+
+        size_t reclaimed = 0;
+        for(size_t i=0; i < allocated.size(); i++) {
+          if(std::binary_search(live.begin(), live.end(), allocated[i]) == false) {
+            alc_.setRefCount(allocated[i], 0);
+            bool rlt = alc_.reclaim(allocated[i]);
+            assert(rlt);
+            reclaimed++;
+          }
+        }
+
+        if(reachable.empty()) {
+          init();
+          return reclaimed;
+        }
+
+        // 参照カウントは head のノードが head からの 1、それ以降のノードが割当時と head からの 2。(末尾のノードは tail からの分が +1)
+        const MD last = reachable.back();
+        que_->list.tail = last;
+        for(size_t i=0; i < reachable.size(); i++) {
+          alc_.setRefCount(reachable[i], (i == 0 ? 1 : 2) + (reachable[i] == last ? 1 : 0));
+        }
+        que_->deq_waiting = 0;
+
+        // 使用量は head 以降のノード(head が指すノード自体は取り出し済み)の合計から求め直す
+        uint64_t used_bytes = 0;
+        for(size_t i=1; i < reachable.size(); i++) {
+          used_bytes += alc_.template ptr<Node>(reachable[i])->data_size;
+        }
+        que_->used_bytes = used_bytes;
+        que_->enq_waiting = 0;
+        que_->enq_wake_below = 0;
+
+        alc_.trimCaches(); // 回収した領域を含めて、キャッシュ中のブロックを他のサイズの割当にも使用可能にする
+        return reclaimed;
+      }
+
     private:
-      void enqImpl(uint32_t new_tail) {
-        bool rlt = alc_.dup(new_tail, 2); // head と tail からの参照分を始めにカウントしておく
+      stats::Stats* statsRegion() const {
+#ifdef IMQUE_STATS
+        return que_ ? &que_->stats : NULL;
+#else
+        return NULL;
+#endif
+      }
+
+      // 要素用のノードを割り当てる。失敗した場合は 0 を返す。
+      MD allocateNode(size_t data_size) {
+        MD md = alc_.allocate(sizeof(Node) + data_size); // md = memory descriptor
+        if(md == 0) {
+          return 0;
+        }
+
+        Node* node = alc_.template ptr<Node>(md);
+        node->next = Node::END;
+        node->data_size = data_size;
+        atomic::add(&que_->used_bytes, data_size);
+        return md;
+      }
+
+      // high_watermark を越えない場合のみ、要素用のノードを割り当てる。失敗した場合は 0 を返す。
+      // (水位の判定と割当はアトミックではないので、並行する追加によって多少越えることはある)
+      // 単独で high_watermark を越えるサイズの要素が永久に追加できなくならないように、キューが空の場合は水位に関わらず割り当てる。
+      MD allocateBelowWatermark(size_t data_size) {
+        const uint64_t high = que_->high_watermark;
+        const uint64_t used = atomic::fetch(&que_->used_bytes);
+        if(high != 0 && used != 0 && used + data_size > high) {
+          return 0;
+        }
+        return allocateNode(data_size);
+      }
+
+      // 割り当て済みのノードに datav のデータを書き込み、キューに追加する
+      void enqData(MD md, const void** datav, size_t* sizev, size_t count, size_t total_size) {
+        char* data = alc_.template ptr<Node>(md)->data;
+        size_t offset = 0;
+        for(size_t i=0; i < count; i++) {
+          memcpy(data + offset, datav[i], sizev[i]);
+          offset += sizev[i];
+        }
+
+        list_.enq(que_->list, md);
+        stats::add(statsRegion(), stats::ENQ_COUNT);
+        stats::add(statsRegion(), stats::ENQ_BYTES, total_size);
+        wakeDeqWaiter();
+      }
+
+      void commitReserved(MD md) {
+        list_.enq(que_->list, md);
+        stats::add(statsRegion(), stats::ENQ_COUNT);
+        stats::add(statsRegion(), stats::ENQ_BYTES, alc_.template ptr<Node>(md)->data_size);
+        wakeDeqWaiter();
+      }
+
+      // 予約の破棄、および deqView で取り出した要素の参照の解放
+      void releaseNode(MD md) {
+        const size_t data_size = alc_.template ptr<Node>(md)->data_size;
+        bool rlt = alc_.release(md);
         assert(rlt);
+        noteDequeued(data_size);
+      }
 
-        for(;;) {
-          NodeRef tail_ref(que_->tail, alc_);
-          if(! tail_ref) {
-            continue;
+      // 要素の追加を、deqWait で待機中のプロセスに通知する。
+      // 待機中のプロセスがいない場合は、システムコールは発行しない。
+      // (count は追加した要素の数。futex で起床できるプロセス数の上限 INT_MAX で切り詰める)
+      void wakeDeqWaiter(size_t count=1) {
+        atomic::fence(); // 要素の追加(tail側のCAS)よりも前に deq_waiting を読み込まないようにする
+        if(atomic::fetch(&que_->deq_waiting) != 0) {
+          atomic::add(&que_->enq_signal, 1);
+          ipc::futex::wake(&que_->enq_signal, static_cast<int>(std::min(count, static_cast<size_t>(INT_MAX))));
+        }
+      }
+
+      // 暫くの間スピンした後で、futex 上で要素が追加されるのを待つ。
+      // deq_waiting のインクリメント後にキューが空であることを確認しているので、起床通知を取りこぼすことはない。
+      // (enq側は、要素の追加後に deq_waiting を確認する)
+      //
+      // 待機中のプロセスが SIGKILL された場合は deq_waiting が実際よりも大きいままになるが、
+      // enq 時に不要な起床システムコールが発行されるようになるだけで、キューの動作は妨げない。
+      // また、起床通知前に enq 側のプロセスが SIGKILL された場合に備えて、一回の待機時間は DEQ_WAIT_SLICE_US までとしている。
+      MD deqWaitImpl(int timeout_ms) {
+        for(int i=0; i < DEQ_WAIT_SPIN_LIMIT; i++) {
+          MD md = deqImpl();
+          if(md != 0) {
+            return md;
           }
+        }
 
-          Node node = tail_ref.node_copy();
-          if(node.next != Node::END) {
-            // tail が末尾を指していないので、一つ前に進める
-            tryMoveNext(&que_->tail, tail_ref.md(), node.next);
-            continue;
+        const long long deadline = timeout_ms < 0 ? -1 : nowUs() + static_cast<long long>(timeout_ms)*1000;
+        for(;;) {
+          uint32_t signal = atomic::fetch(&que_->enq_signal);
+          atomic::add(&que_->deq_waiting, 1);
+          atomic::fence(); // deq_waiting のインクリメントを、キューの空チェックよりも前に可視にする
+
+          MD md = deqImpl();
+          if(md != 0) {
+            atomic::sub(&que_->deq_waiting, 1);
+            return md;
           }
 
-          if(atomic::compare_and_swap(&tail_ref.node_next(), node.next, new_tail)) {
-            tryMoveNext(&que_->tail, tail_ref.md(), new_tail);
-            break;
+          long wait_us = DEQ_WAIT_SLICE_US;
+          if(deadline != -1) {
+            long long remaining = deadline - nowUs();
+            if(remaining <= 0) {
+              atomic::sub(&que_->deq_waiting, 1);
+              return 0;
+            }
+            wait_us = static_cast<long>(std::min(remaining, static_cast<long long>(wait_us)));
           }
+
+          ipc::futex::wait(&que_->enq_signal, signal, wait_us);
+          atomic::sub(&que_->deq_waiting, 1);
         }
       }
 
-      uint32_t deqImpl() {
+      // size バイトの要素用のノードが割り当てられるようになるまで、futex 上で待機する。(タイムアウトした場合は 0 を返す)
+      // 待機に入る前に、起床して欲しい使用量の閾値(enq_wake_below)を設定しておき、取り出し側は使用量がそれを下回った場合にのみ起床する。
+      // (空きが要素のサイズ分に満たない間に起床して、割当を繰り返すことはない)
+      //
+      // 起床通知の取りこぼしを防ぐ仕組みと、SIGKILL されたプロセスへの対処は deqWaitImpl と同様。
+      // また、閾値は複数の待機プロセスで共有するので、起床後に割当に失敗したプロセスは、改めて閾値を設定して待機する。
+      MD enqWaitImpl(size_t size, int timeout_ms) {
+        const long long deadline = timeout_ms < 0 ? -1 : nowUs() + static_cast<long long>(timeout_ms)*1000;
         for(;;) {
-          NodeRef head_ref(que_->head, alc_);
-          if(! head_ref) {
-            continue;
+          uint32_t signal = atomic::fetch(&que_->deq_signal);
+          atomic::add(&que_->enq_waiting, 1);
+          raiseEnqWakeThreshold(size);
+          atomic::fence(); // 待機の表明を、割当の再試行よりも前に可視にする
+
+          MD md = allocateBelowWatermark(size);
+          if(md != 0) {
+            atomic::sub(&que_->enq_waiting, 1);
+            return md;
           }
 
-          Node node = head_ref.node_copy();
-          if(node.next == Node::END) {
-            return 0; // queue is empty
+          long wait_us = ENQ_WAIT_SLICE_US;
+          if(deadline != -1) {
+            long long remaining = deadline - nowUs();
+            if(remaining <= 0) {
+              atomic::sub(&que_->enq_waiting, 1);
+              return 0;
+            }
+            wait_us = static_cast<long>(std::min(remaining, static_cast<long long>(wait_us)));
           }
 
-          if(tryMoveNext(&que_->head, head_ref.md(), node.next)) {
-            return node.next;
+          ipc::futex::wait(&que_->deq_signal, signal, wait_us);
+          atomic::sub(&que_->enq_waiting, 1);
+        }
+      }
+
+      // size バイトの要素が収まる使用量を求め、enq_wake_below をそれ以上に引き上げる
+      //  - 現在の使用量から size バイト以上減った時点 (それだけの領域が解放されれば、割当可能である見込みが高い)
+      //  - high_watermark 設定時は、さらに low_watermark 以下かつ high_watermark - size 以下になった時点
+      void raiseEnqWakeThreshold(size_t size) {
+        const uint64_t used = atomic::fetch(&que_->used_bytes);
+        const uint64_t high = que_->high_watermark;
+        uint64_t fit = used > size ? used - size : 0; // 使用量がこの値以下になれば収まる
+        if(high != 0) {
+          fit = std::min(fit, static_cast<uint64_t>(que_->low_watermark));
+          fit = std::min(fit, high > size ? high - size : 0);
+        }
+
+        const uint64_t below = fit + 1;
+        for(uint64_t curr = atomic::fetch(&que_->enq_wake_below); curr < below; curr = atomic::fetch(&que_->enq_wake_below)) {
+          if(atomic::compare_and_swap(&que_->enq_wake_below, curr, below)) {
+            break;
           }
         }
       }
 
-      bool tryMoveNext(volatile uint32_t* place, uint32_t curr, uint32_t next) {
-        if(atomic::compare_and_swap(place, curr, next)) {
-          bool rlt = alc_.release(curr);
-          assert(rlt);
-          return true;
+      // 要素の解放(取り出し後の解放や予約の破棄)による使用量の減少を記録し、必要なら enqWait で待機中のプロセスを起床する。
+      // 待機中のプロセスがいないか、使用量が閾値を下回っていない場合は、システムコールは発行しない。
+      void noteDequeued(size_t data_size) {
+        atomic::sub(&que_->used_bytes, data_size);
+        atomic::fence(); // 使用量の減算よりも前に enq_waiting を読み込まないようにする (enqWaitImpl 側の fence と対になる)
+        if(atomic::fetch(&que_->enq_waiting) == 0) {
+          return;
+        }
+
+        const uint64_t below = atomic::fetch(&que_->enq_wake_below);
+        if(below != 0 && atomic::fetch(&que_->used_bytes) < below &&
+           atomic::compare_and_swap(&que_->enq_wake_below, below, static_cast<uint64_t>(0))) {
+          atomic::add(&que_->deq_signal, 1);
+          ipc::futex::wake(&que_->deq_signal, INT_MAX);
         }
-        return false;
+      }
+
+      bool takeData(MD md, std::string& buf) {
+        if(md == 0) {
+          return false;
+        }
+
+        Node* node = alc_.template ptr<Node>(md);
+        buf.assign(node->data, node->data_size);
+        const size_t data_size = node->data_size;
+        stats::add(statsRegion(), stats::DEQ_COUNT);
+        stats::add(statsRegion(), stats::DEQ_BYTES, data_size);
+      
+        bool rlt = alc_.release(md);
+        assert(rlt);
+        noteDequeued(data_size);
+        return true;
+      }
+
+      MD deqImpl() { return list_.deq(que_->list); }
+
+      static long long nowUs() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<long long>(ts.tv_sec)*1000*1000 + ts.tv_nsec/1000;
       }
 
     private:
-      const uint32_t shm_size_; 
+      const size_t shm_size_; 
 
       Header* que_;
-      allocator::FixedAllocator alc_;
+      Allocator alc_;
+      NodeList list_;
     };
+
+    template<class Layout>
+    void BasicReservation<Layout>::commit() {
+      if(md_) {
+        que_->commitReserved(md_);
+        clear();
+      }
+    }
+
+    template<class Layout>
+    void BasicReservation<Layout>::abort() {
+      if(md_) {
+        que_->releaseNode(md_);
+        clear();
+      }
+    }
+
+    template<class Layout>
+    void BasicMessageView<Layout>::reset() {
+      if(md_) {
+        que_->releaseNode(md_);
+      }
+      clear();
+    }
+
+    typedef BasicMessageView<allocator::NarrowLayout> MessageView;
+    typedef BasicReservation<allocator::NarrowLayout> Reservation;
+    typedef BasicQueueImpl<allocator::NarrowLayout>   QueueImpl;
+
+#ifdef IMQUE_HAS_ATOMIC_16
+    typedef BasicMessageView<allocator::WideLayout> WideMessageView;
+    typedef BasicReservation<allocator::WideLayout> WideReservation;
+    typedef BasicQueueImpl<allocator::WideLayout>   WideQueueImpl;
+#endif
   }
 }
 
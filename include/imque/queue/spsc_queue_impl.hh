@@ -0,0 +1,191 @@
+#ifndef IMQUE_QUEUE_SPSC_QUEUE_IMPL_HH
+#define IMQUE_QUEUE_SPSC_QUEUE_IMPL_HH
+
+#include "../atomic/atomic.hh"
+#include "../ipc/shared_memory.hh"
+#include <inttypes.h>
+#include <string.h>
+#include <string>
+
+namespace imque {
+  namespace queue {
+    static const char SPSC_MAGIC[] = "IMQUE-SPSC-0.3.1";
+
+    // 単一プロデューサ/単一コンシューマ用のFIFOキュー。
+    // 共有メモリ上のバイトリングに、可変長のレコード(サイズ + データ)を順に格納する。
+    //
+    // 書き込み位置(write_pos)と読み込み位置(read_pos)は、それぞれ一方のプロセスのみが更新し、
+    // 相手側の位置はプロセスローカルにキャッシュしておく (キャッシュで判断できない場合にのみ共有メモリから読み直す)。
+    // そのため enq/deq の通常パスでは、アトミックな read-modify-write 命令は発行しない。
+    //
+    // 同時に enq を行うプロセスは一つ、deq を行うプロセスも一つ、でなければならない。
+    // (プロセスが SIGKILL された場合は、その後に別のプロセスが役割を引き継いで良い)
+    class SpscQueueImpl {
+      struct Header {
+        char magic[sizeof(SPSC_MAGIC)];
+        uint64_t shm_size;
+        uint32_t cache_line_size;
+
+        uint32_t overflowed_count;
+
+        // リング先頭からの累積バイト数。(64bitなので実質的に循環しない)
+        volatile uint64_t write_pos IMQUE_CACHE_ALIGNED;
+        volatile uint64_t read_pos IMQUE_CACHE_ALIGNED;
+      };
+      static const uint32_t HEADER_SIZE = sizeof(Header);
+
+      static const uint32_t ALIGN = 8;                   // レコードの境界
+      static const uint32_t RECORD_HEADER_SIZE = sizeof(uint32_t);
+      static const uint32_t PADDING = 0xFFFFFFFF;       // リングの終端までの残りを読み飛ばすことを示すレコードサイズ
+      static const uint32_t MAX_DATA_SIZE = PADDING - 1; // レコードに格納可能な要素の最大サイズ (サイズは 32bit で記録する)
+
+    public:
+      SpscQueueImpl(ipc::SharedMemory& shm)
+        : shm_size_(shm.size()),
+          que_(shm.ptr<Header>()),
+          ring_(shm.ptr<char>(HEADER_SIZE)),
+          capacity_(shm.size() > HEADER_SIZE ? (shm.size() - HEADER_SIZE) / ALIGN * ALIGN : 0),
+          cached_read_pos_(0),
+          cached_write_pos_(0) {
+      }
+
+      operator bool() const { return que_ && capacity_ > ALIGN; }
+
+      // 初期化メソッド。
+      // コンストラクタに渡した一つの shm につき、一回呼び出す必要がある。
+      void init() {
+        if(*this) {
+          memcpy(que_->magic, SPSC_MAGIC, sizeof(SPSC_MAGIC));
+          que_->shm_size = shm_size_;
+          que_->cache_line_size = atomic::CACHE_LINE_SIZE;
+          que_->overflowed_count = 0;
+          que_->write_pos = 0;
+          que_->read_pos = 0;
+
+          cached_read_pos_ = 0;
+          cached_write_pos_ = 0;
+        }
+      }
+
+      // 重複初期化チェック(簡易)付きの初期化メソッド。
+      void init_once() {
+        if(*this && (memcmp(que_->magic, SPSC_MAGIC, sizeof(SPSC_MAGIC)) != 0 ||
+                     shm_size_ != que_->shm_size ||
+                     atomic::CACHE_LINE_SIZE != que_->cache_line_size)) {
+          init();
+        }
+      }
+
+      // キューに要素を追加する (キューに空きがない場合は false を返す)
+      bool enq(const void* data, size_t size) {
+        return enqv(&data, &size, 1);
+      }
+
+      // キューに要素を追加する (キューに空きがない場合は false を返す)
+      // datav および sizev は count 分のサイズを持ち、それらを全て結合したデータがキューには追加される
+      bool enqv(const void** datav, size_t* sizev, size_t count) {
+        size_t total_size = 0;
+        for(size_t i=0; i < count; i++) {
+          total_size += sizev[i];
+        }
+
+        uint64_t write_pos = que_->write_pos; // 自プロセスのみが更新する値なので、アトミックに読み込む必要はない
+        char* record = reserveRecord(write_pos, total_size);
+        if(record == NULL) {
+          atomic::add(&que_->overflowed_count, 1);
+          return false;
+        }
+
+        *reinterpret_cast<uint32_t*>(record) = total_size;
+        size_t offset = RECORD_HEADER_SIZE;
+        for(size_t i=0; i < count; i++) {
+          memcpy(record + offset, datav[i], sizev[i]);
+          offset += sizev[i];
+        }
+
+        atomic::store(&que_->write_pos, write_pos + recordSize(total_size));
+        return true;
+      }
+
+      // キューから要素を取り出し buf に格納する (キューが空の場合は false を返す)
+      bool deq(std::string& buf) {
+        uint64_t read_pos = que_->read_pos; // 自プロセスのみが更新する値なので、アトミックに読み込む必要はない
+        if(read_pos >= cached_write_pos_) {
+          cached_write_pos_ = atomic::fetch(&que_->write_pos);
+          if(read_pos == cached_write_pos_) {
+            return false; // queue is empty
+          }
+        }
+
+        uint64_t offset = read_pos % capacity_;
+        uint32_t size = *reinterpret_cast<uint32_t*>(ring_ + offset);
+        if(size == PADDING) {
+          read_pos += capacity_ - offset;
+          offset = 0;
+          size = *reinterpret_cast<uint32_t*>(ring_);
+        }
+
+        buf.assign(ring_ + offset + RECORD_HEADER_SIZE, size);
+        atomic::store(&que_->read_pos, read_pos + recordSize(size));
+        return true;
+      }
+
+      // キューが空かどうか
+      bool isEmpty() const {
+        return atomic::fetch(&que_->read_pos) == atomic::fetch(&que_->write_pos);
+      }
+
+      // キューへの要素追加に失敗した回数を返す
+      size_t overflowedCount() const { return que_->overflowed_count; }
+      size_t resetOverflowedCount() {
+        return atomic::fetch_and_clear(&que_->overflowed_count);
+      }
+
+    private:
+      static uint64_t recordSize(size_t data_size) {
+        return (RECORD_HEADER_SIZE + static_cast<uint64_t>(data_size) + ALIGN - 1) / ALIGN * ALIGN;
+      }
+
+      // data_size バイトのレコード用の連続領域を確保し、その先頭を返す。(空きがない場合や、サイズが MAX_DATA_SIZE を越える場合は NULL を返す)
+      // リングの終端に収まらない場合は、終端までをパディングとして読み飛ばすようにして、リングの先頭に配置する。
+      // (write_pos は、パディング分だけ進められる)
+      char* reserveRecord(uint64_t& write_pos, size_t data_size) {
+        if(data_size > capacity_ || data_size > MAX_DATA_SIZE) {
+          return NULL;
+        }
+
+        const uint64_t record_size = recordSize(data_size);
+        const uint64_t offset = write_pos % capacity_;
+        const uint64_t padding_size = capacity_ - offset < record_size ? capacity_ - offset : 0;
+        const uint64_t need = padding_size + record_size;
+
+        if(write_pos + need - cached_read_pos_ > capacity_) {
+          cached_read_pos_ = atomic::fetch(&que_->read_pos);
+          if(write_pos + need - cached_read_pos_ > capacity_) {
+            return NULL; // queue is full
+          }
+        }
+
+        if(padding_size != 0) {
+          *reinterpret_cast<uint32_t*>(ring_ + offset) = PADDING;
+          write_pos += padding_size;
+          return ring_;
+        }
+        return ring_ + offset;
+      }
+
+    private:
+      const uint64_t shm_size_;
+
+      Header* que_;
+      char* ring_;
+      const uint64_t capacity_;
+
+      // 相手側の位置のプロセスローカルなキャッシュ (実際の値以下であることが保証される)
+      uint64_t cached_read_pos_;
+      uint64_t cached_write_pos_;
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef IMQUE_SHARDED_QUEUE_HH
+#define IMQUE_SHARDED_QUEUE_HH
+
+#include "ipc/shared_memory.hh"
+#include "ipc/process.hh"
+#include "queue/lane_queue_impl.hh"
+#include <string>
+#include <sched.h>
+#include <sys/types.h>
+
+namespace imque {
+  // 複数の独立したレーン(キュー)から構成される、緩いFIFOキュー
+  // マルチプロセス間で使用可能
+  //
+  // Queue は head と tail の二箇所に更新が集中するため、プロセス数を増やしてもスループットが頭打ちになる。
+  // ShardedQueue は一つの共有メモリ領域に lane_count 個のレーンを置き、プロセス毎に異なるレーンを使用することで競合を分散させる。
+  //  - 要素の追加: lane_policy に従ってレーンを選ぶ
+  //  - 要素の取り出し: 各プロセスは自分のレーン(プロセスID毎に決まる)から取り出し始め、
+  //                    レーンが空になる(もしくは一定数取り出す)度に、次のレーンに移る (他のプロセスのレーンからも取り出す)
+  //
+  // 順序の保証 (relaxed FIFO):
+  //  - BY_PROCESS の場合、同じプロセスが追加した要素は、追加した順に取り出される。(異なるプロセスが追加した要素間の順序は保証されない)
+  //  - BY_CPU の場合、順序は保証されない。
+  class ShardedQueue {
+  public:
+    enum LANE_POLICY {
+      BY_PROCESS = 0, // プロセスIDでレーンを選ぶ (プロセス毎の順序が保証される)
+      BY_CPU     = 1  // 実行中のCPUでレーンを選ぶ (CPUキャッシュの局所性は高いが、順序は保証されない)
+    };
+
+    // 親子プロセス間で共有可能な無名キューを作成する
+    // shm_size は共有メモリ領域全体のサイズ (各レーンには shm_size/lane_count ずつが割り当てられる)
+    // map_options は共有メモリ領域のマッピング方法 (MapOption の組み合わせ)
+    ShardedQueue(size_t shm_size, uint32_t lane_count, LANE_POLICY lane_policy=BY_PROCESS, int map_options=ipc::MapOption::NONE)
+      : shm_(shm_size, map_options),
+        impl_(shm_, lane_count),
+        lane_policy_(lane_policy),
+        deq_lane_(0),
+        deq_streak_(0),
+        deq_pid_(0) {
+      init();
+    }
+      
+    // 複数プロセス間で共有可能な名前付きキューを作成する
+    // lane_count はキューを共有する全てのプロセスで同じ値を指定する必要がある
+    // filepath は共有メモリのマッピングに使用するファイルのパス
+    ShardedQueue(size_t shm_size, uint32_t lane_count, const std::string& filepath, mode_t mode=0660,
+                 LANE_POLICY lane_policy=BY_PROCESS, int map_options=ipc::MapOption::NONE)
+      : shm_(filepath, shm_size, mode, map_options),
+        impl_(shm_, lane_count),
+        lane_policy_(lane_policy),
+        deq_lane_(0),
+        deq_streak_(0),
+        deq_pid_(0) {
+      if(*this) {
+        impl_.init_once();
+      }
+    }
+
+    operator bool() const { return shm_ && impl_; }
+
+    // 初期化メソッド。
+    // キューを空に戻したい場合や、名前付きキュー用のファイルを使い回して明示的に初期化したい場合などに使用する。
+    void init() {
+      if(*this) {
+        impl_.init();
+      }
+    }
+
+    // 要素を追加する (選択したレーンに空きがない場合は false を返す)
+    // datav および sizev は count 分のサイズを持ち、それらを全て結合したデータがキューには追加される
+    bool enqv(const void** datav, size_t* sizev, size_t count) { return enqLane().enqv(datav, sizev, count); }
+    
+    // 要素を追加する (選択したレーンに空きがない場合は false を返す)
+    bool enq(const void* data, size_t size) { return enqLane().enq(data, size); }
+
+    // 要素を取り出し buf に格納する (全てのレーンが空の場合は false を返す)
+    bool deq(std::string& buf) {
+      const uint32_t count = impl_.laneCount();
+      if(deq_pid_ != ipc::process::self()) {
+        // 初回(およびfork後)は、自プロセスのレーンから取り出し始める
+        deq_pid_ = ipc::process::self();
+        deq_lane_ = homeLane();
+        deq_streak_ = 0;
+      }
+
+      if(deq_streak_ >= DEQ_STREAK_LIMIT) {
+        // 一つのレーンばかりから取り出し続けないように、定期的に次のレーンに移る
+        deq_lane_ = (deq_lane_ + 1) % count;
+        deq_streak_ = 0;
+      }
+
+      for(uint32_t i=0; i < count; i++) {
+        if(impl_.lane(deq_lane_).deq(buf)) {
+          deq_streak_++;
+          return true;
+        }
+        deq_lane_ = (deq_lane_ + 1) % count;
+        deq_streak_ = 0;
+      }
+      return false;
+    }
+
+    // キューが空なら true を返す
+    bool isEmpty() { return impl_.isEmpty(); }
+
+    // キューへの要素追加に失敗した回数を返す
+    size_t overflowedCount() const { return impl_.overflowedCount(); }
+
+    // キューへの要素追加失敗回数の取得と、カウントの初期化をアトミックに行う。
+    size_t resetOverflowedCount() { return impl_.resetOverflowedCount(); }
+
+    // レーンの数を返す
+    uint32_t laneCount() const { return impl_.laneCount(); }
+
+  private:
+    static const uint32_t DEQ_STREAK_LIMIT = 64; // 同じレーンから続けて取り出す最大数
+
+    uint32_t homeLane() const {
+      return static_cast<uint32_t>(ipc::process::self()) % impl_.laneCount();
+    }
+
+    queue::QueueImpl& enqLane() {
+      if(lane_policy_ == BY_CPU) {
+#ifdef __linux__
+        int cpu = sched_getcpu();
+        if(cpu >= 0) {
+          return impl_.lane(static_cast<uint32_t>(cpu) % impl_.laneCount());
+        }
+#endif
+      }
+      return impl_.lane(homeLane());
+    }
+
+  private:
+    ipc::SharedMemory     shm_;
+    queue::LaneQueueImpl  impl_;
+    const LANE_POLICY     lane_policy_;
+
+    // 取り出し中のレーン (プロセスローカル)
+    uint32_t deq_lane_;
+    uint32_t deq_streak_;
+    pid_t    deq_pid_;
+  };
+}
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef IMQUE_STATS_HH
+#define IMQUE_STATS_HH
+
+#include "atomic/atomic.hh"
+#include "ipc/process.hh"
+#include <inttypes.h>
+#include <string.h>
+
+namespace imque {
+  // キューおよびアロケータの内部動作の統計情報。
+  //
+  // IMQUE_STATS マクロを定義してビルドした場合にのみ、キューの共有メモリ領域内(ヘッダの末尾)に統計用の領域が確保され、カウントが行われる。
+  // (定義しない場合は、カウント処理はコンパイル時に取り除かれる。キューを共有する全てのプロセスで、定義の有無を揃える必要がある)
+  //
+  // カウンタはプロセスIDで選んだストライプ(キャッシュライン単位)毎に保持するので、
+  // カウンタの更新自体が複数プロセス間での競合箇所になることはない。値の読み込み時に全ストライプを合計する。
+  namespace stats {
+    static const uint32_t SIZE_CLASS_COUNT = 7; // FixedAllocator の SuperBlock の数
+
+    enum COUNTER {
+      // キュー
+      ENQ_COUNT = 0,    // 追加した要素数
+      ENQ_BYTES,        // 追加した要素の合計バイト数
+      DEQ_COUNT,        // 取り出した要素数
+      DEQ_BYTES,        // 取り出した要素の合計バイト数
+      ENQ_OVERFLOW,     // 空き不足による追加の失敗数
+      ENQ_CAS_RETRY,    // 末尾ノードへの連結の CAS の失敗数
+      TAIL_LAG,         // tail が末尾を指しておらず、代わりに進めた回数
+      DEQ_CAS_RETRY,    // head の CAS の失敗数
+      NODE_REF_RETRY,   // 参照しようとしたノードが解放済みだった回数
+
+      // FixedAllocator (サイズクラス毎)
+      FIXED_MAGAZINE_HIT,                                    // マガジンから割り当てた数
+      FIXED_FREELIST_HIT = FIXED_MAGAZINE_HIT + SIZE_CLASS_COUNT, // SuperBlock のフリーリストから割り当てた数
+      FIXED_MISS = FIXED_FREELIST_HIT + SIZE_CLASS_COUNT,        // キャッシュがなく VariableAllocator に割当を依頼した数
+      FIXED_LARGE = FIXED_MISS + SIZE_CLASS_COUNT,               // 最大ブロックサイズを越え、VariableAllocator に直接委譲した数
+
+      // VariableAllocator
+      VAR_INDEX_HIT,       // 索引から空きノードが見つかった数
+      VAR_SEARCH,          // フリーリストを辿った回数
+      VAR_SEARCH_STEP,     // フリーリストを辿った際に調べたノードの合計数 (VAR_SEARCH で割ると平均探索長)
+      VAR_RETRY_EXHAUSTED, // 楽観的ロックの試行回数(RETRY_LIMIT)か探索長の上限(SEARCH_STEP_LIMIT)を越えて、割当に失敗した数
+      VAR_OUT_OF_MEMORY,   // 空き不足による割当の失敗数
+
+      COUNTER_COUNT
+    };
+
+    static const uint32_t STRIPE_COUNT = 16;
+
+    struct Stripe {
+      volatile uint64_t counters[COUNTER_COUNT];
+    } IMQUE_CACHE_ALIGNED;
+
+    // 共有メモリ上に置く統計領域
+    struct Stats {
+      Stripe stripes[STRIPE_COUNT];
+
+      void clear() {
+        memset(stripes, 0, sizeof(stripes));
+      }
+
+      void add(COUNTER counter, uint64_t delta) {
+        atomic::add(&stripes[ipc::process::self() % STRIPE_COUNT].counters[counter], delta);
+      }
+
+      // 全ストライプの合計値を返す
+      uint64_t sum(uint32_t counter) const {
+        uint64_t total = 0;
+        for(uint32_t i=0; i < STRIPE_COUNT; i++) {
+          total += atomic::fetch(const_cast<volatile uint64_t*>(&stripes[i].counters[counter]));
+        }
+        return total;
+      }
+    };
+
+    // stats が NULL でなければ、カウンタに delta を加算する (IMQUE_STATS 未定義時は何もしない)
+    inline void add(Stats* stats, COUNTER counter, uint64_t delta=1) {
+#ifdef IMQUE_STATS
+      if(stats) {
+        stats->add(counter, delta);
+      }
+#else
+      (void)stats;
+      (void)counter;
+      (void)delta;
+#endif
+    }
+
+    inline void add(Stats* stats, COUNTER base, uint32_t size_class, uint64_t delta) {
+      add(stats, static_cast<COUNTER>(base + size_class), delta);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef IMQUE_CHECK_HH
+#define IMQUE_CHECK_HH
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+namespace imque {
+  // 各チェック(src/bin/*-check.cc)で共通に使用する、要素の生成/検査や子プロセスの起動/回収用の補助関数群
+  namespace check {
+    // 一回の追加/取り出し(の待機)の時間の上限。これを越えた場合は要素が失われた(もしくはキューが停止した)とみなす
+    const int TIMEOUT_MS = 5000;
+
+    inline long now_ms() {
+      timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+    }
+
+    // index 番目の要素を msg に格納する。(サイズを変えるために、番号の後ろに index % padding バイトの埋め草を付ける)
+    inline void make_message(int index, std::string& msg, int padding=100) {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "%d:", index);
+      msg = buf;
+      msg.append(index % padding, 'x');
+    }
+
+    // make_message で生成した要素から番号を取り出す。内容が不正な場合は -1 を返す
+    inline int parse_message(const char* data, size_t size, int padding=100) {
+      const int index = atoi(std::string(data, size < 16 ? size : 16).c_str());
+      std::string expected;
+      make_message(index, expected, padding);
+      if(index < 0 || expected.size() != size || memcmp(expected.data(), data, size) != 0) {
+        return -1;
+      }
+      return index;
+    }
+
+    // 空きができるまで enq を繰り返す (TIMEOUT_MS を越えたら false を返す)
+    template<class Queue>
+    bool enq_retry(Queue& que, const std::string& msg) {
+      const long limit = now_ms() + TIMEOUT_MS;
+      while(que.enq(msg.data(), msg.size()) == false) {
+        if(now_ms() > limit) {
+          return false;
+        }
+        sched_yield();
+      }
+      return true;
+    }
+
+    // 要素が取り出せるまで deq を繰り返す (TIMEOUT_MS を越えたら false を返す)
+    template<class Queue>
+    bool deq_retry(Queue& que, std::string& buf) {
+      const long limit = now_ms() + TIMEOUT_MS;
+      while(que.deq(buf) == false) {
+        if(now_ms() > limit) {
+          return false;
+        }
+        sched_yield();
+      }
+      return true;
+    }
+
+    // count 個の子プロセスを起動し、その PID を children に格納する。
+    // 子プロセスでは自身の番号(0 から count-1)を、親プロセスでは -1 を返す。
+    // (fork に失敗した場合は、起動済みの子プロセスの分だけを children に格納して -1 を返す)
+    inline int fork_children(int count, std::vector<pid_t>& children) {
+      children.clear();
+      for(int i=0; i < count; i++) {
+        const pid_t pid = fork();
+        switch(pid) {
+        case -1:
+          std::cerr << "ERROR: fork() failed: " << strerror(errno) << std::endl;
+          return -1;
+        case 0:
+          return i;
+        }
+        children.push_back(pid);
+      }
+      return -1;
+    }
+
+    // 子プロセスの終了を待ち、異常終了した数を返す
+    inline int wait_children(const std::vector<pid_t>& children) {
+      int abnormal_exit_num = 0;
+      for(std::size_t i=0; i < children.size(); i++) {
+        int status;
+        waitpid(children[i], &status, 0);
+        if(! WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+          abnormal_exit_num++;
+        }
+      }
+      return abnormal_exit_num;
+    }
+
+    // 要素毎の受信回数を集計して、一回だけ受信された要素の数を返す。欠損と重複の数は missing_count と duplicate_count に格納する
+    inline int count_marks(const int* marks, int total, int& missing_count, int& duplicate_count) {
+      int ok_count = 0;
+      missing_count = 0;
+      duplicate_count = 0;
+      for(int i=0; i < total; i++) {
+        if(marks[i] == 0) {
+          missing_count++;
+        } else if(marks[i] > 1) {
+          duplicate_count++;
+        } else {
+          ok_count++;
+        }
+      }
+      return ok_count;
+    }
+
+    // SIGSEGV のハンドラから親プロセスに通知するためのパイプ
+    inline int& notify_fd() {
+      static int fd = -1;
+      return fd;
+    }
+
+    // 要素のコピー中に SIGSEGV が発生した子プロセスは、親プロセスに通知して SIGKILL されるのを待つ
+    inline void stop_in_copy(int) {
+      char c = 's';
+      if(write(notify_fd(), &c, 1) != 1) {
+        _exit(1);
+      }
+      for(;;) {
+        pause();
+      }
+    }
+
+    // 読み込み不可のページをコピー元として size バイトの要素を enq する子プロセスを起動し、
+    // 要素の領域を確保した後のコピー中に止まったところで SIGKILL する。子プロセスが止まった場合は true を返す
+    template<class Queue>
+    bool kill_in_enq(Queue& que, size_t size) {
+      int fds[2];
+      if(pipe(fds) == -1) {
+        std::cerr << "ERROR: pipe() failed: " << strerror(errno) << std::endl;
+        return false;
+      }
+
+      const pid_t child = fork();
+      switch(child) {
+      case -1:
+        std::cerr << "ERROR: fork() failed: " << strerror(errno) << std::endl;
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+      case 0: {
+        notify_fd() = fds[1];
+        signal(SIGSEGV, stop_in_copy);
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        void* unreadable = mmap(NULL, (size + page_size - 1) / page_size * page_size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if(unreadable == MAP_FAILED) {
+          _exit(1);
+        }
+        que.enq(unreadable, size); // 領域の確保後、要素のコピー時に SIGSEGV が発生する
+        _exit(1);
+      }
+      }
+
+      close(fds[1]); // 子プロセスが止まらずに終了した場合は、read が 0 を返す
+      char c;
+      const bool stopped = read(fds[0], &c, 1) == 1;
+      kill(child, SIGKILL);
+      int status;
+      waitpid(child, &status, 0);
+      close(fds[0]);
+      return stopped;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef IMQUE_HISTOGRAM_HH
+#define IMQUE_HISTOGRAM_HH
+
+#include <imque/atomic/atomic.hh>
+#include <inttypes.h>
+#include <string.h>
+#include <ostream>
+
+namespace imque {
+  // レイテンシ等の分布を記録する対数バケットのヒストグラム (HdrHistogram 風)
+  //
+  // 値を 2 の冪毎の区間に分け、各区間をさらに SUB_BUCKET_COUNT 個に等分したバケットで数える。
+  // そのため、値の大小に関わらず相対誤差は 1/SUB_BUCKET_COUNT 以下に収まり、サイズは固定(約8KB)となる。
+  //
+  // ポインタを含まない固定長の構造体なので、共有メモリ上に配置して、
+  // 各子プロセスが自身のヒストグラムを mergeTo で足し込むことで、プロセス間の集計が行える。
+  class Histogram {
+  public:
+    static const uint32_t SUB_BUCKET_BITS = 4;
+    static const uint32_t SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static const uint32_t BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+    Histogram() {
+      clear();
+    }
+
+    void clear() {
+      memset(counts_, 0, sizeof(counts_));
+      count_ = 0;
+      total_ = 0;
+      min_ = UINT64_MAX;
+      max_ = 0;
+    }
+
+    void add(uint64_t val) {
+      counts_[bucketIndex(val)]++;
+      count_++;
+      total_ += val;
+      if(val < min_) min_ = val;
+      if(val > max_) max_ = val;
+    }
+
+    // 他のプロセスと共有している dst に、このヒストグラムの値をアトミックに足し込む
+    // (atomic::add は relaxed なので、dst の読み出しは、足し込んだプロセスの終了を waitpid で待ってから行うこと)
+    void mergeTo(Histogram& dst) const {
+      for(uint32_t i=0; i < BUCKET_COUNT; i++) {
+        if(counts_[i] != 0) {
+          atomic::add(&dst.counts_[i], counts_[i]);
+        }
+      }
+      atomic::add(&dst.count_, count_);
+      atomic::add(&dst.total_, total_);
+      for(uint64_t cur = atomic::fetch(&dst.min_); min_ < cur; cur = atomic::fetch(&dst.min_)) {
+        if(atomic::compare_and_swap(&dst.min_, cur, min_)) break;
+      }
+      for(uint64_t cur = atomic::fetch(&dst.max_); max_ > cur; cur = atomic::fetch(&dst.max_)) {
+        if(atomic::compare_and_swap(&dst.max_, cur, max_)) break;
+      }
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t min() const { return count_ == 0 ? 0 : min_; }
+    uint64_t max() const { return max_; }
+    uint64_t avg() const { return count_ == 0 ? 0 : total_ / count_; }
+
+    // 全体の percentile パーセント(0〜100)の位置の値を返す
+    // (値を含むバケットの上限値。ただし max は越えない)
+    uint64_t percentile(double percentile) const {
+      if(count_ == 0) {
+        return 0;
+      }
+
+      uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * count_ + 0.5);
+      if(rank < 1) rank = 1;
+      if(rank > count_) rank = count_;
+
+      uint64_t seen = 0;
+      for(uint32_t i=0; i < BUCKET_COUNT; i++) {
+        seen += counts_[i];
+        if(seen >= rank) {
+          const uint64_t upper = bucketUpperBound(i);
+          return upper < max_ ? upper : max_;
+        }
+      }
+      return max_;
+    }
+
+  private:
+    static uint32_t bucketIndex(uint64_t val) {
+      if(val < SUB_BUCKET_COUNT) {
+        return static_cast<uint32_t>(val);
+      }
+      const uint32_t msb = 63 - __builtin_clzll(val);        // SUB_BUCKET_BITS 以上
+      const uint32_t shift = msb - SUB_BUCKET_BITS;
+      const uint32_t sub = static_cast<uint32_t>(val >> shift) & (SUB_BUCKET_COUNT - 1);
+      return (shift + 1) * SUB_BUCKET_COUNT + sub;
+    }
+
+    static uint64_t bucketUpperBound(uint32_t index) {
+      if(index < SUB_BUCKET_COUNT) {
+        return index;
+      }
+      const uint32_t shift = index / SUB_BUCKET_COUNT - 1;
+      const uint64_t sub = index % SUB_BUCKET_COUNT;
+      const uint64_t lower = (SUB_BUCKET_COUNT + sub) << shift;
+      return lower + ((1ULL << shift) - 1);
+    }
+
+  private:
+    uint64_t counts_[BUCKET_COUNT];
+    uint64_t count_;
+    uint64_t total_;
+    uint64_t min_;
+    uint64_t max_;
+  };
+
+  // 件数と主要なパーセンタイル値を一行で出力する
+  inline std::ostream& operator<<(std::ostream& out, const Histogram& h) {
+    return out << "count=" << h.count() << ", "
+               << "avg=" << h.avg() << ", "
+               << "p50=" << h.percentile(50) << ", "
+               << "p90=" << h.percentile(90) << ", "
+               << "p99=" << h.percentile(99) << ", "
+               << "p99.9=" << h.percentile(99.9) << ", "
+               << "max=" << h.max();
+  }
+}
+
+#endif
@@ -1,30 +1,114 @@
 #ifndef IMQUE_NANO_TIMER_HH
 #define IMQUE_NANO_TIMER_HH
 
-#include <sys/time.h>
+#include <time.h>
+#include <inttypes.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 
 namespace imque {
+  // 単調増加時計の現在時刻をナノ秒単位で返す
+  // CLOCK_MONOTONIC_RAW は NTP による速度調整の影響を受けないので、短い区間の計測に向いている
+  inline long long monotonic_ns() {
+    timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return static_cast<long long>(ts.tv_sec)*1000*1000*1000 + ts.tv_nsec;
+  }
+
   // ナノ秒単位の時間計測用のタイマー
-  // ※ 現在は可搬性のために gettimeofday(μ秒単位の時刻取得関数) を使用している
   class NanoTimer {
   public:
-    NanoTimer() {
-      gettimeofday(&t, NULL);
+    NanoTimer() : t_(monotonic_ns()) {
     }
     
     long elapsed() const {
-      timeval now;
-      gettimeofday(&now, NULL);
-      return ns(now) - ns(t);
+      return static_cast<long>(monotonic_ns() - t_);
     }
     
   private:
-    long ns(const timeval& ts) const {
-      return static_cast<long>(static_cast<long long>(ts.tv_sec)*1000*1000*1000 + ts.tv_usec*1000);
+    long long t_;
+  };
+
+  // タイムスタンプカウンタ(rdtsc)を用いた時間計測用のタイマー
+  // 一回の計測が clock_gettime よりも軽量なので、キュー操作一回毎のレイテンシ計測に使用する。
+  //
+  // カウンタの周波数は calibrate() で clock_gettime と比較して求める。
+  // (fork 前に呼び出しておけば、子プロセスは較正結果を引き継ぐ。未較正の場合は最初の計測時に較正する)
+  // カウンタの周波数が CPU の周波数変更や省電力状態の影響を受けないこと(invariant TSC)を前提にしているので、
+  // CPUID 0x80000007 の EDX の bit 8 が立っていない CPU や、x86 以外の環境では NanoTimer と同じく clock_gettime を使用する。
+  class TscTimer {
+  public:
+    TscTimer() : t_(now()) {
     }
-    
+
+    long elapsed() const {
+      return static_cast<long>((now() - t_) * nsPerTick());
+    }
+
+    // カウンタ一つ当たりのナノ秒数を求める (約10ミリ秒かかる)
+    static double calibrate() {
+      if(useTsc()) {
+        const long long ns_start = monotonic_ns();
+        const uint64_t tick_start = now();
+
+        timespec wait = {0, 10*1000*1000};
+        nanosleep(&wait, NULL);
+
+        const long long ns_end = monotonic_ns();
+        const uint64_t tick_end = now();
+        nsPerTickRef() = tick_end > tick_start ? static_cast<double>(ns_end - ns_start) / (tick_end - tick_start) : 1.0;
+      } else {
+        nsPerTickRef() = 1.0;
+      }
+      return nsPerTickRef();
+    }
+
+    static double nsPerTick() {
+      if(nsPerTickRef() == 0.0) {
+        calibrate();
+      }
+      return nsPerTickRef();
+    }
+
+  private:
+    static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+      if(useTsc()) {
+        uint32_t lo, hi;
+        __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+        return (static_cast<uint64_t>(hi) << 32) | lo;
+      }
+#endif
+      return static_cast<uint64_t>(monotonic_ns());
+    }
+
+    // invariant TSC が使用できるかどうか
+    static bool useTsc() {
+      static const bool use_tsc = hasInvariantTsc();
+      return use_tsc;
+    }
+
+    static bool hasInvariantTsc() {
+#if defined(__x86_64__) || defined(__i386__)
+      unsigned eax, ebx, ecx, edx;
+      return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1U << 8));
+#else
+      return false;
+#endif
+    }
+
+    static double& nsPerTickRef() {
+      static double ns_per_tick = 0.0;
+      return ns_per_tick;
+    }
+
   private:
-    timeval t;
+    uint64_t t_;
   };
 }
 
@@ -0,0 +1,367 @@
+#define IMQUE_STATS
+#include <imque/ipc/shared_memory.hh>
+#include <imque/allocator/variable_allocator.hh>
+#include <imque/allocator/fixed_allocator.hh>
+#include <imque/atomic/atomic.hh>
+#include <imque/stats.hh>
+
+#include "../aux/nano_timer.hh"
+#include "../aux/histogram.hh"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+
+// アロケータのベンチマーク (VariableAllocator / FixedAllocator / malloc)
+//
+// 各プロセスは HOLD_COUNT 個のスロットを持ち、ランダムに選んだスロットが空なら割当を、埋まっていれば解放を行う。
+// (保持期間がばらばらになるので、長時間の運用と同様に断片化が進む)
+// 割当サイズは、指定の分布もしくは記録済みのサイズのトレースに従う。
+//
+// 実行中は REPORT_INTERVAL(ミリ秒) 毎に、スループット、割当失敗数とその内訳(空き不足/試行回数超過。malloc では常に 0)、
+// フリーリストの長さと最大の空き領域を出力し、終了時に割当/解放のレイテンシ分布を出力する。
+//
+// 割当サイズの分布 (SIZE_DIST):
+//  - uniform:MIN:MAX                     MIN から MAX までの一様分布
+//  - bimodal:SMALL:LARGE:LARGE_PERCENT   SMALL 付近と LARGE 付近(それぞれ ±25%)の二峰分布。LARGE 側の割合を百分率で指定する
+//  - pareto:MIN:ALPHA:MAX                MIN を下限とするパレート分布 (裾の重い分布。ALPHA が小さいほど大きなサイズが出やすい)。MAX で打ち切る
+//  - trace:FILE                          FILE に一行に一つ記録されたサイズを順に使用する (プロセス毎に開始位置をずらして循環する)
+
+namespace {
+  const int MAX_PROCESS_COUNT = 256;
+}
+
+struct Parameter {
+  std::string method; // "variable" | "fixed" | "malloc"
+  int process_count;
+  int op_count;
+  int hold_count;
+  std::string size_dist;
+  int shm_size;
+  int report_interval;
+};
+
+// 全プロセスで共有する計測用の領域
+struct Shared {
+  imque::Histogram allocate;
+  imque::Histogram release;
+
+  // 各要素は該当プロセスのみが書き込む
+  volatile uint64_t op_counts[MAX_PROCESS_COUNT];
+  volatile uint64_t alloc_counts[MAX_PROCESS_COUNT];
+  volatile uint64_t alloc_fail_counts[MAX_PROCESS_COUNT];
+  volatile uint64_t release_fail_counts[MAX_PROCESS_COUNT];
+
+  imque::stats::Stats stats;
+};
+
+class SizeGenerator {
+public:
+  SizeGenerator(const std::string& spec) : kind_(UNIFORM), trace_pos_(0) {
+    std::vector<std::string> fields;
+    std::istringstream in(spec);
+    std::string field;
+    while(std::getline(in, field, ':')) {
+      fields.push_back(field);
+    }
+
+    if(fields.size() == 3 && fields[0] == "uniform") {
+      kind_ = UNIFORM;
+      a_ = atof(fields[1].c_str());
+      b_ = atof(fields[2].c_str());
+    } else if(fields.size() == 4 && fields[0] == "bimodal") {
+      kind_ = BIMODAL;
+      a_ = atof(fields[1].c_str());
+      b_ = atof(fields[2].c_str());
+      c_ = atof(fields[3].c_str()) / 100.0;
+    } else if(fields.size() == 4 && fields[0] == "pareto") {
+      kind_ = PARETO;
+      a_ = atof(fields[1].c_str());
+      b_ = atof(fields[2].c_str());
+      c_ = atof(fields[3].c_str());
+    } else if(fields.size() == 2 && fields[0] == "trace") {
+      kind_ = TRACE;
+      std::ifstream trace(fields[1].c_str());
+      uint32_t size;
+      while(trace >> size) {
+        trace_.push_back(size);
+      }
+    } else {
+      kind_ = INVALID;
+    }
+  }
+
+  operator bool() const { return kind_ != INVALID && (kind_ != TRACE || trace_.empty() == false); }
+
+  // トレースの開始位置をプロセス毎にずらす
+  void seek(int process_index, int process_count) {
+    if(kind_ == TRACE) {
+      trace_pos_ = trace_.size() * process_index / process_count;
+    }
+  }
+
+  uint32_t next() {
+    double size = 1;
+    switch(kind_) {
+    case UNIFORM:
+      size = a_ + (b_ - a_ + 1) * uniform();
+      break;
+    case BIMODAL:
+      size = (uniform() < c_ ? b_ : a_) * (0.75 + 0.5 * uniform());
+      break;
+    case PARETO:
+      size = std::min(a_ / pow(1.0 - uniform(), 1.0 / b_), c_);
+      break;
+    case TRACE:
+      size = trace_[trace_pos_];
+      trace_pos_ = (trace_pos_ + 1) % trace_.size();
+      break;
+    case INVALID:
+      break;
+    }
+    return size < 1 ? 1 : static_cast<uint32_t>(size);
+  }
+
+private:
+  static double uniform() { return rand() / (RAND_MAX + 1.0); } // [0, 1)
+
+private:
+  enum KIND { UNIFORM, BIMODAL, PARETO, TRACE, INVALID };
+  KIND kind_;
+  double a_, b_, c_;
+  std::vector<uint32_t> trace_;
+  size_t trace_pos_;
+};
+
+class MallocAllocator {
+public:
+  void* allocate(uint32_t size) { return malloc(size); }
+  bool release(void* descriptor) { free(descriptor); return true; }
+
+  template<typename T>
+  T* ptr(void* descriptor) { return reinterpret_cast<T*>(descriptor); }
+};
+
+template<typename T> struct Descriptor {};
+template<> struct Descriptor<imque::allocator::VariableAllocator> { typedef uint32_t TYPE; };
+template<> struct Descriptor<imque::allocator::FixedAllocator>    { typedef uint32_t TYPE; };
+template<> struct Descriptor<MallocAllocator>                     { typedef void* TYPE; };
+
+// フリーリストの状態の出力 (malloc の場合は対象外)
+void print_free_list(imque::allocator::VariableAllocator& alc) {
+  imque::allocator::VariableAllocator::FreeListInfo info = alc.freeListInfo();
+  std::cout << "free_nodes=" << info.node_count << ", free_bytes=" << info.free_bytes << ", largest_free=" << info.largest_bytes;
+}
+
+void print_free_list(imque::allocator::FixedAllocator& alc) {
+  imque::allocator::VariableAllocator::FreeListInfo info = alc.freeListInfo();
+  std::cout << "free_nodes=" << info.node_count << ", free_bytes=" << info.free_bytes << ", largest_free=" << info.largest_bytes;
+}
+
+void print_free_list(MallocAllocator&) {
+  std::cout << "free_nodes=-, free_bytes=-, largest_free=-";
+}
+
+uint64_t sum(const volatile uint64_t* counts, int process_count) {
+  uint64_t total = 0;
+  for(int i=0; i < process_count; i++) {
+    total += imque::atomic::fetch(const_cast<volatile uint64_t*>(&counts[i]));
+  }
+  return total;
+}
+
+template<class Allocator>
+void child_start(Allocator& alc, const Parameter& param, SizeGenerator sizes, int index, Shared* shared) {
+  srand(time(NULL) + getpid());
+  sizes.seek(index, param.process_count);
+
+  typedef typename Descriptor<Allocator>::TYPE MD;
+  std::vector<MD> slots(param.hold_count, MD());
+  imque::Histogram alc_hist;
+  imque::Histogram rls_hist;
+  uint64_t alloc_count = 0;
+  uint64_t alloc_fail_count = 0;
+  uint64_t release_fail_count = 0;
+
+  for(int i=0; i < param.op_count; i++) {
+    const int slot = rand() % param.hold_count;
+    if(slots[slot] == MD()) {
+      const uint32_t size = sizes.next();
+
+      imque::TscTimer t;
+      MD md = alc.allocate(size);
+      alc_hist.add(t.elapsed());
+
+      alloc_count++;
+      if(md == MD()) {
+        alloc_fail_count++;
+      } else {
+        memset(alc.template ptr<void>(md), i, size);
+        slots[slot] = md;
+      }
+    } else {
+      imque::TscTimer t;
+      bool ok = alc.release(slots[slot]);
+      rls_hist.add(t.elapsed());
+
+      if(ok == false) {
+        release_fail_count++; // 領域はリークする
+      }
+      slots[slot] = MD();
+    }
+
+    if(i % 1024 == 1023 || i == param.op_count - 1) {
+      imque::atomic::store(&shared->op_counts[index], static_cast<uint64_t>(i + 1));
+      imque::atomic::store(&shared->alloc_counts[index], alloc_count);
+      imque::atomic::store(&shared->alloc_fail_counts[index], alloc_fail_count);
+      imque::atomic::store(&shared->release_fail_counts[index], release_fail_count);
+    }
+  }
+
+  alc_hist.mergeTo(shared->allocate);
+  rls_hist.mergeTo(shared->release);
+}
+
+template<class Allocator>
+void parent_start(Allocator& alc, const Parameter& param, const SizeGenerator& sizes, Shared* shared) {
+  std::vector<pid_t> children(param.process_count);
+
+  imque::NanoTimer timer;
+  for(int i=0; i < param.process_count; i++) {
+    children[i] = fork();
+    switch(children[i]) {
+    case 0:
+      child_start(alc, param, sizes, i, shared);
+      _exit(0);
+    case -1:
+      std::cerr << "ERROR: fork() failed: " << strerror(errno) << std::endl;
+      return;
+    }
+  }
+
+  // 子プロセスが終了するまで、定期的に進捗を出力する
+  uint64_t prev_ops = 0;
+  long prev_elapsed = 0;
+  long finish_elapsed = 0;
+  for(int finished = 0; finished < param.process_count;) {
+    // 終了時刻の誤差を抑えるため、子プロセスの終了は短い間隔で確認する
+    for(imque::NanoTimer interval; finished < param.process_count && interval.elapsed() < param.report_interval * 1000L * 1000L;) {
+      usleep(std::min(param.report_interval, 10) * 1000);
+      for(pid_t pid; (pid = waitpid(-1, NULL, WNOHANG)) > 0;) {
+        finished++;
+      }
+    }
+
+    const long elapsed = finish_elapsed = timer.elapsed();
+    const uint64_t ops = sum(shared->op_counts, param.process_count);
+    std::cout << "#[" << getpid() << "] PROGRESS: "
+              << "t=" << elapsed / 1000 / 1000 << "ms, "
+              << "ops=" << ops << ", "
+              << "ops/s=" << static_cast<uint64_t>((ops - prev_ops) / ((elapsed - prev_elapsed) / 1000.0 / 1000.0 / 1000.0)) << ", "
+              << "a_fail=" << sum(shared->alloc_fail_counts, param.process_count) << " "
+              << "(oom=" << shared->stats.sum(imque::stats::VAR_OUT_OF_MEMORY) << ", "
+              << "retry=" << shared->stats.sum(imque::stats::VAR_RETRY_EXHAUSTED) << "), "
+              << "r_fail=" << sum(shared->release_fail_counts, param.process_count) << ", ";
+    print_free_list(alc);
+    std::cout << std::endl;
+
+    prev_ops = ops;
+    prev_elapsed = elapsed;
+  }
+
+  const double elapsed_sec = finish_elapsed / 1000.0 / 1000.0 / 1000.0;
+  const uint64_t ops = sum(shared->op_counts, param.process_count);
+  const uint64_t alloc_count = sum(shared->alloc_counts, param.process_count);
+  const uint64_t alloc_fail_count = sum(shared->alloc_fail_counts, param.process_count);
+
+  std::cout << "#[" << getpid() << "] P FINISH: "
+            << "ops=" << ops << ", "
+            << "elapsed=" << elapsed_sec << "s, "
+            << "ops/s=" << static_cast<uint64_t>(ops / elapsed_sec) << ", "
+            << "a_fail=" << alloc_fail_count << ", "
+            << "a_fail_rate=" << (alloc_count ? 100.0 * alloc_fail_count / alloc_count : 0.0) << "%, "
+            << "a_fail_oom=" << shared->stats.sum(imque::stats::VAR_OUT_OF_MEMORY) << ", "
+            << "a_fail_retry=" << shared->stats.sum(imque::stats::VAR_RETRY_EXHAUSTED) << ", "
+            << "r_fail=" << sum(shared->release_fail_counts, param.process_count) << std::endl;
+  std::cout << "#[" << getpid() << "] P LATENCY(ns): allocate: " << shared->allocate << std::endl;
+  std::cout << "#[" << getpid() << "] P LATENCY(ns): release: " << shared->release << std::endl;
+}
+
+int main(int argc, char** argv) {
+  if(argc != 7 && argc != 8) {
+  usage:
+    std::cerr << "Usage: allocator-bench ALLOCATION_METHOD(variable|fixed|malloc) PROCESS_COUNT OP_COUNT HOLD_COUNT SIZE_DIST SHM_SIZE [REPORT_INTERVAL(ms)]" << std::endl
+              << "  SIZE_DIST: uniform:MIN:MAX | bimodal:SMALL:LARGE:LARGE_PERCENT | pareto:MIN:ALPHA:MAX | trace:FILE" << std::endl;
+    return 1;
+  }
+
+  Parameter param = {
+    argv[1],
+    atoi(argv[2]),
+    atoi(argv[3]),
+    atoi(argv[4]),
+    argv[5],
+    atoi(argv[6]),
+    argc == 8 ? atoi(argv[7]) : 1000
+  };
+  if(param.process_count < 1 || param.process_count > MAX_PROCESS_COUNT || param.hold_count < 1 || param.report_interval < 1) {
+    goto usage;
+  }
+
+  SizeGenerator sizes(param.size_dist);
+  if(! sizes) {
+    std::cerr << "[ERROR] invalid size distribution: " << param.size_dist << std::endl;
+    goto usage;
+  }
+
+  imque::ipc::SharedMemory shared_shm(sizeof(Shared));
+  imque::ipc::SharedMemory shm(param.shm_size);
+  if(! shared_shm || ! shm) {
+    std::cerr << "[ERROR] shared memory initialization failed" << std::endl;
+    return 1;
+  }
+  Shared* shared = shared_shm.ptr<Shared>();
+  shared->allocate.clear();
+  shared->release.clear();
+  shared->stats.clear();
+
+  imque::TscTimer::calibrate(); // 子プロセスが較正結果を引き継ぐよう fork 前に行う
+
+  if(param.method == "variable") {
+    imque::allocator::VariableAllocator alc(shm.ptr<void>(), shm.size());
+    if(! alc) {
+      std::cerr << "[ERROR] allocator initialization failed" << std::endl;
+      return 1;
+    }
+    alc.init();
+    alc.setStats(&shared->stats);
+    parent_start(alc, param, sizes, shared);
+  } else if (param.method == "fixed") {
+    imque::allocator::FixedAllocator alc(shm.ptr<void>(), shm.size());
+    if(! alc) {
+      std::cerr << "[ERROR] allocator initialization failed" << std::endl;
+      return 1;
+    }
+    alc.init();
+    alc.setStats(&shared->stats);
+    parent_start(alc, param, sizes, shared);
+  } else if (param.method == "malloc") {
+    MallocAllocator alc;
+    parent_start(alc, param, sizes, shared);
+  } else {
+    goto usage;
+  }
+
+  return 0;
+}
@@ -4,6 +4,7 @@
 
 #include "../aux/nano_timer.hh"
 #include "../aux/stat.hh"
+#include "../aux/histogram.hh"
 
 #include <iostream>
 #include <string>
@@ -40,13 +41,19 @@ public:
   T* ptr(void* descriptor) { return reinterpret_cast<T*>(descriptor); }
 };
 
+// 全プロセスのレイテンシ(ナノ秒)の集計先。共有メモリ上に置く。
+struct Latency {
+  imque::Histogram allocate;
+  imque::Histogram release;
+};
+
 template<typename T> struct Descriptor {};
 template<> struct Descriptor<imque::allocator::VariableAllocator> { typedef uint32_t TYPE; };
 template<> struct Descriptor<imque::allocator::FixedAllocator>    { typedef uint32_t TYPE; };
 template<> struct Descriptor<MallocAllocator>                     { typedef void* TYPE; };
 
 template<class Allocator>
-void child_start(Allocator& alc, const Parameter& param) {
+void child_start(Allocator& alc, const Parameter& param, Latency* latency) {
   srand(time(NULL) + getpid());
   int new_nice = nice(rand() % (param.max_nice+1));
   std::cout << "#[" << getpid() << "] C START: nice=" << new_nice << std::endl;
@@ -55,14 +62,22 @@ void child_start(Allocator& alc, const Parameter& param) {
   imque::Stat rls_ok_st;
   imque::Stat alc_ng_st;
   imque::Stat rls_ng_st;
+  imque::Histogram alc_ok_hist;
+  imque::Histogram rls_ok_hist;
   
   int size_range = param.alloc_size_max - param.alloc_size_min + 1;
   for(int i=0; i < param.loop_count; i++) {
     uint32_t size = static_cast<uint32_t>((rand() % size_range) + param.alloc_size_min);
 
-    imque::NanoTimer t1;
+    imque::TscTimer t1;
     typename Descriptor<Allocator>::TYPE md = alc.allocate(size);
-    md != 0 ? alc_ok_st.add(t1.elapsed()) : alc_ng_st.add(t1.elapsed());
+    if(md != 0) {
+      long elapsed = t1.elapsed();
+      alc_ok_st.add(elapsed);
+      alc_ok_hist.add(elapsed);
+    } else {
+      alc_ng_st.add(t1.elapsed());
+    }
     
     if(param.max_hold_micro_sec)
       usleep(rand() % param.max_hold_micro_sec);
@@ -71,9 +86,15 @@ void child_start(Allocator& alc, const Parameter& param) {
       memset(alc.template ptr<void>(md), rand()%0x100, size);
       
       
-      imque::NanoTimer t2;
+      imque::TscTimer t2;
       bool ok = alc.release(md); 
-      ok ? rls_ok_st.add(t2.elapsed()) : rls_ng_st.add(t2.elapsed());
+      if(ok) {
+        long elapsed = t2.elapsed();
+        rls_ok_st.add(elapsed);
+        rls_ok_hist.add(elapsed);
+      } else {
+        rls_ng_st.add(t2.elapsed());
+      }
     }
   }
 
@@ -85,17 +106,19 @@ void child_start(Allocator& alc, const Parameter& param) {
             << "r_ok_avg=" << rls_ok_st.avg() << ", "
             << "r_ng_avg=" << rls_ng_st.avg() 
             << std::endl;
+  alc_ok_hist.mergeTo(latency->allocate);
+  rls_ok_hist.mergeTo(latency->release);
 }
 
 template<class Allocator>
-void parent_start(Allocator& alc, const Parameter& param) {
+void parent_start(Allocator& alc, const Parameter& param, Latency* latency) {
   std::vector<pid_t> children(param.process_count);
   
   for(int i=0; i < param.process_count; i++) {
     children[i] = fork();
     switch(children[i]) {
     case 0:
-      child_start(alc, param);
+      child_start(alc, param, latency);
       return;
     case -1:
       std::cerr << "ERROR: fork() failed: " << strerror(errno) << std::endl;
@@ -134,6 +157,10 @@ void parent_start(Allocator& alc, const Parameter& param) {
             << "killed=" << sigkill_num << ", "
             << "abort=" << signal_num << ", "
             << "unknown=" << unknown_num << std::endl;
+
+  // SIGKILL されたプロセスの分は含まれない
+  std::cout << "#[" << getpid() << "] P LATENCY(ns): allocate: " << latency->allocate << std::endl;
+  std::cout << "#[" << getpid() << "] P LATENCY(ns): release: " << latency->release << std::endl;
 }
 
 
@@ -162,6 +189,17 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  imque::ipc::SharedMemory latency_shm(sizeof(Latency));
+  if(! latency_shm) {
+    std::cerr << "[ERROR] shared memory initialization failed" << std::endl;
+    return 1;
+  }
+  Latency* latency = latency_shm.ptr<Latency>();
+  latency->allocate.clear();
+  latency->release.clear();
+
+  imque::TscTimer::calibrate(); // 子プロセスが較正結果を引き継ぐよう fork 前に行う
+
   if(param.method == "variable") {
     imque::allocator::VariableAllocator alc(shm.ptr<void>(), shm.size());
     if(! alc) {
@@ -169,7 +207,7 @@ int main(int argc, char** argv) {
       return 1;
     }
     alc.init();
-    parent_start(alc, param);
+    parent_start(alc, param, latency);
   } else if (param.method == "fixed") {
     imque::allocator::FixedAllocator alc(shm.ptr<void>(), shm.size());
     if(! alc) {
@@ -177,10 +215,10 @@ int main(int argc, char** argv) {
       return 1;
     }
     alc.init();
-    parent_start(alc, param);
+    parent_start(alc, param, latency);
   } else if (param.method == "malloc") {
     MallocAllocator alc;
-    parent_start(alc, param);
+    parent_start(alc, param, latency);
   } else {
     goto usage;
   }
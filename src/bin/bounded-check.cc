@@ -0,0 +1,226 @@
+/**
+ * BoundedQueue のチェック
+ *  - transfer: 複数の書き込み/読み込みプロセス間で要素をやり取りして、欠損や重複、同じ書き込みプロセスの要素の順序の入れ替わりがないか
+ *  - killed writer: スロットを確保して書き込み中のプロセスが SIGKILL された場合に、そのスロットが解放されてキューが停止しないか
+ *                   (要素のコピー元を読み込み不可のページにして、書き込み途中で SIGSEGV のハンドラ内に止まった子プロセスを SIGKILL する)
+ *  - large slot: 2GiB のスロット二つ(合計で 4GiB を越える領域)のキューが、サイズを切り詰められずに使用できるか
+ */
+#include <imque/bounded_queue.hh>
+#include <imque/ipc/shared_memory.hh>
+#include <imque/atomic/atomic.hh>
+#include "../aux/check.hh"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+using imque::check::make_message;
+using imque::check::deq_retry;
+
+struct Param {
+  int process_count;
+  int messages_per_process;
+  int slot_count;
+};
+
+// 全プロセスで共有する検査結果 (共有メモリ上に置く)
+struct Shared {
+  int error_count; // 内容の不正な要素や、順序の入れ替わり、タイムアウトした取り出しの数
+  int marks[0];    // 要素毎の受信回数
+};
+
+namespace {
+  const uint32_t SLOT_DATA_SIZE = 128;
+}
+
+void writer(imque::BoundedQueue& que, int id, const Param& param) {
+  std::string msg;
+  for(int i=0; i < param.messages_per_process; i++) {
+    make_message(id*param.messages_per_process + i, msg);
+    while(que.enq(msg.data(), msg.size()) == false) {
+      sched_yield();
+    }
+  }
+}
+
+// 受信した要素の内容と、書き込みプロセス毎の順序を検査し、受信回数を記録する
+void reader(imque::BoundedQueue& que, Shared* shared, const Param& param) {
+  std::vector<int> last(param.process_count, -1); // 書き込みプロセス毎の、最後に受信した要素の番号
+  std::string buf;
+  for(int i=0; i < param.messages_per_process; i++) {
+    if(deq_retry(que, buf) == false) {
+      imque::atomic::add(&shared->error_count, 1);
+      return;
+    }
+
+    const int index = imque::check::parse_message(buf.data(), buf.size());
+    if(index < 0 || index >= param.process_count*param.messages_per_process ||
+       index <= last[index / param.messages_per_process]) {
+      imque::atomic::add(&shared->error_count, 1);
+      continue;
+    }
+    last[index / param.messages_per_process] = index;
+    imque::atomic::add(&shared->marks[index], 1);
+  }
+}
+
+// 書き込みと読み込みのプロセスを process_count 個ずつ起動して、結果を検査する。
+// 子プロセスの場合は is_child に true を設定して返る。
+bool transfer_check(imque::BoundedQueue& que, Shared* shared, const Param& param, bool& is_child) {
+  std::vector<pid_t> children;
+  const int child = imque::check::fork_children(param.process_count*2, children);
+  if(child != -1) {
+    is_child = true;
+    if(child < param.process_count) {
+      reader(que, shared, param);
+    } else {
+      writer(que, child - param.process_count, param);
+    }
+    return true;
+  }
+  if(static_cast<int>(children.size()) != param.process_count*2) {
+    return false;
+  }
+
+  const int abnormal_exit_num = imque::check::wait_children(children);
+  int missing_count;
+  int duplicate_count;
+  const int ok_count = imque::check::count_marks(shared->marks, param.process_count*param.messages_per_process, missing_count, duplicate_count);
+
+  const bool ok = (missing_count == 0 && duplicate_count == 0 && shared->error_count == 0 &&
+                   abnormal_exit_num == 0 && que.isEmpty());
+  std::cout << "#[" << getpid() << "] FINISH: transfer: "
+            << "ok=" << ok_count << ", "
+            << "miss=" << missing_count << ", "
+            << "dup=" << duplicate_count << ", "
+            << "error=" << shared->error_count << " | "
+            << "abnormal_exit=" << abnormal_exit_num << " | "
+            << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+// 前後に要素がある状態で、書き込み中の子プロセスを SIGKILL し、
+//  - 子プロセスの前後の要素が欠けずに順に取り出せること (子プロセスの要素は破棄される)
+//  - その後も、スロット配列を何周かする追加/取り出しができること
+// を検査する
+bool killed_writer_check(imque::BoundedQueue& que, const Param& param) {
+  const int before = param.slot_count / 4;
+  const int after = param.slot_count / 4;
+  std::string msg;
+  for(int i=0; i < before; i++) {
+    make_message(i, msg);
+    que.enq(msg.data(), msg.size());
+  }
+
+  const bool stopped = imque::check::kill_in_enq(que, 16); // スロットの確保後、要素のコピー時に止まる
+
+  for(int i=0; i < after; i++) {
+    make_message(before + i, msg);
+    que.enq(msg.data(), msg.size());
+  }
+
+  int in_order = 0;
+  std::string buf;
+  std::string expected;
+  for(int i=0; i < before + after; i++) {
+    make_message(i, expected);
+    if(deq_retry(que, buf) == false || buf != expected) {
+      break;
+    }
+    in_order++;
+  }
+  const bool empty_after_kill = que.isEmpty();
+
+  // 満杯まで追加して全て取り出すことを繰り返す
+  int cycled = 0;
+  for(int round=0; round < 3; round++) {
+    for(int i=0; i < param.slot_count; i++) {
+      make_message(i, msg);
+      if(que.enq(msg.data(), msg.size()) == false) {
+        break;
+      }
+    }
+    for(int i=0; i < param.slot_count; i++) {
+      make_message(i, expected);
+      if(que.deq(buf) == false || buf != expected) {
+        break;
+      }
+      cycled++;
+    }
+  }
+
+  const bool ok = (stopped && in_order == before + after && empty_after_kill &&
+                   cycled == param.slot_count * 3 && que.isEmpty());
+  std::cout << "#[" << getpid() << "] FINISH: killed writer: "
+            << "stopped=" << stopped << ", in_order=" << in_order << "/" << (before + after)
+            << ", cycled=" << cycled << "/" << (param.slot_count * 3) << " | " << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+// 2GiB のスロット二つのキュー(領域全体は 4GiB を越える)で、領域サイズを 32bit に切り詰めると収まらない要素を追加/取り出しできるかを検査する。
+// (領域は実際に書き込んだページ分しかメモリを消費しない。領域の確保自体に失敗した場合は検査を省略する)
+bool large_slot_check() {
+  const uint32_t slot_data_size = 0x80000000;
+  if(imque::queue::BoundedQueueImpl::calcShmSize(2, slot_data_size) <= 0xFFFFFFFF) {
+    return true; // 32bit 環境
+  }
+
+  const size_t shm_size = imque::queue::BoundedQueueImpl::calcShmSize(2, slot_data_size);
+  if(! imque::ipc::SharedMemory(shm_size)) {
+    std::cout << "#[" << getpid() << "] FINISH: large slot: skipped (" << shm_size << " bytes shm unavailable)" << std::endl;
+    return true;
+  }
+
+  imque::BoundedQueue que(2, slot_data_size);
+
+  std::string msg(2 * 1024 * 1024, 'L');
+  std::string buf;
+  const bool enq_rlt = que.enq(msg.data(), msg.size()) && que.enq(msg.data(), msg.size());
+  const bool deq_rlt = que.deq(buf) && buf == msg && que.deq(buf) && buf == msg;
+
+  const bool ok = que && enq_rlt && deq_rlt && que.isEmpty();
+  std::cout << "#[" << getpid() << "] FINISH: large slot: "
+            << "initialized=" << static_cast<bool>(que) << ", enq=" << enq_rlt << ", deq=" << deq_rlt << " | " << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  if(argc != 4) {
+    std::cerr << "Usage: bounded-check PROCESS_COUNT MESSAGES_PER_PROCESS SLOT_COUNT(power of two)" << std::endl;
+    return 1;
+  }
+
+  Param param = {
+    atoi(argv[1]),
+    atoi(argv[2]),
+    atoi(argv[3])
+  };
+
+  imque::BoundedQueue que(param.slot_count, SLOT_DATA_SIZE);
+  if(! que || param.slot_count < 4 || (param.slot_count & (param.slot_count-1)) != 0) {
+    std::cerr << "[ERROR] queue initialization failed" << std::endl;
+    return 1;
+  }
+
+  const int total = param.process_count * param.messages_per_process;
+  imque::ipc::SharedMemory shm(sizeof(Shared) + sizeof(int) * total);
+  if(! shm) {
+    std::cerr << "[ERROR] shm initialization failed" << std::endl;
+    return 1;
+  }
+  memset(shm.ptr<void>(), 0, shm.size());
+
+  bool is_child = false;
+  bool ok = transfer_check(que, shm.ptr<Shared>(), param, is_child);
+  if(is_child) {
+    return 0;
+  }
+
+  que.init();
+  ok = killed_writer_check(que, param) && ok;
+  ok = large_slot_check() && ok;
+  return ok ? 0 : 1;
+}
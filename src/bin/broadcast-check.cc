@@ -0,0 +1,299 @@
+/**
+ * BroadcastQueue のチェック
+ *  - delivery:       複数の購読プロセスが、追加された全ての要素を追加順に受け取るか。
+ *                    (要素の総数は共有メモリ領域に収まる数より十分多いので、全てのカーソルが通過したノードが解放されないと追加が止まる)
+ *  - cut off:        cutOffSlowSubscribers で、末尾との差が閾値を越える購読者のみが切り離され、resubscribe で復帰できるか。
+ *                    また、cut_off_lag を指定したキューで、空きがなくなった時点で遅い購読者が自動的に切り離されるか
+ *  - dead subscriber: SIGKILL された購読者のスロットが、他のプロセスの subscribe で再利用されるか
+ * いずれも、購読者のカーソルが保持しているノードの数(nodeCount)を検査して、全てのカーソルが通過したノードが解放されている(漏れていない)ことを確認する
+ */
+#include <imque/broadcast_queue.hh>
+#include <imque/ipc/shared_memory.hh>
+#include <imque/atomic/atomic.hh>
+#include "../aux/check.hh"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+
+using imque::check::make_message;
+using imque::check::now_ms;
+using imque::check::TIMEOUT_MS;
+
+struct Param {
+  int subscriber_count;
+  int message_count;
+  int shm_size;
+};
+
+// 全プロセスで共有する状態 (共有メモリ上に置く)
+struct Shared {
+  int subscribed_count; // 購読を開始したプロセスの数
+};
+
+namespace {
+  // 購読者の末尾との差の閾値
+  const int LAG = 100;
+}
+
+// 要素が取り出せるまで deq を繰り返す (TIMEOUT_MS を越えたら false を返す)
+bool deq_retry(imque::BroadcastQueue& que, int id, std::string& buf) {
+  const long limit = now_ms() + TIMEOUT_MS;
+  while(que.deq(id, buf) == false) {
+    if(now_ms() > limit) {
+      return false;
+    }
+    sched_yield();
+  }
+  return true;
+}
+
+// 購読を開始してから、全ての要素を追加順に受け取れるかを検査する。全て正しければ 0 を返す
+int subscriber(imque::BroadcastQueue& que, Shared* shared, const Param& param) {
+  const int id = que.subscribe();
+  imque::atomic::add(&shared->subscribed_count, 1);
+  if(id == -1) {
+    return 1;
+  }
+
+  std::string buf;
+  std::string expected;
+  for(int i=0; i < param.message_count; i++) {
+    make_message(i, expected);
+    if(deq_retry(que, id, buf) == false || buf != expected) {
+      return 1;
+    }
+  }
+  que.unsubscribe(id);
+  return 0;
+}
+
+// 子プロセスの場合は is_child に true を設定して返る。
+bool delivery_check(imque::BroadcastQueue& que, Shared* shared, const Param& param, bool& is_child) {
+  std::vector<pid_t> children;
+  if(imque::check::fork_children(param.subscriber_count, children) != -1) {
+    is_child = true;
+    return subscriber(que, shared, param) == 0;
+  }
+  if(static_cast<int>(children.size()) != param.subscriber_count) {
+    return false;
+  }
+
+  // 全ての購読者が購読を開始してから追加する。空きがない場合は、購読者が取り出して解放されるのを待つ
+  while(imque::atomic::fetch(&shared->subscribed_count) < param.subscriber_count) {
+    sched_yield();
+  }
+  int sent = 0;
+  std::string msg;
+  for(; sent < param.message_count; sent++) {
+    make_message(sent, msg);
+    const long limit = now_ms() + TIMEOUT_MS;
+    while(que.enq(msg.data(), msg.size()) == false && now_ms() <= limit) {
+      sched_yield();
+    }
+    if(now_ms() > limit) {
+      break;
+    }
+  }
+
+  const int abnormal_exit_num = imque::check::wait_children(children);
+
+  // 全ての購読者が購読を終了したので、tail が指すノードのみが残る
+  const size_t node_count = que.nodeCount();
+  const bool ok = sent == param.message_count && abnormal_exit_num == 0 && node_count == 1;
+  std::cout << "#[" << getpid() << "] FINISH: delivery: "
+            << "sent=" << sent << "/" << param.message_count << ", "
+            << "nodes=" << node_count << " | "
+            << "abnormal_exit=" << abnormal_exit_num << " | "
+            << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+bool cut_off_check(imque::BroadcastQueue& que) {
+  const size_t cut_off_count = que.cutOffCount();
+  const int slow = que.subscribe();
+  const int fast = que.subscribe();
+  std::string msg;
+  std::string buf;
+  int fast_received = 0;
+  for(int i=0; i < LAG; i++) {
+    make_message(i, msg);
+    que.enq(msg.data(), msg.size());
+    if(que.deq(fast, buf) && buf == msg) {
+      fast_received++;
+    }
+  }
+
+  // slow のカーソルが、購読開始時のノード以降の全てのノードを保持している
+  const size_t lagged_nodes = que.nodeCount();
+  const bool lagged = (que.lag(slow) == static_cast<uint64_t>(LAG) && que.lag(fast) == 0 &&
+                       lagged_nodes == static_cast<size_t>(LAG + 1));
+
+  // 末尾との差が LAG の slow のみが切り離され、slow が保持していたノードが(連鎖的に)解放される
+  const uint32_t cut = que.cutOffSlowSubscribers(LAG - 1);
+  const size_t cut_nodes = que.nodeCount();
+  const bool cut_ok = (cut == 1 && que.isCutOff(slow) && que.isCutOff(fast) == false &&
+                       que.deq(slow, buf) == false && que.cutOffCount() == cut_off_count + 1 && cut_nodes == 1);
+
+  // 切り離された購読者は、復帰後に追加された要素から受け取る
+  que.resubscribe(slow);
+  que.enq("after", 5);
+  std::string slow_buf;
+  const bool resubscribed = (que.isCutOff(slow) == false && que.deq(slow, slow_buf) && slow_buf == "after" &&
+                             que.deq(fast, buf) && buf == "after" && que.deq(slow, buf) == false);
+  que.unsubscribe(slow);
+  que.unsubscribe(fast);
+
+  const bool ok = fast_received == LAG && lagged && cut_ok && resubscribed && que.nodeCount() == 1;
+  std::cout << "#[" << getpid() << "] FINISH: cut off: "
+            << "nodes=" << lagged_nodes << "->" << cut_nodes << ", cut=" << cut << ", resubscribed=" << resubscribed
+            << " | " << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+// cut_off_lag を指定したキューでは、一度も取り出さない購読者がいても、空きがなくなった時点で切り離されて追加が続けられる
+bool auto_cut_off_check(const Param& param) {
+  imque::BroadcastQueue que(param.shm_size, LAG);
+  if(! que) {
+    std::cerr << "[ERROR] queue initialization failed" << std::endl;
+    return false;
+  }
+
+  const int slow = que.subscribe();
+  const int fast = que.subscribe();
+  std::string msg;
+  std::string buf;
+  int sent = 0;
+  int fast_received = 0;
+  for(; sent < param.message_count; sent++) {
+    make_message(sent, msg);
+    if(que.enq(msg.data(), msg.size()) == false) {
+      break;
+    }
+    if(que.deq(fast, buf) && buf == msg) {
+      fast_received++;
+    }
+  }
+
+  const bool ok = (sent == param.message_count && fast_received == sent && que.isCutOff(slow) &&
+                   que.isCutOff(fast) == false && que.cutOffCount() == 1 && que.nodeCount() == 1);
+  std::cout << "#[" << getpid() << "] FINISH: auto cut off: "
+            << "sent=" << sent << "/" << param.message_count << ", fast_received=" << fast_received << ", "
+            << "slow_cut_off=" << que.isCutOff(slow) << ", cut_off_count=" << que.cutOffCount()
+            << " | " << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+// 購読を開始してカーソルがノードを保持した状態の子プロセスを SIGKILL し、
+//  - 全てのスロット(子プロセスのスロットを含む)を subscribe で確保でき、それ以上は確保できないこと
+//  - 子プロセスのカーソルが保持していたノードが解放されること
+// を検査する
+bool dead_subscriber_check(imque::BroadcastQueue& que) {
+  int fds[2];
+  if(pipe(fds) == -1) {
+    std::cerr << "ERROR: pipe() failed: " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  pid_t child = fork();
+  switch(child) {
+  case -1:
+    std::cerr << "ERROR: fork() failed: " << strerror(errno) << std::endl;
+    return false;
+  case 0: {
+    const int id = que.subscribe();
+    if(write(fds[1], &id, sizeof(id)) != sizeof(id)) {
+      _exit(1);
+    }
+    for(;;) {
+      pause();
+    }
+  }
+  }
+
+  int dead_id = -1;
+  const bool subscribed = read(fds[0], &dead_id, sizeof(dead_id)) == sizeof(dead_id) && dead_id != -1;
+  close(fds[0]);
+  close(fds[1]);
+
+  // 子プロセスのカーソルの後ろにノードを溜めた状態で SIGKILL する
+  std::string msg;
+  for(int i=0; i < LAG; i++) {
+    make_message(i, msg);
+    que.enq(msg.data(), msg.size());
+  }
+  kill(child, SIGKILL);
+  int status;
+  waitpid(child, &status, 0);
+  const size_t dead_nodes = que.nodeCount();
+
+  std::vector<int> ids;
+  bool reused = false;
+  for(uint32_t i=0; i < imque::BroadcastQueue::MAX_SUBSCRIBER_COUNT; i++) {
+    const int id = que.subscribe();
+    if(id == -1) {
+      break;
+    }
+    reused = reused || id == dead_id;
+    ids.push_back(id);
+  }
+  const bool full = que.subscribe() == -1;
+  for(std::size_t i=0; i < ids.size(); i++) {
+    que.unsubscribe(ids[i]);
+  }
+
+  // 子プロセスのカーソルが保持していたノードは、スロットの再利用時に解放される
+  const size_t reused_nodes = que.nodeCount();
+  const bool ok = (subscribed && dead_nodes == static_cast<size_t>(LAG + 1) && reused &&
+                   ids.size() == imque::BroadcastQueue::MAX_SUBSCRIBER_COUNT && full && reused_nodes == 1);
+  std::cout << "#[" << getpid() << "] FINISH: dead subscriber: "
+            << "subscribed=" << subscribed << ", reused=" << reused << ", "
+            << "slots=" << ids.size() << "/" << imque::BroadcastQueue::MAX_SUBSCRIBER_COUNT << ", full=" << full << ", "
+            << "nodes=" << dead_nodes << "->" << reused_nodes
+            << " | " << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  if(argc != 4) {
+    std::cerr << "Usage: broadcast-check SUBSCRIBER_COUNT MESSAGE_COUNT SHM_SIZE" << std::endl;
+    return 1;
+  }
+
+  Param param = {
+    atoi(argv[1]),
+    atoi(argv[2]),
+    atoi(argv[3])
+  };
+
+  imque::BroadcastQueue que(param.shm_size);
+  if(! que) {
+    std::cerr << "[ERROR] queue initialization failed" << std::endl;
+    return 1;
+  }
+
+  imque::ipc::SharedMemory shm(sizeof(Shared));
+  if(! shm) {
+    std::cerr << "[ERROR] shm initialization failed" << std::endl;
+    return 1;
+  }
+  memset(shm.ptr<void>(), 0, shm.size());
+
+  bool is_child = false;
+  bool ok = delivery_check(que, shm.ptr<Shared>(), param, is_child);
+  if(is_child) {
+    return ok ? 0 : 1;
+  }
+
+  ok = cut_off_check(que) && ok;
+  ok = auto_cut_off_check(param) && ok;
+  ok = dead_subscriber_check(que) && ok;
+  return ok ? 0 : 1;
+}
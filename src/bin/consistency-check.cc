@@ -16,6 +16,13 @@
 #include <errno.h>
 #include <sys/wait.h>
 
+// IMQUE_TEST_WIDE を定義してビルドした場合は WideQueue を検査する (make wide-test)
+#ifdef IMQUE_TEST_WIDE
+typedef imque::WideQueue TestQueue;
+#else
+typedef imque::Queue TestQueue;
+#endif
+
 struct Param {
   int process_count;
   int messages_per_process;
@@ -23,7 +30,7 @@ struct Param {
   int shm_size;
 };
 
-void reader_start(imque::Queue& que, imque::ipc::SharedMemory& recv_marks, const Param& param) {
+void reader_start(TestQueue& que, imque::ipc::SharedMemory& recv_marks, const Param& param) {
   srand(time(NULL) + getpid());
  
   std::string buf;
@@ -40,7 +47,7 @@ void reader_start(imque::Queue& que, imque::ipc::SharedMemory& recv_marks, const
   }
 }
 
-void writer_start(int id, imque::Queue& que, const Param& param) {
+void writer_start(int id, TestQueue& que, const Param& param) {
   srand(time(NULL) + getpid());
 
   std::ostringstream out;
@@ -54,7 +61,7 @@ void writer_start(int id, imque::Queue& que, const Param& param) {
   }
 }
 
-void parent_start(imque::Queue& que, imque::ipc::SharedMemory& recv_marks, const Param& param) {
+void parent_start(TestQueue& que, imque::ipc::SharedMemory& recv_marks, const Param& param) {
   std::vector<pid_t> children(param.process_count*2); // XXX: 実際は process_count の二倍のプロセスを生成している
 
   // reader
@@ -135,7 +142,7 @@ int main(int argc, char** argv) {
     atoi(argv[4])
   };
 
-  imque::Queue que(param.shm_size);
+  TestQueue que(param.shm_size);
   if(! que) {
     std::cerr << "[ERROR] queue initialization failed" << std::endl;
     return 1;
@@ -0,0 +1,218 @@
+/**
+ * 名前付きでない(memfd)、および shm_open で作成したキューを、fork 後に作成して子プロセスと共有できるかのチェック
+ *  - memfd-socketpair: socketpair で作成したソケットを通して、キューの memfd を SCM_RIGHTS で子プロセスに渡す
+ *  - memfd-listen:     fd_passing::listen/accept/connect で接続した Unix domain socket を通して、同様に渡す
+ *  - shm-open:         子プロセスは ShmName で同じ領域を開く。また、SharedMemory::unlink 後も、マッピング済みのキューが使用できるかを検査する
+ * いずれも、親プロセスが追加した要素を子プロセスが全て取り出して内容を検査し、その返信を親プロセスが取り出して検査する。
+ * (子プロセスはキューの作成前に fork するので、fd や名前を通してのみキューにアクセスできる)
+ */
+#include <imque/queue.hh>
+#include <imque/ipc/fd_passing.hh>
+#include "../aux/check.hh"
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+
+struct Param {
+  int message_count;
+  int shm_size;
+};
+
+using imque::check::TIMEOUT_MS;
+
+void make_message(const char* prefix, int index, std::string& msg) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%s:%d:", prefix, index);
+  msg = buf;
+  msg.append(index % 100, 'x');
+}
+
+// 子プロセス側: "ping" を全て取り出して検査してから、"pong" を追加する。全て正しければ true を返す
+bool child_echo(imque::Queue& que, const Param& param) {
+  if(! que) {
+    return false;
+  }
+  std::string buf;
+  std::string expected;
+  for(int i=0; i < param.message_count; i++) {
+    make_message("ping", i, expected);
+    if(que.deqWait(buf, TIMEOUT_MS) == false || buf != expected) {
+      return false;
+    }
+  }
+  for(int i=0; i < param.message_count; i++) {
+    make_message("pong", i, buf);
+    if(que.enq(buf.data(), buf.size()) == false) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// 親プロセス側: "ping" を追加し、子プロセスの終了を待ってから "pong" を全て取り出して検査する。
+bool parent_round_trip(const char* name, imque::Queue& que, pid_t child, bool passed, const Param& param) {
+  std::string buf;
+  int sent = 0;
+  for(; que && sent < param.message_count; sent++) {
+    make_message("ping", sent, buf);
+    if(que.enq(buf.data(), buf.size()) == false) {
+      break;
+    }
+  }
+
+  int status;
+  waitpid(child, &status, 0);
+  const bool child_ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+  int received = 0;
+  std::string expected;
+  for(; que && received < param.message_count; received++) {
+    make_message("pong", received, expected);
+    if(que.deq(buf) == false || buf != expected) {
+      break;
+    }
+  }
+
+  const bool ok = (passed && child_ok && sent == param.message_count && received == param.message_count && que.isEmpty());
+  std::cout << "#[" << getpid() << "] FINISH: " << name << ": "
+            << "passed=" << passed << ", child=" << child_ok << ", sent=" << sent << ", received=" << received
+            << " | " << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+// 子プロセスは sock から受け取った fd でキューを開く
+int child_recv_queue(int sock, const Param& param) {
+  const int fd = imque::ipc::fd_passing::recv(sock);
+  close(sock);
+  if(fd == -1) {
+    return 1;
+  }
+  imque::Queue que((imque::ipc::Fd(fd)));
+  return child_echo(que, param) ? 0 : 1;
+}
+
+bool memfd_socketpair_check(const Param& param) {
+  int socks[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, socks) != 0) {
+    std::cerr << "ERROR: socketpair() failed: " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  pid_t child = fork();
+  switch(child) {
+  case -1:
+    std::cerr << "ERROR: fork() failed: " << strerror(errno) << std::endl;
+    return false;
+  case 0:
+    close(socks[0]);
+    _exit(child_recv_queue(socks[1], param));
+  }
+  close(socks[1]);
+
+  imque::Queue que(param.shm_size, imque::ipc::Memfd("imque-fd-passing-check"));
+  const bool passed = que && que.fd() != -1 && imque::ipc::fd_passing::send(socks[0], que.fd());
+  close(socks[0]); // 送信に失敗した場合は、子プロセスの recv が失敗して終了する
+  return parent_round_trip("memfd-socketpair", que, child, passed, param);
+}
+
+bool memfd_listen_check(const Param& param) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/imque-fd-passing-check.%d.sock", static_cast<int>(getpid()));
+  const int listen_sock = imque::ipc::fd_passing::listen(path);
+  if(listen_sock == -1) {
+    std::cerr << "ERROR: fd_passing::listen() failed: " << path << std::endl;
+    return false;
+  }
+
+  pid_t child = fork();
+  switch(child) {
+  case -1:
+    std::cerr << "ERROR: fork() failed: " << strerror(errno) << std::endl;
+    return false;
+  case 0: {
+    close(listen_sock);
+    const int sock = imque::ipc::fd_passing::connect(path);
+    _exit(sock == -1 ? 1 : child_recv_queue(sock, param));
+  }
+  }
+
+  imque::Queue que(param.shm_size, imque::ipc::Memfd("imque-fd-passing-check"));
+  const int sock = imque::ipc::fd_passing::accept(listen_sock);
+  const bool passed = que && sock != -1 && imque::ipc::fd_passing::send(sock, que.fd());
+  if(sock != -1) {
+    close(sock);
+  }
+  close(listen_sock);
+  unlink(path);
+  return parent_round_trip("memfd-listen", que, child, passed, param);
+}
+
+bool shm_open_check(const Param& param) {
+  char name[64];
+  snprintf(name, sizeof(name), "/imque-fd-passing-check.%d", static_cast<int>(getpid()));
+  const imque::ipc::ShmName shm_name(name);
+
+  int ready[2];
+  if(pipe(ready) != 0) {
+    std::cerr << "ERROR: pipe() failed: " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  pid_t child = fork();
+  switch(child) {
+  case -1:
+    std::cerr << "ERROR: fork() failed: " << strerror(errno) << std::endl;
+    return false;
+  case 0: {
+    close(ready[1]);
+    char c;
+    if(read(ready[0], &c, 1) != 1) { // 親プロセスがキューを作成するまで待つ
+      _exit(1);
+    }
+    imque::Queue que(param.shm_size, shm_name);
+    _exit(child_echo(que, param) ? 0 : 1);
+  }
+  }
+  close(ready[0]);
+
+  imque::Queue que(param.shm_size, shm_name);
+  char c = 'r';
+  const bool created = que && write(ready[1], &c, 1) == 1;
+  close(ready[1]);
+  bool ok = parent_round_trip("shm-open", que, child, created, param);
+
+  // unlink 後も、マッピング済みのキューはそのまま使用できる。(二回目の unlink は失敗する)
+  const bool unlinked = imque::ipc::SharedMemory::unlink(shm_name);
+  const bool unlinked_again = imque::ipc::SharedMemory::unlink(shm_name);
+  std::string buf;
+  const bool usable = que.enq("after-unlink", 12) && que.deq(buf) && buf == "after-unlink";
+  const bool unlink_ok = unlinked && unlinked_again == false && usable;
+  std::cout << "#[" << getpid() << "] FINISH: shm-open unlink: "
+            << "unlink=" << unlinked << ", unlink_again=" << unlinked_again << ", usable=" << usable
+            << " | " << (unlink_ok ? "ok" : "NG") << std::endl;
+  return ok && unlink_ok;
+}
+
+int main(int argc, char** argv) {
+  if(argc != 3) {
+    std::cerr << "Usage: fd-passing-check MESSAGE_COUNT SHM_SIZE" << std::endl;
+    return 1;
+  }
+
+  Param param = {
+    atoi(argv[1]),
+    atoi(argv[2])
+  };
+
+  bool ok = memfd_socketpair_check(param);
+  ok = memfd_listen_check(param) && ok;
+  ok = shm_open_check(param) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,165 @@
+/**
+ * 満杯になるまでの割当(追加)と全解放(全取り出し)を繰り返し、容量が減少しないかのチェック
+ * (解放済みの隣接した空き領域が結合されずに残ると、大きな割当が入らなくなり、周回毎に容量が減る)
+ * また、生存中だが何も操作していないプロセスのマガジンにキャッシュされたブロックが、他のプロセスの割当に使用されるかもチェックする
+ */
+#include <imque/queue.hh>
+#include <imque/ipc/shared_memory.hh>
+#include <imque/allocator/variable_allocator.hh>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct Param {
+  int shm_size;
+  int block_size;
+  int cycle_count;
+};
+
+// VariableAllocator: 割当に失敗するまで block_size バイトの割当を行い、その後に全て解放する。割り当てられた数を返す。
+int variable_cycle(imque::allocator::VariableAllocator& alc, const Param& param) {
+  std::vector<uint32_t> mds;
+  for(uint32_t md; (md = alc.allocate(param.block_size)) != 0; ) {
+    mds.push_back(md);
+  }
+  for(size_t i=0; i < mds.size(); i++) {
+    alc.release(mds[i]);
+  }
+  return mds.size();
+}
+
+// Queue: 追加に失敗するまで block_size バイトの要素を追加し、その後に全て取り出す。追加できた数を返す。
+int queue_cycle(imque::Queue& que, const Param& param) {
+  std::string msg(param.block_size, 'x');
+  int count = 0;
+  while(que.enq(msg.data(), msg.size())) {
+    count++;
+  }
+
+  std::string buf;
+  while(que.deq(buf));
+  return count;
+}
+
+namespace {
+  // Queue は、取り出し後も最後に取り出した要素のノードが先頭の番兵として領域の途中に残る。
+  // その一要素分と、番兵によって二分された空き領域(VariableAllocator の空き領域は最低一チャンクを残す)で入らなくなる一要素分の、
+  // 最大二要素分だけ、初回よりも容量が減ることがある。
+  const int SENTINEL_LOSS = 2;
+
+  // マガジンを使用するサイズクラスの要素のサイズ
+  const int SMALL_SIZE = 100;
+}
+
+// 各周回の容量を出力し、初回の容量から max_loss を越えて減少した周回があれば false を返す
+template<class Target, class Cycle>
+bool check(const char* name, Target& target, Cycle cycle, const Param& param, int max_loss) {
+  int first = 0;
+  int min = 0;
+  std::cout << "#[" << name << "] capacity:";
+  for(int i=0; i < param.cycle_count; i++) {
+    int count = cycle(target, param);
+    std::cout << " " << count;
+    if(i == 0) {
+      first = min = count;
+    } else if(count < min) {
+      min = count;
+    }
+  }
+  std::cout << std::endl;
+
+  bool ok = first > 0 && min >= first - max_loss;
+  std::cout << "#[" << name << "] FINISH: " << (ok ? "ok" : "NG") << ", first=" << first << ", min=" << min << std::endl;
+  return ok;
+}
+
+// 子プロセスで SMALL_SIZE バイトの要素の追加/取り出しを行い、マガジンにブロックを溜めた状態で待機させる。
+// その間に親プロセスで満杯まで追加できた数が、新規のキューの初回の容量から SENTINEL_LOSS を越えて減少していないかを検査する。
+// (子プロセスのマガジン内のブロックが他のプロセスから使用できないと、その分だけ容量が減る)
+bool idle_cache_check(const Param& param) {
+  std::string msg(SMALL_SIZE, 'x');
+  std::string buf;
+
+  imque::Queue fresh(param.shm_size);
+  int expected = 0;
+  while(fresh.enq(msg.data(), msg.size())) {
+    expected++;
+  }
+
+  imque::Queue que(param.shm_size);
+  int ready[2], done[2];
+  if(! que || pipe(ready) != 0 || pipe(done) != 0) {
+    std::cerr << "[ERROR] idle cache check initialization failed" << std::endl;
+    return false;
+  }
+
+  pid_t child = fork();
+  if(child == 0) {
+    for(int i=0; i < 8; i++) {
+      que.enq(msg.data(), msg.size());
+    }
+    while(que.deq(buf));
+
+    char c = 'r';
+    if(write(ready[1], &c, 1) != 1 || read(done[0], &c, 1) != 1) { // 親が満杯まで追加し終わるまで、何もせずに待機する
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  char c;
+  if(child == -1 || read(ready[0], &c, 1) != 1) {
+    std::cerr << "[ERROR] idle cache check child failed" << std::endl;
+    return false;
+  }
+  int count = 0;
+  while(que.enq(msg.data(), msg.size())) {
+    count++;
+  }
+  c = 'd';
+  if(write(done[1], &c, 1) != 1) {
+    std::cerr << "[ERROR] idle cache check child failed" << std::endl;
+  }
+  waitpid(child, NULL, 0);
+
+  bool ok = count >= expected - SENTINEL_LOSS;
+  std::cout << "#[idle-cache] FINISH: " << (ok ? "ok" : "NG") << ", expected=" << expected << ", count=" << count << std::endl;
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  if(argc != 4) {
+    std::cerr << "Usage: fill-drain-check SHM_SIZE BLOCK_SIZE CYCLE_COUNT" << std::endl;
+    return 1;
+  }
+
+  Param param = {
+    atoi(argv[1]),
+    atoi(argv[2]),
+    atoi(argv[3])
+  };
+
+  imque::ipc::SharedMemory shm(param.shm_size);
+  imque::allocator::VariableAllocator alc(shm.ptr<void>(), shm.size());
+  if(! shm || ! alc) {
+    std::cerr << "[ERROR] allocator initialization failed" << std::endl;
+    return 1;
+  }
+  alc.init();
+
+  imque::Queue que(param.shm_size);
+  if(! que) {
+    std::cerr << "[ERROR] queue initialization failed" << std::endl;
+    return 1;
+  }
+
+  bool ok = check("variable", alc, variable_cycle, param, 0);
+  ok = check("queue", que, queue_cycle, param, SENTINEL_LOSS) && ok;
+  ok = idle_cache_check(param) && ok;
+  return ok ? 0 : 1;
+}
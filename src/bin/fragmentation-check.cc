@@ -0,0 +1,107 @@
+/**
+ * 断片化した VariableAllocator で、一回の割当で辿るフリーリストのノード数が SEARCH_STEP_LIMIT 以下に収まるかのチェック
+ *  - 領域を一チャンクの割当で埋め、一つおきに解放して、一チャンクの空きノードが大量に並ぶフリーリストを作る
+ *  - miss: どの空きノードにも収まらない割当が、リスト全体を辿らずに(上限以内のノード数で)失敗すること
+ *  - hit:  連続した領域を解放してできた空きノードには、索引から(上限以内のノード数で)割り当てられること
+ */
+#define IMQUE_STATS
+#include <imque/ipc/shared_memory.hh>
+#include <imque/allocator/variable_allocator.hh>
+#include <imque/stats.hh>
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+typedef imque::allocator::VariableAllocator Allocator;
+
+namespace {
+  const size_t CHUNK_SIZE = 64;
+  const int ATTEMPT_COUNT = 100;
+  const int RUN_LENGTH = 8; // hit で解放する連続したブロックの数
+
+  imque::stats::Stats g_stats;
+}
+
+// 前回の呼び出しからの、フリーリストを辿ったノード数の増分を返す
+uint64_t steps_since_last() {
+  static uint64_t prev = 0;
+  const uint64_t curr = g_stats.sum(imque::stats::VAR_SEARCH_STEP);
+  const uint64_t delta = curr - prev;
+  prev = curr;
+  return delta;
+}
+
+int main(int argc, char** argv) {
+  if(argc != 2) {
+    std::cerr << "Usage: fragmentation-check SHM_SIZE" << std::endl;
+    return 1;
+  }
+
+  imque::ipc::SharedMemory shm(atoi(argv[1]));
+  Allocator alc(shm.ptr<void>(), shm.size());
+  if(! shm || ! alc) {
+    std::cerr << "[ERROR] allocator initialization failed" << std::endl;
+    return 1;
+  }
+  alc.init();
+  g_stats.clear();
+  alc.setStats(&g_stats);
+
+  // 満杯まで一チャンクずつ割り当て、一つおきに解放する
+  std::vector<uint32_t> mds;
+  for(uint32_t md; (md = alc.allocate(CHUNK_SIZE)) != 0; ) {
+    mds.push_back(md);
+  }
+  for(size_t i=0; i < mds.size(); i += 2) {
+    alc.release(mds[i]);
+    mds[i] = 0;
+  }
+  const Allocator::FreeListInfo info = alc.freeListInfo();
+  steps_since_last();
+
+  // miss: 二チャンクの割当は、どの空きノードにも収まらない
+  int miss_success = 0;
+  uint64_t miss_max_steps = 0;
+  for(int i=0; i < ATTEMPT_COUNT; i++) {
+    if(alc.allocate(CHUNK_SIZE*2) != 0) {
+      miss_success++;
+    }
+    const uint64_t steps = steps_since_last();
+    if(steps > miss_max_steps) {
+      miss_max_steps = steps;
+    }
+  }
+
+  // hit: 領域の後半で、連続した RUN_LENGTH 個のブロック(間の空きノードを含む)を解放して、そこに四チャンクずつ割り当てる
+  int hit_success = 0;
+  uint64_t hit_max_steps = 0;
+  for(int i=0; i < ATTEMPT_COUNT; i++) {
+    const size_t start = mds.size()/2 + static_cast<size_t>(i)*RUN_LENGTH*2;
+    for(size_t j=start; j < start+RUN_LENGTH*2 && j < mds.size(); j++) {
+      if(mds[j] != 0) {
+        alc.release(mds[j]);
+        mds[j] = 0;
+      }
+    }
+    steps_since_last();
+    if(alc.allocate(CHUNK_SIZE*4) != 0) {
+      hit_success++;
+    }
+    const uint64_t steps = steps_since_last();
+    if(steps > hit_max_steps) {
+      hit_max_steps = steps;
+    }
+  }
+
+  const uint64_t limit = Allocator::SEARCH_STEP_LIMIT;
+  const bool ok = (info.node_count > limit * 4 &&
+                   miss_success == 0 && miss_max_steps <= limit &&
+                   hit_success == ATTEMPT_COUNT && hit_max_steps <= limit);
+  std::cout << "#[" << getpid() << "] FINISH: free_nodes=" << info.node_count << ", limit=" << limit
+            << " | miss: success=" << miss_success << ", max_steps=" << miss_max_steps
+            << " | hit: success=" << hit_success << "/" << ATTEMPT_COUNT << ", max_steps=" << hit_max_steps
+            << " | " << (ok ? "ok" : "NG") << std::endl;
+  return ok ? 0 : 1;
+}
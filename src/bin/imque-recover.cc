@@ -0,0 +1,58 @@
+/**
+ * 名前付きキューの共有メモリ領域から、SIGKILL されたプロセスがリークさせた領域を回収するコマンド。
+ *
+ *
+ * [使い方]
+ * $ imque-recover SHM_FILE_PATH
+ *   - SHM_FILE_PATH: キューが使用する共有メモリ用ファイルのパス
+ *
+ * ※ キューを使用している全てのプロセスを停止した(静止した)状態で実行すること
+ * ※ このコマンドと同じ設定(Queue、IMQUE_STATS の有無、IMQUE_CACHE_LINE_SIZE)で作成されたキュー以外は、変更せずにエラーとする
+ */
+#include <imque/queue.hh>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <iostream>
+
+int main(int argc, char** argv) {
+  if(argc != 2) {
+    std::cerr << "Usage: imque-recover SHM_FILE_PATH" << std::endl;
+    return 1;
+  }
+
+  const char* shm_file_path = argv[1];
+
+  // Queue のコンストラクタは、ヘッダが一致しない領域を初期化してしまうので、
+  // 先に読み込み専用でマッピングして、同じレイアウトのキューの領域であることを確認する
+  int fd = open(shm_file_path, O_RDONLY);
+  if(fd == -1) {
+    std::cerr << "open() failed: " << shm_file_path << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+  size_t shm_size;
+  {
+    imque::ipc::SharedMemory shm((imque::ipc::Fd(fd)), imque::MapOption::READ_ONLY);
+    if(! shm) {
+      std::cerr << "mmap() failed: " << shm_file_path << std::endl;
+      return 1;
+    }
+    if(imque::queue::QueueImpl::isCompatible(shm) == false) {
+      std::cerr << "not a queue created with the same layout as this command "
+                << "(WideQueue, IMQUE_STATS, IMQUE_CACHE_LINE_SIZE or size mismatch): " << shm_file_path << std::endl;
+      return 1;
+    }
+    shm_size = shm.size();
+  }
+
+  imque::Queue que(shm_size, shm_file_path);
+  if(! que) {
+    std::cerr << "queue initialization failed: " << shm_file_path << std::endl;
+    return 1;
+  }
+
+  size_t reclaimed = que.recover();
+  std::cout << "recover: " << shm_file_path << ": reclaimed=" << reclaimed << std::endl;
+  return 0;
+}
@@ -0,0 +1,128 @@
+/**
+ * 名前付きキューの統計情報を表示するコマンド。
+ * キューを使用するプロセスと、このコマンドの双方が IMQUE_STATS マクロを定義してビルドされている必要がある。
+ *
+ *
+ * [使い方]
+ * $ imque-stat SHM_FILE_PATH [INTERVAL(秒)] [COUNT]
+ *   - SHM_FILE_PATH: キューが使用する共有メモリ用ファイルのパス (読み込み専用でマッピングする)
+ *                    WideQueue の領域も参照可能 (統計領域の 8byte のカウンタのみを読み込み、16byte の atomic::fetch は使用しない)
+ *   - INTERVAL: 表示間隔。各値は、この間の一秒あたりの増分を表示する (デフォルトは 1)
+ *   - COUNT: 表示回数 (デフォルトは 0 = 無制限)
+ */
+#define IMQUE_STATS
+#include <imque/queue.hh>
+#include <imque/stats.hh>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <iostream>
+#include <vector>
+
+namespace {
+  typedef std::vector<uint64_t> Snapshot;
+
+  Snapshot take(const imque::stats::Stats* st) {
+    Snapshot snap(imque::stats::COUNTER_COUNT);
+    for(uint32_t i=0; i < imque::stats::COUNTER_COUNT; i++) {
+      snap[i] = st->sum(i);
+    }
+    return snap;
+  }
+
+  const imque::stats::Stats* attach(const imque::ipc::SharedMemory& shm) {
+    if(const imque::stats::Stats* st = imque::queue::QueueImpl::statsOf(shm)) {
+      return st;
+    }
+#ifdef IMQUE_HAS_ATOMIC_16
+    if(const imque::stats::Stats* st = imque::queue::WideQueueImpl::statsOf(shm)) {
+      return st;
+    }
+#endif
+    return NULL;
+  }
+}
+
+int main(int argc, char** argv) {
+  if(argc < 2 || argc > 4) {
+    std::cerr << "Usage: imque-stat SHM_FILE_PATH [INTERVAL(sec)] [COUNT]" << std::endl;
+    return 1;
+  }
+
+  const char* shm_file_path = argv[1];
+  const int interval = argc > 2 ? atoi(argv[2]) : 1;
+  const int count = argc > 3 ? atoi(argv[3]) : 0;
+  if(interval <= 0) {
+    std::cerr << "invalid interval: " << argv[2] << std::endl;
+    return 1;
+  }
+
+  int fd = open(shm_file_path, O_RDONLY);
+  if(fd == -1) {
+    std::cerr << "open() failed: " << shm_file_path << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+  imque::ipc::SharedMemory shm((imque::ipc::Fd(fd)), imque::MapOption::READ_ONLY);
+  if(! shm) {
+    std::cerr << "mmap() failed: " << shm_file_path << std::endl;
+    return 1;
+  }
+
+  const imque::stats::Stats* st = attach(shm);
+  if(st == NULL) {
+    std::cerr << "statistics not available (not a queue, or the queue is not built with IMQUE_STATS): " << shm_file_path << std::endl;
+    return 1;
+  }
+
+  using namespace imque::stats;
+  Snapshot prev = take(st);
+  for(int n=0; count == 0 || n < count; n++) {
+    sleep(interval);
+    Snapshot curr = take(st);
+    Snapshot d(COUNTER_COUNT);
+    for(uint32_t i=0; i < COUNTER_COUNT; i++) {
+      d[i] = (curr[i] - prev[i]) / interval;
+    }
+    prev = curr;
+
+    char now[32];
+    time_t t = time(NULL);
+    strftime(now, sizeof(now), "%H:%M:%S", localtime(&t));
+
+    std::cout << "[" << now << "] queue: "
+              << "enq=" << d[ENQ_COUNT] << "/s (" << d[ENQ_BYTES] << "B/s), "
+              << "deq=" << d[DEQ_COUNT] << "/s (" << d[DEQ_BYTES] << "B/s), "
+              << "in_flight=" << (curr[ENQ_COUNT] - curr[DEQ_COUNT]) << " (" << (curr[ENQ_BYTES] - curr[DEQ_BYTES]) << "B), "
+              << "overflow=" << d[ENQ_OVERFLOW] << "/s" << std::endl;
+
+    std::cout << "  retry: "
+              << "enq_cas=" << d[ENQ_CAS_RETRY] << "/s, "
+              << "deq_cas=" << d[DEQ_CAS_RETRY] << "/s, "
+              << "tail_lag=" << d[TAIL_LAG] << "/s, "
+              << "node_ref=" << d[NODE_REF_RETRY] << "/s" << std::endl;
+
+    std::cout << "  fixed_allocator:";
+    for(uint32_t i=0; i < SIZE_CLASS_COUNT; i++) {
+      const uint64_t mag = d[FIXED_MAGAZINE_HIT+i];
+      const uint64_t free = d[FIXED_FREELIST_HIT+i];
+      const uint64_t miss = d[FIXED_MISS+i];
+      if(mag + free + miss == 0) {
+        continue;
+      }
+      std::cout << " " << (64 << i) << "B(magazine=" << mag << ", freelist=" << free << ", miss=" << miss << ")/s";
+    }
+    std::cout << " large=" << d[FIXED_LARGE] << "/s" << std::endl;
+
+    std::cout << "  variable_allocator: "
+              << "index_hit=" << d[VAR_INDEX_HIT] << "/s, "
+              << "search=" << d[VAR_SEARCH] << "/s, "
+              << "avg_search_len=" << (d[VAR_SEARCH] ? static_cast<double>(d[VAR_SEARCH_STEP]) / d[VAR_SEARCH] : 0.0) << ", "
+              << "retry_exhausted=" << d[VAR_RETRY_EXHAUSTED] << "/s, "
+              << "out_of_memory=" << d[VAR_OUT_OF_MEMORY] << "/s" << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,526 @@
+#include <imque/queue.hh>
+#include <imque/atomic/atomic.hh>
+#include <imque/ipc/shared_memory.hh>
+
+#include "../aux/nano_timer.hh"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <mqueue.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <unistd.h>
+#include <errno.h>
+
+// imque とカーネルのプロセス間通信機構のスループット比較
+//
+// 機構 × プロデューサ数 × コンシューマ数 × 要素サイズ の全ての組み合わせについて、
+// プロデューサ群が合計 MESSAGE_COUNT 個の要素を送信し、コンシューマ群がそれらを全て受信するまでの時間を計測する。
+// (一回の計測で送信する合計バイト数は MAX_TOTAL_BYTES までに制限する)
+//
+// 各プロセスは、親プロセスが使用可能なCPUに順番に固定する。
+// 結果は CSV もしくは JSON で標準出力に出力する。
+//
+// 機構毎の制約:
+//  - pipe: 要素の境界を保持しないので、複数のプロデューサ/コンシューマがいる場合は PIPE_BUF 以下のサイズのみ計測する
+//  - unix: SOCK_SEQPACKET のソケットペア。送信バッファに収まらないサイズは計測しない
+//  - mq:   POSIX メッセージキュー。/proc/sys/fs/mqueue/msgsize_max を越えるサイズは計測しない
+//  - sysv: System V メッセージキュー。msgmax を越えるサイズは計測しない
+// 計測できない組み合わせは status=unsupported として出力する。
+
+namespace {
+  const size_t IMQUE_SHM_SIZE = 64 * 1024 * 1024;
+  const size_t MAX_TOTAL_BYTES = 256 * 1024 * 1024;
+
+  // 要素の先頭バイトで、データと終了通知を区別する
+  const char DATA_MSG = 'D';
+  const char STOP_MSG = 'S';
+}
+
+struct Param {
+  std::vector<std::string> mechanisms;
+  std::vector<int> producer_counts;
+  std::vector<int> consumer_counts;
+  std::vector<int> msg_sizes;
+  int msg_count;
+  bool json;
+};
+
+// 全プロセスで共有する計測用の領域
+struct Shared {
+  volatile uint32_t ready_count;
+  volatile uint32_t go;
+  volatile uint64_t recv_count;
+};
+
+/*
+ * 各機構のチャンネル
+ *  - operator bool: 指定のサイズ/プロセス数で使用可能かどうか
+ *  - send: 要素を送信する (空きがない場合は待つ)
+ *  - recv: 要素を一つ受信する (要素がない場合は待つ)
+ */
+class ImqueChannel {
+public:
+  ImqueChannel(size_t, int, int) : que_(IMQUE_SHM_SIZE) {}
+  operator bool() const { return que_; }
+
+  bool send(const std::string& msg) {
+    while(que_.enq(msg.data(), msg.size()) == false) {
+      sched_yield();
+    }
+    return true;
+  }
+
+  bool recv(std::string& buf) {
+    while(que_.deq(buf) == false) {
+      sched_yield();
+    }
+    return true;
+  }
+
+private:
+  imque::Queue que_;
+};
+
+class PipeChannel {
+public:
+  PipeChannel(size_t msg_size, int producer_count, int consumer_count) : msg_size_(msg_size) {
+    fds_[0] = fds_[1] = -1;
+    if(msg_size > PIPE_BUF && (producer_count > 1 || consumer_count > 1)) {
+      return; // 書き込みがアトミックにならず、要素が混ざる
+    }
+    if(pipe(fds_) == -1) {
+      fds_[0] = fds_[1] = -1;
+    }
+  }
+  ~PipeChannel() {
+    close(fds_[0]);
+    close(fds_[1]);
+  }
+  operator bool() const { return fds_[0] != -1; }
+
+  bool send(const std::string& msg) {
+    for(size_t offset=0; offset < msg.size();) {
+      ssize_t n = write(fds_[1], msg.data() + offset, msg.size() - offset);
+      if(n == -1) {
+        if(errno == EINTR) continue;
+        return false;
+      }
+      offset += n;
+    }
+    return true;
+  }
+
+  bool recv(std::string& buf) {
+    buf.resize(msg_size_);
+    for(size_t offset=0; offset < msg_size_;) {
+      ssize_t n = read(fds_[0], &buf[offset], msg_size_ - offset);
+      if(n <= 0) {
+        if(n == -1 && errno == EINTR) continue;
+        return false;
+      }
+      offset += n;
+    }
+    return true;
+  }
+
+private:
+  const size_t msg_size_;
+  int fds_[2];
+};
+
+class UnixChannel {
+public:
+  UnixChannel(size_t msg_size, int, int) : msg_size_(msg_size) {
+    fds_[0] = fds_[1] = -1;
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds_) == -1) {
+      fds_[0] = fds_[1] = -1;
+      return;
+    }
+
+    int bufsize = static_cast<int>(msg_size * 4);
+    setsockopt(fds_[1], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    setsockopt(fds_[0], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+    // 送信可能なサイズかどうかを、一つ送受信してみて確認する
+    std::string probe(msg_size, DATA_MSG);
+    if(::send(fds_[1], probe.data(), probe.size(), MSG_DONTWAIT) != static_cast<ssize_t>(probe.size()) ||
+       ::recv(fds_[0], &probe[0], probe.size(), MSG_DONTWAIT) != static_cast<ssize_t>(probe.size())) {
+      close(fds_[0]);
+      close(fds_[1]);
+      fds_[0] = fds_[1] = -1;
+    }
+  }
+  ~UnixChannel() {
+    close(fds_[0]);
+    close(fds_[1]);
+  }
+  operator bool() const { return fds_[0] != -1; }
+
+  bool send(const std::string& msg) {
+    for(;;) {
+      if(::send(fds_[1], msg.data(), msg.size(), 0) == static_cast<ssize_t>(msg.size())) return true;
+      if(errno != EINTR) return false;
+    }
+  }
+
+  bool recv(std::string& buf) {
+    buf.resize(msg_size_);
+    for(;;) {
+      if(::recv(fds_[0], &buf[0], msg_size_, 0) == static_cast<ssize_t>(msg_size_)) return true;
+      if(errno != EINTR) return false;
+    }
+  }
+
+private:
+  const size_t msg_size_;
+  int fds_[2];
+};
+
+class MqChannel {
+public:
+  MqChannel(size_t msg_size, int, int) : msg_size_(msg_size), mq_(-1) {
+    std::ostringstream name;
+    name << "/ipc-bench-" << getpid();
+
+    mq_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.mq_maxmsg = 10;
+    attr.mq_msgsize = msg_size;
+    mq_ = mq_open(name.str().c_str(), O_RDWR | O_CREAT | O_EXCL, 0600, &attr);
+    if(mq_ != -1) {
+      mq_unlink(name.str().c_str()); // 記述子は fork 先にも引き継がれる
+    }
+  }
+  ~MqChannel() {
+    if(mq_ != -1) {
+      mq_close(mq_);
+    }
+  }
+  operator bool() const { return mq_ != -1; }
+
+  bool send(const std::string& msg) {
+    for(;;) {
+      if(mq_send(mq_, msg.data(), msg.size(), 0) == 0) return true;
+      if(errno != EINTR) return false;
+    }
+  }
+
+  bool recv(std::string& buf) {
+    buf.resize(msg_size_);
+    for(;;) {
+      if(mq_receive(mq_, &buf[0], msg_size_, NULL) == static_cast<ssize_t>(msg_size_)) return true;
+      if(errno != EINTR) return false;
+    }
+  }
+
+private:
+  const size_t msg_size_;
+  mqd_t mq_;
+};
+
+class SysvChannel {
+public:
+  SysvChannel(size_t msg_size, int, int) : msg_size_(msg_size), id_(-1) {
+    msginfo info;
+    if(msgctl(0, IPC_INFO, reinterpret_cast<msqid_ds*>(&info)) == -1 || msg_size > static_cast<size_t>(info.msgmax)) {
+      return;
+    }
+    id_ = msgget(IPC_PRIVATE, IPC_CREAT | 0600);
+    buf_.resize(sizeof(long) + msg_size);
+  }
+  ~SysvChannel() {
+    if(id_ != -1) {
+      msgctl(id_, IPC_RMID, NULL);
+    }
+  }
+  operator bool() const { return id_ != -1; }
+
+  bool send(const std::string& msg) {
+    const long mtype = 1;
+    memcpy(&buf_[0], &mtype, sizeof(long));
+    memcpy(&buf_[sizeof(long)], msg.data(), msg.size());
+    for(;;) {
+      if(msgsnd(id_, &buf_[0], msg.size(), 0) == 0) return true;
+      if(errno != EINTR) return false;
+    }
+  }
+
+  bool recv(std::string& buf) {
+    for(;;) {
+      if(msgrcv(id_, &buf_[0], msg_size_, 0, 0) == static_cast<ssize_t>(msg_size_)) break;
+      if(errno != EINTR) return false;
+    }
+    buf.assign(&buf_[sizeof(long)], msg_size_);
+    return true;
+  }
+
+private:
+  const size_t msg_size_;
+  int id_;
+  std::vector<char> buf_;
+};
+
+// 親プロセスが使用可能なCPUの一覧
+std::vector<int> available_cpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for(int i=0; i < CPU_SETSIZE; i++) {
+      if(CPU_ISSET(i, &set)) {
+        cpus.push_back(i);
+      }
+    }
+  }
+  return cpus;
+}
+
+void pin_to(const std::vector<int>& cpus, int index) {
+  if(cpus.empty()) {
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpus[index % cpus.size()], &set);
+  sched_setaffinity(0, sizeof(set), &set);
+}
+
+void wait_go(Shared* shared) {
+  imque::atomic::add(&shared->ready_count, 1);
+  while(imque::atomic::fetch(&shared->go) == 0) {
+    sched_yield();
+  }
+}
+
+template<class Channel>
+void producer_start(Channel& ch, size_t msg_size, int count, Shared* shared) {
+  std::string msg(msg_size, 'x');
+  msg[0] = DATA_MSG;
+
+  wait_go(shared);
+  for(int i=0; i < count; i++) {
+    if(ch.send(msg) == false) {
+      _exit(1);
+    }
+  }
+  _exit(0);
+}
+
+template<class Channel>
+void consumer_start(Channel& ch, size_t msg_size, Shared* shared) {
+  std::string buf;
+  int recv_count = 0;
+
+  wait_go(shared);
+  for(;;) {
+    if(ch.recv(buf) == false || buf.size() != msg_size) {
+      _exit(1);
+    }
+    if(buf[0] == STOP_MSG) {
+      break;
+    }
+    recv_count++;
+  }
+  imque::atomic::add(&shared->recv_count, recv_count);
+  _exit(0);
+}
+
+struct Result {
+  std::string status; // ok | unsupported | failed
+  int msg_count;
+  double elapsed_sec;
+};
+
+template<class Channel>
+Result run(int producer_count, int consumer_count, size_t msg_size, int msg_count, const std::vector<int>& cpus) {
+  Result result = {"unsupported", 0, 0};
+
+  Channel ch(msg_size, producer_count, consumer_count);
+  if(! ch) {
+    return result;
+  }
+
+  imque::ipc::SharedMemory shm(sizeof(Shared));
+  if(! shm) {
+    result.status = "failed";
+    return result;
+  }
+  Shared* shared = shm.ptr<Shared>();
+
+  const int per_producer = msg_count / producer_count;
+  result.msg_count = per_producer * producer_count;
+
+  std::vector<pid_t> producers(producer_count);
+  std::vector<pid_t> consumers(consumer_count);
+  for(int i=0; i < producer_count; i++) {
+    if((producers[i] = fork()) == 0) {
+      pin_to(cpus, i);
+      producer_start(ch, msg_size, per_producer, shared);
+    }
+  }
+  for(int i=0; i < consumer_count; i++) {
+    if((consumers[i] = fork()) == 0) {
+      pin_to(cpus, producer_count + i);
+      consumer_start(ch, msg_size, shared);
+    }
+  }
+
+  while(imque::atomic::fetch(&shared->ready_count) < static_cast<uint32_t>(producer_count + consumer_count)) {
+    sched_yield();
+  }
+  imque::NanoTimer timer;
+  imque::atomic::store(&shared->go, 1);
+
+  bool ok = true;
+  for(int i=0; i < producer_count; i++) {
+    int status;
+    waitpid(producers[i], &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+
+  // 全てのデータの後ろに、コンシューマ数分の終了通知を送る
+  std::string stop(msg_size, 'x');
+  stop[0] = STOP_MSG;
+  for(int i=0; i < consumer_count; i++) {
+    ok = ch.send(stop) && ok;
+  }
+
+  for(int i=0; i < consumer_count; i++) {
+    int status;
+    waitpid(consumers[i], &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+  result.elapsed_sec = timer.elapsed() / 1000.0 / 1000.0 / 1000.0;
+
+  ok = ok && imque::atomic::fetch(&shared->recv_count) == static_cast<uint64_t>(result.msg_count);
+  result.status = ok ? "ok" : "failed";
+  return result;
+}
+
+Result run(const std::string& mechanism, int producer_count, int consumer_count, size_t msg_size, int msg_count, const std::vector<int>& cpus) {
+  if(mechanism == "imque") return run<ImqueChannel>(producer_count, consumer_count, msg_size, msg_count, cpus);
+  if(mechanism == "pipe")  return run<PipeChannel>(producer_count, consumer_count, msg_size, msg_count, cpus);
+  if(mechanism == "unix")  return run<UnixChannel>(producer_count, consumer_count, msg_size, msg_count, cpus);
+  if(mechanism == "mq")    return run<MqChannel>(producer_count, consumer_count, msg_size, msg_count, cpus);
+  if(mechanism == "sysv")  return run<SysvChannel>(producer_count, consumer_count, msg_size, msg_count, cpus);
+  Result result = {"unsupported", 0, 0};
+  return result;
+}
+
+void print_header(const Param& param) {
+  if(param.json) {
+    std::cout << "[" << std::endl;
+  } else {
+    std::cout << "mechanism,producers,consumers,msg_size,messages,elapsed_sec,msgs_per_sec,gb_per_sec,status" << std::endl;
+  }
+}
+
+void print_result(const Param& param, bool first, const std::string& mechanism, int producer_count, int consumer_count, int msg_size, const Result& r) {
+  const double msgs_per_sec = r.elapsed_sec > 0 ? r.msg_count / r.elapsed_sec : 0;
+  const double gb_per_sec = msgs_per_sec * msg_size / 1000.0 / 1000.0 / 1000.0;
+
+  if(param.json) {
+    std::cout << (first ? "  " : ", ")
+              << "{\"mechanism\": \"" << mechanism << "\", "
+              << "\"producers\": " << producer_count << ", "
+              << "\"consumers\": " << consumer_count << ", "
+              << "\"msg_size\": " << msg_size << ", "
+              << "\"messages\": " << r.msg_count << ", "
+              << "\"elapsed_sec\": " << r.elapsed_sec << ", "
+              << "\"msgs_per_sec\": " << msgs_per_sec << ", "
+              << "\"gb_per_sec\": " << gb_per_sec << ", "
+              << "\"status\": \"" << r.status << "\"}" << std::endl;
+  } else {
+    std::cout << mechanism << ","
+              << producer_count << ","
+              << consumer_count << ","
+              << msg_size << ","
+              << r.msg_count << ","
+              << r.elapsed_sec << ","
+              << msgs_per_sec << ","
+              << gb_per_sec << ","
+              << r.status << std::endl;
+  }
+}
+
+void print_footer(const Param& param) {
+  if(param.json) {
+    std::cout << "]" << std::endl;
+  }
+}
+
+std::vector<std::string> split(const std::string& s) {
+  std::vector<std::string> items;
+  std::istringstream in(s);
+  std::string item;
+  while(std::getline(in, item, ',')) {
+    if(! item.empty()) {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+std::vector<int> split_int(const std::string& s) {
+  std::vector<int> items;
+  std::vector<std::string> strs = split(s);
+  for(size_t i=0; i < strs.size(); i++) {
+    items.push_back(atoi(strs[i].c_str()));
+  }
+  return items;
+}
+
+int main(int argc, char** argv) {
+  if(argc != 6 && argc != 7) {
+  usage:
+    std::cerr << "Usage: ipc-bench MECHANISMS(imque,pipe,unix,mq,sysv|all) PRODUCER_COUNTS CONSUMER_COUNTS MESSAGE_SIZES MESSAGE_COUNT [csv|json]" << std::endl
+              << "  ex. ipc-bench all 1,2,4 1,2,4 16,256,4096,65536,1048576 100000 csv" << std::endl;
+    return 1;
+  }
+
+  Param param;
+  param.mechanisms = std::string(argv[1]) == "all" ? split("imque,pipe,unix,mq,sysv") : split(argv[1]);
+  param.producer_counts = split_int(argv[2]);
+  param.consumer_counts = split_int(argv[3]);
+  param.msg_sizes = split_int(argv[4]);
+  param.msg_count = atoi(argv[5]);
+  param.json = argc == 7 && std::string(argv[6]) == "json";
+  if(argc == 7 && param.json == false && std::string(argv[6]) != "csv") {
+    goto usage;
+  }
+
+  const std::vector<int> cpus = available_cpus();
+
+  bool first = true;
+  print_header(param);
+  for(size_t m=0; m < param.mechanisms.size(); m++) {
+    for(size_t s=0; s < param.msg_sizes.size(); s++) {
+      const int msg_size = std::max(param.msg_sizes[s], 1);
+      const int msg_count = static_cast<int>(std::min(static_cast<size_t>(param.msg_count), MAX_TOTAL_BYTES / msg_size));
+
+      for(size_t p=0; p < param.producer_counts.size(); p++) {
+        for(size_t c=0; c < param.consumer_counts.size(); c++) {
+          const int producer_count = std::max(param.producer_counts[p], 1);
+          const int consumer_count = std::max(param.consumer_counts[c], 1);
+          Result r = run(param.mechanisms[m], producer_count, consumer_count, msg_size, msg_count, cpus);
+          print_result(param, first, param.mechanisms[m], producer_count, consumer_count, msg_size, r);
+          first = false;
+        }
+      }
+    }
+  }
+  print_footer(param);
+
+  return 0;
+}
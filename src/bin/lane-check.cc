@@ -0,0 +1,332 @@
+/**
+ * 複数のレーンから構成されるキュー(ShardedQueue, NumaQueue)のチェック
+ * 対象は sharded-by-process(BY_PROCESS), sharded-by-cpu(BY_CPU), numa の三つで、それぞれ以下を検査する
+ *  - transfer:    複数の書き込み/読み込みプロセス間で要素をやり取りして、欠損や重複がないか
+ *                 (BY_PROCESS の場合は、同じ書き込みプロセスの要素の順序の入れ替わりがないかも検査する)
+ *  - lane choice: 書き込みプロセスが追加した要素が、レーンの選択方針(プロセスID、CPU、NUMAノード)通りのレーンに入っているか
+ *                 (同じ共有メモリ領域を LaneQueueImpl で開き、レーン毎に直接取り出して検査する)
+ *  - steal:       全てのレーンに要素がある状態で、一つのプロセスが(自分のレーン以外からも取り出して)全ての要素を取り出せるか
+ * ※ BY_CPU と numa の書き込みプロセスは、選ばれるレーンが変わらないように、一つのCPUに固定して実行する
+ */
+#include <imque/sharded_queue.hh>
+#include <imque/numa_queue.hh>
+#include <imque/queue/lane_queue_impl.hh>
+#include <imque/ipc/shared_memory.hh>
+#include <imque/ipc/numa.hh>
+#include <imque/atomic/atomic.hh>
+#include "../aux/check.hh"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <sched.h>
+
+struct Param {
+  int process_count;
+  int messages_per_process;
+  int lane_count;
+  int shm_size;
+};
+
+enum Kind {
+  SHARDED_BY_PROCESS,
+  SHARDED_BY_CPU,
+  NUMA
+};
+
+// 全プロセスで共有する検査結果 (共有メモリ上に置く)
+struct Shared {
+  int error_count; // 内容の不正な要素や、順序の入れ替わり、タイムアウトした追加/取り出しの数
+  int marks[0];    // 要素毎の受信回数
+};
+
+const char* kind_name(Kind kind) {
+  switch(kind) {
+  case SHARDED_BY_PROCESS: return "sharded-by-process";
+  case SHARDED_BY_CPU:     return "sharded-by-cpu";
+  default:                 return "numa";
+  }
+}
+
+// lane 番目のレーンに入るはずの index 番目の要素を msg に格納する。(サイズを変えるために、番号の後ろに index % 100 バイトの埋め草を付ける)
+void make_message(int lane, int index, std::string& msg) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%d:%d:", lane, index);
+  msg = buf;
+  msg.append(index % 100, 'x');
+}
+
+// msg を解析して lane と index を取り出す。内容が不正な場合は false を返す
+bool parse_message(const std::string& msg, int& lane, int& index) {
+  std::string expected;
+  if(sscanf(msg.c_str(), "%d:%d:", &lane, &index) != 2) {
+    return false;
+  }
+  make_message(lane, index, expected);
+  return msg == expected;
+}
+
+// 呼び出し元のプロセスを、実行可能なCPUのうちの id 番目(の剰余)に固定する
+bool pin_to_cpu(int id) {
+  cpu_set_t allowed;
+  if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return false;
+  }
+  int nth = id % CPU_COUNT(&allowed);
+  for(int cpu=0; cpu < CPU_SETSIZE; cpu++) {
+    if(CPU_ISSET(cpu, &allowed) && nth-- == 0) {
+      cpu_set_t one;
+      CPU_ZERO(&one);
+      CPU_SET(cpu, &one);
+      return sched_setaffinity(0, sizeof(one), &one) == 0;
+    }
+  }
+  return false;
+}
+
+// 呼び出し元のプロセスの要素が入るはずのレーンを返す
+int expected_lane(Kind kind, int lane_count) {
+  switch(kind) {
+  case SHARDED_BY_PROCESS: return getpid() % lane_count;
+  case SHARDED_BY_CPU:     return sched_getcpu() % lane_count;
+  default:                 return imque::ipc::numa::currentNode() % lane_count;
+  }
+}
+
+// id 番目の書き込みプロセス。追加に失敗した場合は 1 を返す
+template<class Queue>
+int writer(Queue& que, Kind kind, int id, const Param& param) {
+  if(kind != SHARDED_BY_PROCESS && pin_to_cpu(id) == false) {
+    return 1;
+  }
+  const int lane = expected_lane(kind, que.laneCount());
+  std::string msg;
+  for(int i=0; i < param.messages_per_process; i++) {
+    make_message(lane, id*param.messages_per_process + i, msg);
+    if(imque::check::enq_retry(que, msg) == false) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// 受信した要素の内容(と BY_PROCESS の場合は書き込みプロセス毎の順序)を検査し、受信回数を記録する
+template<class Queue>
+void reader(Queue& que, Kind kind, Shared* shared, const Param& param) {
+  std::vector<int> last(param.process_count, -1); // 書き込みプロセス毎の、最後に受信した要素の番号
+  std::string buf;
+  for(int i=0; i < param.messages_per_process; i++) {
+    if(imque::check::deq_retry(que, buf) == false) {
+      imque::atomic::add(&shared->error_count, 1);
+      return;
+    }
+
+    int lane, index;
+    if(parse_message(buf, lane, index) == false || index < 0 || index >= param.process_count*param.messages_per_process ||
+       (kind == SHARDED_BY_PROCESS && index <= last[index / param.messages_per_process])) {
+      imque::atomic::add(&shared->error_count, 1);
+      continue;
+    }
+    last[index / param.messages_per_process] = index;
+    imque::atomic::add(&shared->marks[index], 1);
+  }
+}
+
+bool report(Kind kind, const char* name, bool ok, int received, int total, int missing_count, int duplicate_count, int error_count,
+            int abnormal_exit_num) {
+  std::cout << "#[" << getpid() << "] FINISH: " << kind_name(kind) << " " << name << ": "
+            << "received=" << received << "/" << total << ", "
+            << "miss=" << missing_count << ", "
+            << "dup=" << duplicate_count << ", "
+            << "error=" << error_count << " | "
+            << "abnormal_exit=" << abnormal_exit_num << " | "
+            << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+// 書き込みと読み込みのプロセスを process_count 個ずつ起動して、結果を検査する。
+// 子プロセスの場合は is_child に true を設定して返る。
+template<class Queue>
+bool transfer_check(Queue& que, Kind kind, const Param& param, bool& is_child) {
+  const int total = param.process_count * param.messages_per_process;
+  imque::ipc::SharedMemory shm(sizeof(Shared) + sizeof(int) * total);
+  if(! shm) {
+    std::cerr << "[ERROR] shm initialization failed" << std::endl;
+    return false;
+  }
+  memset(shm.ptr<void>(), 0, shm.size());
+  Shared* shared = shm.ptr<Shared>();
+
+  std::vector<pid_t> children;
+  const int child = imque::check::fork_children(param.process_count*2, children);
+  if(child != -1) {
+    is_child = true;
+    if(child < param.process_count) {
+      reader(que, kind, shared, param);
+      return true;
+    }
+    return writer(que, kind, child - param.process_count, param) == 0;
+  }
+  if(static_cast<int>(children.size()) != param.process_count*2) {
+    return false;
+  }
+  const int abnormal_exit_num = imque::check::wait_children(children);
+
+  int missing_count, duplicate_count;
+  imque::check::count_marks(shared->marks, total, missing_count, duplicate_count);
+  const bool ok = (missing_count == 0 && duplicate_count == 0 && shared->error_count == 0 &&
+                   abnormal_exit_num == 0 && que.isEmpty());
+  return report(kind, "transfer", ok, total - missing_count, total, missing_count, duplicate_count, shared->error_count,
+                abnormal_exit_num);
+}
+
+// 書き込みプロセスを process_count 個起動して全て追加させた後、各レーンから直接取り出して、要素が選択方針通りのレーンに入っているかを検査する
+template<class Queue>
+bool lane_choice_check(Queue& que, imque::queue::LaneQueueImpl& lanes, Kind kind, const Param& param, bool& is_child) {
+  std::vector<pid_t> children;
+  const int child = imque::check::fork_children(param.process_count, children);
+  if(child != -1) {
+    is_child = true;
+    return writer(que, kind, child, param) == 0;
+  }
+  if(static_cast<int>(children.size()) != param.process_count) {
+    return false;
+  }
+  const int abnormal_exit_num = imque::check::wait_children(children);
+
+  const int total = param.process_count * param.messages_per_process;
+  std::vector<int> marks(total, 0);
+  int received = 0;
+  int error_count = 0;
+  std::string buf;
+  for(uint32_t i=0; i < lanes.laneCount(); i++) {
+    while(lanes.lane(i).deq(buf)) {
+      int lane, index;
+      if(parse_message(buf, lane, index) == false || lane != static_cast<int>(i) || index < 0 || index >= total) {
+        error_count++;
+        continue;
+      }
+      marks[index]++;
+      received++;
+    }
+  }
+
+  int missing_count, duplicate_count;
+  imque::check::count_marks(&marks[0], total, missing_count, duplicate_count);
+  const bool ok = (missing_count == 0 && duplicate_count == 0 && error_count == 0 && abnormal_exit_num == 0 && que.isEmpty());
+  return report(kind, "lane choice", ok, received, total, missing_count, duplicate_count, error_count, abnormal_exit_num);
+}
+
+// 各レーンに直接 messages_per_process 個ずつ追加した後、que から一つのプロセスで全て取り出せるか(とレーン毎の順序)を検査する
+template<class Queue>
+bool steal_check(Queue& que, imque::queue::LaneQueueImpl& lanes, Kind kind, const Param& param) {
+  const int lane_count = lanes.laneCount();
+  const int total = lane_count * param.messages_per_process;
+  int error_count = 0;
+  std::string msg;
+  for(int i=0; i < lane_count; i++) {
+    for(int j=0; j < param.messages_per_process; j++) {
+      make_message(i, i*param.messages_per_process + j, msg);
+      if(lanes.lane(i).enq(msg.data(), msg.size()) == false) {
+        error_count++;
+      }
+    }
+  }
+
+  std::vector<int> marks(total, 0);
+  std::vector<int> last(lane_count, -1); // レーン毎の、最後に受信した要素の番号
+  int received = 0;
+  std::string buf;
+  while(que.deq(buf)) {
+    int lane, index;
+    if(parse_message(buf, lane, index) == false || lane < 0 || lane >= lane_count ||
+       index / param.messages_per_process != lane || index <= last[lane]) {
+      error_count++;
+      continue;
+    }
+    last[lane] = index;
+    marks[index]++;
+    received++;
+  }
+
+  int missing_count, duplicate_count;
+  imque::check::count_marks(&marks[0], total, missing_count, duplicate_count);
+  const bool ok = (missing_count == 0 && duplicate_count == 0 && error_count == 0 && que.isEmpty());
+  return report(kind, "steal", ok, received, total, missing_count, duplicate_count, error_count, 0);
+}
+
+// que と同じ共有メモリ領域を inspector で開いて、各チェックを順に実行する
+template<class Queue>
+bool check_all(Queue& que, Kind kind, const char* path, const Param& param, bool& is_child) {
+  imque::ipc::SharedMemory inspector_shm(path, param.shm_size);
+  imque::queue::LaneQueueImpl lanes(inspector_shm, que.laneCount());
+  if(! que || ! lanes) {
+    std::cerr << "[ERROR] " << kind_name(kind) << ": queue initialization failed" << std::endl;
+    return false;
+  }
+
+  bool ok = transfer_check(que, kind, param, is_child);
+  if(is_child) {
+    return ok;
+  }
+  que.init();
+  ok = lane_choice_check(que, lanes, kind, param, is_child) && ok;
+  if(is_child) {
+    return ok;
+  }
+  que.init();
+  return steal_check(que, lanes, kind, param) && ok;
+}
+
+int main(int argc, char** argv) {
+  if(argc != 5) {
+    std::cerr << "Usage: lane-check PROCESS_COUNT MESSAGES_PER_PROCESS LANE_COUNT SHM_SIZE" << std::endl;
+    return 1;
+  }
+
+  Param param = {
+    atoi(argv[1]),
+    atoi(argv[2]),
+    atoi(argv[3]),
+    atoi(argv[4])
+  };
+
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/imque-lane-check.%d", static_cast<int>(getpid()));
+
+  // 子プロセスは、自分が実行したチェックの結果のみを終了コードにする
+  bool ok = true;
+  bool is_child = false;
+  {
+    imque::ShardedQueue que(param.shm_size, param.lane_count, path, 0660, imque::ShardedQueue::BY_PROCESS);
+    const bool rlt = check_all(que, SHARDED_BY_PROCESS, path, param, is_child);
+    if(is_child) {
+      return rlt ? 0 : 1;
+    }
+    ok = rlt && ok;
+  }
+  unlink(path);
+  {
+    imque::ShardedQueue que(param.shm_size, param.lane_count, path, 0660, imque::ShardedQueue::BY_CPU);
+    const bool rlt = check_all(que, SHARDED_BY_CPU, path, param, is_child);
+    if(is_child) {
+      return rlt ? 0 : 1;
+    }
+    ok = rlt && ok;
+  }
+  unlink(path);
+  {
+    imque::NumaQueue que(param.shm_size, path);
+    const bool rlt = check_all(que, NUMA, path, param, is_child);
+    if(is_child) {
+      return rlt ? 0 : 1;
+    }
+    ok = rlt && ok;
+  }
+  unlink(path);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,168 @@
+/**
+ * FixedAllocator のマガジン(プロセス毎のキャッシュ)のチェック
+ * 複数のプロセスが、マガジンの容量を越える数のブロックの割当/解放を繰り返し、
+ * マガジンと SuperBlock のフリーリストの間のブロックの移動(refill/flush)を競合させる。
+ * (プロセス数がマガジンの数(32)を越える場合、あふれたプロセスはマガジンを使わずにフリーリストを直接操作する)
+ * SHM_SIZE が小さく割当が失敗する場合は、drainCaches によってマガジン内の全ブロックが(割当を経ずに)フリーリストに戻されることも繰り返される。
+ *  - 同じブロックが同時に二つの割当に返されないか (ブロックの位置毎の所有者を共有メモリ上に記録し、CAS で検出する)
+ *  - 保持中のブロックの内容が、他のプロセスに書き換えられないか
+ *  - 全プロセスの終了後に、割当済みのままのブロック(リーク)や、キャッシュ中に重複して現れるブロックがないか
+ */
+#include <imque/ipc/shared_memory.hh>
+#include <imque/allocator/fixed_allocator.hh>
+#include <imque/atomic/atomic.hh>
+#include "../aux/check.hh"
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+
+struct Param {
+  int process_count;
+  int loop_count;
+  int shm_size;
+};
+
+// 全プロセスで共有する検査結果 (共有メモリ上に置く)
+struct Shared {
+  int error_count;    // 二重に割り当てられたブロックや、内容を書き換えられたブロックの数
+  int failed_count;   // 割当に失敗した回数 (容量不足。エラーではない)
+  int owners[0];      // ブロックの位置(チャンク単位)毎の、保持中のプロセスの番号+1 (保持されていなければ 0)
+};
+
+namespace {
+  typedef imque::allocator::FixedAllocator::MD MD;
+
+  const size_t CHUNK_SIZE = 64;
+
+  // 一度に保持するブロックの最大数。マガジンの容量の数倍にして、refill と flush が繰り返し発生するようにする
+  const int HOLD_LIMIT = imque::allocator::FixedAllocatorAux::MAGAZINE_SIZE * 3;
+
+  // 割当サイズ。フリーリストの競合が起きやすいように、ほとんどは小さい二つのサイズクラスとし、
+  // 領域を圧迫して割当の失敗(drainCaches)を起こすための最大のサイズクラスを混ぜる
+  const size_t SIZES[] = {48, 64, 100, 128, 4000};
+}
+
+struct Stamp {
+  int id;
+  int seq;
+};
+
+void child_start(imque::allocator::FixedAllocator& alc, char* region, Shared* shared, int id, const Param& param) {
+  srand(time(NULL) + getpid());
+
+  MD mds[HOLD_LIMIT];
+  for(int i=0; i < param.loop_count; i++) {
+    const int count = 1 + rand() % HOLD_LIMIT;
+    const size_t size = SIZES[rand() % (sizeof(SIZES)/sizeof(SIZES[0]))];
+
+    int held = 0;
+    for(; held < count; held++) {
+      mds[held] = alc.allocate(size);
+      if(mds[held] == 0) {
+        imque::atomic::add(&shared->failed_count, 1);
+        break;
+      }
+      char* ptr = alc.ptr<char>(mds[held]);
+      const size_t pos = (ptr - region) / CHUNK_SIZE;
+      if(imque::atomic::compare_and_swap(&shared->owners[pos], 0, id+1) == false) {
+        imque::atomic::add(&shared->error_count, 1); // 他のプロセスが保持中のブロックが割り当てられた
+      }
+      Stamp stamp = {id, i*HOLD_LIMIT + held};
+      memcpy(ptr, &stamp, sizeof(stamp));
+    }
+
+    if(rand() % 4 == 0) {
+      sched_yield();
+    }
+
+    // 割当と異なる順序で解放する
+    for(int j=held-1; j > 0; j--) {
+      std::swap(mds[j], mds[rand() % (j+1)]);
+    }
+    for(int j=0; j < held; j++) {
+      char* ptr = alc.ptr<char>(mds[j]);
+      const size_t pos = (ptr - region) / CHUNK_SIZE;
+      Stamp stamp;
+      memcpy(&stamp, ptr, sizeof(stamp));
+      if(stamp.id != id || stamp.seq / HOLD_LIMIT != i ||
+         imque::atomic::compare_and_swap(&shared->owners[pos], id+1, 0) == false) {
+        imque::atomic::add(&shared->error_count, 1); // 保持中に他のプロセスに使用された
+      }
+      alc.release(mds[j]);
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  if(argc != 4) {
+    std::cerr << "Usage: magazine-check PROCESS_COUNT LOOP_COUNT SHM_SIZE" << std::endl;
+    return 1;
+  }
+
+  Param param = {
+    atoi(argv[1]),
+    atoi(argv[2]),
+    atoi(argv[3])
+  };
+
+  imque::ipc::SharedMemory shm(param.shm_size);
+  imque::ipc::SharedMemory result_shm(sizeof(Shared) + sizeof(int) * (param.shm_size / CHUNK_SIZE + 1));
+  if(! shm || ! result_shm) {
+    std::cerr << "[ERROR] shared memory initialization failed" << std::endl;
+    return 1;
+  }
+  memset(result_shm.ptr<void>(), 0, result_shm.size());
+  Shared* shared = result_shm.ptr<Shared>();
+
+  imque::allocator::FixedAllocator alc(shm.ptr<void>(), shm.size());
+  if(! alc) {
+    std::cerr << "[ERROR] allocator initialization failed" << std::endl;
+    return 1;
+  }
+  alc.init();
+
+  std::vector<pid_t> children;
+  const int child = imque::check::fork_children(param.process_count, children);
+  if(child != -1) {
+    child_start(alc, shm.ptr<char>(), shared, child, param);
+    return 0; // alc のデストラクタで、マガジン内のブロックをフリーリストに返却する
+  }
+  if(static_cast<int>(children.size()) != param.process_count) {
+    return 1;
+  }
+  const int abnormal_exit_num = imque::check::wait_children(children);
+
+  // 全プロセスの終了後は、割当済みの全ブロックがキャッシュ中のはず
+  std::vector<MD> allocated;
+  std::vector<MD> cached;
+  alc.collectAllocated(allocated);
+  alc.collectCached(cached);
+  std::sort(cached.begin(), cached.end());
+  const size_t unique_cached = std::unique(cached.begin(), cached.end()) - cached.begin();
+  const int leaked = static_cast<int>(allocated.size()) - static_cast<int>(unique_cached);
+  const int duplicated = static_cast<int>(cached.size() - unique_cached);
+
+  int held_count = 0;
+  for(size_t i=0; i < param.shm_size / CHUNK_SIZE; i++) {
+    if(shared->owners[i] != 0) {
+      held_count++;
+    }
+  }
+
+  const bool ok = (shared->error_count == 0 && abnormal_exit_num == 0 && leaked == 0 && duplicated == 0 && held_count == 0);
+  std::cout << "#[" << getpid() << "] FINISH: magazine churn: "
+            << "process=" << param.process_count << ", "
+            << "error=" << shared->error_count << ", "
+            << "failed=" << shared->failed_count << ", "
+            << "leaked=" << leaked << ", "
+            << "duplicated=" << duplicated << ", "
+            << "held=" << held_count << " | "
+            << "abnormal_exit=" << abnormal_exit_num << " | "
+            << (ok ? "ok" : "NG") << std::endl;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+/**
+ * 共有メモリ領域のマッピングオプション(MapOption)のチェック
+ *  - 各オプションを指定しても領域が使用可能で、options() が実際に適用されたオプションのみを返すか
+ *  - HUGE_TLB が使用できない環境(ヒュージページ未確保など)では、通常のページで確保し直されるか
+ *  - POPULATE が(他のプロセスが書き込み済みの)領域の内容を変えないか
+ *  - NumaQueue のように、マッピング後に populate() で事前フォールトを行った場合も、options() が POPULATE を返すか
+ *  - READ_ONLY と POPULATE を組み合わせても、領域に書き込みを行わない(SIGSEGV にならない)か
+ */
+#include <imque/queue.hh>
+#include <imque/numa_queue.hh>
+#include <imque/ipc/shared_memory.hh>
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using imque::ipc::SharedMemory;
+using imque::ipc::MapOption;
+
+namespace {
+  const size_t SHM_SIZE = 4 * 1024 * 1024;
+  const char PATTERN = 'p';
+}
+
+// 領域の全体が読み書き可能かを検査する
+bool check_writable(SharedMemory& shm) {
+  char* p = shm.ptr<char>();
+  memset(p, PATTERN, shm.size());
+  return p[0] == PATTERN && p[shm.size()-1] == PATTERN;
+}
+
+bool report(const char* name, bool ok, int options) {
+  std::cout << "#[map-option] " << name << ": options=" << options << " | " << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+// 無名領域に requested を指定して、領域が使用可能で、options() が requested の部分集合かつ required を含むことを検査する
+bool anonymous_check(const char* name, int requested, int required) {
+  SharedMemory shm(SHM_SIZE, requested);
+  const int applied = shm.options();
+  return report(name, (shm && shm.size() == SHM_SIZE && (applied & ~requested) == 0 && (applied & required) == required &&
+                       check_writable(shm)), applied);
+}
+
+// HUGE_TLB を指定した無名領域のキューが使用可能で、mapOptions() がヒュージページの使用可否に応じた値を返すことを検査する
+// (ヒュージページを確保していない環境では、HUGE_TLB を含まない値に戻って、通常のページで確保される)
+bool huge_tlb_fallback_check() {
+  imque::Queue que(SHM_SIZE, MapOption::HUGE_TLB);
+  std::string buf;
+  const bool rlt = que && que.enq("huge", 4) && que.deq(buf) && buf == "huge";
+  const int applied = que.mapOptions();
+  std::cout << "#[map-option] huge-tlb: " << ((applied & MapOption::HUGE_TLB) ? "huge pages" : "fallback to normal pages") << std::endl;
+  return report("huge-tlb queue", rlt && (applied & ~MapOption::HUGE_TLB) == 0, applied);
+}
+
+// POPULATE を指定した NumaQueue が使用可能で、mapOptions() が POPULATE を含むことを検査する
+// (NumaQueue は POPULATE を外してマッピングし、各レーンのノード配置後に populate() を呼び出す)
+bool numa_populate_check() {
+  imque::NumaQueue que(SHM_SIZE, MapOption::POPULATE);
+  std::string buf;
+  const bool rlt = que && que.enq("numa", 4) && que.deq(buf) && buf == "numa";
+  const int applied = que.mapOptions();
+  return report("numa-queue populate", rlt && applied == MapOption::POPULATE, applied);
+}
+
+// 書き込み済みのファイルを POPULATE 付きで読み書き可能に、および READ_ONLY|POPULATE 付きで読み込み専用にマッピングし、
+// 内容が変わらないこと、読み込み専用の場合は POPULATE が適用されないことを検査する
+bool file_check() {
+  char path[] = "/tmp/imque-map-option-check.XXXXXX";
+  int fd = mkstemp(path);
+  if(fd == -1) {
+    std::cerr << "[ERROR] mkstemp() failed" << std::endl;
+    return false;
+  }
+  close(fd);
+
+  bool ok = true;
+  {
+    SharedMemory writer(path, SHM_SIZE);
+    ok = writer && check_writable(writer);
+  }
+  {
+    SharedMemory populated(path, SHM_SIZE, 0660, MapOption::POPULATE);
+    const char* p = populated.ptr<const char>();
+    const int applied = populated.options();
+    ok = report("populate", populated && applied == MapOption::POPULATE && p[0] == PATTERN && p[SHM_SIZE-1] == PATTERN, applied) && ok;
+  }
+  {
+    SharedMemory read_only((imque::ipc::Fd(open(path, O_RDONLY))), MapOption::READ_ONLY|MapOption::POPULATE);
+    read_only.populate(); // 読み込み専用の領域に対しては何もしない
+    const char* p = read_only.ptr<const char>();
+    const int applied = read_only.options();
+    ok = report("read-only|populate", read_only && applied == MapOption::READ_ONLY && p[0] == PATTERN && p[SHM_SIZE-1] == PATTERN, applied) && ok;
+  }
+
+  unlink(path);
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  if(argc != 1) {
+    std::cerr << "Usage: map-option-check" << std::endl;
+    return 1;
+  }
+
+  // POPULATE は常に適用可能。それ以外は環境によって適用されない場合がある
+  bool ok = anonymous_check("none", MapOption::NONE, MapOption::NONE);
+  ok = anonymous_check("huge-tlb", MapOption::HUGE_TLB, MapOption::NONE) && ok;
+  ok = anonymous_check("huge-page", MapOption::HUGE_PAGE, MapOption::NONE) && ok;
+  ok = anonymous_check("populate", MapOption::POPULATE, MapOption::POPULATE) && ok;
+  ok = anonymous_check("lock", MapOption::LOCK, MapOption::NONE) && ok;
+  ok = anonymous_check("all", MapOption::HUGE_TLB|MapOption::HUGE_PAGE|MapOption::POPULATE|MapOption::LOCK, MapOption::POPULATE) && ok;
+  ok = huge_tlb_fallback_check() && ok;
+  ok = numa_populate_check() && ok;
+  ok = file_check() && ok;
+  return ok ? 0 : 1;
+}
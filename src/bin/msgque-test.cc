@@ -2,6 +2,7 @@
 
 #include "../aux/nano_timer.hh"
 #include "../aux/stat.hh"
+#include "../aux/histogram.hh"
 
 #include <iostream>
 #include <string>
@@ -32,6 +33,12 @@ struct Param {
   int kill_num;
 };
 
+// 全プロセスのレイテンシ(ナノ秒)の集計先。共有メモリ上に置く。
+struct Latency {
+  imque::Histogram enq;
+  imque::Histogram deq;
+};
+
 void gen_random_string(std::string& s, std::size_t size) {
   const char cs[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
   s.resize(size);
@@ -40,17 +47,24 @@ void gen_random_string(std::string& s, std::size_t size) {
   }
 }
 
-void reader_start(const Param& param, imque::Queue& que) {
+void reader_start(const Param& param, imque::Queue& que, Latency* latency) {
   srand(time(NULL) + getpid());
   int new_nice = nice(rand() % (param.reader_max_nice+1));
   std::cout << "#[" << getpid() << "] R START: nice=" << new_nice << std::endl;
   
   imque::Stat ok_st;
   imque::Stat ng_st;
+  imque::Histogram ok_hist;
   std::string buf;
   for(int i=0; i < param.reader_loop_count; i++) {
-    imque::NanoTimer t;
-    que.deq(buf) ? ok_st.add(t.elapsed()) : ng_st.add(t.elapsed());
+    imque::TscTimer t;
+    if(que.deq(buf)) {
+      long elapsed = t.elapsed();
+      ok_st.add(elapsed);
+      ok_hist.add(elapsed);
+    } else {
+      ng_st.add(t.elapsed());
+    }
     
     if(param.read_interval)
       usleep(rand() % param.read_interval);
@@ -61,15 +75,17 @@ void reader_start(const Param& param, imque::Queue& que) {
             << "ok_avg=" << ok_st.avg() << ", "
             << "ng_avg=" << ng_st.avg()
             << std::endl;
+  ok_hist.mergeTo(latency->deq);
 }
 
-void writer_start(const Param& param, imque::Queue& que) {
+void writer_start(const Param& param, imque::Queue& que, Latency* latency) {
   srand(time(NULL) + getpid());
   int new_nice = nice(rand() % (param.writer_max_nice+1));
   std::cout << "#[" << getpid() << "] W START: nice=" << new_nice << std::endl;
   
   imque::Stat ok_st;
   imque::Stat ng_st;
+  imque::Histogram ok_hist;
   int size_range = param.msg_size_max - param.msg_size_min + 1;
   std::string buf;
   
@@ -77,8 +93,14 @@ void writer_start(const Param& param, imque::Queue& que) {
     uint32_t size = static_cast<uint32_t>((rand() % size_range) + param.msg_size_min);
     gen_random_string(buf, size);
     
-    imque::NanoTimer t;
-    que.enq(buf.data(), buf.size()) ? ok_st.add(t.elapsed()) : ng_st.add(t.elapsed());
+    imque::TscTimer t;
+    if(que.enq(buf.data(), buf.size())) {
+      long elapsed = t.elapsed();
+      ok_st.add(elapsed);
+      ok_hist.add(elapsed);
+    } else {
+      ng_st.add(t.elapsed());
+    }
     
     if(param.write_interval)
       usleep(rand() % param.write_interval);
@@ -90,9 +112,10 @@ void writer_start(const Param& param, imque::Queue& que) {
             << "ok_avg=" << ok_st.avg() << ", "
             << "ng_avg=" << ng_st.avg()
             << std::endl;
+  ok_hist.mergeTo(latency->enq);
 }
 
-void parent_start(const Param& param, imque::Queue& que) {
+void parent_start(const Param& param, imque::Queue& que, Latency* latency) {
   std::vector<pid_t> writers(param.writer_count);
   std::vector<pid_t> readers(param.reader_count);
   
@@ -101,7 +124,7 @@ void parent_start(const Param& param, imque::Queue& que) {
       writers[i] = fork();
       switch(writers[i]) {
       case 0:
-        writer_start(param, que);
+        writer_start(param, que, latency);
         return;
       case -1:
         std::cerr << "ERROR: fork() failed: " << strerror(errno) << std::endl;
@@ -112,7 +135,7 @@ void parent_start(const Param& param, imque::Queue& que) {
       readers[i] = fork();
       switch(readers[i]) {
       case 0:
-        reader_start(param, que);
+        reader_start(param, que, latency);
         return;
       case -1:
         std::cerr << "ERROR: fork() failed: " << strerror(errno) << std::endl;
@@ -160,6 +183,10 @@ void parent_start(const Param& param, imque::Queue& que) {
             << "signal=" << signal_num << ", "
             << "unknown=" << unknown_num << " | " 
             << "overflow=" << que.overflowedCount() << std::endl;
+
+  // SIGKILL されたプロセスの分は含まれない
+  std::cout << "#[" << getpid() << "] P LATENCY(ns): enq: " << latency->enq << std::endl;
+  std::cout << "#[" << getpid() << "] P LATENCY(ns): deq: " << latency->deq << std::endl;
 }
 
 int main(int argc, char** argv) {
@@ -189,7 +216,17 @@ int main(int argc, char** argv) {
     return 1;
   }
   
-  parent_start(param, que);
+  imque::ipc::SharedMemory latency_shm(sizeof(Latency));
+  if(! latency_shm) {
+    std::cerr << "[ERROR] shared memory initialization failed" << std::endl;
+    return 1;
+  }
+  Latency* latency = latency_shm.ptr<Latency>();
+  latency->enq.clear();
+  latency->deq.clear();
+
+  imque::TscTimer::calibrate(); // 子プロセスが較正結果を引き継ぐよう fork 前に行う
+  parent_start(param, que, latency);
   
   return 0;
 }
@@ -0,0 +1,180 @@
+#include <imque/queue.hh>
+
+#include "../aux/nano_timer.hh"
+#include "../aux/histogram.hh"
+
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+
+// 二つの Queue (要求用と応答用) を使った、二プロセス間の往復(ping-pong)レイテンシの計測
+//
+// クライアント(親プロセス)は要求キューに要素を追加し、サーバ(子プロセス)はそれを取り出して応答キューに追加し返す。
+// クライアントが応答を取り出すまでの時間を一往復毎に計測し、その分布を出力する。(片道はその半分として概算する)
+//
+// 受信の待ち方:
+//  - spin:  deq が成功するまで空回りする (最小レイテンシ。専有するCPUが必要)
+//  - yield: deq が失敗する毎に sched_yield を呼ぶ (同じCPUを共有する場合など)
+//  - block: deqWait で待つ (暫くスピンした後で futex 上で待機する。起床のシステムコール分のレイテンシが加わる)
+
+enum WAIT_MODE {
+  SPIN,
+  YIELD,
+  BLOCK
+};
+
+struct Param {
+  int ping_cpu;
+  int pong_cpu;
+  int round_count;
+  int msg_size;
+  WAIT_MODE mode;
+};
+
+namespace {
+  const size_t SHM_SIZE = 1024 * 1024;
+  const int WARMUP_ROUND_COUNT = 1000;
+  const char STOP_MSG = 'S';
+  const char* const MODE_NAMES[] = {"spin", "yield", "block"};
+}
+
+bool pin_to(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+void recv(const Param& param, imque::Queue& que, std::string& buf) {
+  if(param.mode == BLOCK) {
+    que.deqWait(buf, -1);
+    return;
+  }
+
+  while(que.deq(buf) == false) {
+    if(param.mode == YIELD) {
+      sched_yield();
+    }
+  }
+}
+
+void send(imque::Queue& que, const std::string& msg) {
+  while(que.enq(msg.data(), msg.size()) == false) {
+    sched_yield(); // 満杯 (通常は起こらない)
+  }
+}
+
+void pong_start(const Param& param, imque::Queue& req_que, imque::Queue& rep_que) {
+  std::string buf;
+  for(;;) {
+    recv(param, req_que, buf);
+    if(buf[0] == STOP_MSG) {
+      break;
+    }
+    send(rep_que, buf);
+  }
+  _exit(0);
+}
+
+void ping_start(const Param& param, imque::Queue& req_que, imque::Queue& rep_que) {
+  std::string msg(param.msg_size, 'x');
+  std::string buf;
+  imque::Histogram rtt;
+
+  for(int i=0; i < WARMUP_ROUND_COUNT + param.round_count; i++) {
+    imque::TscTimer t;
+    send(req_que, msg);
+    recv(param, rep_que, buf);
+    long elapsed = t.elapsed();
+
+    if(i >= WARMUP_ROUND_COUNT) {
+      rtt.add(elapsed);
+    }
+  }
+
+  msg[0] = STOP_MSG;
+  send(req_que, msg);
+
+  std::cout << "#[" << getpid() << "] ping_cpu=" << param.ping_cpu << ", "
+            << "pong_cpu=" << param.pong_cpu << ", "
+            << "msg_size=" << param.msg_size << ", "
+            << "mode=" << MODE_NAMES[param.mode] << std::endl;
+  std::cout << "#[" << getpid() << "] RTT(ns): " << rtt << std::endl;
+  std::cout << "#[" << getpid() << "] ONE-WAY(ns, RTT/2): "
+            << "p50=" << rtt.percentile(50) / 2 << ", "
+            << "p99=" << rtt.percentile(99) / 2 << ", "
+            << "p99.9=" << rtt.percentile(99.9) / 2 << std::endl;
+}
+
+int main(int argc, char** argv) {
+  if(argc != 5 && argc != 6) {
+  usage:
+    std::cerr << "Usage: pingpong-bench PING_CPU PONG_CPU ROUND_COUNT MESSAGE_SIZE [spin|yield|block]" << std::endl;
+    return 1;
+  }
+
+  Param param = {
+    atoi(argv[1]),
+    atoi(argv[2]),
+    atoi(argv[3]),
+    std::max(atoi(argv[4]), 1),
+    SPIN
+  };
+  if(argc == 6) {
+    const std::string mode = argv[5];
+    if(mode == "yield") {
+      param.mode = YIELD;
+    } else if(mode == "block") {
+      param.mode = BLOCK;
+    } else if(mode != "spin") {
+      goto usage;
+    }
+  }
+  if(param.ping_cpu == param.pong_cpu && param.mode == SPIN) {
+    std::cerr << "[WARN] ping and pong share a cpu in spin mode; each round waits for a scheduler tick" << std::endl;
+  }
+
+  imque::Queue req_que(SHM_SIZE);
+  imque::Queue rep_que(SHM_SIZE);
+  if(! req_que || ! rep_que) {
+    std::cerr << "[ERROR] queue initialization failed" << std::endl;
+    return 1;
+  }
+
+  imque::TscTimer::calibrate();
+
+  // 子プロセス(pong)は fork 前に設定した CPU の固定を引き継ぐ
+  if(pin_to(param.pong_cpu) == false) {
+    std::cerr << "[ERROR] sched_setaffinity() failed: cpu=" << param.pong_cpu << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  pid_t pong = fork();
+  switch(pong) {
+  case 0:
+    pong_start(param, req_que, rep_que);
+    return 0;
+  case -1:
+    std::cerr << "[ERROR] fork() failed: " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  if(pin_to(param.ping_cpu) == false) {
+    std::cerr << "[ERROR] sched_setaffinity() failed: cpu=" << param.ping_cpu << ": " << strerror(errno) << std::endl;
+    kill(pong, SIGKILL);
+    waitpid(pong, NULL, 0);
+    return 1;
+  }
+  ping_start(param, req_que, rep_que);
+
+  int status;
+  waitpid(pong, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+}
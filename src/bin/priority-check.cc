@@ -0,0 +1,270 @@
+/**
+ * PriorityQueue のチェック
+ *  - order:    一つのプロセスで複数の優先度の要素を混ぜて追加し、取り出した要素が優先度順で、同じ優先度の中では追加順になっているか
+ *              (低い優先度の要素が残っている状態で追加した高い優先度の要素が、次の取り出しで返るかも検査する)
+ *  - transfer: 複数の書き込み/読み込みプロセス間で、様々な優先度の要素をやり取りして、欠損や重複、取り出した優先度の誤り、
+ *              同じ書き込みプロセスの同じ優先度の要素の順序の入れ替わりがないか。
+ *  - ping-pong: 各書き込みプロセスは、要素を一つ追加する度に、それが取り出されるまで待つ。
+ *              キューはほぼ常に空なので、読み込みプロセスはレベルが空になる度に nonempty_mask のビットを落とし、それが追加と競合する。
+ *              ビットが落ちたままで取り出せなくなった要素があれば、書き込みプロセスの待機がタイムアウトしてエラーとして検出される
+ */
+#include <imque/priority_queue.hh>
+#include <imque/ipc/shared_memory.hh>
+#include <imque/atomic/atomic.hh>
+#include "../aux/check.hh"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+using imque::check::make_message;
+using imque::check::now_ms;
+using imque::check::TIMEOUT_MS;
+
+struct Param {
+  int process_count;
+  int messages_per_process;
+  int level_count;
+  int shm_size;
+};
+
+// 全プロセスで共有する検査結果 (共有メモリ上に置く)
+struct Shared {
+  int error_count;    // 内容や優先度の不正な要素や、順序の入れ替わり、タイムアウトした取り出し(や取り出しの待機)の数
+  int received_count; // 全体の受信数 (ping-pong で使用)
+  int marks[0];       // 要素毎の受信回数
+};
+
+// index 番目の要素の優先度 (連続した要素の優先度がばらつくようにする)
+uint32_t priority_of(int index, const Param& param) {
+  return static_cast<uint32_t>(index * 7 + index / 3) % param.level_count;
+}
+
+// 要素が取り出せるまで deq を繰り返す (TIMEOUT_MS を越えたら false を返す)
+bool deq_retry(imque::PriorityQueue& que, std::string& buf, uint32_t& priority) {
+  const long limit = now_ms() + TIMEOUT_MS;
+  while(que.deq(buf, priority) == false) {
+    if(now_ms() > limit) {
+      return false;
+    }
+    sched_yield();
+  }
+  return true;
+}
+
+bool order_check(imque::PriorityQueue& que, const Param& param) {
+  const int count = param.messages_per_process;
+  std::string msg;
+  for(int i=0; i < count; i++) {
+    make_message(i, msg);
+    que.enq(priority_of(i, param), msg.data(), msg.size());
+  }
+
+  // 優先度順、同じ優先度の中では番号順に取り出されるはず
+  std::vector<int> last(param.level_count, -1); // 優先度毎の、最後に受信した要素の番号
+  uint32_t prev_priority = 0;
+  int in_order = 0;
+  std::string buf;
+  uint32_t priority;
+  while(que.deq(buf, priority)) {
+    const int index = imque::check::parse_message(buf.data(), buf.size());
+    if(index < 0 || index >= count || priority != priority_of(index, param) ||
+       priority < prev_priority || index <= last[priority]) {
+      break;
+    }
+    last[priority] = index;
+    prev_priority = priority;
+    in_order++;
+  }
+
+  // 低い優先度の要素が残っている状態で、最も高い優先度の要素を追加する
+  const uint32_t lowest = param.level_count - 1;
+  que.enq(lowest, "low-1", 5);
+  que.enq(lowest, "low-2", 5);
+  que.enq(0, "high", 4);
+  const bool preempted = (que.deq(buf, priority) && buf == "high" && priority == 0 &&
+                          que.deq(buf, priority) && buf == "low-1" && priority == lowest &&
+                          que.deq(buf, priority) && buf == "low-2" && priority == lowest);
+
+  const bool ok = in_order == count && preempted && que.isEmpty() && que.deq(buf) == false;
+  std::cout << "#[" << getpid() << "] FINISH: order: "
+            << "in_order=" << in_order << "/" << count << ", preempted=" << preempted
+            << " | " << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+void writer(imque::PriorityQueue& que, int id, const Param& param) {
+  std::string msg;
+  for(int i=0; i < param.messages_per_process; i++) {
+    const int index = id*param.messages_per_process + i;
+    make_message(index, msg);
+    while(que.enq(priority_of(index, param), msg.data(), msg.size()) == false) {
+      sched_yield();
+    }
+  }
+}
+
+// 受信した要素の内容と優先度、書き込みプロセスと優先度毎の順序を検査し、受信回数を記録する。不正な要素の場合は false を返す
+bool check_received(const std::string& buf, uint32_t priority, std::vector<int>& last, Shared* shared, const Param& param) {
+  const int index = imque::check::parse_message(buf.data(), buf.size());
+  if(index < 0 || index >= param.process_count*param.messages_per_process || priority != priority_of(index, param)) {
+    return false;
+  }
+
+  int& prev = last[index / param.messages_per_process * param.level_count + priority];
+  if(index <= prev) {
+    return false;
+  }
+  prev = index;
+  imque::atomic::add(&shared->marks[index], 1);
+  return true;
+}
+
+void reader(imque::PriorityQueue& que, Shared* shared, const Param& param) {
+  std::vector<int> last(param.process_count * param.level_count, -1); // 書き込みプロセスと優先度毎の、最後に受信した要素の番号
+  std::string buf;
+  uint32_t priority;
+  for(int i=0; i < param.messages_per_process; i++) {
+    if(deq_retry(que, buf, priority) == false) {
+      imque::atomic::add(&shared->error_count, 1);
+      return;
+    }
+    if(check_received(buf, priority, last, shared, param) == false) {
+      imque::atomic::add(&shared->error_count, 1);
+    }
+  }
+}
+
+// 全ての要素が取り出されるまで deq を繰り返す (TIMEOUT_MS の間、一つも取り出せなかった場合は諦める)
+void ping_pong_reader(imque::PriorityQueue& que, Shared* shared, const Param& param) {
+  const int total = param.process_count * param.messages_per_process;
+  std::vector<int> last(param.process_count * param.level_count, -1);
+  std::string buf;
+  uint32_t priority;
+  long limit = now_ms() + TIMEOUT_MS;
+  while(imque::atomic::fetch(&shared->received_count) < total) {
+    if(que.deq(buf, priority) == false) {
+      if(now_ms() > limit) {
+        return;
+      }
+      sched_yield();
+      continue;
+    }
+    if(check_received(buf, priority, last, shared, param) == false) {
+      imque::atomic::add(&shared->error_count, 1);
+    }
+    imque::atomic::add(&shared->received_count, 1);
+    limit = now_ms() + TIMEOUT_MS;
+  }
+}
+
+// 要素を一つ追加する度に、それが取り出されるまで待つ
+void ping_pong_writer(imque::PriorityQueue& que, Shared* shared, int id, const Param& param) {
+  std::string msg;
+  for(int i=0; i < param.messages_per_process; i++) {
+    const int index = id*param.messages_per_process + i;
+    make_message(index, msg);
+    while(que.enq(priority_of(index, param), msg.data(), msg.size()) == false) {
+      sched_yield();
+    }
+
+    const long limit = now_ms() + TIMEOUT_MS;
+    while(imque::atomic::fetch(&shared->marks[index]) == 0) {
+      if(now_ms() > limit) {
+        imque::atomic::add(&shared->error_count, 1); // 取り出せなくなった要素がある
+        return;
+      }
+      sched_yield();
+    }
+  }
+}
+
+// 書き込みと読み込みのプロセスを process_count 個ずつ起動して、結果を検査する。
+// 子プロセスの場合は is_child に true を設定して返る。
+bool transfer_check(imque::PriorityQueue& que, Shared* shared, const Param& param, bool ping_pong, bool& is_child) {
+  std::vector<pid_t> children;
+  const int child = imque::check::fork_children(param.process_count*2, children);
+  if(child != -1) {
+    is_child = true;
+    if(child < param.process_count) {
+      if(ping_pong) {
+        ping_pong_reader(que, shared, param);
+      } else {
+        reader(que, shared, param);
+      }
+    } else {
+      if(ping_pong) {
+        ping_pong_writer(que, shared, child - param.process_count, param);
+      } else {
+        writer(que, child - param.process_count, param);
+      }
+    }
+    return true;
+  }
+  if(static_cast<int>(children.size()) != param.process_count*2) {
+    return false;
+  }
+
+  const int abnormal_exit_num = imque::check::wait_children(children);
+  int missing_count;
+  int duplicate_count;
+  const int ok_count = imque::check::count_marks(shared->marks, param.process_count*param.messages_per_process, missing_count, duplicate_count);
+
+  std::string buf;
+  const bool ok = (missing_count == 0 && duplicate_count == 0 && shared->error_count == 0 &&
+                   abnormal_exit_num == 0 && que.isEmpty() && que.deq(buf) == false);
+  std::cout << "#[" << getpid() << "] FINISH: " << (ping_pong ? "ping-pong" : "transfer") << ": "
+            << "ok=" << ok_count << ", "
+            << "miss=" << missing_count << ", "
+            << "dup=" << duplicate_count << ", "
+            << "error=" << shared->error_count << " | "
+            << "abnormal_exit=" << abnormal_exit_num << " | "
+            << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  if(argc != 5) {
+    std::cerr << "Usage: priority-check PROCESS_COUNT MESSAGES_PER_PROCESS LEVEL_COUNT(2 or more) SHM_SIZE" << std::endl;
+    return 1;
+  }
+
+  Param param = {
+    atoi(argv[1]),
+    atoi(argv[2]),
+    atoi(argv[3]),
+    atoi(argv[4])
+  };
+
+  imque::PriorityQueue que(param.shm_size, param.level_count);
+  if(! que || param.level_count < 2) {
+    std::cerr << "[ERROR] queue initialization failed" << std::endl;
+    return 1;
+  }
+
+  const int total = param.process_count * param.messages_per_process;
+  imque::ipc::SharedMemory shm(sizeof(Shared) + sizeof(int) * total);
+  if(! shm) {
+    std::cerr << "[ERROR] shm initialization failed" << std::endl;
+    return 1;
+  }
+  memset(shm.ptr<void>(), 0, shm.size());
+
+  bool ok = order_check(que, param);
+
+  bool is_child = false;
+  ok = transfer_check(que, shm.ptr<Shared>(), param, false, is_child) && ok;
+  if(is_child) {
+    return 0;
+  }
+
+  memset(shm.ptr<void>(), 0, shm.size());
+  ok = transfer_check(que, shm.ptr<Shared>(), param, true, is_child) && ok;
+  if(is_child) {
+    return 0;
+  }
+  return ok ? 0 : 1;
+}
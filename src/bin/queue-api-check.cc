@@ -0,0 +1,428 @@
+/**
+ * Queue の追加/取り出し API 毎に、複数プロセス間で要素をやり取りして、欠損や重複がないか、使用量(usedBytes)が正しく戻るかのチェック
+ *  - wait: 取り出しに deqWait を使用する。また、空のキューにも追加できないサイズの要素の enqWait が、待機せずに失敗するかを検査する
+ *  - view: 取り出しに deqView を使用する。また、参照中の要素の領域が view の破棄で解放されるかを検査する
+ *  - batch-deq: 取り出しに deqBatch を使用する
+ *  - batch-enq: 追加に enqBatch を使用する。また、割当に失敗した enqBatch が使用量を変えずに何も追加しないかを検査する
+ *  - reserve: 追加に reserve/commit を使用する (途中で破棄する予約も混ぜる)。また、破棄した予約の領域が解放されるかを検査する
+ */
+#include <imque/queue.hh>
+#include <imque/ipc/shared_memory.hh>
+#include <imque/atomic/atomic.hh>
+#include "../aux/check.hh"
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+using imque::check::now_ms;
+using imque::check::TIMEOUT_MS;
+
+struct Param {
+  int process_count;
+  int messages_per_process;
+  int shm_size;
+};
+
+// 全プロセスで共有する検査結果 (共有メモリ上に置く)
+struct Shared {
+  int error_count; // 内容の不正な要素や、タイムアウトした取り出しの数
+  int marks[0];    // 要素毎の受信回数
+};
+
+namespace {
+  // 要素の埋め草の長さの周期 (要素のサイズは最大で 200 バイト程度になる)
+  const int PADDING = 200;
+
+  // 先頭の番兵ノードの位置の変化によって減少し得る容量 (要素数)
+  const int SENTINEL_LOSS = 2;
+
+  // deqBatch/enqBatch で一度に扱う要素の最大数
+  const int BATCH_SIZE = 16;
+}
+
+// 受信した要素の内容を検査し、受信回数を記録する
+void mark(Shared* shared, const char* data, size_t size, const Param& param) {
+  const int index = imque::check::parse_message(data, size, PADDING);
+  if(index < 0 || index >= param.process_count*param.messages_per_process) {
+    imque::atomic::add(&shared->error_count, 1);
+    return;
+  }
+  imque::atomic::add(&shared->marks[index], 1);
+}
+
+void enq_writer(imque::Queue& que, int id, const Param& param) {
+  std::string msg;
+  for(int i=0; i < param.messages_per_process; i++) {
+    imque::check::make_message(id*param.messages_per_process + i, msg, PADDING);
+    if(imque::check::enq_retry(que, msg) == false) {
+      return;
+    }
+  }
+}
+
+// 十要素毎に、書き込み途中の予約を一つ破棄してから追加する (破棄した予約の内容が取り出されたら、内容の不正として検出される)
+void reserve_writer(imque::Queue& que, int id, const Param& param) {
+  std::string msg;
+  for(int i=0; i < param.messages_per_process; i++) {
+    imque::check::make_message(id*param.messages_per_process + i, msg, PADDING);
+    if(i % 10 == 0) {
+      imque::Reservation aborted;
+      if(que.reserve(msg.size(), aborted)) {
+        memset(aborted.data(), 'a', aborted.size());
+        aborted.abort();
+      }
+    }
+
+    imque::Reservation reservation;
+    while(que.reserve(msg.size(), reservation) == false) {
+      sched_yield();
+    }
+    memcpy(reservation.data(), msg.data(), msg.size());
+    reservation.commit();
+  }
+}
+
+// 一度に最大 BATCH_SIZE 個ずつ追加する
+void batch_writer(imque::Queue& que, int id, const Param& param) {
+  std::vector<std::string> msgs(BATCH_SIZE);
+  iovec records[BATCH_SIZE];
+  for(int i=0; i < param.messages_per_process; ) {
+    const int n = std::min(param.messages_per_process - i, BATCH_SIZE);
+    for(int j=0; j < n; j++) {
+      imque::check::make_message(id*param.messages_per_process + i + j, msgs[j], PADDING);
+      records[j].iov_base = const_cast<char*>(msgs[j].data());
+      records[j].iov_len = msgs[j].size();
+    }
+    while(que.enqBatch(records, n) == false) {
+      sched_yield();
+    }
+    i += n;
+  }
+}
+
+void wait_reader(imque::Queue& que, Shared* shared, const Param& param) {
+  std::string buf;
+  for(int i=0; i < param.messages_per_process; i++) {
+    if(que.deqWait(buf, TIMEOUT_MS) == false) {
+      imque::atomic::add(&shared->error_count, 1);
+      return;
+    }
+    mark(shared, buf.data(), buf.size(), param);
+  }
+}
+
+void view_reader(imque::Queue& que, Shared* shared, const Param& param) {
+  imque::MessageView view;
+  for(int i=0; i < param.messages_per_process; ) {
+    if(que.deqView(view)) {
+      mark(shared, view.data(), view.size(), param);
+      view.reset();
+      i++;
+    } else {
+      sched_yield();
+    }
+  }
+}
+
+// 一度に最大 BATCH_SIZE 個ずつ取り出す
+void batch_reader(imque::Queue& que, Shared* shared, const Param& param) {
+  std::vector<std::string> bufs;
+  for(int i=0; i < param.messages_per_process; ) {
+    size_t n = que.deqBatch(bufs, std::min(param.messages_per_process - i, BATCH_SIZE));
+    if(n == 0) {
+      sched_yield();
+      continue;
+    }
+    for(size_t j=0; j < n; j++) {
+      mark(shared, bufs[j].data(), bufs[j].size(), param);
+    }
+    i += n;
+  }
+}
+
+// 満杯になるまで size バイトの要素を追加し、追加できた数を返す
+int fill(imque::Queue& que, size_t size) {
+  std::string msg(size, 'f');
+  int count = 0;
+  while(que.enq(msg.data(), msg.size())) {
+    count++;
+  }
+  return count;
+}
+
+// キュー内の要素を全て取り出す
+void drain(imque::Queue& que) {
+  std::string buf;
+  while(que.deq(buf));
+}
+
+// 空のキューに enq で追加できる最大の要素サイズを求め、それを一バイト越える要素の enqWait が待機せずに失敗すること、
+// および最大サイズの要素の enqWait は成功することを検査する。
+// (空のキューでは取り出しによる解放が起きないので、待機しても割当できるようになることはない)
+// ※ 取り出した要素のノードは次の取り出しまで番兵として残るので、大きな要素を取り出した後は、小さな要素の追加/取り出しで番兵を置き換えておく
+bool enq_wait_limit_check(imque::Queue& que, const Param& param) {
+  size_t fit = 0;                // 追加できたサイズ
+  size_t over = param.shm_size;  // 追加できなかったサイズ
+  while(over - fit > 1) {
+    const size_t size = (fit + over) / 2;
+    const std::string msg(size, 'l');
+    if(que.enq(msg.data(), msg.size())) {
+      fit = size;
+      drain(que);
+      que.enq("s", 1);
+      drain(que);
+    } else {
+      over = size;
+    }
+  }
+
+  const std::string over_msg(over, 'o');
+  const long start = now_ms();
+  const bool over_rlt = que.enqWait(over_msg.data(), over_msg.size(), TIMEOUT_MS);
+  const long elapsed = now_ms() - start;
+
+  const std::string fit_msg(fit, 'f');
+  const bool fit_rlt = que.enqWait(fit_msg.data(), fit_msg.size(), 0);
+  drain(que);
+
+  const bool ok = (fit > 0 && over_rlt == false && elapsed < TIMEOUT_MS/2 && fit_rlt && que.usedBytes() == 0);
+  std::cout << "#[" << getpid() << "] FINISH: enq wait limit: "
+            << "fit=" << fit << ", over_rlt=" << over_rlt << ", elapsed=" << elapsed << "ms, fit_rlt=" << fit_rlt
+            << " | " << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+// 満杯のキューから全要素を deqView で取り出して参照を保持している間は、使用量が変わらず追加もできないこと、
+// および view の破棄後は、使用量が 0 に戻り同じ数の要素が追加できることを検査する
+// (初回の取り出しで番兵ノードが要素用のノードに置き換わり容量が僅かに変わるので、一周分の追加/取り出しを済ませてから計測する)
+// ※ 参照の保持中も、先頭の番兵だったノードは head の移動で解放されるので、その一つ分だけは追加できる
+// ※ 番兵の位置が変わると空き領域が二分されるので、再追加の数は SENTINEL_LOSS 個まで少なくなることがある (fill-drain-check を参照)
+bool view_release_check(imque::Queue& que, const Param& param) {
+  const size_t size = 100;
+  fill(que, size);
+  drain(que);
+  const int count = fill(que, size);
+
+  std::vector<imque::MessageView*> views(count);
+  for(int i=0; i < count; i++) {
+    views[i] = new imque::MessageView;
+    que.deqView(*views[i]);
+  }
+  const size_t held_used = que.usedBytes();
+  const bool held_empty = que.isEmpty();
+  const int held_extra = fill(que, size);
+  drain(que);
+
+  for(int i=0; i < count; i++) {
+    delete views[i];
+  }
+  const size_t released_used = que.usedBytes();
+  const int refill_count = fill(que, size);
+
+  const bool ok = (count > 0 && held_used == count*size && held_empty && held_extra <= 1 &&
+                   released_used == 0 && refill_count >= count - SENTINEL_LOSS);
+  std::cout << "#[" << getpid() << "] FINISH: view release: "
+            << "count=" << count << ", held_used=" << held_used << ", held_extra=" << held_extra << ", released_used=" << released_used
+            << ", refill_count=" << refill_count << " | " << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+// 満杯になるまで予約を行い、予約を保持している間は、使用量が変わらず追加もできないこと、
+// および予約の破棄(abort もしくは commit せずに破棄)後は、使用量が 0 に戻り同じ数の要素が追加できることを検査する
+// (計測前の一周分の追加/取り出しは view_release_check と同様。予約と再追加の数は、それぞれ直前の追加数から SENTINEL_LOSS 個まで少なくなることがある)
+bool reserve_abort_check(imque::Queue& que, const Param& param) {
+  const size_t size = 100;
+  fill(que, size);
+  drain(que);
+  const int count = fill(que, size);
+  drain(que);
+
+  std::vector<imque::Reservation*> reservations;
+  for(;;) {
+    imque::Reservation* r = new imque::Reservation;
+    if(que.reserve(size, *r) == false) {
+      delete r;
+      break;
+    }
+    reservations.push_back(r);
+  }
+  const int reserved = reservations.size();
+  const size_t held_used = que.usedBytes();
+  const bool held_empty = que.isEmpty();
+  const int held_extra = fill(que, size);
+
+  for(int i=0; i < reserved; i++) {
+    if(i % 2 == 0) {
+      reservations[i]->abort();
+    }
+    delete reservations[i];
+  }
+  const size_t released_used = que.usedBytes();
+  const int refill_count = fill(que, size);
+
+  const bool ok = (count > 0 && reserved >= count - SENTINEL_LOSS && held_used == reserved*size && held_empty &&
+                   held_extra == 0 && released_used == 0 && refill_count >= reserved - SENTINEL_LOSS);
+  std::cout << "#[" << getpid() << "] FINISH: reserve abort: "
+            << "count=" << count << ", reserved=" << reserved << ", held_used=" << held_used << ", held_extra=" << held_extra
+            << ", released_used=" << released_used << ", refill_count=" << refill_count << " | " << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+// 半分程度まで追加したキューに、空き容量を越える数の要素を enqBatch で追加し、
+// 失敗した場合に、使用量と要素数が変わらない(一部の要素だけが追加されたり、割当済みの領域が残ったりしない)ことを検査する。
+// (失敗した enqBatch の呼び出しは、要素数に関わらず overflowedCount に一回と数えられるはず)
+bool batch_overflow_check(imque::Queue& que, const Param& param) {
+  const size_t size = 100;
+  std::string msg(size, 'b');
+  const int count = fill(que, size);
+  drain(que);
+
+  const int half = count / 2;
+  for(int i=0; i < half; i++) {
+    que.enq(msg.data(), msg.size());
+  }
+  const size_t before_used = que.usedBytes();
+  const size_t before_overflowed = que.overflowedCount();
+
+  std::vector<iovec> records(count);
+  for(int i=0; i < count; i++) {
+    records[i].iov_base = const_cast<char*>(msg.data());
+    records[i].iov_len = msg.size();
+  }
+  const bool batch_rlt = que.enqBatch(&records[0], records.size());
+  const size_t after_used = que.usedBytes();
+  const size_t overflowed = que.overflowedCount() - before_overflowed;
+
+  std::string buf;
+  int remaining = 0;
+  while(que.deq(buf)) {
+    remaining++;
+  }
+
+  const bool ok = (count > 0 && batch_rlt == false && before_used == half*size && after_used == before_used &&
+                   overflowed == 1 && remaining == half && que.usedBytes() == 0);
+  std::cout << "#[" << getpid() << "] FINISH: batch overflow: "
+            << "count=" << count << ", before_used=" << before_used << ", after_used=" << after_used
+            << ", overflowed=" << overflowed << ", remaining=" << remaining << " | " << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+typedef void (*Writer)(imque::Queue& que, int id, const Param& param);
+typedef void (*Reader)(imque::Queue& que, Shared* shared, const Param& param);
+typedef bool (*SingleCheck)(imque::Queue& que, const Param& param);
+
+struct Mode {
+  const char* name;
+  Writer writer;
+  Reader reader;
+  SingleCheck single_check; // 単一プロセスで行う追加の検査 (無い場合は NULL)
+};
+
+const Mode MODES[] = {
+  {"wait", enq_writer, wait_reader, enq_wait_limit_check},
+  {"view", enq_writer, view_reader, view_release_check},
+  {"batch-deq", enq_writer, batch_reader, NULL},
+  {"batch-enq", batch_writer, wait_reader, batch_overflow_check},
+  {"reserve", reserve_writer, wait_reader, reserve_abort_check}
+};
+const int MODE_COUNT = sizeof(MODES) / sizeof(MODES[0]);
+
+// mode の読み込み側と書き込み側のプロセスを process_count 個ずつ起動して、結果を検査する。
+// 子プロセスの場合は is_child に true を設定して返る。
+bool run(const Mode& mode, imque::Queue& que, Shared* shared, const Param& param, bool& is_child) {
+  std::vector<pid_t> children;
+  const int child = imque::check::fork_children(param.process_count*2, children);
+  if(child != -1) {
+    is_child = true;
+    if(child < param.process_count) {
+      mode.reader(que, shared, param);
+    } else {
+      mode.writer(que, child - param.process_count, param);
+    }
+    return true;
+  }
+  if(static_cast<int>(children.size()) != param.process_count*2) {
+    return false;
+  }
+
+  const int abnormal_exit_num = imque::check::wait_children(children);
+  int missing_count;
+  int duplicate_count;
+  const int ok_count = imque::check::count_marks(shared->marks, param.process_count*param.messages_per_process, missing_count, duplicate_count);
+
+  const size_t used = que.usedBytes();
+  const bool ok = (missing_count == 0 && duplicate_count == 0 && shared->error_count == 0 &&
+                   abnormal_exit_num == 0 && used == 0 && que.isEmpty());
+  std::cout << "#[" << getpid() << "] FINISH: mode=" << mode.name << ", "
+            << "ok=" << ok_count << ", "
+            << "miss=" << missing_count << ", "
+            << "dup=" << duplicate_count << ", "
+            << "error=" << shared->error_count << " | "
+            << "abnormal_exit=" << abnormal_exit_num << " | "
+            << "used=" << used << " | "
+            << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  if(argc != 5) {
+  usage:
+    std::cerr << "Usage: queue-api-check MODE(all|wait|view|batch-deq|batch-enq|reserve) PROCESS_COUNT MESSAGES_PER_PROCESS SHM_SIZE" << std::endl;
+    return 1;
+  }
+
+  const std::string mode_name = argv[1];
+  Param param = {
+    atoi(argv[2]),
+    atoi(argv[3]),
+    atoi(argv[4])
+  };
+
+  std::vector<const Mode*> modes;
+  for(int i=0; i < MODE_COUNT; i++) {
+    if(mode_name == "all" || mode_name == MODES[i].name) {
+      modes.push_back(&MODES[i]);
+    }
+  }
+  if(modes.empty()) {
+    goto usage;
+  }
+
+  imque::Queue que(param.shm_size);
+  if(! que) {
+    std::cerr << "[ERROR] queue initialization failed" << std::endl;
+    return 1;
+  }
+
+  const int total = param.process_count * param.messages_per_process;
+  imque::ipc::SharedMemory shm(sizeof(Shared) + sizeof(int) * total);
+  if(! shm) {
+    std::cerr << "[ERROR] shm initialization failed" << std::endl;
+    return 1;
+  }
+  Shared* shared = shm.ptr<Shared>();
+
+  bool ok = true;
+  for(std::size_t i=0; i < modes.size(); i++) {
+    que.init();
+    memset(shm.ptr<void>(), 0, shm.size());
+
+    bool is_child = false;
+    bool rlt = run(*modes[i], que, shared, param, is_child);
+    if(is_child) {
+      return 0;
+    }
+    ok = rlt && ok;
+
+    if(modes[i]->single_check) {
+      que.init();
+      ok = modes[i]->single_check(que, param) && ok;
+    }
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,160 @@
+/**
+ * Queue::recover および imque-recover コマンドのチェック
+ * 要素の追加中(ノードの割当後、要素のコピー中)に SIGKILL された子プロセスがリークさせた領域が回収され、キューの容量が元に戻るかを検査する。
+ * (要素のコピー元を読み込み不可のページにして、コピー中に SIGSEGV のハンドラ内に止まった子プロセスを SIGKILL する)
+ *  - recover:       recover() の呼び出し後に、満杯まで追加できる要素数(容量)が、SIGKILL 前に戻るか
+ *  - imque-recover: 名前付きキューの共有メモリ用ファイルに対して bin/imque-recover を実行した後に、同様に容量が元に戻るか
+ * (容量は、先頭のダミーノードの位置などによって通常の使用でも数要素分は変動するので、リークした一つのノード分未満の差は許容する)
+ * いずれも、SIGKILL 前に追加済みの要素が、回収後も欠けずに順に取り出せるかを併せて検査する
+ */
+#include <imque/queue.hh>
+#include "../aux/check.hh"
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+
+struct Param {
+  int shm_size;
+  int kill_count;
+};
+
+namespace {
+  // 容量の計測に使う要素のサイズ
+  const size_t FILL_SIZE = 256;
+
+  // SIGKILL 前に追加しておく要素の数
+  const int KEPT_COUNT = 10;
+}
+
+void make_message(int index, std::string& msg) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "kept:%d", index);
+  msg = buf;
+}
+
+// 満杯になるまで追加できた要素数を返す。追加した要素は全て取り出して、キューを空に戻す
+int fill_capacity(imque::Queue& que) {
+  const std::string msg(FILL_SIZE, 'f');
+  int count = 0;
+  while(que.enq(msg.data(), msg.size())) {
+    count++;
+  }
+  std::string buf;
+  for(int i=0; i < count; i++) {
+    que.deq(buf);
+  }
+  return count;
+}
+
+// SIGKILL された子プロセスが追加しようとしていた要素のサイズ
+// (全ての子プロセス分で、容量の半分程度が失われるサイズにする)
+size_t leak_size(const Param& param) {
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  return (param.shm_size / (param.kill_count * 2) + page_size - 1) / page_size * page_size;
+}
+
+// ノードを割り当てた後の要素のコピー中に止まった子プロセスを SIGKILL することを、kill_count 回繰り返す。
+// 止まった回数を返す。
+int kill_in_enq(imque::Queue& que, const Param& param) {
+  int stopped = 0;
+  for(int i=0; i < param.kill_count; i++) {
+    if(imque::check::kill_in_enq(que, leak_size(param))) {
+      stopped++;
+    }
+  }
+  return stopped;
+}
+
+// SIGKILL 前に追加した要素が、順に全て取り出せるかを検査する
+bool deq_kept(imque::Queue& que) {
+  std::string buf;
+  std::string expected;
+  for(int i=0; i < KEPT_COUNT; i++) {
+    make_message(i, expected);
+    if(que.deq(buf) == false || buf != expected) {
+      return false;
+    }
+  }
+  return que.isEmpty();
+}
+
+// recover_fn で回収した後の容量が、SIGKILL 前の容量に戻るかを検査する
+bool check(const char* name, imque::Queue& que, const Param& param, bool (*recover_fn)(imque::Queue&, const char*, int), const char* path) {
+  que.init();
+  const int base = fill_capacity(que);
+
+  std::string msg;
+  for(int i=0; i < KEPT_COUNT; i++) {
+    make_message(i, msg);
+    que.enq(msg.data(), msg.size());
+  }
+
+  const int stopped = kill_in_enq(que, param);
+  const bool recovered = recover_fn(que, path, stopped);
+  const bool kept = deq_kept(que);
+  const int capacity = fill_capacity(que);
+  const bool restored = capacity >= base || static_cast<size_t>(base - capacity) * FILL_SIZE < leak_size(param);
+  const bool ok = (stopped == param.kill_count && recovered && kept && restored);
+  std::cout << "#[" << getpid() << "] FINISH: " << name << ": "
+            << "stopped=" << stopped << "/" << param.kill_count << ", recovered=" << recovered << ", kept=" << kept << ", "
+            << "capacity=" << capacity << "/" << base
+            << " | " << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+// 止まった子プロセス毎に、割当済みのノードが一つずつ回収されるはず
+bool recover_in_process(imque::Queue& que, const char*, int stopped) {
+  return que.recover() == static_cast<size_t>(stopped);
+}
+
+// bin/imque-recover を子プロセスで実行する
+bool recover_command(imque::Queue&, const char* path, int) {
+  pid_t child = fork();
+  switch(child) {
+  case -1:
+    std::cerr << "ERROR: fork() failed: " << strerror(errno) << std::endl;
+    return false;
+  case 0:
+    execl("bin/imque-recover", "imque-recover", path, (char*)NULL);
+    std::cerr << "ERROR: exec(bin/imque-recover) failed: " << strerror(errno) << std::endl;
+    _exit(1);
+  }
+  int status;
+  waitpid(child, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char** argv) {
+  if(argc != 3) {
+    std::cerr << "Usage: recover-check SHM_SIZE KILL_COUNT" << std::endl;
+    return 1;
+  }
+
+  Param param = {
+    atoi(argv[1]),
+    atoi(argv[2])
+  };
+
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/imque-recover-check.%d", static_cast<int>(getpid()));
+
+  bool ok = false;
+  {
+    imque::Queue que(param.shm_size, path);
+    if(! que || param.kill_count < 1) {
+      std::cerr << "[ERROR] queue initialization failed" << std::endl;
+      unlink(path);
+      return 1;
+    }
+    ok = check("recover", que, param, recover_in_process, path);
+    ok = check("imque-recover", que, param, recover_command, path) && ok;
+  }
+  unlink(path);
+  return ok ? 0 : 1;
+}
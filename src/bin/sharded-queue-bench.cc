@@ -0,0 +1,154 @@
+#include <imque/sharded_queue.hh>
+#include <imque/atomic/atomic.hh>
+#include <imque/ipc/shared_memory.hh>
+
+#include "../aux/nano_timer.hh"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+
+// ShardedQueue のレーン数に対するスケーラビリティの計測
+// レーン数を 1,2,4,... MAX_LANE_COUNT と変えながら、
+// WRITER_COUNT 個のプロセスが WRITER_LOOP_COUNT 個ずつ追加した要素を、READER_COUNT 個のプロセスが全て取り出すまでの時間を計測する。
+// 併せて、プロセス毎の順序(relaxed FIFO)が守られているかどうかも検査する。
+
+struct Param {
+  int reader_count;
+  int writer_count;
+  int writer_loop_count;
+  int msg_size;
+  int max_lane_count;
+  size_t shm_size;
+  imque::ShardedQueue::LANE_POLICY lane_policy;
+};
+
+struct Message {
+  uint32_t writer;
+  uint32_t seq;
+};
+
+// 全プロセスで共有するカウンタ
+struct Shared {
+  volatile uint64_t deq_count;
+  volatile uint64_t order_error_count;
+};
+
+void reader_start(const Param& param, imque::ShardedQueue& que, Shared* shared) {
+  const uint64_t total = static_cast<uint64_t>(param.writer_count) * param.writer_loop_count;
+  std::vector<int64_t> last_seq(param.writer_count, -1);
+  std::string buf;
+  
+  while(imque::atomic::fetch(&shared->deq_count) < total) {
+    if(que.deq(buf) == false) {
+      sched_yield();
+      continue;
+    }
+    
+    const Message* msg = reinterpret_cast<const Message*>(buf.data());
+    if(buf.size() < sizeof(Message) || msg->writer >= last_seq.size() || msg->seq <= last_seq[msg->writer]) {
+      imque::atomic::add(&shared->order_error_count, 1);
+    } else {
+      last_seq[msg->writer] = msg->seq;
+    }
+    imque::atomic::add(&shared->deq_count, 1);
+  }
+}
+
+void writer_start(const Param& param, imque::ShardedQueue& que, uint32_t writer) {
+  std::string buf(std::max(static_cast<size_t>(param.msg_size), sizeof(Message)), 'x');
+  Message* msg = reinterpret_cast<Message*>(&buf[0]);
+  msg->writer = writer;
+  
+  for(int i=0; i < param.writer_loop_count; i++) {
+    msg->seq = i;
+    while(que.enq(buf.data(), buf.size()) == false) {
+      sched_yield(); // 満杯
+    }
+  }
+}
+
+bool run(const Param& param, uint32_t lane_count, Shared* shared) {
+  imque::ShardedQueue que(param.shm_size, lane_count, param.lane_policy);
+  if(! que) {
+    std::cerr << "[ERROR] queue initialization failed: lane_count=" << lane_count << std::endl;
+    return false;
+  }
+  shared->deq_count = 0;
+  shared->order_error_count = 0;
+
+  imque::NanoTimer t;
+  std::vector<pid_t> children;
+  for(int i=0; i < param.writer_count + param.reader_count; i++) {
+    pid_t pid = fork();
+    switch(pid) {
+    case 0:
+      if(i < param.writer_count) {
+        writer_start(param, que, i);
+      } else {
+        reader_start(param, que, shared);
+      }
+      _exit(0);
+    case -1:
+      std::cerr << "ERROR: fork() failed: " << strerror(errno) << std::endl;
+      return false;
+    }
+    children.push_back(pid);
+  }
+
+  int failed_num = 0;
+  for(std::size_t i=0; i < children.size(); i++) {
+    int status;
+    waitpid(children[i], &status, 0);
+    if(! WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed_num++;
+    }
+  }
+  long elapsed = t.elapsed();
+  
+  const uint64_t total = static_cast<uint64_t>(param.writer_count) * param.writer_loop_count;
+  std::cout << "lanes=" << lane_count << ", "
+            << "elapsed=" << elapsed / 1000 / 1000 << "ms, "
+            << "throughput=" << static_cast<long>(total * 1000.0 * 1000 * 1000 / (elapsed ? elapsed : 1)) << "msg/s, "
+            << "order_error=" << shared->order_error_count << ", "
+            << "failed=" << failed_num << ", "
+            << "overflow=" << que.overflowedCount() << std::endl;
+  return failed_num == 0;
+}
+
+int main(int argc, char** argv) {
+  if(argc != 7 && argc != 8) {
+    std::cerr << "Usage: sharded-queue-bench READER_COUNT WRITER_COUNT WRITER_LOOP_COUNT MESSAGE_SIZE MAX_LANE_COUNT SHM_SIZE [process|cpu]" << std::endl;
+    return 1;
+  }
+
+  Param param = {
+    atoi(argv[1]),
+    atoi(argv[2]),
+    atoi(argv[3]),
+    atoi(argv[4]),
+    atoi(argv[5]),
+    static_cast<size_t>(atoll(argv[6])),
+    argc == 8 && strcmp(argv[7], "cpu") == 0 ? imque::ShardedQueue::BY_CPU : imque::ShardedQueue::BY_PROCESS
+  };
+
+  imque::ipc::SharedMemory shm(sizeof(Shared));
+  if(! shm) {
+    std::cerr << "[ERROR] shared memory initialization failed" << std::endl;
+    return 1;
+  }
+  
+  for(int lane_count=1; lane_count <= param.max_lane_count; lane_count *= 2) {
+    if(! run(param, lane_count, shm.ptr<Shared>())) {
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,126 @@
+/**
+ * SpscQueue のプロデューサ/コンシューマ間で要素をやり取りして、欠損や重複、順序の入れ替わりがないかのチェック
+ * また、4GiB を越えるサイズの共有メモリ領域で、容量が切り詰められずに使用できるかもチェックする
+ */
+#include <imque/spsc_queue.hh>
+#include <iostream>
+#include <string>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+
+struct Param {
+  int message_count;
+  int shm_size;
+};
+
+// index 番目の要素を msg に格納する。(リング終端のパディングを様々な位置で発生させるために、番号の後ろに index % 300 バイトの埋め草を付ける)
+void make_message(int index, std::string& msg) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%d:", index);
+  msg = buf;
+  msg.append(index % 300, static_cast<char>('a' + index % 26));
+}
+
+void producer(imque::SpscQueue& que, const Param& param) {
+  std::string msg;
+  for(int i=0; i < param.message_count; i++) {
+    make_message(i, msg);
+    while(que.enq(msg.data(), msg.size()) == false) {
+      sched_yield();
+    }
+  }
+}
+
+// 要素を追加順に受信できたかを検査する
+bool consumer(imque::SpscQueue& que, const Param& param) {
+  std::string buf;
+  std::string expected;
+  int error_count = 0;
+  for(int i=0; i < param.message_count; i++) {
+    while(que.deq(buf) == false) {
+      sched_yield();
+    }
+    make_message(i, expected);
+    if(buf != expected) {
+      if(error_count == 0) {
+        std::cerr << "[ERROR] unexpected message: index=" << i << ", data=" << buf.substr(0, 16) << std::endl;
+      }
+      error_count++;
+    }
+  }
+
+  const bool ok = error_count == 0 && que.isEmpty();
+  std::cout << "#[" << getpid() << "] FINISH: transfer: "
+            << "count=" << param.message_count << ", error=" << error_count << " | "
+            << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+// 4GiB を越える領域で、32bit に切り詰めた容量(1MiB)よりも大きな要素を追加/取り出しできるかを検査する。
+// (領域は実際に書き込んだページ分しかメモリを消費しない。領域の確保自体に失敗した場合は検査を省略する)
+bool large_ring_check() {
+  const size_t small = 1024 * 1024;
+  const uint64_t shm_size = (static_cast<uint64_t>(1) << 32) + small;
+  if(shm_size != static_cast<size_t>(shm_size)) {
+    return true; // 32bit 環境
+  }
+
+  imque::SpscQueue que(static_cast<size_t>(shm_size));
+  if(! que) {
+    std::cout << "#[" << getpid() << "] FINISH: large ring: skipped (" << shm_size << " bytes shm unavailable)" << std::endl;
+    return true;
+  }
+
+  std::string msg(small * 2, 'L');
+  std::string buf;
+  const bool enq_rlt = que.enq(msg.data(), msg.size());
+  const bool deq_rlt = que.deq(buf);
+
+  const bool ok = enq_rlt && deq_rlt && buf == msg && que.isEmpty();
+  std::cout << "#[" << getpid() << "] FINISH: large ring: "
+            << "enq=" << enq_rlt << ", deq=" << deq_rlt << " | " << (ok ? "ok" : "NG") << std::endl;
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  if(argc != 3) {
+    std::cerr << "Usage: spsc-check MESSAGE_COUNT SHM_SIZE" << std::endl;
+    return 1;
+  }
+
+  Param param = {
+    atoi(argv[1]),
+    atoi(argv[2])
+  };
+
+  imque::SpscQueue que(param.shm_size);
+  if(! que) {
+    std::cerr << "[ERROR] queue initialization failed" << std::endl;
+    return 1;
+  }
+
+  pid_t child = fork();
+  switch(child) {
+  case -1:
+    std::cerr << "ERROR: fork() failed: " << strerror(errno) << std::endl;
+    return 1;
+  case 0:
+    producer(que, param);
+    return 0;
+  }
+
+  bool ok = consumer(que, param);
+  int status;
+  waitpid(child, &status, 0);
+  ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+  ok = large_ring_check() && ok;
+  return ok ? 0 : 1;
+}